@@ -0,0 +1,310 @@
+//=============================================================================
+//
+//     FILE : Arduino.cpp
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Mock Arduino layer for the native (host) env.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "driver/pulse_cnt.h"
+
+unsigned long  MockMicros = 0UL;
+int            MockLevels[MOCK_PINS];
+MockWrite      MockWrites[MOCK_WRITES];
+long           MockNumWrites = 0L;
+
+uint8_t          MockEEPROM[MOCK_EEPROM_SIZE];
+long             MockEEPROMWrites = 0L;
+MockEEPROMClass  EEPROM;
+
+int              MockEncoderCount = 0;
+bool             MockInterruptsOff = false;
+
+struct MockInterrupt
+{
+  void  (*Handler) (void *);
+  void   *Arg;
+  int     Mode;
+};
+
+static MockInterrupt  Interrupts[MOCK_PINS];
+
+#if defined(ARDUINO_ARCH_AVR)
+volatile uint8_t   PCICR, PCMSK0, PCMSK1, PCMSK2;
+volatile uint8_t   TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t  TCNT1, OCR1A;
+long               MockTimerInterrupts = 0L;
+MockStatus         SREG;
+static bool        InTimerISR = false;
+
+extern "C" void TIMER1_COMPA_vect () __attribute__ ((weak));  // StepperMotor.cpp's handler, if linked
+extern "C" void PCINT0_vect () __attribute__ ((weak));        // Pin change handlers (LIMIT_INTERRUPTS)
+extern "C" void PCINT1_vect () __attribute__ ((weak));
+extern "C" void PCINT2_vect () __attribute__ ((weak));
+#endif
+
+//=== mockTick ============================================
+
+static void mockTick (unsigned long micros)
+{
+#if defined(ARDUINO_ARCH_AVR)
+  // Timer1 in CTC mode with prescaler 8 counts F_CPU / 8 ticks per microsecond
+  for (; micros > 0UL; micros--)
+  {
+    MockMicros++;
+    if (InTimerISR || MockInterruptsOff || !(TIMSK1 & _BV(OCIE1A)) || TIMER1_COMPA_vect == NULL)
+      continue;
+
+    long count = TCNT1 + F_CPU / 8000000L;
+
+    TCNT1 = (uint16_t) count;
+    if (count > OCR1A)
+    {
+      TCNT1 = (uint16_t) (count - OCR1A - 1L);
+      InTimerISR = true;
+      MockTimerInterrupts++;
+      TIMER1_COMPA_vect ();
+      InTimerISR = false;
+    }
+  }
+#else
+  MockMicros += micros;
+#endif
+}
+
+//=== MockReset ===========================================
+
+void MockReset ()
+{
+  MockMicros        = 0UL;
+  MockNumWrites     = 0L;
+  MockEncoderCount  = 0;
+  MockInterruptsOff = false;
+
+#if defined(ARDUINO_ARCH_AVR)
+  TCCR1A = TCCR1B = TIMSK1 = TIFR1 = 0;
+  TCNT1  = OCR1A = 0;
+  MockTimerInterrupts = 0L;
+#endif
+
+  for (int pin=0; pin<MOCK_PINS; pin++)
+    MockLevels[pin] = HIGH;
+
+  // Handlers stay attached until detachInterrupt(): a motor attaches them when it is constructed
+}
+
+//=== MockEraseEEPROM =====================================
+
+void MockEraseEEPROM ()
+{
+  memset (MockEEPROM, 0xFF, sizeof (MockEEPROM));
+  MockEEPROMWrites = 0L;
+}
+
+//=== MockAdvance =========================================
+
+void MockAdvance (unsigned long micros)
+{
+  mockTick (micros);
+}
+
+//=== MockRisingEdges =====================================
+
+long MockRisingEdges (int pin, unsigned long *times, long maxTimes)
+{
+  // Times of the recorded LOW to HIGH writes of a pin, returns how many were found
+  long  count = 0L;
+  int   value = LOW;
+  long  last  = (MockNumWrites < MOCK_WRITES) ? MockNumWrites : MOCK_WRITES;
+
+  for (long i=0; i<last; i++)
+  {
+    if (MockWrites[i].Pin != pin)
+      continue;
+
+    if (MockWrites[i].Value == HIGH && value == LOW)
+    {
+      if (count < maxTimes)
+        times[count] = MockWrites[i].Micros;
+      count++;
+    }
+    value = MockWrites[i].Value;
+  }
+
+  return count;
+}
+
+//=== MockSetLevel ========================================
+
+void MockSetLevel (int pin, int level)
+{
+  if (pin < 0 || pin >= MOCK_PINS || MockLevels[pin] == level)
+    return;
+
+  MockLevels[pin] = level;
+  if (MockInterruptsOff)
+    return;
+
+  MockInterrupt *interrupt = &Interrupts[pin];
+  if (interrupt->Handler != NULL &&
+      (interrupt->Mode == CHANGE || interrupt->Mode == ((level == HIGH) ? RISING : FALLING)))
+    interrupt->Handler (interrupt->Arg);
+
+#if defined(ARDUINO_ARCH_AVR)
+  // A pin change interrupt fires on both edges of an enabled pin
+  void (*vector) () = (pin <= 7) ? PCINT2_vect : (pin <= 13) ? PCINT0_vect : PCINT1_vect;
+
+  if (pin <= 21 && vector != NULL && (PCICR & _BV(digitalPinToPCICRbit (pin))) &&
+      (*digitalPinToPCMSK (pin) & _BV(digitalPinToPCMSKbit (pin))))
+    vector ();
+#endif
+}
+
+//=== Interrupts ==========================================
+
+void attachInterruptArg (int pin, void (*handler) (void *), void *arg, int mode)
+{
+  if (pin < 0 || pin >= MOCK_PINS)
+    return;
+
+  Interrupts[pin].Handler = handler;
+  Interrupts[pin].Arg     = arg;
+  Interrupts[pin].Mode    = mode;
+}
+
+void detachInterrupt (int pin)
+{
+  if (pin >= 0 && pin < MOCK_PINS)
+    Interrupts[pin].Handler = NULL;
+}
+
+//=== Digital I/O =========================================
+
+void pinMode (int pin, int mode)
+{
+  (void) pin;
+  (void) mode;
+}
+
+void digitalWrite (int pin, int value)
+{
+  if (pin < 0 || pin >= MOCK_PINS)
+    return;
+
+  if (MockNumWrites < MOCK_WRITES)
+  {
+    MockWrites[MockNumWrites].Micros = MockMicros;
+    MockWrites[MockNumWrites].Pin    = (uint8_t) pin;
+    MockWrites[MockNumWrites].Value  = (uint8_t) value;
+  }
+  MockNumWrites++;
+}
+
+int digitalRead (int pin)
+{
+  if (pin < 0 || pin >= MOCK_PINS)
+    return LOW;
+
+  return MockLevels[pin];
+}
+
+//=== Time ================================================
+
+unsigned long micros ()
+{
+  return MockMicros;
+}
+
+unsigned long millis ()
+{
+  return MockMicros / 1000UL;
+}
+
+void delay (unsigned long ms)
+{
+  mockTick (ms * 1000UL);
+}
+
+void delayMicroseconds (unsigned int us)
+{
+  mockTick (us);
+}
+
+//=== Streams =============================================
+
+size_t Stream::readBytes (char *buffer, size_t length)
+{
+  size_t count = 0;
+  int    c;
+
+  while (count < length && (c = read ()) >= 0)
+    buffer[count++] = (char) c;
+
+  return count;
+}
+
+void MockStream::Feed (const void *data, int length)
+{
+  if (Head == Tail)
+    Head = Tail = 0;
+
+  if (length > MOCK_STREAM - Tail)
+    length = MOCK_STREAM - Tail;
+
+  memcpy (Data + Tail, data, length);
+  Tail += length;
+}
+
+int MockStream::available ()
+{
+  return Tail - Head;
+}
+
+int MockStream::read ()
+{
+  Reads++;
+  return (Head < Tail) ? Data[Head++] : -1;
+}
+
+size_t MockStream::readBytes (char *buffer, size_t length)
+{
+  size_t count = (size_t) (Tail - Head);
+
+  Reads++;
+  if (count > length)
+    count = length;
+
+  memcpy (buffer, Data + Head, count);
+  Head += (int) count;
+  return count;
+}
+
+//=== Number Conversion ===================================
+
+char *ltoa (long value, char *buffer, int radix)
+{
+  (void) radix;  // Only base 10 is used
+  sprintf (buffer, "%ld", value);
+  return buffer;
+}
+
+char *ultoa (unsigned long value, char *buffer, int radix)
+{
+  (void) radix;
+  sprintf (buffer, "%lu", value);
+  return buffer;
+}
+
+char *itoa (int value, char *buffer, int radix)
+{
+  (void) radix;
+  sprintf (buffer, "%d", value);
+  return buffer;
+}
@@ -0,0 +1,154 @@
+//=============================================================================
+//
+//     FILE : Arduino.h
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Mock Arduino layer for the native (host) env.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  Just enough of the Arduino API to build StepperMotor and StepperGroup on the host:
+//
+//    - micros() / millis() read a virtual clock that only moves when the test moves it
+//      (MockAdvance) or when the class itself waits (delay, delayMicroseconds)
+//    - every digitalWrite() is recorded with its virtual time in MockWrites
+//    - digitalRead() returns MockLevels[pin], which tests set to simulate limit switches
+//      (inputs read HIGH, as with INPUT_PULLUP, until changed).  MockSetLevel() also calls the
+//      pin's interrupt handler on a matching edge: attachInterruptArg() handlers, or built with
+//      -D ARDUINO_ARCH_AVR the PCINTn_vect handler of an enabled pin change interrupt (LIMIT_INTERRUPTS)
+//    - MockStream is a Stream that returns the bytes a test feeds it, like a Serial port
+//    - EEPROM.h keeps its bytes in MockEEPROM across MockReset(), like a power cycle
+//    - driver/pulse_cnt.h reads the encoder count from MockEncoderCount (STEP_ENCODER)
+//    - built with -D ARDUINO_ARCH_AVR (the native-timer env), Timer1 is emulated: while OCIE1A
+//      is set and interrupts are on, the virtual clock counts its ticks and calls the
+//      TIMER1_COMPA_vect handler on each compare match, as the AVR does for STEPPER_TIMER
+//
+//  Only the native env uses this library; the board envs ignore it (lib_ignore).
+//
+//=============================================================================
+
+#ifndef ARDUINO_MOCK_H
+#define ARDUINO_MOCK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HIGH          1
+#define LOW           0
+#define INPUT         0
+#define OUTPUT        1
+#define INPUT_PULLUP  2
+
+#define RISING        1        // Interrupt modes, as on the ESP32
+#define FALLING       2
+#define CHANGE        3
+
+#define MOCK_PINS     64       // Pins 0..MOCK_PINS-1
+#define NUM_DIGITAL_PINS  MOCK_PINS
+#define MOCK_WRITES   100000   // Pin writes kept in MockWrites (later ones are counted but not kept)
+#define MOCK_STREAM   4096     // Bytes a MockStream holds
+
+typedef uint8_t byte;
+
+struct MockWrite
+{
+  unsigned long  Micros;  // Virtual time of the write
+  uint8_t        Pin;
+  uint8_t        Value;
+};
+
+extern unsigned long  MockMicros;               // Virtual clock
+extern int            MockLevels[MOCK_PINS];    // Pin levels read by digitalRead()
+extern MockWrite      MockWrites[MOCK_WRITES];  // Recorded digitalWrite() calls
+extern long           MockNumWrites;            // Calls made (may exceed MOCK_WRITES)
+
+void  MockReset    ();                          // Clock to 0, pins HIGH, no recorded writes, encoder at 0
+void  MockAdvance  (unsigned long micros);      // Moves the virtual clock forward
+long  MockRisingEdges (int pin, unsigned long *times, long maxTimes);  // Times of a pin's LOW to HIGH writes
+void  MockSetLevel (int pin, int level);        // Sets MockLevels[pin] and calls its interrupt handler on a matching edge
+
+void           pinMode           (int pin, int mode);
+void           digitalWrite      (int pin, int value);
+int            digitalRead       (int pin);
+unsigned long  micros            ();
+unsigned long  millis            ();
+void           delay             (unsigned long ms);
+void           delayMicroseconds (unsigned int us);
+
+extern bool  MockInterruptsOff;                 // noInterrupts() holds off the emulated timer interrupt
+
+inline void  noInterrupts () { MockInterruptsOff = true; }
+inline void  interrupts   () { MockInterruptsOff = false; }
+
+void  attachInterruptArg (int pin, void (*handler) (void *), void *arg, int mode);  // Called by MockSetLevel()
+void  detachInterrupt    (int pin);
+
+#if defined(ARDUINO_ARCH_AVR)
+  #ifndef F_CPU
+    #define F_CPU  16000000L
+  #endif
+
+  #define _BV(bit)  (1 << (bit))
+  #define WGM12     3
+  #define CS11      1
+  #define OCIE1A    1
+  #define OCF1A     1
+  #define ISR(vector)  extern "C" void vector ()
+
+  // Pin change interrupts as on the ATmega328: pins 0-7 on PCINT2, 8-13 on PCINT0, 14-21 on PCINT1
+  #define digitalPinToPCICR(p)     (((p) >= 0 && (p) <= 21) ? (&PCICR) : ((volatile uint8_t *) 0))
+  #define digitalPinToPCICRbit(p)  (((p) <= 7) ? 2 : (((p) <= 13) ? 0 : 1))
+  #define digitalPinToPCMSK(p)     (((p) <= 7) ? (&PCMSK2) : (((p) <= 13) ? (&PCMSK0) : (((p) <= 21) ? (&PCMSK1) : ((volatile uint8_t *) 0))))
+  #define digitalPinToPCMSKbit(p)  (((p) <= 7) ? (p) : (((p) <= 13) ? ((p) - 8) : ((p) - 14)))
+
+  extern volatile uint8_t   PCICR, PCMSK0, PCMSK1, PCMSK2;
+  extern volatile uint8_t   TCCR1A, TCCR1B, TIMSK1, TIFR1;
+  extern volatile uint16_t  TCNT1, OCR1A;
+  extern long               MockTimerInterrupts;   // TIMER1_COMPA_vect calls made
+
+  // SREG holds only the interrupt flag: it reads MockInterruptsOff, and restoring it restores that
+  struct MockStatus
+  {
+    operator uint8_t () const              { return MockInterruptsOff ? 0 : 0x80; }
+    MockStatus & operator= (uint8_t value) { MockInterruptsOff = !(value & 0x80); return *this; }
+  };
+
+  extern MockStatus         SREG;
+#else
+  #define IRAM_ATTR
+#endif
+
+class Stream
+{
+  public:
+    virtual         ~Stream   () {}
+    virtual int     available () = 0;
+    virtual int     read      () = 0;                               // -1 if nothing is waiting
+    virtual size_t  readBytes (char *buffer, size_t length);        // Reads up to length bytes
+};
+
+class MockStream : public Stream
+{
+  public:
+    uint8_t  Data[MOCK_STREAM];
+    int      Head  = 0;                                             // Next byte to read
+    int      Tail  = 0;                                             // End of the fed bytes
+    long     Reads = 0L;                                            // Calls to read() and readBytes()
+
+    void     Feed      (const void *data, int length);              // Bytes for the next reads
+    int      available () override;
+    int      read      () override;
+    size_t   readBytes (char *buffer, size_t length) override;
+};
+
+char *  ltoa  (long value, char *buffer, int radix);
+char *  ultoa (unsigned long value, char *buffer, int radix);
+char *  itoa  (int value, char *buffer, int radix);
+
+#endif
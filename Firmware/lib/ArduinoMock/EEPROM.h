@@ -0,0 +1,42 @@
+//=============================================================================
+//
+//     FILE : EEPROM.h
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Mock EEPROM for the native (host) env.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  The read() / update() / length() subset of the Arduino EEPROM library, backed by MockEEPROM.
+//  MockReset() leaves it alone, so a test can "power cycle" a motor by constructing a new one.
+//  MockEEPROMWrites counts the bytes actually written, to check that unchanged data is skipped.
+//
+//=============================================================================
+
+#ifndef EEPROM_MOCK_H
+#define EEPROM_MOCK_H
+
+#include <stdint.h>
+
+#define MOCK_EEPROM_SIZE  1024   // Bytes, as on the ATmega328
+
+extern uint8_t  MockEEPROM[MOCK_EEPROM_SIZE];
+extern long     MockEEPROMWrites;
+
+void  MockEraseEEPROM ();        // All bytes to 0xFF (erased), write count to 0
+
+struct MockEEPROMClass
+{
+  uint8_t   read   (int address)                 { return MockEEPROM[address]; }
+  void      write  (int address, uint8_t value)  { MockEEPROM[address] = value;  MockEEPROMWrites++; }
+  void      update (int address, uint8_t value)  { if (MockEEPROM[address] != value) write (address, value); }
+  uint16_t  length ()                            { return MOCK_EEPROM_SIZE; }
+};
+
+extern MockEEPROMClass  EEPROM;
+
+#endif
@@ -0,0 +1,78 @@
+//=============================================================================
+//
+//     FILE : pulse_cnt.h
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Mock ESP-IDF PCNT driver for the native (host) env.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  The subset of driver/pulse_cnt.h used by StepperMotor (-D STEP_ENCODER).  There is one unit,
+//  and its count is MockEncoderCount, which a test moves to simulate the encoder on the shaft
+//  (or holds still to simulate a stall).  MockReset() sets it to 0.
+//
+//=============================================================================
+
+#ifndef PULSE_CNT_MOCK_H
+#define PULSE_CNT_MOCK_H
+
+typedef int  esp_err_t;
+
+#define ESP_OK    0
+#define ESP_FAIL  -1
+
+extern int  MockEncoderCount;   // Accumulated count of the PCNT unit
+
+typedef struct MockPcntUnit    *pcnt_unit_handle_t;
+typedef struct MockPcntChannel *pcnt_channel_handle_t;
+
+typedef enum
+{
+  PCNT_CHANNEL_EDGE_ACTION_HOLD,
+  PCNT_CHANNEL_EDGE_ACTION_INCREASE,
+  PCNT_CHANNEL_EDGE_ACTION_DECREASE
+} pcnt_channel_edge_action_t;
+
+typedef enum
+{
+  PCNT_CHANNEL_LEVEL_ACTION_KEEP,
+  PCNT_CHANNEL_LEVEL_ACTION_INVERSE,
+  PCNT_CHANNEL_LEVEL_ACTION_HOLD
+} pcnt_channel_level_action_t;
+
+typedef struct
+{
+  int  low_limit;
+  int  high_limit;
+  int  intr_priority;
+  struct { unsigned accum_count : 1; } flags;
+} pcnt_unit_config_t;
+
+typedef struct
+{
+  int  edge_gpio_num;
+  int  level_gpio_num;
+  struct { unsigned invert_edge_input : 1; unsigned invert_level_input : 1; } flags;
+} pcnt_chan_config_t;
+
+typedef struct
+{
+  unsigned  max_glitch_ns;
+} pcnt_glitch_filter_config_t;
+
+inline esp_err_t  pcnt_new_unit                 (const pcnt_unit_config_t *, pcnt_unit_handle_t *unit)  { *unit = (pcnt_unit_handle_t) &MockEncoderCount;  return ESP_OK; }
+inline esp_err_t  pcnt_unit_set_glitch_filter   (pcnt_unit_handle_t, const pcnt_glitch_filter_config_t *)  { return ESP_OK; }
+inline esp_err_t  pcnt_new_channel              (pcnt_unit_handle_t, const pcnt_chan_config_t *, pcnt_channel_handle_t *channel)  { *channel = NULL;  return ESP_OK; }
+inline esp_err_t  pcnt_channel_set_edge_action  (pcnt_channel_handle_t, pcnt_channel_edge_action_t, pcnt_channel_edge_action_t)  { return ESP_OK; }
+inline esp_err_t  pcnt_channel_set_level_action (pcnt_channel_handle_t, pcnt_channel_level_action_t, pcnt_channel_level_action_t)  { return ESP_OK; }
+inline esp_err_t  pcnt_unit_add_watch_point     (pcnt_unit_handle_t, int)  { return ESP_OK; }
+inline esp_err_t  pcnt_unit_enable              (pcnt_unit_handle_t)  { return ESP_OK; }
+inline esp_err_t  pcnt_unit_start               (pcnt_unit_handle_t)  { return ESP_OK; }
+inline esp_err_t  pcnt_unit_clear_count         (pcnt_unit_handle_t)  { MockEncoderCount = 0;  return ESP_OK; }
+inline esp_err_t  pcnt_unit_get_count           (pcnt_unit_handle_t, int *count)  { *count = MockEncoderCount;  return ESP_OK; }
+
+#endif
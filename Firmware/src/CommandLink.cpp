@@ -0,0 +1,160 @@
+//==========================================================
+//
+//   FILE   : CommandLink.cpp
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Command transport: frames text lines and binary packets from a Serial port.
+//            (See CommandLink.h for details)
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//==========================================================
+
+#include <Arduino.h>
+#include <string.h>
+#include "CommandLink.h"
+
+//==========================================================
+//  Constructor
+//==========================================================
+CommandLink::CommandLink (Stream *port)
+{
+  Port      = port;
+  Head      = 0;
+  Scan      = 0;
+  Tail      = 0;
+  Binary    = false;
+  Discard   = false;
+  Overflows = 0L;
+}
+
+//=== Receive =============================================
+
+bool CommandLink::Receive (LinkPacket *packet)
+{
+  uint8_t  c;
+  int      end;
+
+  // The last packet has been handled, so its bytes may be reused
+  fill ();
+
+  while (Scan < Tail)
+  {
+    c = Buffer[Scan++];
+
+    // The first byte of a packet selects the protocol
+    if (Scan - 1 == Head && c == BIN_SYNC && !Discard)
+    {
+      Binary = true;
+      continue;
+    }
+
+    if (Binary)
+    {
+      // Binary frame: header, then payload length + CRC
+      if (Scan - Head < BIN_HEADER_LENGTH)
+        continue;
+
+      if (Buffer[Head + 2] > BIN_MAX_PAYLOAD)
+      {
+        // Bad length, resync after the sync byte
+        Binary = false;
+        Scan   = Head + 1;
+        Head   = Scan;
+      }
+      else if (Scan - Head == BIN_HEADER_LENGTH + Buffer[Head + 2] + 1)
+      {
+        Binary          = false;
+        packet->Binary  = true;
+        packet->TooLong = false;
+        packet->Data    = Buffer + Head;
+        packet->Length  = Scan - Head;
+        Head            = Scan;
+        return true;
+      }
+      continue;
+    }
+
+    if (c == '\n')
+    {
+      // Command is ready, terminate it in place (dropping a CR before the LF)
+      end = Scan - 1;
+      if (end > Head && Buffer[end - 1] == '\r')
+        end--;
+      Buffer[end] = 0;
+
+      if (Discard || end == Head)
+      {
+        // End of a dropped line, or an empty one
+        Discard = false;
+        Head    = Scan;
+        continue;
+      }
+
+      packet->Binary  = false;
+      packet->TooLong = false;
+      packet->Data    = Buffer + Head;
+      packet->Length  = end - Head;
+      Head            = Scan;
+      return true;
+    }
+
+    if (Discard)
+      Head = Scan;  // Dropped bytes are freed at once
+    else if (Scan - Head >= LINK_MAX_PACKET)
+    {
+      // Too long: report it once, then drop the rest of the line
+      Discard = true;
+      Head    = Scan;
+      Overflows++;
+
+      packet->Binary  = false;
+      packet->TooLong = true;
+      packet->Data    = NULL;
+      packet->Length  = 0;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+//=== GetOverflows ========================================
+
+long CommandLink::GetOverflows ()
+{
+  return Overflows;
+}
+
+//=== fill ================================================
+
+void CommandLink::fill ()
+{
+  int waiting = Port->available ();
+
+  if (waiting <= 0)
+    return;
+
+  if (Head == Tail)
+  {
+    // Nothing pending, start over at the front
+    Head = Scan = Tail = 0;
+  }
+  else if (Tail + waiting > LINK_BUFFER_SIZE && Head > 0)
+  {
+    // Move the unframed bytes to the front to make room
+    memmove (Buffer, Buffer + Head, Tail - Head);
+    Scan -= Head;
+    Tail -= Head;
+    Head  = 0;
+  }
+
+  // One bulk read of as much as fits (the rest waits in the port's buffer)
+  if (waiting > LINK_BUFFER_SIZE - Tail)
+    waiting = LINK_BUFFER_SIZE - Tail;
+
+  if (waiting > 0)
+    Tail += (int) Port->readBytes ((char *) Buffer + Tail, waiting);
+}
@@ -0,0 +1,95 @@
+//=============================================================================
+//
+//     FILE : CommandLink.h
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Command transport: frames text lines and binary packets from a Serial port.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  A CommandLink takes all the bytes waiting in a Stream (HardwareSerial, or the ESP32-S3's
+//  native USB CDC) with one readBytes() call per Receive() into its own buffer, and frames them
+//  there in place:
+//
+//    - a packet that starts with BIN_SYNC is a binary frame of BIN_HEADER_LENGTH + length + 1 bytes
+//    - anything else is a text command ending in LF (a CR before it is dropped), which is
+//      NUL-terminated where the LF was
+//
+//  Receive() returns a pointer into the buffer, so a packet is never copied.  It stays valid until
+//  the next Receive().  Bytes are only moved when a packet reaches the end of the buffer: the unframed
+//  bytes are moved back to the front, which is at most one buffer's worth.
+//
+//  A text line of LINK_MAX_PACKET chars or more is reported once as TooLong and the rest of it,
+//  up to its LF, is dropped, so its tail is never executed as a command of its own.  A binary
+//  header with a bad length is dropped a byte at a time until the next sync byte.
+//
+//  Bytes that arrive while loop() is busy wait in the port's own receive buffer, which the UART or
+//  USB driver fills from its interrupt.  On the ESP32 main.cpp enlarges it to SERIAL_RX_BUFFER.
+//
+//    CommandLink  Link (&Serial);
+//    LinkPacket   packet;
+//
+//    if (Link.Receive (&packet))
+//      ...  // packet.Binary ? ExecuteBinary (packet.Data, packet.Length, ..) : ExecuteCommand ((char *) packet.Data)
+//
+//=============================================================================
+
+#ifndef CMD_LINK_H
+#define CMD_LINK_H
+
+#include <Arduino.h>
+#include "StepperMotor.h"
+
+#ifndef LINK_MAX_PACKET
+  #define LINK_MAX_PACKET   64   // Longest text command (or ';' batch), including its NUL
+#endif
+
+#ifndef LINK_BUFFER_SIZE
+  #if defined(ARDUINO_ARCH_AVR)
+    #define LINK_BUFFER_SIZE  128
+  #else
+    #define LINK_BUFFER_SIZE  512
+  #endif
+#endif
+
+static_assert (LINK_BUFFER_SIZE >= 2 * LINK_MAX_PACKET && LINK_BUFFER_SIZE >= 2 * BIN_MAX_FRAME,
+               "LINK_BUFFER_SIZE must hold two packets");
+
+struct LinkPacket
+{
+  bool      Binary;   // A binary frame, else a NUL-terminated text command
+  bool      TooLong;  // A text line was too long and is being dropped (Data is NULL)
+  uint8_t  *Data;     // The packet, in the link's buffer until the next Receive()
+  int       Length;   // Bytes in the frame, or chars before the NUL
+};
+
+//=========================================================
+//  class CommandLink
+//=========================================================
+
+class CommandLink
+{
+  private:
+    Stream   *Port;
+    uint8_t   Buffer[LINK_BUFFER_SIZE];
+    int       Head;           // First byte of the packet being framed
+    int       Scan;           // Next byte to frame
+    int       Tail;           // End of the received bytes
+    bool      Binary;         // The packet being framed is a binary frame
+    bool      Discard;        // Dropping the rest of a too-long line
+    long      Overflows;      // Too-long lines dropped
+
+    void      fill  ();       // Reads everything the port has waiting
+
+  public:
+    CommandLink (Stream *port);
+
+    bool      Receive       (LinkPacket *packet);  // Returns true when a complete packet (or a TooLong report) is ready
+    long      GetOverflows  ();                    // Returns the number of too-long lines dropped
+};
+
+#endif
@@ -0,0 +1,128 @@
+//=============================================================================
+//
+//     FILE : ConfigStore.h
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Non-volatile storage for the saved motor configurations.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  A ConfigStore keeps one fixed-size record per slot and survives a power cycle.  The backend is
+//  picked at compile time from the PlatformIO env:
+//
+//    ESP32      - NVS through Preferences, namespace CONFIG_NAMESPACE, key "motor<slot>".
+//                 NVS spreads its writes over the flash pages itself.
+//    Otherwise  - EEPROM, record n at CONFIG_EEPROM_ADDRESS + n * length.
+//                 EEPROM.update() only rewrites the bytes that changed.
+//
+//  Write() compares the record with the stored one first and does nothing if they match, so
+//  saving an unchanged configuration costs no wear on either backend.
+//
+//=============================================================================
+
+#pragma once
+
+#include <Arduino.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+  #include <Preferences.h>
+
+  #ifndef CONFIG_NAMESPACE
+    #define CONFIG_NAMESPACE  "stepper"
+  #endif
+#else
+  #include <EEPROM.h>
+
+  #ifndef CONFIG_EEPROM_ADDRESS
+    #define CONFIG_EEPROM_ADDRESS  0   // First EEPROM byte used for the records
+  #endif
+#endif
+
+#define CONFIG_MAX_LENGTH  64          // Longest record
+
+class ConfigStore
+{
+  private:
+  #if defined(ARDUINO_ARCH_ESP32)
+    static void key (int slot, char *name)
+    {
+      snprintf (name, 12, "motor%d", slot);
+    }
+  #endif
+
+  public:
+    //=== Read ================================================
+
+    static bool Read (int slot, uint8_t *data, int length)
+    {
+      // Returns false if the slot was never written (the record is then undefined)
+    #if defined(ARDUINO_ARCH_ESP32)
+      Preferences  prefs;
+      char         name[12];
+      size_t       stored = 0;
+
+      key (slot, name);
+      if (prefs.begin (CONFIG_NAMESPACE, true))
+      {
+        if (prefs.getBytesLength (name) == (size_t) length)
+          stored = prefs.getBytes (name, data, length);
+        prefs.end ();
+      }
+
+      return stored == (size_t) length;
+    #else
+      int address = CONFIG_EEPROM_ADDRESS + slot * length;
+
+      if (slot < 0 || address + length > (int) EEPROM.length ())
+        return false;
+
+      for (int i=0; i<length; i++)
+        data[i] = EEPROM.read (address + i);
+
+      return true;
+    #endif
+    }
+
+    //=== Write ===============================================
+
+    static bool Write (int slot, const uint8_t *data, int length)
+    {
+      uint8_t stored[CONFIG_MAX_LENGTH];
+
+      if (length > CONFIG_MAX_LENGTH)
+        return false;
+
+      // Unchanged records are not written again
+      if (Read (slot, stored, length) && memcmp (stored, data, length) == 0)
+        return true;
+
+    #if defined(ARDUINO_ARCH_ESP32)
+      Preferences  prefs;
+      char         name[12];
+      size_t       written = 0;
+
+      key (slot, name);
+      if (prefs.begin (CONFIG_NAMESPACE, false))
+      {
+        written = prefs.putBytes (name, data, length);
+        prefs.end ();
+      }
+
+      return written == (size_t) length;
+    #else
+      int address = CONFIG_EEPROM_ADDRESS + slot * length;
+
+      if (slot < 0 || address + length > (int) EEPROM.length ())
+        return false;
+
+      for (int i=0; i<length; i++)
+        EEPROM.update (address + i, data[i]);
+
+      return true;
+    #endif
+    }
+};
@@ -0,0 +1,121 @@
+//=============================================================================
+//
+//     FILE : FastGPIO.h
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Direct register access for the Step, Direction, Enable and limit switch pins.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  digitalWrite() and digitalRead() look up the pin's port and bit mask on every call.
+//  A FastPin does that lookup once, in Attach(), and then toggles the pin with a single
+//  register write.  The backend is picked at compile time from the PlatformIO env:
+//
+//    -D FAST_GPIO on the ESP32  - GPIO.out_w1ts / out_w1tc set and clear registers
+//                                 (out1_w1ts / out1_w1tc for pins 32 and up)
+//    -D FAST_GPIO on AVR        - the pin's PORTx / PINx registers
+//    no FAST_GPIO               - digitalWrite() / digitalRead()
+//
+//  On AVR the PORTx read-modify-write is done with interrupts off, since the Step pin may
+//  share a port with pins written from an interrupt.
+//
+//=============================================================================
+
+#pragma once
+
+#include <Arduino.h>
+
+#if defined(FAST_GPIO) && defined(ARDUINO_ARCH_ESP32)
+  #include "soc/gpio_reg.h"
+#endif
+
+class FastPin
+{
+  private:
+  #if defined(FAST_GPIO) && defined(ARDUINO_ARCH_ESP32)
+    uint32_t            Mask;
+    volatile uint32_t  *SetReg;     // GPIO.out_w1ts
+    volatile uint32_t  *ClearReg;   // GPIO.out_w1tc
+    volatile uint32_t  *InReg;      // GPIO.in
+  #elif defined(FAST_GPIO) && defined(ARDUINO_ARCH_AVR)
+    uint8_t             Mask;
+    volatile uint8_t   *OutReg;     // PORTx
+    volatile uint8_t   *InReg;      // PINx
+  #else
+    int                 Pin;
+  #endif
+
+  public:
+    //=== Attach ==============================================
+
+    void Attach (int pin)
+    {
+    #if defined(FAST_GPIO) && defined(ARDUINO_ARCH_ESP32)
+      if (pin < 32)
+      {
+        Mask     = 1UL << pin;
+        SetReg   = (volatile uint32_t *) GPIO_OUT_W1TS_REG;
+        ClearReg = (volatile uint32_t *) GPIO_OUT_W1TC_REG;
+        InReg    = (volatile uint32_t *) GPIO_IN_REG;
+      }
+      else
+      {
+        Mask     = 1UL << (pin - 32);
+        SetReg   = (volatile uint32_t *) GPIO_OUT1_W1TS_REG;
+        ClearReg = (volatile uint32_t *) GPIO_OUT1_W1TC_REG;
+        InReg    = (volatile uint32_t *) GPIO_IN1_REG;
+      }
+    #elif defined(FAST_GPIO) && defined(ARDUINO_ARCH_AVR)
+      Mask   = digitalPinToBitMask (pin);
+      OutReg = portOutputRegister (digitalPinToPort (pin));
+      InReg  = portInputRegister  (digitalPinToPort (pin));
+    #else
+      Pin = pin;
+    #endif
+    }
+
+    //=== High / Low ==========================================
+
+    inline void High ()
+    {
+    #if defined(FAST_GPIO) && defined(ARDUINO_ARCH_ESP32)
+      *SetReg = Mask;
+    #elif defined(FAST_GPIO) && defined(ARDUINO_ARCH_AVR)
+      uint8_t oldSREG = SREG;
+      cli ();
+      *OutReg |= Mask;
+      SREG = oldSREG;
+    #else
+      digitalWrite (Pin, HIGH);
+    #endif
+    }
+
+    inline void Low ()
+    {
+    #if defined(FAST_GPIO) && defined(ARDUINO_ARCH_ESP32)
+      *ClearReg = Mask;
+    #elif defined(FAST_GPIO) && defined(ARDUINO_ARCH_AVR)
+      uint8_t oldSREG = SREG;
+      cli ();
+      *OutReg &= ~Mask;
+      SREG = oldSREG;
+    #else
+      digitalWrite (Pin, LOW);
+    #endif
+    }
+
+    //=== IsLow ===============================================
+
+    inline bool IsLow ()
+    {
+    #if defined(FAST_GPIO) && (defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_AVR))
+      return (*InReg & Mask) == 0;
+    #else
+      return digitalRead (Pin) == LOW;
+    #endif
+    }
+};
@@ -0,0 +1,98 @@
+//=============================================================================
+//
+//     FILE : SpscQueue.h
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Lock-free single-producer, single-consumer queue.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  A fixed ring of N slots (holding N-1 items) passed between exactly one producer and one
+//  consumer, which may run on different cores.  Only the producer writes Head and only the
+//  consumer writes Tail, so Push() and Pop() never block or take a lock: the release store
+//  of an index publishes the slot it covers to the other side's acquire load.
+//
+//    SpscQueue<Packet, 16>  Commands;
+//
+//    Commands.Push (packet);   // Producer, returns false if the queue is full
+//    Commands.Pop (&packet);   // Consumer, returns false if the queue is empty
+//    Commands.Free ();         // Room left, so a producer can keep slots for what it must not drop
+//
+//=============================================================================
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+
+template <typename T, int N>
+class SpscQueue
+{
+  private:
+    T                 Items[N];
+    std::atomic<int>  Head;  // Next slot to write (producer)
+    std::atomic<int>  Tail;  // Next slot to read (consumer)
+
+  public:
+    SpscQueue () : Head (0), Tail (0) {}
+
+    //=== Push ================================================
+
+    bool Push (const T &item)
+    {
+      int head = Head.load (std::memory_order_relaxed);
+      int next = (head + 1) % N;
+
+      if (next == Tail.load (std::memory_order_acquire))
+        return false;  // Full
+
+      Items[head] = item;
+      Head.store (next, std::memory_order_release);
+
+      return true;
+    }
+
+    //=== Pop =================================================
+
+    bool Pop (T *item)
+    {
+      int tail = Tail.load (std::memory_order_relaxed);
+
+      if (tail == Head.load (std::memory_order_acquire))
+        return false;  // Empty
+
+      *item = Items[tail];
+      Tail.store ((tail + 1) % N, std::memory_order_release);
+
+      return true;
+    }
+
+    //=== Count ===============================================
+
+    int Count ()
+    {
+      // Items waiting: exact for either side's own view, a snapshot for anyone else
+      return (Head.load (std::memory_order_acquire) - Tail.load (std::memory_order_acquire) + N) % N;
+    }
+
+    //=== Free ================================================
+
+    int Free ()
+    {
+      // Items that can still be pushed (at least this many for the producer)
+      return N - 1 - Count ();
+    }
+
+    //=== IsEmpty =============================================
+
+    bool IsEmpty ()
+    {
+      return Tail.load (std::memory_order_acquire) == Head.load (std::memory_order_acquire);
+    }
+};
+
+#endif
@@ -0,0 +1,298 @@
+//==========================================================
+//
+//   FILE   : StepperGroup.cpp
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Coordinated motion for a group of StepperMotor objects.
+//            (See StepperGroup.h for details)
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//==========================================================
+
+#include <Arduino.h>
+#include "StepperGroup.h"
+
+//==========================================================
+//  Constructor
+//==========================================================
+StepperGroup::StepperGroup ()
+{
+  NumMotors      = 0;
+  MajorAxis      = 0;
+  MajorSteps     = 0L;
+  Running        = false;
+  NextStepMicros = 0L;
+}
+
+//=== AddMotor ============================================
+
+bool StepperGroup::AddMotor (StepperMotor *motor)
+{
+  if (Running || NumMotors >= MAX_GROUP_MOTORS)
+    return false;
+
+  AxisReturns[NumMotors] = OKAY;
+  Motors[NumMotors++]    = motor;
+
+  return true;
+}
+
+//=== GetNumMotors ========================================
+
+int StepperGroup::GetNumMotors ()
+{
+  return NumMotors;
+}
+
+//=========================================================
+//  Run:
+//  Must be called inside your loop function with no delay.
+//=========================================================
+RunReturn StepperGroup::Run ()
+{
+  StepperMotor  *motor;
+  RunReturn      rr;
+  int            axis;
+  int            failed = -1;  // Axis whose step the RMT driver refused
+
+#if defined(NONBLOCKING_PULSE)
+  // Finish the step pulses of the last tick first
+  bool  pulseBusy = false;
+
+  for (axis=0; axis<NumMotors; axis++)
+    if (Motors[axis]->pulseBusy ())
+      pulseBusy = true;
+
+  if (pulseBusy)
+    return OKAY;
+#endif
+
+  // Is the group moving and is it time for the next step?
+  if (!Running || ((long) (micros() - NextStepMicros) < 0L))  // Signed difference is safe across micros() wrap
+    return OKAY;
+
+  // Has the major axis arrived?  (All other axes arrive with it)
+  if (Motors[MajorAxis]->AbsolutePosition == Motors[MajorAxis]->TargetPosition)
+  {
+    for (axis=0; axis<NumMotors; axis++)
+      AxisReturns[axis] = RUN_COMPLETE;
+
+    Running = false;
+    return RUN_COMPLETE;
+  }
+
+  // Decide which axes step on this tick and check their range limits
+  // before any of them move
+  for (axis=0; axis<NumMotors; axis++)
+  {
+    motor = Motors[axis];
+
+    // Stop if a motor was Disabled or E-Stopped on its own
+    if (!motor->Homed)
+      return stopMove (axis, MOTION_ABORTED);
+
+    if (axis == MajorAxis)
+      AxisStepping[axis] = true;
+    else
+    {
+      AxisError[axis]   -= AxisSteps[axis];
+      AxisStepping[axis] = (AxisError[axis] < 0L);
+      if (AxisStepping[axis])
+        AxisError[axis] += MajorSteps;
+    }
+
+    if (AxisStepping[axis])
+    {
+      rr = motor->checkNextStep ();
+      if (rr != OKAY)
+        return stopMove (axis, rr);
+    }
+  }
+
+  // Step all axes together
+#if defined(STEPPER_RMT) || defined(NONBLOCKING_PULSE)
+  for (axis=0; axis<NumMotors; axis++)
+    if (AxisStepping[axis])
+      Motors[axis]->doStep ();
+#else
+  for (axis=0; axis<NumMotors; axis++)
+    if (AxisStepping[axis])
+      Motors[axis]->StepOut.High ();
+
+  delayMicroseconds (PULSE_WIDTH);
+
+  for (axis=0; axis<NumMotors; axis++)
+    if (AxisStepping[axis])
+      Motors[axis]->StepOut.Low ();
+#endif
+
+#if defined(STEPPER_RMT)
+  // A step the RMT driver refused was never taken, so that axis keeps its position
+  for (axis=0; axis<NumMotors; axis++)
+    if (AxisStepping[axis] && Motors[axis]->SegmentReturn == STEP_ERROR)
+    {
+      Motors[axis]->SegmentReturn = OKAY;
+      AxisStepping[axis]          = false;
+      failed                      = axis;
+    }
+#endif
+
+  // Set positions, the major axis also advances the velocity profile
+  for (axis=0; axis<NumMotors; axis++)
+  {
+    if (!AxisStepping[axis])
+      continue;
+
+    motor = Motors[axis];
+
+    if (axis == MajorAxis)
+      NextStepMicros += motor->advanceStep ();
+    else
+    {
+      motor->AbsolutePosition = motor->NextPosition;
+      motor->DeltaPosition   += motor->StepIncrement;
+    }
+
+    // Check limit switches, if specified
+    rr = motor->checkLimitSwitches ();
+    if (rr != OKAY)
+      return stopMove (axis, rr);
+  }
+
+  if (failed >= 0)
+    return stopMove (failed, STEP_ERROR);
+
+  return OKAY;
+}
+
+//=== MoveAbsolute ========================================
+
+bool StepperGroup::MoveAbsolute (const long *absPositions, long stepsPerSecond)
+{
+  long  targets[MAX_GROUP_MOTORS];
+
+  for (int axis=0; axis<NumMotors; axis++)
+    targets[axis] = absPositions[axis];
+
+  return startMove (targets, stepsPerSecond);
+}
+
+//=== MoveRelative ========================================
+
+bool StepperGroup::MoveRelative (const long *numSteps, long stepsPerSecond)
+{
+  long  targets[MAX_GROUP_MOTORS];
+
+  for (int axis=0; axis<NumMotors; axis++)
+    targets[axis] = Motors[axis]->AbsolutePosition + numSteps[axis];
+
+  return startMove (targets, stepsPerSecond);
+}
+
+//=== startMove ===========================================
+
+bool StepperGroup::startMove (const long *targets, long stepsPerSecond)
+{
+  StepperMotor  *motor;
+  int            axis;
+
+  if (NumMotors == 0 || Running || stepsPerSecond < 1L)
+    return false;
+
+  // All motors must be Homed, Enabled and idle, with nothing queued or streaming,
+  // before any of them is touched
+  for (axis=0; axis<NumMotors; axis++)
+  {
+    motor = Motors[axis];
+    if (!motor->Homed || motor->State != MS_ENABLED || motor->Streaming || motor->QueueHead != motor->QueueTail)
+      return false;
+  }
+
+  // Velocities beyond what the backend can deliver are held to its limit
+  if (stepsPerSecond > MAX_STEP_RATE)
+    stepsPerSecond = MAX_STEP_RATE;
+
+  // The axis with the most steps sets the velocity profile
+  MajorAxis  = 0;
+  MajorSteps = 0L;
+  for (axis=0; axis<NumMotors; axis++)
+  {
+    motor = Motors[axis];
+    motor->TargetPosition = targets[axis];
+    motor->TotalSteps     = abs(targets[axis] - motor->AbsolutePosition);
+    AxisReturns[axis]     = OKAY;
+
+    if (motor->TotalSteps > MajorSteps)
+    {
+      MajorAxis  = axis;
+      MajorSteps = motor->TotalSteps;
+    }
+  }
+
+  // Set ramp and direction for each axis
+  for (axis=0; axis<NumMotors; axis++)
+  {
+    motor = Motors[axis];
+
+    // Minor axes run at their share of the major axis velocity
+    motor->MaxVelocity = (MajorSteps > 0L) ? (long) ((int64_t) stepsPerSecond * motor->TotalSteps / MajorSteps) : 0L;
+    motor->forgetPosition ();
+#if defined(STEPPER_TIMER)
+    motor->stopTimer ();  // The group does the stepping
+#endif
+    motor->setupRamp ();
+    motor->setupRotation ();
+
+    // The group does the stepping.  Starting the error term at MajorSteps - AxisSteps spaces
+    // the minor steps evenly and puts the last one on the major axis' last step.
+    motor->State    = MS_ENABLED;
+    AxisSteps[axis] = motor->TotalSteps;
+    AxisError[axis] = MajorSteps - AxisSteps[axis];
+  }
+
+  NextStepMicros = micros() + 10L;  // Direction must be set 10-microseconds before stepping
+  Running        = true;
+
+  return true;
+}
+
+//=== stopMove ============================================
+
+RunReturn StepperGroup::stopMove (int axis, RunReturn rr)
+{
+  // One axis stopped the group, the others stop with it
+  AxisReturns[axis] = rr;
+  Running           = false;
+
+  return rr;
+}
+
+//=== EStop ===============================================
+
+void StepperGroup::EStop ()
+{
+  Running = false;
+
+  for (int axis=0; axis<NumMotors; axis++)
+    Motors[axis]->EStop ();
+}
+
+//=== IsRunning ===========================================
+
+bool StepperGroup::IsRunning ()
+{
+  return Running;
+}
+
+//=== GetAxisReturn =======================================
+
+RunReturn StepperGroup::GetAxisReturn (int axis)
+{
+  if (axis < 0 || axis >= NumMotors)
+    return OKAY;
+
+  return AxisReturns[axis];
+}
@@ -0,0 +1,100 @@
+//=============================================================================
+//
+//     FILE : StepperGroup.h
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Coordinated motion for a group of StepperMotor objects.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  A StepperGroup moves up to MAX_GROUP_MOTORS motors together so that all axes start and
+//  finish at the same time, following a straight line in step space (linear interpolation).
+//
+//  The axis with the most steps (the "major" axis) follows the normal trapezoidal velocity
+//  ramp of its motor (see SetRamp()) at the specified steps per second.  Every other axis is
+//  stepped from the same clock with a Bresenham (DDA) step scheduler, so its steps are spread
+//  evenly over the major axis steps.
+//
+//  Each motor's own range limits (LowerLimit/UpperLimit) and limit switch pins are checked for
+//  every step.  If any axis hits a limit, the whole group stops so the axes stay coordinated.
+//  A motor that is Disabled or E-Stopped during the move stops the group with MOTION_ABORTED.
+//
+//  A move is refused (MoveAbsolute()/MoveRelative() return false, no motor is touched) unless
+//  every motor is Homed, Enabled and idle, with no queued moves or stream, and stepsPerSecond
+//  is at least 1.  A group move can't be started while another one is running.
+//
+//  While a group move is running, its motors are stepped only by the group's Run() method.
+//  Calling Run() on the individual motors returns OKAY and does nothing.
+//
+//  Usage:
+//
+//    StepperMotor  X (2, 3, 4), Y (5, 6, 7), Z (8, 9, 10);
+//    StepperGroup  XYZ;
+//
+//    setup()
+//    {
+//      X.Enable();  Y.Enable();  Z.Enable();
+//      XYZ.AddMotor (&X);  XYZ.AddMotor (&Y);  XYZ.AddMotor (&Z);
+//
+//      long target[3] = { 2000, -500, 1200 };
+//      if (!XYZ.MoveAbsolute (target, 3000))
+//        ...                      // An axis is busy, not Homed or not Enabled
+//    }
+//
+//    loop()
+//    {
+//      RunReturn rr = XYZ.Run();  // RUN_COMPLETE when all axes have arrived
+//      ...                        // Use GetAxisReturn(axis) to see which axis stopped the group
+//    }
+//
+//=============================================================================
+
+#ifndef SMG_H
+#define SMG_H
+
+#include "StepperMotor.h"
+
+#define MAX_GROUP_MOTORS  4
+
+//=========================================================
+//  class StepperGroup
+//=========================================================
+
+class StepperGroup
+{
+  private:
+    StepperMotor   *Motors[MAX_GROUP_MOTORS];
+    RunReturn      AxisReturns[MAX_GROUP_MOTORS];  // Result for each axis of the last move
+    long           AxisSteps[MAX_GROUP_MOTORS];    // Number of steps for each axis
+    long           AxisError[MAX_GROUP_MOTORS];    // Bresenham error term for each axis
+    bool           AxisStepping[MAX_GROUP_MOTORS]; // Axis takes a step on this tick
+    int            NumMotors;
+    int            MajorAxis;                      // Axis with the most steps, sets the velocity profile
+    long           MajorSteps;
+    bool           Running;
+    unsigned long  NextStepMicros;                 // Target micros for next step
+
+    bool           startMove  (const long *targets, long stepsPerSecond);
+    RunReturn      stopMove   (int axis, RunReturn rr);
+
+  public:
+    StepperGroup ();
+
+    bool           AddMotor       (StepperMotor *motor);                         // Adds a motor as the next axis, returns false if the group is full
+    int            GetNumMotors   ();                                            // Returns the number of axes
+
+    RunReturn      Run            ();                                            // Keeps the group moving (must be called from your loop() function with no delay)
+
+    bool           MoveAbsolute   (const long *absPositions, long stepsPerSecond);  // Moves all axes to Absolute target positions (one per axis), returns false if refused
+    bool           MoveRelative   (const long *numSteps, long stepsPerSecond);      // Moves all axes by a number of steps (one per axis), returns false if refused
+    void           EStop          ();                                            // Stops all axes immediately (emergency stop)
+
+    bool           IsRunning      ();                                            // Returns true while a group move is in progress
+    RunReturn      GetAxisReturn  (int axis);                                    // Returns the RunReturn result of one axis for the last move
+};
+
+#endif
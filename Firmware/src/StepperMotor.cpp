@@ -15,7 +15,27 @@
 
 #include <Arduino.h>
 #include <string.h>
+#include <math.h>
+#include <stddef.h>
+#if defined(ARDUINO_ARCH_ESP32)
+  #include "driver/gpio.h"
+#endif
 #include "StepperMotor.h"
+#include "StepperScheduler.h"
+#include "ConfigStore.h"
+
+// Motion state shared with the timer interrupt is updated inside a critical section
+#if defined(STEPPER_TIMER) && defined(ARDUINO_ARCH_ESP32)
+  portMUX_TYPE MotionLock = portMUX_INITIALIZER_UNLOCKED;  // Also taken by StepperScheduler's timer
+  #define LOCK_MOTION()    portENTER_CRITICAL (&MotionLock)
+  #define UNLOCK_MOTION()  portEXIT_CRITICAL (&MotionLock)
+#elif defined(STEPPER_TIMER)
+  #define LOCK_MOTION()    noInterrupts ()
+  #define UNLOCK_MOTION()  interrupts ()
+#else
+  #define LOCK_MOTION()
+  #define UNLOCK_MOTION()
+#endif
 
 //==========================================================
 //  Constructor
@@ -40,10 +60,21 @@ StepperMotor::StepperMotor (int enablePin, int directionPin, int stepPin, int ll
   if (ULSwitchPin >= 0)
     pinMode (ULSwitchPin, INPUT_PULLUP);
 
+  // Look up the pin registers once
+  EnableOut   .Attach (EnablePin);
+  DirectionOut.Attach (DirectionPin);
+  StepOut     .Attach (StepPin);
+
+  if (LLSwitchPin >= 0)
+    LLSwitchIn.Attach (LLSwitchPin);
+
+  if (ULSwitchPin >= 0)
+    ULSwitchIn.Attach (ULSwitchPin);
+
   // Initialize pins
-  digitalWrite (EnablePin   , HIGH);  // HIGH = Off (disabled)
-  digitalWrite (DirectionPin, LOW);
-  digitalWrite (StepPin     , LOW);
+  EnableOut   .High ();  // HIGH = Off (disabled)
+  DirectionOut.Low  ();
+  StepOut     .Low  ();
 
 	// Set initial motor state and step position/timing
 	Homed             = false;
@@ -56,14 +87,115 @@ StepperMotor::StepperMotor (int enablePin, int directionPin, int stepPin, int ll
   UpperLimit        =  2000000000L;
   RampSteps         = 0L;
   RampDownStep      = 0L;
-  Velocity          = 0L;
+  RampLevel         = 0L;
   VelocityIncrement = RampScale * 5L;  // Default ramp scale of 5
+  Profile           = PROFILE_TRAPEZOID;
+  MaxJerk           = SCURVE_JERK;
+  Acceleration      = 0L;
+  RampVelocity      = 0L;
+  FullRampSteps     = 0L;
   NextPosition      = 0L;
   NextStepMicros    = -1L;
+  PulseHigh         = false;
+  PulseHold         = false;
+  PulseMicros       = 0L;
+  DirectionDeferred = false;
   MaxVelocity       = 0;
   TargetOrSteps     = 0;
   TotalSteps        = 0;
   StepCount         = 0;
+  Table             = &Tables[0];
+  Spare             = &Tables[1];
+  SpareBusy         = false;
+  PrepareNeeded     = false;
+  RampSettings      = 1;
+  DirectionChanged  = false;
+  StepDelay         = 0L;
+  Ramping           = false;
+  Homing            = HS_IDLE;
+  NumUserCommands   = 0;
+  HomingFastSpeed   = HOMING_SPEED;
+  HomingSlowSpeed   = HOMING_SLOW_SPEED;
+  ExitLevel         = 0L;
+  CommandedVelocity = 0L;
+  Scheduler         = NULL;
+  SchedulerAxis     = 0;
+  QueueHead         = 0;
+  QueueTail         = 0;
+  StreamHead        = 0;
+  StreamTail        = 0;
+  Streaming         = false;
+  StreamEnd         = false;
+  StreamLeft        = 0L;
+  StreamInterval    = 0L;
+  StreamAdd         = 0L;
+  StreamIncrement   = 1L;
+  StreamFraction    = 0L;
+  StepInterval      = 0L;
+  TelemetryReady    = false;
+  TelemetryPeriod   = 0L;
+  TelemetrySteps    = 0L;
+  TelemetryMicros   = 0L;
+  TelemetryPosition = 0L;
+  TelemetryState    = MS_DISABLED;
+  ConfigSlot        = 0;
+  PositionSaved     = false;  // Decided by LoadConfig(), which reads the saved record once
+  NumTriggers       = 0;
+  TriggerBelow      = 0;
+  TriggerPulsing    = false;
+  BlinkPin          = -1;
+  BlinkChanges      = 0;
+  BlinkMicros       = 0L;
+
+  // Neither ramp table is built yet (a RampSteps of 0 fits no ramp)
+  memset (Tables, 0, sizeof (Tables));
+
+#if defined(STEP_ENCODER)
+  // No encoder until AttachEncoder()
+  EncoderUnit       = NULL;
+  EncoderCounts     = 1L;
+  EncoderSteps      = 1L;
+  EncoderOffset     = 0L;
+  MaxFollowingError = 0L;
+  FollowingMode     = ENCODER_STOP;
+  Corrections       = 0;
+  EncoderMicros     = 0L;
+#endif
+
+#if defined(STEP_STATS)
+  ClearStepStats ();
+#endif
+
+#if defined(LIMIT_INTERRUPTS)
+  // Limit switches are latched by an interrupt
+  LimitEvent        = OKAY;
+  initLimitInterrupts ();
+#endif
+
+#if defined(STEPPER_RMT)
+  // Step pulses are generated by the RMT peripheral
+  SegmentReturn     = OKAY;
+  DirectionPending  = false;
+  initRMT ();
+#elif defined(STEPPER_TIMER)
+  // Steps are generated by a hardware timer interrupt
+  initTimer ();
+#endif
+}
+
+//==========================================================
+//  Destructor
+//==========================================================
+StepperMotor::~StepperMotor ()
+{
+#if defined(STEPPER_TIMER)
+  // Hand the step timer back for another motor
+  releaseTimer ();
+#endif
+
+#if defined(LIMIT_INTERRUPTS)
+  releaseLimitInterrupts ();
+#endif
 }
 
 //=========================================================
@@ -72,538 +204,4210 @@ StepperMotor::StepperMotor (int enablePin, int directionPin, int stepPin, int ll
 //=========================================================
 RunReturn StepperMotor::Run ()
 {
-  // Is the motor RUNNING and is it time for it to step
-  if (Homed && (State == MS_RUNNING) && (micros() >= NextStepMicros))
+#if defined(STEP_STATS)
+  recordRun ();
+#endif
+
+  RunReturn rr = runEngine ();
+
+  // The next queued move's ramp table is built here, ahead of its junction
+  if (PrepareNeeded)
+    prepareMove ();
+
+  // Compare outputs pulsed by the step engine
+  if (TriggerPulsing)
+    endTriggerPulses ();
+
+  // Identification blink
+  if (BlinkChanges > 0)
+    blinkStep ();
+
+  // Homing continues with its next phase
+  if (Homing != HS_IDLE && rr != OKAY)
+    rr = homingEvent (rr);
+
+#if defined(STEP_ENCODER)
+  // Closed loop: compare the encoder with the step position
+  if (MaxFollowingError > 0L && EncoderUnit != NULL && Homing == HS_IDLE)
+    rr = checkEncoder (rr);
+#endif
+
+  // Telemetry subscription
+  if (TelemetryPeriod > 0L || TelemetrySteps > 0L)
+    checkTelemetry ();
+
+  return rr;
+}
+
+//=== runEngine ===========================================
+
+RunReturn StepperMotor::runEngine ()
+{
+#if defined(STEPPER_TIMER)
+  // A queued move the interrupt held for its ramp table starts once it is built
+  if (TimerHeld)
   {
-    // Is the motor at the target position?
-    if (AbsolutePosition == TargetPosition)
+    TimerHeld = false;
+    if (State == MS_RUNNING)
     {
-      // Yes, stop motor and indicate completion
-      State = MS_ENABLED;
-      return RUN_COMPLETE;
+      prepareMove ();
+      startTimer (10L);
     }
+  }
 
-    // No, so continue motion
-    NextPosition = AbsolutePosition + StepIncrement;  // +1 for clockwise rotations, -1 for counter-clockwise
+  // The timer interrupt does the stepping, just report what it has queued
+  return takeEvent ();
+#else
+#if defined(NONBLOCKING_PULSE)
+  // Finish the last step pulse first.  A stream that ran dry has no next step to wait for,
+  // so it ends now (the pulse is still lowered by the following passes).
+  if (pulseBusy ())
+    return (Streaming && StreamEnd && State == MS_RUNNING) ? stopRotation (RUN_COMPLETE) : OKAY;
+#endif
 
-    // Check next position against range limits
-    // If out of range, stop motor and return range error
-    if (NextPosition < LowerLimit)
+  // Is the motor RUNNING?
+  if (!Homed || (State != MS_RUNNING))
+    return OKAY;
+
+#if defined(LIMIT_INTERRUPTS) && !defined(STEPPER_RMT)
+  // A latched limit switch stops the motor without waiting for the next step
+  if (LimitEvent != OKAY && Homing == HS_IDLE)
+  {
+    RunReturn rr = checkLimitSwitches ();
+    if (rr != OKAY)
+      return stopRotation (rr);
+  }
+#endif
+
+#if defined(STEPPER_RMT)
+  // Keep the RMT peripheral supplied with step segments
+  return runSegments ();
+#else
+  // Is it time for the motor to step?  (A signed difference stays correct when micros() wraps)
+  unsigned long now = micros();
+  if ((long) (now - NextStepMicros) >= 0L)
+  {
+    // Is the motor at the target position or at a range limit?
+    RunReturn rr = checkNextStep ();
+    if (rr != OKAY)
     {
-      State = MS_ENABLED;
-      return RANGE_ERROR_LOWER;
+      // Yes, stop motor and indicate completion or range error
+      return stopRotation (rr);
     }
 
-    if (NextPosition > UpperLimit)
+    // The Direction pin just changed, step 10-microseconds later
+    if (DirectionChanged)
     {
-      State = MS_ENABLED;
-      return RANGE_ERROR_UPPER;
+      DirectionChanged = false;
+      StepDelay        = micros() + 10L - NextStepMicros;
+      NextStepMicros  += StepDelay;
+      return OKAY;
     }
 
     // Perform a single step
     doStep ();
 
-    // Set current position
-    AbsolutePosition = NextPosition;
-    DeltaPosition   += StepIncrement;
+#if defined(STEP_STATS)
+    recordStep (now - NextStepMicros);
+#endif
 
-    // Check limit switches, if specified
-    if ((LLSwitchPin >= 0) && digitalRead (LLSwitchPin) == LOW)
-    {
-      // Lower limit switch triggered
-      State = MS_ENABLED;
-      return LIMIT_SWITCH_LOWER;
-    }
-
-    if ((ULSwitchPin >= 0) && digitalRead (ULSwitchPin) == LOW)
-    {
-      // Upper limit switch triggered
-      State = MS_ENABLED;
-      return LIMIT_SWITCH_UPPER;
-    }
+    // Set current position and velocity
+    unsigned long interval = keepSchedule (advanceStep ());
 
-    // Adjust velocity if ramping
-    StepCount = abs(DeltaPosition);
-    if (StepCount <= RampSteps)
-    {
-      // Ramping up
-      Velocity += VelocityIncrement;
-    }
-    else if (StepCount > RampDownStep)
-    {
-      // Ramping down
-      Velocity -= VelocityIncrement;
-    }
+    // Check limit switches, if specified
+    rr = checkLimitSwitches ();
+    if (rr != OKAY)
+      return stopRotation (rr);
 
     // Set time for next step
-    if (Velocity > 0L)
-      NextStepMicros += 1000000L / Velocity;
+    NextStepMicros += interval;
   }
 
   return OKAY;
+#endif
+#endif
 }
 
-//=== startRotation =======================================
+#if defined(STEP_STATS)
+//=== Step Stats ==========================================
+//  How late each software step is against its schedule, and how long loop()
+//  kept Run() from being called.  Late steps show up even when no step is lost.
 
-void StepperMotor::startRotation ()
+void StepperMotor::recordRun ()
 {
-  // Determine number of steps in ramp and set starting speed
-  if (VelocityIncrement == 0L)
-  {
-    // Immediate full speed, no ramping
-    RampSteps = 0L;
-    Velocity  = MaxVelocity;  // Start at full velocity
-  }
-  else
-  {
-    // Ramp up
-    RampSteps = MaxVelocity / VelocityIncrement;
-    if (RampSteps == 0L)
-      Velocity = MaxVelocity;  // Start at slow value
-    else
-      Velocity = 0L;  // Start from a stand-still
-  }
+  unsigned long now = micros();
 
-  // Set on what step to start ramping down
-  if (TotalSteps > 2L * RampSteps)
-    RampDownStep = TotalSteps - RampSteps;  // Normal trapezoid velocity
-  else
-    RampDownStep = RampSteps = TotalSteps / 2L;  // Stunted triangle velocity
+  if (RunTimed && State == MS_RUNNING && (now - LastRunMicros) > Stats.MaxRunGap)
+    Stats.MaxRunGap = now - LastRunMicros;
 
-  // Set Direction
-  if (TargetPosition >= AbsolutePosition)
-  {
-    StepIncrement = 1L;
-    digitalWrite (DirectionPin, LOW);
-  }
-  else if (TargetPosition < AbsolutePosition)
-  {
-    StepIncrement = -1L;
-    digitalWrite (DirectionPin, HIGH);
-  }
+  LastRunMicros = now;
+  RunTimed      = (State == MS_RUNNING);
+}
 
-  // Start rotation
-  DeltaPosition  = 0L;
-  NextStepMicros = micros() + 10L;  // Direction must be set 10-microseconds before stepping
-  State          = MS_RUNNING;
+void StepperMotor::recordStep (unsigned long late)
+{
+  int  bin = 0;
+
+  // Bin n holds lateness 2^(n-1) .. 2^n - 1
+  while ((late >> bin) != 0UL && bin < STATS_BINS - 1)
+    bin++;
+
+  Stats.Histogram[bin]++;
+  Stats.Steps++;
+
+  if (late > Stats.MaxLate)
+    Stats.MaxLate = late;
+
+  if (late > STATS_DEADLINE)
+    Stats.Missed++;
 }
 
-//=== doStep ==============================================
+//=== recordCommand =======================================
 
-void StepperMotor::doStep ()
+void StepperMotor::recordCommand (unsigned long start)
 {
-  // Perform a single step
-  digitalWrite (StepPin, HIGH);
-  delayMicroseconds (PULSE_WIDTH);
-  digitalWrite (StepPin, LOW);
+  unsigned long elapsed = micros() - start;
+
+  if (elapsed > Stats.MaxCommand)
+    Stats.MaxCommand = elapsed;
+}
 
+//=== GetStepStats ========================================
 
-  // // For fast stepping on the Arduino NANO:
-  // PORTD |= B00010000;   // Turn on Pulse pin (Arduino NANO Digital Pin 4)
-  // delayMicroseconds (PULSE_WIDTH);
-  // PORTD &= ~B00010000;  // Turn off Pulse pin
+const StepStats *StepperMotor::GetStepStats ()
+{
+  return &Stats;
+}
 
+//=== ClearStepStats ======================================
 
+void StepperMotor::ClearStepStats ()
+{
+  memset (&Stats, 0, sizeof (Stats));
+  RunTimed = false;
 }
+#endif
 
-//=== Enable ==============================================
+//=== Telemetry ===========================================
+//  A subscribed host gets a BIN_TELEMETRY frame (position, velocity, state) every
+//  TelemetryPeriod, every TelemetrySteps steps and on every change of state.
+//  Only the latest frame is kept, so a frame not taken in time is replaced.
 
-void StepperMotor::Enable ()
+void StepperMotor::SetTelemetry (long periodMs, long everySteps)
 {
-  // Enable motor driver
-  digitalWrite (EnablePin, LOW);
-  State = MS_ENABLED;
+  TelemetryPeriod   = (periodMs > 0L) ? periodMs * 1000L : 0L;
+  TelemetrySteps    = (everySteps > 0L) ? everySteps : 0L;
+  TelemetryMicros   = micros();
+  TelemetryPosition = GetAbsolutePosition ();
+  TelemetryState    = State;
+  TelemetryReady    = false;
 
-  // Also, set the current position as HOME
-  SetHomePosition ();
+  // A scheduled motor at rest now needs Run() for its frames
+  wakeScheduler ();
 }
 
-//=== Disable =============================================
+//=== TakeTelemetry =======================================
 
-void StepperMotor::Disable ()
+const uint8_t * StepperMotor::TakeTelemetry (int *frameLength)
 {
-  // Disable motor driver
-  digitalWrite (EnablePin, HIGH);
+  if (!TelemetryReady)
+    return NULL;
 
-  State = MS_DISABLED;
-  Homed = false;  // When motor is free to move, the HOME position is lost
+  TelemetryReady = false;
+  *frameLength   = sizeof (TelemetryFrame);
+
+  return TelemetryFrame;
 }
 
-//=== FindHome ============================================
+//=== checkTelemetry ======================================
 
-void StepperMotor::FindHome ()
+void StepperMotor::checkTelemetry ()
 {
-  // Seek counter-clockwise to lower limit switch
-  // Then back-off until switch releases and set
-  // new HOME position
+  unsigned long  now      = micros();
+  long           position = GetAbsolutePosition ();
+  long           values[3];
 
-  if (LLSwitchPin >= 0)
-  {
-    Enable ();
+  if (State == TelemetryState &&
+      (TelemetryPeriod == 0L || now - TelemetryMicros < (unsigned long) TelemetryPeriod) &&
+      (TelemetrySteps  == 0L || abs (position - TelemetryPosition) < TelemetrySteps))
+    return;
 
-    // Find limit switch
-    digitalWrite (DirectionPin, HIGH);
-    while (digitalRead (LLSwitchPin) == HIGH)
-    {
-      doStep ();
-      delay (5L);
-    }
+  values[0] = position;
+  values[1] = GetVelocity ();
+  values[2] = State;
+  buildFrame (TelemetryFrame, BIN_TELEMETRY, values, 3);
 
-    // Back off slowly
-    digitalWrite (DirectionPin, LOW);
-    while (digitalRead (LLSwitchPin) == LOW)
-    {
-      doStep ();
-      delay (50L);
-    }
+  TelemetryReady    = true;
+  TelemetryMicros   = now;
+  TelemetryPosition = position;
+  TelemetryState    = State;
+}
 
-    // A few more steps
-    for (int i=0; i<10; i++)
-      doStep ();
+//=== Trigger Points ======================================
+//  Triggers[] is sorted by position and TriggerBelow counts the points below the current
+//  position, so the points a step can reach are always at TriggerBelow (and just before it).
 
-    SetHomePosition ();
-  }
+//=== outputPin ===========================================
+
+bool StepperMotor::outputPin (int pin)
+{
+  // Never one of the motor's own Step, Direction, Enable or limit switch pins
+  if (pin < 0 || pin == StepPin || pin == DirectionPin || pin == EnablePin || pin == LLSwitchPin || pin == ULSwitchPin)
+    return false;
+
+#if defined(ARDUINO_ARCH_ESP32)
+  return GPIO_IS_VALID_OUTPUT_GPIO (pin);  // Input-only and missing GPIOs are refused
+#else
+  return (pin < NUM_DIGITAL_PINS);
+#endif
 }
 
-//=== SetHomePosition =====================================
+//=== AddTrigger ==========================================
 
-void StepperMotor::SetHomePosition ()
+bool StepperMotor::AddTrigger (long position, int pin, TriggerAction action)
 {
-  // Only if Enabled
-  if (State == MS_ENABLED)
-  {
-    // Set current position as HOME position
-    AbsolutePosition = 0L;
-    DeltaPosition    = 0L;
-    Homed            = true;
-  }
+  int i;
+
+  // The step engine reads the list while running
+  if (State == MS_RUNNING || NumTriggers >= TRIGGER_POINTS || !outputPin (pin) || action > TRIGGER_PULSE)
+    return false;
+
+  pinMode (pin, OUTPUT);
+
+  // Insert after the points at the same position, so they fire in the order added
+  for (i=NumTriggers; i>0 && Triggers[i-1].Position > position; i--)
+    Triggers[i] = Triggers[i-1];
+
+  Triggers[i].Position = position;
+  Triggers[i].Action   = (uint8_t) action;
+  Triggers[i].Pulsing  = false;
+  Triggers[i].PulseEnd = 0L;
+  Triggers[i].Out.Attach (pin);
+  NumTriggers++;
+
+  seekTriggers ();
+  return true;
 }
 
-//=== SetLowerLimit =======================================
+//=== ClearTriggers =======================================
 
-void StepperMotor::SetLowerLimit (long lowerLimit)
+bool StepperMotor::ClearTriggers ()
 {
-  // Must be <= 0 and <= UpperLimit
-  if (lowerLimit <= 0 && lowerLimit <= UpperLimit)
-    LowerLimit = lowerLimit;
+  if (State == MS_RUNNING)
+    return false;
+
+  // End any pulse still high
+  for (int i=0; i<NumTriggers; i++)
+    if (Triggers[i].Pulsing)
+      Triggers[i].Out.Low ();
+
+  NumTriggers    = 0;
+  TriggerBelow   = 0;
+  TriggerPulsing = false;
+  return true;
 }
 
-//=== SetUpperLimit =======================================
+//=== GetTriggerCount =====================================
 
-void StepperMotor::SetUpperLimit (long upperLimit)
+int StepperMotor::GetTriggerCount ()
 {
-  // Must be >= 0 and >= LowerLimit
-  if (upperLimit >= 0 && upperLimit >= LowerLimit)
-    UpperLimit = upperLimit;
+  return NumTriggers;
 }
 
-//=== SetRamp =============================================
+//=== checkTriggers =======================================
 
-void StepperMotor::SetRamp (int ramp)
+void StepperMotor::checkTriggers ()
 {
-  // Must be 0..9
-  if (ramp >= 0 && ramp <= 9)
+  // A step moves the position by one, so only the points next to TriggerBelow can be reached
+  int count = 0;
+
+  if (StepIncrement > 0L)
   {
-    // Set velocity slope (increment)
-    if (ramp == 0)
-      VelocityIncrement = 0L;  // constant full velocity
-    else
-      VelocityIncrement = RampScale * (10L - (long)ramp);
+    // Clockwise: the points at the last position are now below it
+    while (TriggerBelow < NumTriggers && Triggers[TriggerBelow].Position < AbsolutePosition)
+      TriggerBelow++;
+  }
+  else
+  {
+    // Counter-clockwise: the points at the new position are no longer below it
+    while (TriggerBelow > 0 && Triggers[TriggerBelow - 1].Position >= AbsolutePosition)
+      TriggerBelow--;
   }
-}
 
-//=== RotateAbsolute ======================================
+  while (TriggerBelow + count < NumTriggers && Triggers[TriggerBelow + count].Position == AbsolutePosition)
+    count++;
 
-void StepperMotor::RotateAbsolute (long newPosition, int stepsPerSecond)
-{
-  TargetPosition = newPosition;  // Set Absolute Position
-  MaxVelocity    = stepsPerSecond;
-  TotalSteps     = abs(TargetPosition - AbsolutePosition);
+  if (count == 0)
+    return;
 
-  startRotation ();
+#if defined(STEPPER_RMT)
+  // The step is only queued: fire the points when its segment has been sent
+  if (SegmentBuilding)
+  {
+    SegmentTriggerFirst = TriggerBelow;
+    SegmentTriggerCount = count;
+    return;
+  }
+#endif
+
+  fireTriggers (TriggerBelow, count);
 }
 
-//==== RotateRelative =====================================
+//=== fireTriggers ========================================
 
-void StepperMotor::RotateRelative (long numSteps, int stepsPerSecond)
+void StepperMotor::fireTriggers (int first, int count)
 {
-  // If numSteps is positive (> 0) then motor rotates clockwise, else counter-clockwise
-  if (numSteps != 0)
+  TriggerPoint *point;
+
+  for (int i=first; i<first+count; i++)
   {
-    TargetPosition = AbsolutePosition + numSteps;
-    MaxVelocity    = stepsPerSecond;
-    TotalSteps     = abs(numSteps);
+    point = &Triggers[i];
 
-    startRotation ();
+    if (point->Action == TRIGGER_LOW)
+      point->Out.Low ();
+    else
+      point->Out.High ();
+
+    if (point->Action == TRIGGER_PULSE)
+    {
+      point->PulseEnd = micros() + TRIGGER_PULSE_MICROS;
+      point->Pulsing  = true;
+      TriggerPulsing  = true;
+    }
   }
 }
 
-//=== RotateToHome ========================================
+//=== seekTriggers ========================================
 
-void StepperMotor::RotateToHome ()
+void StepperMotor::seekTriggers ()
 {
-  MaxVelocity    = HOMING_SPEED;
-  TargetPosition = 0L;  // HOME position
-  TotalSteps     = abs(AbsolutePosition);
-
-  startRotation ();
+  // The position jumped (or the list changed), count the points below it again
+  TriggerBelow = 0;
+  while (TriggerBelow < NumTriggers && Triggers[TriggerBelow].Position < AbsolutePosition)
+    TriggerBelow++;
 }
 
-//=== RotateToLowerLimit ==================================
+//=== endTriggerPulses ====================================
 
-void StepperMotor::RotateToLowerLimit ()
+void StepperMotor::endTriggerPulses ()
 {
-  MaxVelocity    = HOMING_SPEED;
-  TargetPosition = LowerLimit;
-  TotalSteps     = abs(AbsolutePosition - LowerLimit);
+  unsigned long now = micros();
 
-  startRotation ();
+  // Cleared first: a pulse fired meanwhile (by an interrupt) sets it again
+  TriggerPulsing = false;
+
+  for (int i=0; i<NumTriggers; i++)
+  {
+    if (!Triggers[i].Pulsing)
+      continue;
+
+    if ((long) (now - Triggers[i].PulseEnd) >= 0L)
+    {
+      Triggers[i].Out.Low ();
+      Triggers[i].Pulsing = false;
+    }
+    else
+      TriggerPulsing = true;
+  }
 }
 
-//=== RototaeToUpperLimit =================================
+#if defined(STEP_ENCODER)
+//=== Encoder =============================================
+//  The PCNT unit counts both edges of both channels (4 counts per encoder line).  Its count is
+//  scaled to steps, and EncoderOffset makes it read the step position whenever they are synced.
 
-void StepperMotor::RotateToUpperLimit ()
+//=== AttachEncoder =======================================
+
+bool StepperMotor::AttachEncoder (int pinA, int pinB, long countsPerRev, long stepsPerRev)
 {
-  MaxVelocity    = HOMING_SPEED;
-  TargetPosition = UpperLimit;
-  TotalSteps     = abs(AbsolutePosition - UpperLimit);
+  pcnt_channel_handle_t  channelA, channelB;
 
-  startRotation ();
-}
+  if (EncoderUnit != NULL || countsPerRev <= 0L || stepsPerRev <= 0L)
+    return false;
 
-//=== EStop ===============================================
+  // Accumulate the total past the limits of the 16-bit hardware counter
+  pcnt_unit_config_t unitConfig = {};
+  unitConfig.low_limit         = -ENCODER_LIMIT;
+  unitConfig.high_limit        =  ENCODER_LIMIT;
+  unitConfig.flags.accum_count = 1;
+  if (pcnt_new_unit (&unitConfig, &EncoderUnit) != ESP_OK)
+  {
+    EncoderUnit = NULL;  // All PCNT units are in use
+    return false;
+  }
 
-void StepperMotor::EStop ()
-{
-  // Emergency Stop
-  // ((( Requires Re-Enable of motor )))
-	digitalWrite (StepPin  , LOW );   // Pulse Off
-	digitalWrite (EnablePin, HIGH);   // Disengage
+  pcnt_glitch_filter_config_t filterConfig = {};
+  filterConfig.max_glitch_ns = ENCODER_GLITCH_NS;
+  pcnt_unit_set_glitch_filter (EncoderUnit, &filterConfig);
 
-  State = MS_ESTOPPED;
-  Homed = false;
-  TargetPosition = AbsolutePosition;
-}
+  // Each channel counts the edges of one pin, up or down by the level of the other (quadrature)
+  pcnt_chan_config_t channelConfig = {};
+  channelConfig.edge_gpio_num  = pinA;
+  channelConfig.level_gpio_num = pinB;
+  pcnt_new_channel (EncoderUnit, &channelConfig, &channelA);
 
-//=== IsHomed =============================================
+  channelConfig.edge_gpio_num  = pinB;
+  channelConfig.level_gpio_num = pinA;
+  pcnt_new_channel (EncoderUnit, &channelConfig, &channelB);
 
-bool StepperMotor::IsHomed ()
-{
-  // Return homed state
-  return Homed;
-}
+  pcnt_channel_set_edge_action  (channelA, PCNT_CHANNEL_EDGE_ACTION_DECREASE, PCNT_CHANNEL_EDGE_ACTION_INCREASE);
+  pcnt_channel_set_level_action (channelA, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE);
+  pcnt_channel_set_edge_action  (channelB, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_DECREASE);
+  pcnt_channel_set_level_action (channelB, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE);
 
-//=== GetState ============================================
+  // The driver adds the count to its total each time a limit is reached
+  pcnt_unit_add_watch_point (EncoderUnit, -ENCODER_LIMIT);
+  pcnt_unit_add_watch_point (EncoderUnit,  ENCODER_LIMIT);
 
-MotorState StepperMotor::GetState ()
-{
-  // Return current motor state
-  return State;
-}
+  pcnt_unit_enable      (EncoderUnit);
+  pcnt_unit_clear_count (EncoderUnit);
+  pcnt_unit_start       (EncoderUnit);
 
-//=== GetAbsolutePosition =================================
+  EncoderCounts = countsPerRev;
+  EncoderSteps  = stepsPerRev;
+  syncEncoder ();
 
-long StepperMotor::GetAbsolutePosition ()
-{
-  // Return current position from HOME
-  return AbsolutePosition;
+  return true;
 }
 
-//=== GetRelativePosition =================================
+//=== SetFollowingError ===================================
 
-long StepperMotor::GetRelativePosition ()
+void StepperMotor::SetFollowingError (long maxSteps, EncoderMode mode)
 {
-  // Return number of steps moved from last position
-  return DeltaPosition;
+  MaxFollowingError = (maxSteps > 0L) ? maxSteps : 0L;
+  FollowingMode     = (mode == ENCODER_CORRECT) ? ENCODER_CORRECT : ENCODER_STOP;
+  Corrections       = 0;
 }
 
-//=== GetLowerLimit =======================================
+//=== GetEncoderPosition ==================================
 
-long StepperMotor::GetLowerLimit ()
+long StepperMotor::GetEncoderPosition ()
 {
-  return LowerLimit;
+  // Without an encoder, the step position
+  if (EncoderUnit == NULL)
+    return GetAbsolutePosition ();
+
+  return encoderSteps () + EncoderOffset;
 }
 
-//=== GetUpperLimit =======================================
+//=== GetFollowingError ===================================
 
-long StepperMotor::GetUpperLimit ()
+long StepperMotor::GetFollowingError ()
 {
-  return UpperLimit;
+  // Negative when the shaft is behind (counter-clockwise of) the step position
+  return GetEncoderPosition () - GetAbsolutePosition ();
 }
 
-//=== GetRemainingTime ====================================
+//=== encoderSteps ========================================
 
-unsigned long StepperMotor::GetRemainingTime ()
+long StepperMotor::encoderSteps ()
 {
-  // Return remaining time (in milliseconds) for motion to complete
-  if (State != MS_RUNNING)
-    return 0L;
-
-  unsigned long numSteps = abs (AbsolutePosition - TargetPosition);
-  unsigned long remTime  = 1000L * numSteps / MaxVelocity + 500L;  // +500 for ramping
+  int count = 0;
 
-  return remTime;
+  pcnt_unit_get_count (EncoderUnit, &count);
+  return (long) ((int64_t) count * EncoderSteps / EncoderCounts);
 }
 
-//=== GetVersion ==========================================
+//=== syncEncoder =========================================
 
-const char * StepperMotor::GetVersion ()
+void StepperMotor::syncEncoder ()
 {
-  return version;
+  // The step position is known to be right (HOME set, or a saved position restored)
+  if (EncoderUnit != NULL)
+    EncoderOffset = AbsolutePosition - encoderSteps ();
+
+  Corrections = 0;
 }
 
-//=== BlinkLED ============================================
+//=== checkEncoder ========================================
 
-void StepperMotor::BlinkLED (int LEDpin)
+RunReturn StepperMotor::checkEncoder (RunReturn rr)
 {
-  pinMode(LEDpin, OUTPUT);
-
-  // Blink onboard LED
-  for (int i=0; i<10; i++)
+  if (rr == OKAY)
   {
-    digitalWrite (LEDpin, HIGH);
-    delay (20);
-    digitalWrite (LEDpin, LOW);
-    delay (80);
+    // While running, check every ENCODER_CHECK_MICROS
+    unsigned long now = micros();
+    if (State != MS_RUNNING || (long) (now - EncoderMicros) < ENCODER_CHECK_MICROS)
+      return OKAY;
+    EncoderMicros = now;
   }
-}
+  else if (rr != RUN_COMPLETE)
+    return rr;  // Range and limit errors are reported as they are
 
+  if (labs (GetFollowingError ()) <= MaxFollowingError)
+  {
+    if (rr == RUN_COMPLETE)
+      Corrections = 0;
+    return rr;
+  }
 
-//=========================================================
-//  ExecuteCommand
-//=========================================================
+  long shaft = encoderSteps () + EncoderOffset;
 
-const char * StepperMotor::ExecuteCommand (const char *packet)
-{
-  char  command[3];
-  int   ramp, velocity;
-  long  limit, targetOrNumSteps;
+  // Steps were lost (or gained): stop stepping on the spot.  (In timer builds the
+  // lock waits out a step interrupt in progress, and keeps the next one out.)
+  LOCK_MOTION ();
+  if (State == MS_RUNNING)
+  {
+  #if defined(STEPPER_RMT)
+    stopSegments (true);
+  #elif defined(STEPPER_TIMER)
+    stopTimer ();
+    EventTail = EventHead;  // An event queued before the stop is stale
+  #endif
+    State = MS_ENABLED;
+  }
 
-  // Initialize return string
-  ecReturnString[0] = 0;
+  // The shaft is where the encoder says
+  AbsolutePosition = shaft;
+  DeltaPosition    = 0L;
+  seekTriggers ();
+  UNLOCK_MOTION ();
 
-  // Command string must be at least 2 chars
-  if (strlen(packet) < 2)
+  if (FollowingMode == ENCODER_CORRECT && !Streaming && Corrections < ENCODER_RETRIES)
+  {
+    // Finish the rotation from a stand-still, then the queued moves as planned
+    // (the timer is stopped until startRotation() starts it again)
+    Corrections++;
+    TotalSteps = labs (TargetPosition - AbsolutePosition);
+    ExitLevel  = 0L;
+    startRotation ();
+
+    LOCK_MOTION ();
+    planQueue ();
+    UNLOCK_MOTION ();
+    return OKAY;
+  }
+
+  Corrections    = 0;
+  TargetPosition = AbsolutePosition;
+  return stopRotation (FOLLOWING_ERROR);
+}
+#endif
+
+//=== checkNextStep =======================================
+
+RunReturn StepperMotor::checkNextStep ()
+{
+  if (Streaming)
+  {
+    // A stream ends when its ring runs dry
+    if (StreamEnd)
+      return RUN_COMPLETE;
+
+    if (StreamIncrement != StepIncrement)
+    {
+      setStreamDirection ();
+      DirectionChanged = true;  // The step engine waits 10-microseconds before stepping
+    }
+  }
+
+  // Is the motor at the target position?
+  else if (AbsolutePosition == TargetPosition)
+  {
+    // Yes, continue with the next queued move, if any
+    if (!nextQueuedMove ())
+      return RUN_COMPLETE;
+  }
+
+  // No, so continue motion
+  NextPosition = AbsolutePosition + StepIncrement;  // +1 for clockwise rotations, -1 for counter-clockwise
+
+  // Check next position against range limits (the position is unknown while homing)
+  if (Homing == HS_IDLE)
+  {
+    if (NextPosition < LowerLimit)
+      return RANGE_ERROR_LOWER;
+
+    if (NextPosition > UpperLimit)
+      return RANGE_ERROR_UPPER;
+  }
+
+  return OKAY;
+}
+
+//=== advanceStep =========================================
+
+unsigned long StepperMotor::advanceStep ()
+{
+  if (Streaming)
+    return advanceStream ();
+
+  // Set current position
+  AbsolutePosition = NextPosition;
+  DeltaPosition   += StepIncrement;
+
+  if (NumTriggers > 0)
+    checkTriggers ();
+
+  // Adjust velocity if ramping
+  // The ramp table index follows the velocity level using only adds and compares
+  StepCount = abs(DeltaPosition);
+  if (StepCount <= RampSteps)
+  {
+    // Ramping up
+    RampLevel++;
+    RampAccum += Table->Length;
+    if (RampAccum >= Table->RampSteps)
+    {
+      RampAccum -= Table->RampSteps;
+      RampIndex++;
+    }
+  }
+  else if (StepCount > RampDownStep || RampLevel > FullRampSteps)
+  {
+    // Ramping down, or slowing to a lowered cruise velocity (SetVelocity)
+    RampLevel--;
+    RampAccum -= Table->Length;
+    if (RampAccum < 0L)
+    {
+      RampAccum += Table->RampSteps;
+      RampIndex--;
+    }
+  }
+
+  // Return time (in microseconds) until next step
+  if (Ramping && RampLevel <= 0L)
+    return StepInterval = 0L;
+
+  unsigned long interval = IntervalFraction;
+
+  if (Ramping && RampLevel != FullRampSteps)
+    interval += Table->Intervals[RampIndex];
+  else
+  {
+    // At full velocity the remainder of the fixed-point division is carried
+    // as well, so the step rate is exactly MaxVelocity over any distance
+    interval   += CruiseInterval;
+    CruiseAccum += CruiseRemainder;
+    if (CruiseAccum >= (unsigned long) MaxVelocity)
+    {
+      CruiseAccum -= MaxVelocity;
+      interval++;
+    }
+  }
+
+  IntervalFraction = interval & RAMP_FRACTION_MASK;  // Carry fractional microseconds to the next step
+
+  return StepInterval = interval >> RAMP_FRACTION_BITS;
+}
+
+
+//=== keepSchedule ========================================
+
+unsigned long StepperMotor::keepSchedule (unsigned long interval)
+{
+  // The step after a direction change waited for the Direction pin,
+  // so the one after it comes that much sooner and the schedule is kept
+  if (StepDelay > 0L)
+  {
+    interval  = (interval > StepDelay) ? interval - StepDelay : 0L;
+    StepDelay = 0L;
+  }
+
+  return interval;
+}
+//=== S-Curve =============================================
+//  A 7-segment S-curve ramp from a stand-still up to velocity V: the acceleration
+//  rises at the max jerk J, holds at A, then falls at -J to zero at V.  (If V is
+//  reached before the acceleration gets to A, the constant part is left out.)
+//  A jerk of 0 gives a constant acceleration ramp.
+//  The ramp's step intervals come from the time at which each step is reached.
+
+struct SCurve
+{
+  float  V, A, J;      // Velocity, acceleration and jerk limits
+  float  Tj, Ta, T;    // Jerk time, constant acceleration time, total ramp time
+  float  X1, X2, D;    // Distance at the end of the first and second segments, and in total
+  float  V1;           // Velocity at the end of the first segment
+};
+
+static void sCurveSetup (SCurve *s, float velocity, float accel, float jerk)
+{
+  s->V = velocity;
+  s->J = jerk;
+  s->A = (jerk > 0.0f && velocity * jerk < accel * accel) ? sqrtf (velocity * jerk) : accel;
+
+  s->Tj = (jerk > 0.0f) ? s->A / s->J : 0.0f;
+  s->Ta = s->V / s->A - s->Tj;
+  s->T  = 2.0f * s->Tj + s->Ta;
+  s->V1 = 0.5f * s->J * s->Tj * s->Tj;
+  s->X1 = s->V1 * s->Tj / 3.0f;
+  s->X2 = s->X1 + s->V1 * s->Ta + 0.5f * s->A * s->Ta * s->Ta;
+  s->D  = 0.5f * s->V * s->T;  // The ramp is symmetric about its midpoint
+}
+
+static float sCurveTime (const SCurve *s, float x)
+{
+  // Time (seconds) at which the ramp has travelled x steps
+  if (x <= 0.0f)
+    return 0.0f;
+
+  if (x <= s->X1)
+    return cbrtf (6.0f * x / s->J);
+
+  if (x <= s->X2)
+    return s->Tj + (sqrtf (s->V1 * s->V1 + 2.0f * s->A * (x - s->X1)) - s->V1) / s->A;
+
+  if (x >= s->D)
+    return s->T + (x - s->D) / s->V;
+
+  // Last segment: D - x = V*r - J*r³/6 with r the time left in the ramp.
+  // Newton's method from below converges in a few iterations.
+  float r = (s->D - x) / s->V;
+
+  for (int i=0; i<4; i++)
+    r += (s->D - x - s->V * r + s->J * r * r * r / 6.0f) / (s->V - 0.5f * s->J * r * r);
+
+  return s->T - r;
+}
+
+//=== curveRamp ===========================================
+
+bool StepperMotor::curveRamp ()
+{
+  // The ramp is computed in time (S-curve or constant acceleration)
+  // rather than in velocity increments per step
+  return (Profile == PROFILE_SCURVE || Acceleration > 0L);
+}
+
+//=== rampAccel ===========================================
+
+float StepperMotor::rampAccel (long maxVelocity)
+{
+  if (Acceleration > 0L)
+    return (float) Acceleration;
+
+  // The trapezoid ramp reaches maxVelocity in maxVelocity/VelocityIncrement steps,
+  // so its average acceleration is maxVelocity * VelocityIncrement / 2
+  return 0.5f * (float) maxVelocity * (float) VelocityIncrement;
+}
+
+//=== curveSteps ==========================================
+
+long StepperMotor::curveSteps (long velocity, long maxVelocity)
+{
+  SCurve  s;
+
+  if (velocity <= 0L)
+    return 0L;
+
+  sCurveSetup (&s, velocity, rampAccel (maxVelocity), (Profile == PROFILE_SCURVE) ? MaxJerk : 0L);
+
+  // One more step than the ramp distance, so the last level is at full velocity
+  return (long) s.D + 1L;
+}
+
+//=== planRamp ============================================
+
+void StepperMotor::planRamp (long maxVelocity, long steps, long *rampVelocity, long *fullSteps)
+{
+  long  lo, hi, mid;
+
+  // Number of steps to ramp up to full velocity
+  *rampVelocity = maxVelocity;
+  *fullSteps    = 0L;
+
+  if ((VelocityIncrement > 0L || Acceleration > 0L) && maxVelocity > 0L)
+  {
+    if (curveRamp ())
+    {
+      *fullSteps = curveSteps (maxVelocity, maxVelocity);
+
+      // Too short to reach full velocity?  Find the highest velocity
+      // whose whole S-curve fits, so the jerk stays limited.
+      // (A constant acceleration ramp just turns into a triangle.)
+      if (Profile == PROFILE_SCURVE && 2L * *fullSteps > steps)
+      {
+        lo = 0L;
+        hi = maxVelocity;
+        while (hi - lo > 1L)
+        {
+          mid = (lo + hi) / 2L;
+          if (2L * curveSteps (mid, maxVelocity) > steps)
+            hi = mid;
+          else
+            lo = mid;
+        }
+
+        *rampVelocity = (lo > 0L) ? lo : 1L;
+        *fullSteps    = curveSteps (*rampVelocity, maxVelocity);
+      }
+    }
+    else
+      *fullSteps = maxVelocity / VelocityIncrement;
+  }
+}
+
+//=== setupRamp ===========================================
+
+void StepperMotor::setupRamp ()
+{
+  // Velocities beyond what the backend can deliver are held to its limit,
+  // and a rotation never runs below 1 step/sec (a 0 cruise interval steps on every call)
+  if (MaxVelocity > MAX_STEP_RATE)
+    MaxVelocity = MAX_STEP_RATE;
+  else if (MaxVelocity < 1L)
+    MaxVelocity = 1L;
+
+  planRamp (MaxVelocity, TotalSteps, &RampVelocity, &FullRampSteps);
+
+  // Step intervals for the ramp are looked up instead of divided out on every step
+  // (the spare may already hold them, built ahead for a queued move)
+  Ramping = (FullRampSteps > 0L);
+  if (Ramping && !tableFits (Table, MaxVelocity, RampVelocity, FullRampSteps))
+  {
+    if (!SpareBusy && tableFits (Spare, MaxVelocity, RampVelocity, FullRampSteps))
+      swapTables ();
+    else
+      buildRampTable (Table, MaxVelocity, RampVelocity, FullRampSteps);
+  }
+
+  resetRamp ();
+}
+
+//=== resetRamp ===========================================
+
+void StepperMotor::resetRamp ()
+{
+  // Reset the ramp position
+  RampIndex        = 0;
+  RampAccum        = 0L;
+  IntervalFraction = 0L;
+
+  // Constant velocity
+  setupCruise ();
+}
+
+//=== buildRampTable ======================================
+
+static float harmonic (long n)
+{
+  // Harmonic number H(n) = 1 + 1/2 + .. + 1/n
+  float h = 0.0f;
+
+  if (n < 16L)
+  {
+    for (long j=1; j<=n; j++)
+      h += 1.0f / j;
+  }
+  else
+    h = logf ((float) n) + 0.5772157f + 0.5f / n - 1.0f / (12.0f * n * n);
+
+  return h;
+}
+
+static float levelMean (long lo, long hi)
+{
+  // Mean of 1/level over levels lo..hi, in a few float operations however many levels share it.
+  // Near the start of the ramp it is a difference of harmonic numbers.  Further out, where those
+  // nearly cancel in float, it is 1/midpoint with its curvature term, good to (count/midpoint)^4.
+  float count = (float) (hi - lo + 1L);
+
+  if (lo <= hi - lo + 1L)
+    return (harmonic (hi) - harmonic (lo - 1L)) / count;
+
+  float middle = 0.5f * (float) (lo + hi);
+  return (1.0f + (count * count - 1.0f) / (12.0f * middle * middle)) / middle;
+}
+
+void StepperMotor::buildRampTable (RampTable *table, long maxVelocity, long rampVelocity, long fullSteps)
+{
+  // The table covers the full ramp up to rampVelocity, so a stunted
+  // triangle ramp uses the lower part of the same table.
+  // Entry j holds the step interval at ramp level j.  Ramps longer
+  // than the table share each entry between neighbouring levels, using
+  // the average interval of the group so the ramp time is unchanged.
+  // That average comes from levelMean(), so the build costs one division
+  // per entry rather than one per level (a 32-bit division is slow on AVR).
+  long           length, lo, hi;
+  float          scale;
+  SCurve         sCurve;
+
+  // Is the table already built for this ramp?
+  if (fullSteps <= 0L || tableFits (table, maxVelocity, rampVelocity, fullSteps))
+    return;
+
+  length = (fullSteps < RAMP_TABLE_SIZE) ? fullSteps : RAMP_TABLE_SIZE;
+
+  if (curveRamp ())
+    sCurveSetup (&sCurve, rampVelocity, rampAccel (maxVelocity), (Profile == PROFILE_SCURVE) ? MaxJerk : 0L);
+
+  scale = (float) (1000000UL << RAMP_FRACTION_BITS) / VelocityIncrement;
+
+  for (long j=0; j<=length; j++)
+  {
+    // Velocity levels lo..hi share entry j
+    lo = (j * fullSteps + length - 1L) / length;
+    hi = (j == length) ? fullSteps : ((j + 1L) * fullSteps + length - 1L) / length - 1L;
+    if (lo < 1L)
+      lo = 1L;
+    if (hi < lo)
+      hi = lo;
+
+    if (curveRamp ())
+    {
+      // Level k is the interval from step k to step k+1 of the curve
+      table->Intervals[j] = (sCurveTime (&sCurve, hi) - sCurveTime (&sCurve, lo - 1L)) * (float) (1000000UL << RAMP_FRACTION_BITS) / (hi - lo + 1L);
+      continue;
+    }
+
+    // Level k's interval is 1/(k * VelocityIncrement) seconds
+    if (lo == hi)
+      table->Intervals[j] = (1000000UL << RAMP_FRACTION_BITS) / (lo * VelocityIncrement);
+    else
+      table->Intervals[j] = (unsigned long) (scale * levelMean (lo, hi) + 0.5f);
+  }
+
+  table->Length      = length;
+  table->RampSteps   = fullSteps;
+  table->Increment   = VelocityIncrement;
+  table->Profile     = Profile;
+  table->MaxVelocity = maxVelocity;
+  table->Velocity    = rampVelocity;
+  table->Jerk        = MaxJerk;
+  table->Accel       = Acceleration;
+}
+
+//=== tableFits ===========================================
+
+bool StepperMotor::tableFits (const RampTable *table, long maxVelocity, long rampVelocity, long fullSteps)
+{
+  // Linear ramps depend only on their length, curves on their velocities as well
+  return (fullSteps == table->RampSteps && VelocityIncrement == table->Increment && Profile == table->Profile && Acceleration == table->Accel &&
+          (!curveRamp () || (maxVelocity == table->MaxVelocity && rampVelocity == table->Velocity && MaxJerk == table->Jerk)));
+}
+
+//=== swapTables ==========================================
+
+void StepperMotor::swapTables ()
+{
+  RampTable *table = Table;
+
+  Table = Spare;
+  Spare = table;
+}
+
+//=== setupCruise =========================================
+
+void StepperMotor::setupCruise ()
+{
+  CruiseInterval  = (MaxVelocity > 0L) ? (1000000UL << RAMP_FRACTION_BITS) / MaxVelocity : 0L;
+  CruiseRemainder = (MaxVelocity > 0L) ? (1000000UL << RAMP_FRACTION_BITS) % MaxVelocity : 0L;
+  CruiseAccum     = 0L;
+}
+
+//=== tableLevel ==========================================
+
+long StepperMotor::tableLevel (unsigned long interval)
+{
+  // Lowest ramp level of the table whose step interval is no longer than interval
+  long  lo = 0L, hi = Table->Length, mid;
+
+  if (Table->Intervals[hi] > interval)
+    return Table->RampSteps;
+
+  while (lo < hi)
+  {
+    mid = (lo + hi) / 2L;
+    if (Table->Intervals[mid] <= interval)
+      hi = mid;
+    else
+      lo = mid + 1L;
+  }
+
+  return (lo * Table->RampSteps + Table->Length - 1L) / Table->Length;
+}
+
+//=== Ramp Timing =========================================
+//  The time of a rotation is the sum of its step intervals, taken level by level
+//  in the same up/cruise/down phases as advanceStep().  Each level's interval is
+//  the difference of a closed-form time, so no steps are summed one by one.
+
+struct RampTiming
+{
+  bool    Ramping;     // False for constant velocity
+  bool    Curve;       // Ramp computed in time (S-curve or constant acceleration)
+  SCurve  Shape;       // Curve of a curve ramp
+  float   Increment;   // VelocityIncrement of a ramp factor trapezoid
+  float   Cruise;      // Seconds per step at full velocity
+  long    FullSteps;   // Ramp level of full velocity
+};
+
+static float levelTime (const RampTiming *t, long level)
+{
+  // Time (seconds) of the step intervals at ramp levels 1..level
+  if (level <= 0L)
+    return 0.0f;
+
+  if (t->Curve)
+    return sCurveTime (&t->Shape, level);
+
+  // Ramp factor: level j has an interval of 1/(j * increment), so the sum is
+  // the harmonic number H(level) / increment
+  return harmonic (level) / t->Increment;
+}
+
+static float phaseTime (const RampTiming *t, long count, long level, long total, long rampSteps, long rampDownStep)
+{
+  // Time (seconds) from step 'count' at ramp 'level' until the rotation is complete:
+  // the intervals after each of the steps count+1..total
+  float  time = 0.0f;
+  long   n;
+
+  if (!t->Ramping)
+    return (total - count) * t->Cruise;
+
+  // Ramping up
+  n = ((rampSteps < total) ? rampSteps : total) - count;
+  if (n > 0L)
+  {
+    time  += levelTime (t, level + n) - levelTime (t, level);
+    level += n;
+    count += n;
+  }
+
+  // Cruising at a constant level, after slowing to it if SetVelocity() lowered it
+  n = ((rampDownStep < total) ? rampDownStep : total) - count;
+  if (n > 0L && level > t->FullSteps)
+  {
+    long m = (n < level - t->FullSteps) ? n : level - t->FullSteps;
+
+    time  += levelTime (t, level - 1L) - levelTime (t, level - 1L - m);
+    level -= m;
+    count += m;
+    n     -= m;
+  }
+  if (n > 0L)
+  {
+    time  += n * ((level >= t->FullSteps) ? t->Cruise : levelTime (t, level) - levelTime (t, level - 1L));
+    count += n;
+  }
+
+  // Ramping down (levels below 1 have no interval)
+  n = total - count;
+  if (n > 0L)
+    time += levelTime (t, level - 1L) - levelTime (t, level - 1L - n);
+
+  return time;
+}
+
+//=== rampTiming ==========================================
+
+void StepperMotor::rampTiming (long maxVelocity, long steps, RampTiming *timing)
+{
+  long  rampVelocity, fullSteps;
+
+  planRamp (maxVelocity, steps, &rampVelocity, &fullSteps);
+
+  timing->Ramping   = (fullSteps > 0L);
+  timing->Curve     = curveRamp ();
+  timing->Increment = VelocityIncrement;
+  timing->Cruise    = (maxVelocity > 0L) ? 1.0f / maxVelocity : 0.0f;
+  timing->FullSteps = fullSteps;
+
+  if (timing->Ramping && timing->Curve)
+    sCurveSetup (&timing->Shape, rampVelocity, rampAccel (maxVelocity), (Profile == PROFILE_SCURVE) ? MaxJerk : 0L);
+}
+
+//=== moveTime ============================================
+
+float StepperMotor::moveTime (long maxVelocity, long steps, long entryLevel, long exitLevel)
+{
+  // Predicted time (seconds) of a whole move, planned the same way as
+  // setupRotation() (from and to a stand-still) or planProfile()
+  RampTiming  timing;
+  long        fullSteps, rampSteps, rampDownStep, peak;
+
+  rampTiming (maxVelocity, steps, &timing);
+  planRamp (maxVelocity, steps, &peak, &fullSteps);
+
+  if (entryLevel == 0L && exitLevel == 0L)
+  {
+    rampSteps = fullSteps;
+    if (steps > 2L * rampSteps)
+      rampDownStep = steps - rampSteps;
+    else
+      rampDownStep = rampSteps = steps / 2L;
+  }
+  else
+  {
+    if (exitLevel > entryLevel + steps)
+      exitLevel = entryLevel + steps;
+
+    peak = (steps + entryLevel + exitLevel) / 2L;
+    if (peak > fullSteps)
+      peak = fullSteps;
+    if (peak < entryLevel)
+      peak = entryLevel;
+    if (peak < exitLevel)
+      peak = exitLevel;
+
+    rampSteps    = peak - entryLevel;
+    rampDownStep = steps - (peak - exitLevel);
+  }
+
+  return phaseTime (&timing, 0L, entryLevel, steps, rampSteps, rampDownStep);
+}
+
+//=== stopRotation ========================================
+
+RunReturn StepperMotor::stopRotation (RunReturn rr)
+{
+  // Stop motor, a range or limit error also cancels the queued moves
+  State = MS_ENABLED;
+
+  if (rr != RUN_COMPLETE)
+  {
+    QueueTail  = QueueHead;
+    StreamTail = StreamHead;
+  }
+  Streaming = false;
+
+  return rr;
+}
+
+//=== setRampLevel ========================================
+
+void StepperMotor::setRampLevel (long level)
+{
+  // Continue the ramp from a ramp level (steps into the ramp)
+  RampLevel = level;
+  RampIndex = level * Table->Length / Table->RampSteps;
+  RampAccum = level * Table->Length - RampIndex * Table->RampSteps;
+}
+
+//=== planProfile =========================================
+
+void StepperMotor::planProfile ()
+{
+  // Set the ramp-up and ramp-down steps for the rest of the current
+  // rotation so that it ends at ExitLevel instead of a stand-still
+  long  level, stepCount, remaining, fullSteps, peak;
+
+  if (!Ramping)
+    return;
+
+  level     = RampLevel;
+  stepCount = abs(DeltaPosition);
+  remaining = TotalSteps - stepCount;
+  fullSteps = FullRampSteps;
+
+  // Can't speed up more than one level per step
+  if (ExitLevel > level + remaining)
+    ExitLevel = level + remaining;
+
+  // Above full velocity after SetVelocity() lowered it?  advanceStep() slows
+  // down to it while cruising, so ramp down from full velocity at the end,
+  // or at once if there isn't room to slow down first.
+  if (level > fullSteps)
+  {
+    RampSteps = stepCount;
+    if (remaining >= level - ExitLevel)
+      RampDownStep = stepCount + remaining - (fullSteps - ExitLevel);
+    else
+      RampDownStep = stepCount;
+    return;
+  }
+
+  // Highest velocity level that still allows ramping down to ExitLevel
+  peak = (remaining + level + ExitLevel) / 2L;
+  if (peak > fullSteps)
+    peak = fullSteps;
+  if (peak < level)
+    peak = level;
+  if (peak < ExitLevel)
+    peak = ExitLevel;
+
+  RampSteps    = stepCount + peak - level;
+  RampDownStep = stepCount + remaining - (peak - ExitLevel);
+}
+
+//=== junctionLevel =======================================
+
+long StepperMotor::junctionLevel (long increment1, long velocity1, long increment2, long velocity2)
+{
+  // Highest velocity level for passing from one move into the next without stopping
+  long  velocity = (velocity1 < velocity2) ? velocity1 : velocity2;
+
+  if (increment1 != increment2 || (VelocityIncrement == 0L && Acceleration == 0L))
+    return 0L;  // Must stop to change direction
+
+  if (Profile != PROFILE_TRAPEZOID)
+    return 0L;  // S-curve levels depend on each move's velocity, so stop between moves
+
+  if (Acceleration > 0L)
+    return (long) ((float) velocity * (float) velocity / (2.0f * (float) Acceleration));  // v² = 2·a·steps
+
+  return velocity / VelocityIncrement;
+}
+
+//=== planQueue ===========================================
+
+void StepperMotor::planQueue ()
+{
+  // Look ahead over the queued moves and set each move's exit velocity level.
+  // The backward pass makes sure every move can still ramp down in time
+  // for the last queued move to end at a stand-still.  The forward pass
+  // then limits each exit to what can be reached by ramping up.
+  QueuedMove  *move, *prev;
+  int          count, i;
+  long         exitLevel, entryLevel;
+
+  if (State != MS_RUNNING || !Ramping)
+    return;
+
+  count     = (QueueHead - QueueTail + MOTION_QUEUE_SIZE) % MOTION_QUEUE_SIZE;
+  exitLevel = 0L;
+
+  for (i=count-1; i>=0; i--)
+  {
+    move            = &Queue[(QueueTail + i) % MOTION_QUEUE_SIZE];
+    move->ExitLevel = exitLevel;
+
+    entryLevel = exitLevel + move->Steps;
+    if (i > 0)
+    {
+      prev      = &Queue[(QueueTail + i - 1) % MOTION_QUEUE_SIZE];
+      exitLevel = junctionLevel (prev->Increment, prev->MaxVelocity, move->Increment, move->MaxVelocity);
+    }
+    else
+      exitLevel = junctionLevel (StepIncrement, MaxVelocity, move->Increment, move->MaxVelocity);
+
+    if (exitLevel > entryLevel)
+      exitLevel = entryLevel;
+  }
+
+  // Re-plan the rest of the current rotation
+  ExitLevel = exitLevel;
+  planProfile ();
+
+  // Forward pass
+  entryLevel = ExitLevel;
+  for (i=0; i<count; i++)
+  {
+    move = &Queue[(QueueTail + i) % MOTION_QUEUE_SIZE];
+    if (move->ExitLevel > entryLevel + move->Steps)
+      move->ExitLevel = entryLevel + move->Steps;
+
+    entryLevel = move->ExitLevel;
+  }
+}
+
+//=== nextQueuedMove ======================================
+
+bool StepperMotor::nextQueuedMove ()
+{
+  // Start the next queued move when the current one reaches its target
+  if (QueueTail == QueueHead)
+    return false;
+
+  QueuedMove  *move     = &Queue[QueueTail];
+  long         level    = (Ramping && State == MS_RUNNING) ? RampLevel : 0L;
+  bool         reversed = (move->Increment != StepIncrement);
+
+#if defined(STEPPER_TIMER)
+  // The interrupt can't build a table: timerStep() holds a move that isn't ready
+  // and every start from task context prepares it first
+  if (!moveReady (move))
+    return false;
+#else
+  // Task context: a move queued too late to be prepared ahead is prepared now
+  if (!moveReady (move))
+    prepareMove ();
+#endif
+
+  TargetPosition = move->Target;
+  MaxVelocity    = move->MaxVelocity;
+  TotalSteps     = move->Steps;
+  ExitLevel      = move->ExitLevel;
+  QueueTail      = (QueueTail + 1) % MOTION_QUEUE_SIZE;
+  takeMoveRamp (move);
+
+  if (level > 0L && !reversed)
+  {
+    // Blend into the next move without stopping
+    DeltaPosition     = 0L;
+    CommandedVelocity = MaxVelocity;
+    if (Ramping)
+      setRampLevel ((level < FullRampSteps) ? level : FullRampSteps);
+    planProfile ();
+  }
+  else
+  {
+    // Start from a stand-still
+    setupRotation ();
+    if (reversed)
+      DirectionChanged = true;  // The step engine waits 10-microseconds before stepping
+  }
+
+  return true;
+}
+
+//=== prepareMove =========================================
+
+void StepperMotor::prepareMove ()
+{
+  // Plan the ramp of the next queued move and build its table into the spare,
+  // here in task context, so the junction only has to swap the tables.
+  // The step engine keeps running meanwhile: it doesn't take the spare while
+  // it is built, and the plan is dropped if the move started in the meantime.
+  QueuedMove  *move;
+  long         maxVelocity, steps, rampVelocity, fullSteps;
+  int          tail;
+  uint16_t     settings;
+
+  LOCK_MOTION ();
+  PrepareNeeded = false;
+  tail          = QueueTail;
+  move          = &Queue[tail];
+
+  if (tail == QueueHead || moveReady (move))
+  {
+    UNLOCK_MOTION ();
+    return;
+  }
+
+  maxVelocity = move->MaxVelocity;
+  steps       = move->Steps;
+  settings    = RampSettings;
+  SpareBusy   = true;
+  UNLOCK_MOTION ();
+
+  planRamp (maxVelocity, steps, &rampVelocity, &fullSteps);
+  if (fullSteps > 0L && !tableFits (Table, maxVelocity, rampVelocity, fullSteps))
+    buildRampTable (Spare, maxVelocity, rampVelocity, fullSteps);
+
+  LOCK_MOTION ();
+  SpareBusy = false;
+  if (QueueTail == tail && QueueHead != tail)
+  {
+    move->RampVelocity  = rampVelocity;
+    move->FullRampSteps = fullSteps;
+    move->Planned       = settings;
+  }
+  else
+    PrepareNeeded = true;  // The move started (or was cleared), prepare the one after it
+  UNLOCK_MOTION ();
+}
+
+//=== moveReady ===========================================
+
+bool StepperMotor::moveReady (const QueuedMove *move)
+{
+  // Planned with the current ramp settings, and its table is built
+  if (move->Planned != RampSettings)
+    return false;
+
+  if (move->FullRampSteps <= 0L)
+    return true;
+
+  return (tableFits (Table, move->MaxVelocity, move->RampVelocity, move->FullRampSteps) ||
+          (!SpareBusy && tableFits (Spare, move->MaxVelocity, move->RampVelocity, move->FullRampSteps)));
+}
+
+//=== takeMoveRamp ========================================
+
+bool StepperMotor::takeMoveRamp (QueuedMove *move)
+{
+  // Switch to the ramp prepared for the move (MaxVelocity is already the move's)
+  if (!moveReady (move))
+    return false;
+
+  RampVelocity  = move->RampVelocity;
+  FullRampSteps = move->FullRampSteps;
+  Ramping       = (FullRampSteps > 0L);
+
+  if (Ramping && !tableFits (Table, MaxVelocity, RampVelocity, FullRampSteps))
+    swapTables ();
+
+  resetRamp ();
+
+  // The move after it is prepared on the next Run() pass
+  PrepareNeeded = true;
+  return true;
+}
+
+//=== SetVelocity =========================================
+//  Changes the cruise velocity of the current rotation without stopping.
+//  The ramp picks up from the current velocity: a higher velocity gets a new
+//  table and ramps up from the same level, a lower one keeps the current table
+//  and advanceStep() ramps down to it while cruising.  The ramp-down is then
+//  re-planned so the rotation still ends at its target (or queued junction).
+//  The new table is built into the spare outside the motion lock, which is
+//  only held to read the current velocity and to swap and re-plan.
+
+bool StepperMotor::SetVelocity (long stepsPerSecond)
+{
+  unsigned long  interval;
+  long           maxVelocity, target, totalSteps, rampVelocity, fullSteps;
+  bool           faster;
+
+  if (State != MS_RUNNING || Streaming || Homing != HS_IDLE || stepsPerSecond <= 0L)
+    return false;
+
+  // Velocities beyond what the backend can deliver are held to its limit
+  maxVelocity = (stepsPerSecond < MAX_STEP_RATE) ? stepsPerSecond : MAX_STEP_RATE;
+
+  for (;;)
+  {
+    LOCK_MOTION ();
+
+    // Current step interval (fixed-point micros), and the rotation it belongs to
+    interval   = (Ramping && RampLevel != FullRampSteps) ? Table->Intervals[RampIndex] : CruiseInterval;
+    faster     = (!Ramping || (1000000UL << RAMP_FRACTION_BITS) / maxVelocity <= interval);
+    target     = TargetPosition;
+    totalSteps = TotalSteps;
+    SpareBusy  = true;  // The step engine must not swap the spare in while it is rebuilt
+
+    UNLOCK_MOTION ();
+
+    // The new ramp and its table are built while the motor keeps stepping
+    planRamp (maxVelocity, totalSteps, &rampVelocity, &fullSteps);
+    if (faster && fullSteps > 0L && !tableFits (Table, maxVelocity, rampVelocity, fullSteps))
+      buildRampTable (Spare, maxVelocity, rampVelocity, fullSteps);
+
+    LOCK_MOTION ();
+    SpareBusy = false;
+
+    if (State != MS_RUNNING)
+    {
+      UNLOCK_MOTION ();
+      return false;  // The rotation ended meanwhile
+    }
+
+    if (TargetPosition == target && TotalSteps == totalSteps)
+      break;  // Still the same rotation, keep the lock
+
+    UNLOCK_MOTION ();  // A queued move started meanwhile, plan for it instead
+  }
+
+  MaxVelocity = maxVelocity;
+
+  if (faster)
+  {
+    // Faster (or no ramp): continue the new ramp at the current velocity.
+    // Trapezoid and constant acceleration levels don't depend on the velocity
+    // limit, an S-curve continues at its level of the same interval.
+    RampVelocity  = rampVelocity;
+    FullRampSteps = fullSteps;
+    Ramping       = (FullRampSteps > 0L);
+    if (Ramping && !tableFits (Table, MaxVelocity, RampVelocity, FullRampSteps))
+      swapTables ();
+
+    resetRamp ();
+    if (Ramping)
+      setRampLevel ((Profile == PROFILE_SCURVE) ? tableLevel (interval) :
+                    (RampLevel < FullRampSteps) ? RampLevel : FullRampSteps);
+  }
+  else
+  {
+    // Slower: the current table still covers the levels down to the new velocity
+    if (Profile == PROFILE_SCURVE)
+      fullSteps = tableLevel ((1000000UL << RAMP_FRACTION_BITS) / MaxVelocity);
+
+    FullRampSteps = (fullSteps > 0L) ? fullSteps : 1L;
+    setupCruise ();
+  }
+
+  // Re-plan the rest of the rotation (and its junction with the queued moves)
+  if (QueueHead != QueueTail)
+    planQueue ();
+  else
+    planProfile ();
+
+  UNLOCK_MOTION ();
+
+  // The spare may have gone to the new ramp, so the next queued move's table is built again
+  prepareMove ();
+
+  return true;
+}
+
+//=== OverrideVelocity ====================================
+
+bool StepperMotor::OverrideVelocity (int percent)
+{
+  // Percentage of the velocity the current rotation was commanded at
+  return SetVelocity (CommandedVelocity * percent / 100L);
+}
+
+//=== Streamed Segments ===================================
+//  Segments from the host replace the ramp: each step's interval is the last one
+//  plus the segment's add, in ticks with the fraction carried to the next step.
+
+bool StepperMotor::QueueSegment (long interval, long count, long add)
+{
+  int  next;
+
+  if (count == 0L || !Homed || State == MS_DISABLED || State == MS_ESTOPPED)
+    return false;
+
+  // A stream can't cut into a rotation
+  if (State == MS_RUNNING && !Streaming)
+    return false;
+
+  // The first segment starts the motor (outside the lock, it may write storage)
+  if (State != MS_RUNNING)
+    forgetPosition ();
+
+  LOCK_MOTION ();
+
+  // A stream that ran dry stops at its next step, which would drop the segment:
+  // the host starts a new stream once Run() has returned RUN_COMPLETE
+  if (State == MS_RUNNING && StreamEnd)
+  {
+    UNLOCK_MOTION ();
+    return false;
+  }
+
+  // Starting a new stream?  Discard what was left of an old one
+  if (State != MS_RUNNING)
+    StreamTail = StreamHead;
+
+  // Is there room?
+  next = (StreamHead + 1) % STREAM_BUFFER_SIZE;
+  if (next == StreamTail)
+  {
+    UNLOCK_MOTION ();
+    return false;
+  }
+
+  StreamSegment *segment = &Stream[StreamHead];
+  segment->Interval = interval;
+  segment->Count    = count;
+  segment->Add      = add;
+  StreamHead        = next;
+
+  if (State != MS_RUNNING)
+  {
+    // Idle, so start the stream now with its first step
+    Homing         = HS_IDLE;
+    QueueTail      = QueueHead;
+    ExitLevel      = 0L;
+    Streaming      = true;
+    StreamEnd      = false;
+    StreamFraction = 0L;
+    DeltaPosition  = 0L;
+    nextSegment ();
+    setStreamDirection ();  // With RMT, also clears SegmentReturn (or sets STEP_ERROR)
+
+    NextStepMicros = micros() + 10L;  // Direction must be set 10-microseconds before stepping
+    State          = MS_RUNNING;
+    wakeScheduler ();
+
+#if defined(STEPPER_TIMER)
+    startTimer (10L);
+#endif
+  }
+
+  UNLOCK_MOTION ();
+
+  return true;
+}
+
+//=== GetStreamFree =======================================
+
+int StepperMotor::GetStreamFree ()
+{
+  return STREAM_BUFFER_SIZE - 1 - (StreamHead - StreamTail + STREAM_BUFFER_SIZE) % STREAM_BUFFER_SIZE;
+}
+
+//=== nextSegment =========================================
+
+bool StepperMotor::nextSegment ()
+{
+  if (StreamTail == StreamHead)
+    return false;
+
+  StreamSegment *segment = &Stream[StreamTail];
+  StreamLeft      = abs (segment->Count);
+  StreamInterval  = segment->Interval;
+  StreamAdd       = segment->Add;
+  StreamIncrement = (segment->Count < 0L) ? -1L : 1L;
+  StreamTail      = (StreamTail + 1) % STREAM_BUFFER_SIZE;
+
+  return true;
+}
+
+//=== setStreamDirection ==================================
+
+void StepperMotor::setStreamDirection ()
+{
+#if defined(STEPPER_RMT)
+  // Finish the queued steps before changing direction
+  if (!stopSegments (false))
+    return;
+#endif
+
+  StepIncrement = StreamIncrement;
+  setDirection ();
+}
+
+//=== setDirection ========================================
+
+void StepperMotor::setDirection ()
+{
+#if defined(NONBLOCKING_PULSE)
+  // Never change direction during a step pulse, pulseBusy() sets it once the pulse has ended
+  if (PulseHigh || PulseHold)
+  {
+    DirectionDeferred = true;
+    return;
+  }
+#endif
+
+  if (StepIncrement > 0L)
+    DirectionOut.Low ();
+  else
+    DirectionOut.High ();
+}
+
+//=== advanceStream =======================================
+
+unsigned long StepperMotor::advanceStream ()
+{
+  // Set current position
+  AbsolutePosition = NextPosition;
+  DeltaPosition   += StepIncrement;
+  StepCount        = abs(DeltaPosition);
+
+  if (NumTriggers > 0)
+    checkTriggers ();
+
+  // The next step is in this segment or the next one
+  if (--StreamLeft > 0L)
+    StreamInterval += StreamAdd;
+  else if (!nextSegment ())
+  {
+    StreamEnd = true;
+    return StepInterval = 0L;
+  }
+
+  // Return time (in microseconds) until next step
+  unsigned long ticks = StreamFraction + ((StreamInterval > 0L) ? StreamInterval : 0L);
+  StreamFraction = ticks & STREAM_TICK_MASK;
+
+  return StepInterval = ticks >> STREAM_TICK_BITS;
+}
+
+//=== streamTime ==========================================
+
+float StepperMotor::streamTime ()
+{
+  // Intervals after the next step in the current segment, then every waiting segment
+  float  ticks;
+  float  n;
+  int    tail;
+
+  LOCK_MOTION ();
+
+  n     = (StreamEnd || StreamLeft < 1L) ? 0.0f : StreamLeft - 1.0f;
+  ticks = n * StreamInterval + StreamAdd * n * (n + 1.0f) / 2.0f;
+
+  for (tail=StreamTail; tail!=StreamHead; tail=(tail+1)%STREAM_BUFFER_SIZE)
+  {
+    n      = abs (Stream[tail].Count);
+    ticks += n * Stream[tail].Interval + Stream[tail].Add * n * (n - 1.0f) / 2.0f;
+  }
+
+  UNLOCK_MOTION ();
+
+#if !defined(STEPPER_RMT) && !defined(STEPPER_TIMER)
+  // Time until the next step is due
+  long wait = (long) (NextStepMicros - micros());
+  if (wait > 0L)
+    ticks += (float) wait * (1L << STREAM_TICK_BITS);
+#endif
+
+  return ticks / (1000000.0f * (1L << STREAM_TICK_BITS));
+}
+
+//=== reversalPending =====================================
+
+bool StepperMotor::reversalPending ()
+{
+  // Will the next streamed segment change direction?
+  if (Streaming)
+    return (StreamIncrement != StepIncrement);
+
+  // Will the next queued move change direction?
+  return (AbsolutePosition == TargetPosition) && (QueueTail != QueueHead) && (Queue[QueueTail].Increment != StepIncrement);
+}
+
+//=== checkLimitSwitches ==================================
+
+RunReturn StepperMotor::checkLimitSwitches ()
+{
+  if (Homing != HS_IDLE)
+    return checkHomingSwitches ();
+
+#if defined(LIMIT_INTERRUPTS)
+  // Only the latch is checked, the pins are read once it is set
+  if (LimitEvent == OKAY)
+    return OKAY;
+
+  LimitEvent = readLimitSwitches ();  // Cleared if the contact bounced open again
+  return LimitEvent;
+#else
+  return readLimitSwitches ();
+#endif
+}
+
+//=== readLimitSwitches ===================================
+
+RunReturn StepperMotor::readLimitSwitches ()
+{
+  // Only the switch the motor is heading for stops it, so a motor resting on a switch can drive off it
+  if ((StepIncrement < 0L) && (LLSwitchPin >= 0) && LLSwitchIn.IsLow ())
+    return LIMIT_SWITCH_LOWER;  // Lower limit switch triggered
+
+  if ((StepIncrement > 0L) && (ULSwitchPin >= 0) && ULSwitchIn.IsLow ())
+    return LIMIT_SWITCH_UPPER;  // Upper limit switch triggered
+
+  return OKAY;
+}
+
+//=== checkHomingSwitches =================================
+
+RunReturn StepperMotor::checkHomingSwitches ()
+{
+  // While homing, the lower limit switch ends each phase
+  bool lowerPressed = LLSwitchIn.IsLow ();
+
+  if ((ULSwitchPin >= 0) && ULSwitchIn.IsLow ())
+    return LIMIT_SWITCH_UPPER;  // Wrong way, stop homing
+
+  switch (Homing)
+  {
+    case HS_SEEK:
+    case HS_APPROACH:
+      return lowerPressed ? LIMIT_SWITCH_LOWER : OKAY;  // Found the switch
+
+    case HS_BACKOFF:
+    case HS_RELEASE:
+      return lowerPressed ? OKAY : RUN_COMPLETE;  // Switch released
+
+    default:
+      return OKAY;
+  }
+}
+
+//=== startHomingPhase ====================================
+
+void StepperMotor::startHomingPhase (HomingState phase, long numSteps, long stepsPerSecond)
+{
+  Homing         = phase;
+  TargetPosition = AbsolutePosition + numSteps;
+  MaxVelocity    = stepsPerSecond;
+  TotalSteps     = abs(numSteps);
+
+  startRotation ();
+}
+
+//=== homingEvent =========================================
+
+RunReturn StepperMotor::homingEvent (RunReturn rr)
+{
+  // Advance the homing state machine when a phase stops
+  switch (Homing)
+  {
+    case HS_SEEK:
+      // Found the switch at speed, back off slowly until it releases
+      if (rr == LIMIT_SWITCH_LOWER)
+      {
+        startHomingPhase (HS_BACKOFF, HOMING_MAX_STEPS, HomingSlowSpeed);
+        return OKAY;
+      }
+      break;
+
+    case HS_BACKOFF:
+      // Move clear of the switch before approaching it again
+      if (rr == RUN_COMPLETE)
+      {
+        startHomingPhase (HS_BACKOFF_CLEAR, HOMING_BACKOFF_STEPS, HomingSlowSpeed);
+        return OKAY;
+      }
+      break;
+
+    case HS_BACKOFF_CLEAR:
+      // Slowly re-approach the switch for a repeatable HOME position
+      if (rr == RUN_COMPLETE)
+      {
+        startHomingPhase (HS_APPROACH, -HOMING_MAX_STEPS, HomingSlowSpeed);
+        return OKAY;
+      }
+      break;
+
+    case HS_APPROACH:
+      if (rr == LIMIT_SWITCH_LOWER)
+      {
+        startHomingPhase (HS_RELEASE, HOMING_MAX_STEPS, HomingSlowSpeed);
+        return OKAY;
+      }
+      break;
+
+    case HS_RELEASE:
+      // A few more steps past the release point
+      if (rr == RUN_COMPLETE)
+      {
+        startHomingPhase (HS_FINAL, 10L, HomingSlowSpeed);
+        return OKAY;
+      }
+      break;
+
+    case HS_FINAL:
+      if (rr == RUN_COMPLETE)
+      {
+        Homing = HS_IDLE;
+        SetHomePosition ();
+        return HOME_COMPLETE;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  // Anything else is a failure, the position is unknown
+  Homing = HS_IDLE;
+  Homed  = false;
+
+  return rr;
+}
+
+#if defined(LIMIT_INTERRUPTS)
+
+#if defined(ARDUINO_ARCH_AVR)
+StepperMotor *StepperMotor::LimitMotors[MAX_LIMIT_MOTORS];
+int           StepperMotor::NumLimitMotors = 0;
+
+ISR (PCINT0_vect) { StepperMotor::LimitISR (); }
+ISR (PCINT1_vect) { StepperMotor::LimitISR (); }
+ISR (PCINT2_vect) { StepperMotor::LimitISR (); }
+#endif
+
+//=== initLimitInterrupts =================================
+
+void StepperMotor::initLimitInterrupts ()
+{
+  int  pins[2] = { LLSwitchPin, ULSwitchPin };
+
+#if defined(ARDUINO_ARCH_AVR)
+  // Pin change interrupts fire on both edges of any enabled pin in a port,
+  // so LimitISR() checks every registered motor
+  if (NumLimitMotors >= MAX_LIMIT_MOTORS)
+    return;
+
+  LimitMotors[NumLimitMotors++] = this;
+
+  for (int i=0; i<2; i++)
+  {
+    if (pins[i] < 0 || digitalPinToPCICR (pins[i]) == 0)
+      continue;
+
+    *digitalPinToPCMSK (pins[i]) |= _BV(digitalPinToPCMSKbit (pins[i]));
+    *digitalPinToPCICR (pins[i]) |= _BV(digitalPinToPCICRbit (pins[i]));
+  }
+#else
+  for (int i=0; i<2; i++)
+    if (pins[i] >= 0)
+      attachInterruptArg (pins[i], limitAlarm, this, FALLING);  // Switches pull the pin LOW
+#endif
+}
+
+//=== releaseLimitInterrupts ==============================
+
+void StepperMotor::releaseLimitInterrupts ()
+{
+  int  pins[2] = { LLSwitchPin, ULSwitchPin };
+
+#if defined(ARDUINO_ARCH_AVR)
+  // The interrupts must not reach a motor that is gone
+  noInterrupts ();
+
+  for (int i=0; i<NumLimitMotors; i++)
+  {
+    if (LimitMotors[i] != this)
+      continue;
+
+    LimitMotors[i] = LimitMotors[--NumLimitMotors];
+    for (int j=0; j<2; j++)
+      if (pins[j] >= 0 && digitalPinToPCICR (pins[j]) != 0)
+        *digitalPinToPCMSK (pins[j]) &= ~_BV(digitalPinToPCMSKbit (pins[j]));
+    break;
+  }
+
+  interrupts ();
+#else
+  for (int i=0; i<2; i++)
+    if (pins[i] >= 0)
+      detachInterrupt (pins[i]);
+#endif
+}
+
+#if defined(ARDUINO_ARCH_AVR)
+
+//=== LimitISR ============================================
+
+void StepperMotor::LimitISR ()
+{
+  for (int i=0; i<NumLimitMotors; i++)
+    LimitMotors[i]->limitInterrupt ();
+}
+
+#else
+
+//=== limitAlarm ==========================================
+
+void IRAM_ATTR StepperMotor::limitAlarm (void *context)
+{
+#if defined(STEPPER_TIMER)
+  portENTER_CRITICAL_ISR (&MotionLock);
+  ((StepperMotor *) context)->limitInterrupt ();
+  portEXIT_CRITICAL_ISR (&MotionLock);
+#else
+  ((StepperMotor *) context)->limitInterrupt ();
+#endif
+}
+
+#endif
+
+//=== limitInterrupt ======================================
+
+void StepperMotor::limitInterrupt ()
+{
+  // Limit switch interrupt: latch the pressed switch
+  RunReturn rr = readLimitSwitches ();
+  if (rr == OKAY)
+    return;  // Released, or another pin on the same port
+
+  LimitEvent = rr;
+
+#if defined(STEPPER_TIMER)
+  // Stop the step timer right away
+  if (Homed && State == MS_RUNNING && Homing == HS_IDLE)
+    stopMotion (rr);
+#endif
+}
+
+#endif
+
+#if defined(STEPPER_TIMER)
+
+#if defined(ARDUINO_ARCH_AVR)
+StepperMotor     *StepperMotor::TimerMotor     = NULL;
+StepperScheduler *StepperMotor::TimerScheduler = NULL;
+
+ISR (TIMER1_COMPA_vect)
+{
+  StepperMotor::TimerISR ();
+}
+#endif
+
+//=== initTimer ===========================================
+
+void StepperMotor::initTimer ()
+{
+  EventHead  = EventTail = 0;
+  TimerHeld  = false;
+  TimerReady = false;
+
+#if defined(ARDUINO_ARCH_AVR)
+  // Timer1 drives one motor only, a second one is refused (it can't be enabled),
+  // unless it is added to the StepperScheduler that drives its motors with Timer1
+  if (TimerMotor != NULL || TimerScheduler != NULL)
+    return;
+
+  TimerMotor = this;
+#else
+  // Free-running 1MHz timer, the alarm is moved forward for every step
+  gptimer_config_t timerConfig = {};
+  timerConfig.clk_src       = GPTIMER_CLK_SRC_DEFAULT;
+  timerConfig.direction     = GPTIMER_COUNT_UP;
+  timerConfig.resolution_hz = 1000000L;
+  if (gptimer_new_timer (&timerConfig, &StepTimer) != ESP_OK)
+  {
+    StepTimer = NULL;  // All general-purpose timers are in use, the motor can't be enabled
+    return;
+  }
+
+  gptimer_event_callbacks_t callbacks = {};
+  callbacks.on_alarm = timerAlarm;
+  if (gptimer_register_event_callbacks (StepTimer, &callbacks, this) != ESP_OK ||
+      gptimer_enable (StepTimer) != ESP_OK)
+  {
+    gptimer_del_timer (StepTimer);
+    StepTimer = NULL;
+    return;
+  }
+
+  gptimer_start (StepTimer);
+#endif
+
+  TimerReady = true;
+}
+
+//=== releaseTimer ========================================
+
+void StepperMotor::releaseTimer ()
+{
+  if (!TimerReady)
+    return;
+
+  stopTimer ();
+  TimerReady = false;
+
+  if (Scheduler != NULL)
+    return;  // The timer is the scheduler's
+
+#if defined(ARDUINO_ARCH_AVR)
+  TimerMotor = NULL;  // Free for the next motor
+#else
+  gptimer_stop      (StepTimer);
+  gptimer_disable   (StepTimer);
+  gptimer_del_timer (StepTimer);
+  StepTimer = NULL;
+#endif
+}
+
+//=== startTimer ==========================================
+
+void StepperMotor::startTimer (unsigned long delayMicros)
+{
+  if (!TimerReady)
+    return;
+
+  if (Scheduler != NULL)
+  {
+    Scheduler->armTimer (SchedulerAxis, micros() + delayMicros);
+    return;
+  }
+
+#if defined(ARDUINO_ARCH_AVR)
+  noInterrupts ();
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | _BV(CS11);  // CTC mode, prescaler 8
+  TCNT1  = 0;
+  TimerTicksLeft = delayMicros * (F_CPU / 8000000L);
+  loadTimer ();
+  TIFR1  = _BV(OCF1A);              // Clear any stale compare match
+  TIMSK1 |= _BV(OCIE1A);
+  interrupts ();
+#else
+  uint64_t  count;
+
+  gptimer_get_raw_count (StepTimer, &count);
+  NextStepCount = count + delayMicros;
+
+  gptimer_alarm_config_t alarmConfig = {};
+  alarmConfig.alarm_count = NextStepCount;
+  gptimer_set_alarm_action (StepTimer, &alarmConfig);
+#endif
+}
+
+//=== stopTimer ===========================================
+
+void StepperMotor::stopTimer ()
+{
+  if (!TimerReady)
+    return;
+
+  if (Scheduler != NULL)
+  {
+    Scheduler->disarmTimer (SchedulerAxis);
+    return;
+  }
+
+#if defined(ARDUINO_ARCH_AVR)
+  TIMSK1 &= ~_BV(OCIE1A);
+#else
+  // A one-shot alarm that is not moved forward will not fire again
+  gptimer_set_alarm_action (StepTimer, NULL);
+#endif
+}
+
+#if defined(ARDUINO_ARCH_AVR)
+
+//=== loadTimer ===========================================
+
+void StepperMotor::loadTimer ()
+{
+  // Intervals longer than the 16-bit compare register are split into chunks
+  unsigned long chunk = (TimerTicksLeft > 65536L) ? 65536L : TimerTicksLeft;
+
+  TimerTicksLeft -= chunk;
+  if (chunk == 0L)
+    chunk = 1L;  // No wait, compare on the next tick (TimerTicksLeft must not wrap below 0)
+
+  OCR1A = chunk - 1L;
+}
+
+//=== TimerISR ============================================
+
+void StepperMotor::TimerISR ()
+{
+  if (TimerScheduler != NULL)
+    TimerScheduler->timerInterrupt ();
+  else if (TimerMotor->TimerTicksLeft > 0L)
+    TimerMotor->loadTimer ();  // Still waiting out a long interval
+  else
+    TimerMotor->timerStep ();
+}
+
+#else
+
+//=== timerAlarm ==========================================
+
+bool IRAM_ATTR StepperMotor::timerAlarm (gptimer_handle_t timer, const gptimer_alarm_event_data_t *eventData, void *context)
+{
+  portENTER_CRITICAL_ISR (&MotionLock);
+  ((StepperMotor *) context)->timerStep ();
+  portEXIT_CRITICAL_ISR (&MotionLock);
+  return false;
+}
+
+#endif
+
+//=== timerStep ===========================================
+
+void StepperMotor::timerStep ()
+{
+  // Timer interrupt: the same step sequence as Run() in software mode
+  if (!Homed || (State != MS_RUNNING))
+  {
+    stopTimer ();
+    return;
+  }
+
+  // The interrupt can't build a ramp table, so a queued move whose table isn't
+  // ready yet waits for Run() to build it (see runEngine)
+  if (!Streaming && AbsolutePosition == TargetPosition && QueueTail != QueueHead && !moveReady (&Queue[QueueTail]))
+  {
+    stopTimer ();
+    TimerHeld = true;
+    return;
+  }
+
+  RunReturn rr = checkNextStep ();
+  if (rr != OKAY)
+  {
+    stopMotion (rr);
+    return;
+  }
+
+  // The Direction pin just changed, step 10-microseconds later
+  if (DirectionChanged)
+  {
+    DirectionChanged = false;
+
+    // The scheduler's timer counts from its deadlines (micros)
+    if (Scheduler != NULL)
+    {
+      StepDelay = micros() + 10L - Scheduler->Deadline[SchedulerAxis];
+      Scheduler->armTimer (SchedulerAxis, Scheduler->Deadline[SchedulerAxis] + StepDelay);
+      return;
+    }
+
+  #if defined(ARDUINO_ARCH_AVR)
+    StepDelay      = 20L;  // From the compare match, so 10 are left after the interrupt's latency
+    TimerTicksLeft = StepDelay * (F_CPU / 8000000L);
+    loadTimer ();
+  #else
+    uint64_t  now;
+
+    gptimer_get_raw_count (StepTimer, &now);
+    StepDelay     = now + 10L - NextStepCount;
+    NextStepCount = now + 10L;
+
+    gptimer_alarm_config_t alarmConfig = {};
+    alarmConfig.alarm_count = NextStepCount;
+    gptimer_set_alarm_action (StepTimer, &alarmConfig);
+  #endif
+    return;
+  }
+
+  doStep ();
+  unsigned long interval = keepSchedule (advanceStep ());
+
+  rr = checkLimitSwitches ();
+  if (rr != OKAY)
+  {
+    stopMotion (rr);
+    return;
+  }
+
+  // Reprogram the compare for the next step
+  if (Scheduler != NULL)
+  {
+    unsigned long next = Scheduler->Deadline[SchedulerAxis] + interval;
+
+    if ((long) (next - micros()) <= 0L)
+      next = micros() + 1L;  // Running late, step as soon as possible
+
+    Scheduler->armTimer (SchedulerAxis, next);
+    return;
+  }
+
+#if defined(ARDUINO_ARCH_AVR)
+  TimerTicksLeft = interval * (F_CPU / 8000000L);
+  loadTimer ();
+#else
+  uint64_t  count;
+
+  NextStepCount += interval;
+  gptimer_get_raw_count (StepTimer, &count);
+  if (NextStepCount <= count)
+    NextStepCount = count + 1L;  // Running late, step as soon as possible
+
+  gptimer_alarm_config_t alarmConfig = {};
+  alarmConfig.alarm_count = NextStepCount;
+  gptimer_set_alarm_action (StepTimer, &alarmConfig);
+#endif
+}
+
+//=== stopMotion ==========================================
+
+void StepperMotor::stopMotion (RunReturn rr)
+{
+  // Timer interrupt: stop stepping and queue the event for Run()
+  uint8_t next = (EventHead + 1) % TIMER_EVENT_QUEUE;
+
+  stopTimer ();
+  stopRotation (rr);
+
+  if (next != EventTail)  // Drop the event if Run() has not been called for a long time
+  {
+    Events[EventHead] = rr;
+    EventHead         = next;
+  }
+}
+
+//=== takeEvent ===========================================
+
+RunReturn StepperMotor::takeEvent ()
+{
+  if (EventTail == EventHead)
+    return OKAY;
+
+  RunReturn rr = Events[EventTail];
+  EventTail = (EventTail + 1) % TIMER_EVENT_QUEUE;
+
+  return rr;
+}
+
+#endif
+
+#if defined(STEPPER_RMT)
+
+//=== initRMT =============================================
+
+void StepperMotor::initRMT ()
+{
+  // Attach an RMT transmit channel to the Step pin
+  rmt_tx_channel_config_t channelConfig = {};
+  channelConfig.gpio_num          = (gpio_num_t) StepPin;
+  channelConfig.clk_src           = RMT_CLK_SRC_DEFAULT;
+  channelConfig.resolution_hz     = RMT_RESOLUTION_HZ;
+  channelConfig.mem_block_symbols = 64;
+  channelConfig.trans_queue_depth = RMT_QUEUED_SEGMENTS;
+  rmt_new_tx_channel (&channelConfig, &RmtChannel);
+
+  // Segments are pre-built symbols, so a copy encoder is all that is needed
+  rmt_copy_encoder_config_t encoderConfig = {};
+  rmt_new_copy_encoder (&encoderConfig, &RmtEncoder);
+
+  // Count finished segments
+  rmt_tx_event_callbacks_t callbacks = {};
+  callbacks.on_trans_done = rmtSegmentDone;
+  rmt_tx_register_event_callbacks (RmtChannel, &callbacks, this);
+
+  rmt_enable (RmtChannel);
+  RmtPending = 0;
+  RmtBuffer  = 0;
+  RmtQueued  = 0;
+  RmtSent    = 0;
+
+  SegmentBuilding     = false;
+  SegmentTriggerCount = 0;
+}
+
+//=== rmtSegmentDone ======================================
+
+bool IRAM_ATTR StepperMotor::rmtSegmentDone (rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *eventData, void *context)
+{
+  // RMT interrupt: one queued segment has been sent (in the order they were queued)
+  StepperMotor *motor = (StepperMotor *) context;
+  int           slot  = motor->RmtSent % RMT_QUEUED_SEGMENTS;
+
+  if (motor->RmtTriggerCount[slot] > 0)
+    motor->fireTriggers (motor->RmtTriggerFirst[slot], motor->RmtTriggerCount[slot]);
+
+  motor->RmtSent++;
+  motor->RmtPending--;
+  return false;
+}
+
+//=== runSegments =========================================
+
+RunReturn StepperMotor::runSegments ()
+{
+  // Stop queuing new segments once a limit switch is triggered
+  if (SegmentReturn == OKAY && DeltaPosition != 0L)
+    SegmentReturn = checkLimitSwitches ();
+
+  if (SegmentReturn != OKAY)
+  {
+    // Let the queued segments finish so the position stays exact
+    if (RmtPending > 0)
+      return OKAY;
+
+    return stopRotation (SegmentReturn);
+  }
+
+  // A reversal set up while steps were queued changes the Direction pin once they are sent
+  if (DirectionPending)
+  {
+    if (RmtPending > 0)
+      return OKAY;
+
+    DirectionPending = false;
+    setDirection ();  // The first segment leads with 10-microseconds of low
+  }
+
+  // Is there room in the transmit queue?
+  if (RmtPending >= RMT_QUEUED_SEGMENTS)
+    return OKAY;
+
+  // Build the next segment from the velocity ramp
+  rmt_symbol_word_t  *symbols       = RmtSymbols[RmtBuffer];
+  int                 numSymbols    = 0;
+  unsigned long       segmentMicros = 0L;
+  unsigned long       interval, lowMicros, chunk;
+  long                segmentStart  = AbsolutePosition;
+  long                segmentDelta  = DeltaPosition;
+
+  if (DeltaPosition == 0L)
+  {
+    // Direction must be set 10-microseconds before stepping
+    symbols[numSymbols].level0    = 0;
+    symbols[numSymbols].duration0 = 5;
+    symbols[numSymbols].level1    = 0;
+    symbols[numSymbols].duration1 = 5;
+    numSymbols++;
+  }
+
+  SegmentBuilding     = true;  // Compare points reached by advanceStep() wait for the segment to be sent
+  SegmentTriggerCount = 0;
+
+  while (segmentMicros < RMT_SEGMENT_MICROS && numSymbols <= RMT_SEGMENT_SYMBOLS - RMT_MAX_STEP_SYMBOLS)
+  {
+    // A queued move that changes direction must wait for the queued pulses
+    if (reversalPending () && (segmentMicros > 0L || RmtPending > 0))
+      break;
+
+    SegmentReturn = checkNextStep ();
+    if (SegmentReturn != OKAY)
+      break;
+
+    if (DirectionChanged)
+    {
+      // The Direction pin just changed, 10-microseconds of low before the next step
+      DirectionChanged = false;
+      symbols[numSymbols].level0    = 0;
+      symbols[numSymbols].duration0 = 5;
+      symbols[numSymbols].level1    = 0;
+      symbols[numSymbols].duration1 = 5;
+      numSymbols++;
+      segmentMicros += 10L;
+      StepDelay      = 10L;
+    }
+
+    interval = keepSchedule (advanceStep ());
+    if (interval < 2L * PULSE_WIDTH)
+      interval = 2L * PULSE_WIDTH;
+    segmentMicros += interval;
+
+    // Step pulse followed by as much of the low time as fits in one symbol
+    lowMicros = interval - PULSE_WIDTH;
+    chunk     = (lowMicros > RMT_MAX_DURATION) ? RMT_MAX_DURATION : lowMicros;
+    symbols[numSymbols].level0    = 1;
+    symbols[numSymbols].duration0 = PULSE_WIDTH;
+    symbols[numSymbols].level1    = 0;
+    symbols[numSymbols].duration1 = chunk;
+    numSymbols++;
+    lowMicros -= chunk;
+
+    // Long (slow) intervals are padded with all-low symbols
+    while (lowMicros > 0L)
+    {
+      chunk = (lowMicros > 2L * RMT_MAX_DURATION) ? 2L * RMT_MAX_DURATION : lowMicros;
+      symbols[numSymbols].level0    = 0;
+      symbols[numSymbols].duration0 = chunk / 2L;
+      symbols[numSymbols].level1    = 0;
+      symbols[numSymbols].duration1 = chunk - chunk / 2L;
+      if (symbols[numSymbols].duration0 == 0)
+        symbols[numSymbols].duration0 = symbols[numSymbols].duration1 = 1;  // Symbol durations must be non-zero
+      numSymbols++;
+      lowMicros -= chunk;
+    }
+
+    // A segment ends at a compare point, so its outputs fire right after the step
+    if (SegmentTriggerCount > 0)
+      break;
+  }
+
+  SegmentBuilding = false;
+
+  // Nothing left to send?  (motion ended exactly on a segment boundary)
+  if (segmentMicros == 0L)
+    return OKAY;
+
+  // Queue the segment, with the compare points it reaches
+  rmt_transmit_config_t transmitConfig = {};
+  int                   slot           = RmtQueued % RMT_QUEUED_SEGMENTS;
+
+  RmtTriggerFirst[slot] = SegmentTriggerFirst;
+  RmtTriggerCount[slot] = SegmentTriggerCount;
+  RmtPending++;  // Before the transmit, its interrupt may count it down at once
+  if (rmt_transmit (RmtChannel, RmtEncoder, symbols, numSymbols * sizeof(rmt_symbol_word_t), &transmitConfig) != ESP_OK)
+  {
+    // The segment's steps were never sent: the position goes back to the last step that was,
+    // and the motor stops with STEP_ERROR once the queued segments are sent
+    RmtPending--;
+    AbsolutePosition = segmentStart;
+    DeltaPosition    = segmentDelta;
+    seekTriggers ();
+    SegmentReturn = STEP_ERROR;
+  }
+  else
+    RmtQueued++;
+
+  RmtBuffer = (RmtBuffer + 1) % RMT_QUEUED_SEGMENTS;
+
+  return OKAY;
+}
+
+//=== stopSegments ========================================
+
+bool StepperMotor::stopSegments (bool abort)
+{
+  if (abort)
+  {
+    // Discard everything in the transmit queue
+    rmt_disable (RmtChannel);
+    rmt_enable  (RmtChannel);
+    RmtPending = 0;
+    RmtSent    = RmtQueued;  // Their compare points are dropped too
+  }
+  else if (rmt_tx_wait_all_done (RmtChannel, RMT_WAIT_MS) != ESP_OK)
+  {
+    // Let queued steps finish before changing direction.  That is a few step pulses at most,
+    // the bound only catches a stuck RMT, which stops the motor.
+    SegmentReturn = STEP_ERROR;
+    return false;
+  }
+
+  SegmentReturn = OKAY;
+  return true;
+}
+
+#endif
+
+//=== startRotation =======================================
+
+void StepperMotor::startRotation ()
+{
+#if defined(STEPPER_TIMER)
+  // A motor without a step timer never runs
+  if (!TimerReady)
+    return;
+#endif
+
+  forgetPosition ();
+
+#if defined(STEPPER_TIMER)
+  // Hold off the timer interrupt while the rotation is set up.  (A queued move started by the
+  // interrupt itself calls setupRotation() directly, and must leave the timer running.)
+  stopTimer ();
+  TimerHeld = false;
+#endif
+
+  setupRamp ();
+  setupRotation ();
+
+  // Start rotation
+  NextStepMicros = micros() + 10L;  // Direction must be set 10-microseconds before stepping
+  State          = MS_RUNNING;
+  wakeScheduler ();
+
+#if defined(STEPPER_TIMER)
+  startTimer (10L);
+#endif
+}
+
+//=== wakeScheduler =======================================
+
+void StepperMotor::wakeScheduler ()
+{
+  // A scheduled motor's next step may now come before the deadline the scheduler has for it.
+  // (In timer builds startTimer() gives the scheduler its deadline.)
+#if !defined(STEPPER_TIMER)
+  if (Scheduler != NULL)
+    Scheduler->wake (this);
+#endif
+}
+
+//=== setupRotation =======================================
+
+void StepperMotor::setupRotation ()
+{
+  // The ramp is already set up: by setupRamp(), or prepared for a queued move
+  // (No ramp means immediate full speed, or a start at a slow value)
+  RampSteps         = FullRampSteps;
+  RampLevel         = 0L;  // Start from a stand-still
+  CommandedVelocity = MaxVelocity;
+
+  // Set on what step to start ramping down
+  if (TotalSteps > 2L * RampSteps)
+    RampDownStep = TotalSteps - RampSteps;  // Normal trapezoid velocity
+  else
+    RampDownStep = RampSteps = TotalSteps / 2L;  // Stunted triangle velocity
+
+#if defined(STEPPER_RMT)
+  SegmentReturn = OKAY;
+#endif
+
+  // Set Direction
+#if defined(STEPPER_RMT)
+  // A reversal behind queued steps is left to runSegments(), so the caller never waits for them
+  long pinIncrement = DirectionPending ? -StepIncrement : StepIncrement;
+
+  StepIncrement    = (TargetPosition >= AbsolutePosition) ? 1L : -1L;
+  DirectionPending = (StepIncrement != pinIncrement && RmtPending > 0);
+  if (!DirectionPending)
+    setDirection ();
+#else
+  StepIncrement = (TargetPosition >= AbsolutePosition) ? 1L : -1L;
+  setDirection ();
+#endif
+
+#if defined(LIMIT_INTERRUPTS)
+  // A switch that is already pressed gives no interrupt, so latch it now if the rotation heads for it
+  LimitEvent = readLimitSwitches ();
+#endif
+
+  DeltaPosition = 0L;
+
+  // Queued moves may end at a velocity other than zero
+  if (ExitLevel > 0L)
+    planProfile ();
+}
+
+//=== doStep ==============================================
+
+void StepperMotor::doStep ()
+{
+  // Perform a single step
+#if defined(STEPPER_RMT)
+  // The Step pin belongs to the RMT peripheral, so queue a one-step segment.  The RMT reads it
+  // after this returns, so it goes in a segment buffer, and the step is not waited for.
+  rmt_symbol_word_t      *pulse          = RmtSymbols[RmtBuffer];
+  rmt_transmit_config_t   transmitConfig = {};
+  int                     numSymbols     = 0;
+
+  // A reversal, or a transmit queue still full (its buffers in use), waits for the queued steps.
+  // That is a few step pulses at most, the bound only catches a stuck RMT.
+  if ((DirectionPending || RmtPending >= RMT_QUEUED_SEGMENTS) && rmt_tx_wait_all_done (RmtChannel, RMT_WAIT_MS) != ESP_OK)
+  {
+    SegmentReturn = STEP_ERROR;  // The step was not taken, the group stops (StepperGroup::Run)
+    return;
+  }
+
+  if (DirectionPending)
+  {
+    DirectionPending = false;
+    setDirection ();
+
+    // Direction must be set 10-microseconds before stepping
+    pulse[numSymbols].level0    = 0;
+    pulse[numSymbols].duration0 = 5;
+    pulse[numSymbols].level1    = 0;
+    pulse[numSymbols].duration1 = 5;
+    numSymbols++;
+  }
+
+  pulse[numSymbols].level0    = 1;
+  pulse[numSymbols].duration0 = PULSE_WIDTH;
+  pulse[numSymbols].level1    = 0;
+  pulse[numSymbols].duration1 = PULSE_WIDTH;
+  numSymbols++;
+
+  RmtTriggerCount[RmtQueued % RMT_QUEUED_SEGMENTS] = 0;  // advanceStep() fires them after this step
+  RmtPending++;
+  if (rmt_transmit (RmtChannel, RmtEncoder, pulse, numSymbols * sizeof(rmt_symbol_word_t), &transmitConfig) != ESP_OK)
+  {
+    RmtPending--;
+    SegmentReturn = STEP_ERROR;  // The step was not taken, the group stops (StepperGroup::Run)
+  }
+  else
+    RmtQueued++;
+
+  RmtBuffer = (RmtBuffer + 1) % RMT_QUEUED_SEGMENTS;
+#elif defined(NONBLOCKING_PULSE)
+  // Raise the pulse, pulseBusy() lowers it on a later pass
+  StepOut.High ();
+  PulseHigh   = true;
+  PulseMicros = micros() + PULSE_WIDTH;
+#else
+  StepOut.High ();
+  delayMicroseconds (PULSE_WIDTH);
+  StepOut.Low ();
+#endif
+}
+
+//=== pulseBusy ===========================================
+
+bool StepperMotor::pulseBusy ()
+{
+  if (!PulseHigh && !PulseHold)
+    return false;
+
+  // Still within the pulse, or within the low time after it?
+  if ((long) (micros() - PulseMicros) < 0L)
+    return true;
+
+  if (PulseHigh)
+  {
+    StepOut.Low ();
+    PulseHigh   = false;
+    PulseHold   = true;
+    PulseMicros = micros() + PULSE_WIDTH;  // Pin stays low at least as long as the pulse
+    return true;
+  }
+
+  PulseHold = false;
+
+  // A direction change deferred by the pulse is made now, and the next pulse waits 10-microseconds for it
+  if (DirectionDeferred)
+  {
+    DirectionDeferred = false;
+    setDirection ();
+    PulseHold   = true;
+    PulseMicros = micros() + 10L;
+    return true;
+  }
+
+  return false;
+}
+
+//=== Enable ==============================================
+
+void StepperMotor::Enable ()
+{
+#if defined(STEPPER_TIMER)
+  // A motor that didn't get a step timer is refused, it stays Disabled
+  if (!TimerReady)
+    return;
+#endif
+
+  // Enable motor driver
+  EnableOut.Low ();
+  State = MS_ENABLED;
+
+  // Also, set the current position as HOME
+  SetHomePosition ();
+}
+
+//=== Disable =============================================
+
+void StepperMotor::Disable ()
+{
+  // Disable motor driver
+  EnableOut.High ();
+
+  State  = MS_DISABLED;
+  Homed  = false;  // When motor is free to move, the HOME position is lost
+  Homing = HS_IDLE;
+}
+
+//=== FindHome ============================================
+
+void StepperMotor::FindHome ()
+{
+  // Seek counter-clockwise to lower limit switch at the fast homing speed,
+  // back off until the switch releases, then re-approach it slowly and back
+  // off again to set the new HOME position.
+  // Homing runs inside Run(), which returns HOME_COMPLETE when finished.
+
+  if (LLSwitchPin >= 0)
+  {
+    replaceMotion ();
+    Enable ();
+
+    startHomingPhase (HS_SEEK, -HOMING_MAX_STEPS, HomingFastSpeed);
+  }
+}
+
+//=== SetHomingSpeed ======================================
+
+void StepperMotor::SetHomingSpeed (long fastSpeed, long slowSpeed)
+{
+  if (fastSpeed > 0L)
+    HomingFastSpeed = fastSpeed;
+
+  if (slowSpeed > 0L)
+    HomingSlowSpeed = slowSpeed;
+}
+
+//=== SetHomePosition =====================================
+
+void StepperMotor::SetHomePosition ()
+{
+  // Only if Enabled
+  if (State == MS_ENABLED)
+  {
+    // Set current position as HOME position
+    AbsolutePosition = 0L;
+    DeltaPosition    = 0L;
+    Homed            = true;
+    seekTriggers ();
+
+#if defined(STEP_ENCODER)
+    syncEncoder ();
+#endif
+  }
+}
+
+//=== SetLowerLimit =======================================
+
+void StepperMotor::SetLowerLimit (long lowerLimit)
+{
+  // Must be <= 0 and <= UpperLimit
+  if (lowerLimit <= 0 && lowerLimit <= UpperLimit)
+    LowerLimit = lowerLimit;
+}
+
+//=== SetUpperLimit =======================================
+
+void StepperMotor::SetUpperLimit (long upperLimit)
+{
+  // Must be >= 0 and >= LowerLimit
+  if (upperLimit >= 0 && upperLimit >= LowerLimit)
+    UpperLimit = upperLimit;
+}
+
+//=== SetRamp =============================================
+
+void StepperMotor::SetRamp (int ramp)
+{
+  // Must be 0..9
+  if (ramp >= 0 && ramp <= 9)
+  {
+    // Set velocity slope (increment), replacing any acceleration from SetAcceleration()
+    Acceleration = 0L;
+
+    if (ramp == 0)
+      VelocityIncrement = 0L;  // constant full velocity
+    else
+      VelocityIncrement = RampScale * (10L - (long)ramp);
+
+    rampChanged ();
+  }
+}
+
+//=== SetAcceleration =====================================
+
+void StepperMotor::SetAcceleration (long stepsPerSec2)
+{
+  // Ramps follow a true constant acceleration, SetRamp() goes back to the ramp factor
+  if (stepsPerSec2 > 0L)
+  {
+    Acceleration = stepsPerSec2;
+    rampChanged ();
+  }
+}
+
+//=== SetProfile ==========================================
+
+void StepperMotor::SetProfile (MotionProfile profile, long maxJerk)
+{
+  if (profile == PROFILE_TRAPEZOID || profile == PROFILE_SCURVE)
+    Profile = profile;
+
+  if (maxJerk > 0L)
+    MaxJerk = maxJerk;
+
+  rampChanged ();
+}
+
+//=== rampChanged =========================================
+
+void StepperMotor::rampChanged ()
+{
+  // Ramps prepared for queued moves with the old settings are prepared again
+  // (0 marks a move that isn't prepared, so it is skipped)
+  LOCK_MOTION ();
+  if (++RampSettings == 0)
+    RampSettings = 1;
+
+  PrepareNeeded = true;
+  UNLOCK_MOTION ();
+}
+
+//=== RotateAbsolute ======================================
+
+void StepperMotor::RotateAbsolute (long newPosition, long stepsPerSecond)
+{
+  if (stepsPerSecond < 1L)
+    return;  // No velocity, ignored
+
+  replaceMotion ();  // A direct rotation replaces any queued moves or homing
+
+  TargetPosition = newPosition;  // Set Absolute Position
+  MaxVelocity    = stepsPerSecond;
+  TotalSteps     = abs(TargetPosition - AbsolutePosition);
+
+  startRotation ();
+}
+
+//==== RotateRelative =====================================
+
+void StepperMotor::RotateRelative (long numSteps, long stepsPerSecond)
+{
+  // If numSteps is positive (> 0) then motor rotates clockwise, else counter-clockwise
+  if (numSteps != 0 && stepsPerSecond >= 1L)
+  {
+    replaceMotion ();  // A direct rotation replaces any queued moves or homing
+
+    TargetPosition = AbsolutePosition + numSteps;
+    MaxVelocity    = stepsPerSecond;
+    TotalSteps     = abs(numSteps);
+
+    startRotation ();
+  }
+}
+
+//=== RotateToHome ========================================
+
+void StepperMotor::RotateToHome ()
+{
+  replaceMotion ();  // A direct rotation replaces any queued moves or homing
+
+  MaxVelocity    = HomingFastSpeed;
+  TargetPosition = 0L;  // HOME position
+  TotalSteps     = abs(AbsolutePosition);
+
+  startRotation ();
+}
+
+//=== RotateToLowerLimit ==================================
+
+void StepperMotor::RotateToLowerLimit ()
+{
+  replaceMotion ();  // A direct rotation replaces any queued moves or homing
+
+  MaxVelocity    = HomingFastSpeed;
+  TargetPosition = LowerLimit;
+  TotalSteps     = abs(AbsolutePosition - LowerLimit);
+
+  startRotation ();
+}
+
+//=== RototaeToUpperLimit =================================
+
+void StepperMotor::RotateToUpperLimit ()
+{
+  replaceMotion ();  // A direct rotation replaces any queued moves or homing
+
+  MaxVelocity    = HomingFastSpeed;
+  TargetPosition = UpperLimit;
+  TotalSteps     = abs(AbsolutePosition - UpperLimit);
+
+  startRotation ();
+}
+
+//=== QueueAbsolute =======================================
+
+bool StepperMotor::QueueAbsolute (long absPosition, long stepsPerSecond)
+{
+  long  lastTarget, steps;
+  int   next;
+
+  if (stepsPerSecond < 1L)
+    return false;  // No velocity
+
+  // Only a homed motor that is running, or Enabled and able to start it, takes a move
+  // (else it would sit in the queue and start on some later, unrelated move)
+  if (!Homed || (State != MS_RUNNING && State != MS_ENABLED))
+    return false;
+
+  // The new move starts where the previous queued (or current) move ends
+  if (QueueHead != QueueTail)
+    lastTarget = Queue[(QueueHead + MOTION_QUEUE_SIZE - 1) % MOTION_QUEUE_SIZE].Target;
+  else if (State == MS_RUNNING)
+    lastTarget = TargetPosition;
+  else
+    lastTarget = AbsolutePosition;
+
+  steps = abs(absPosition - lastTarget);
+  if (steps == 0L)
+    return true;  // Nothing to do
+
+  // Moves can't follow a running stream
+  if (Streaming && State == MS_RUNNING)
+    return false;
+
+  // Is there room?
+  next = (QueueHead + 1) % MOTION_QUEUE_SIZE;
+  if (next == QueueTail)
+    return false;
+
+  LOCK_MOTION ();
+
+  QueuedMove *move = &Queue[QueueHead];
+  move->Target      = absPosition;
+  move->MaxVelocity = (stepsPerSecond < MAX_STEP_RATE) ? stepsPerSecond : MAX_STEP_RATE;
+  move->Steps       = steps;
+  move->Increment   = (absPosition > lastTarget) ? 1L : -1L;
+  move->ExitLevel   = 0L;
+  move->Planned     = 0;  // Its ramp is prepared below
+  QueueHead         = next;
+
+  bool idle = (State != MS_RUNNING);
+  if (!idle)
+    planQueue ();  // Blend with the moves ahead of it
+
+  UNLOCK_MOTION ();
+
+  // Plan the next move's ramp and build its table now, outside the step engine
+  prepareMove ();
+
+  if (idle)
+  {
+    // Idle, so start this move now
+    forgetPosition ();
+    LOCK_MOTION ();
+    nextQueuedMove ();
+    NextStepMicros = micros() + 10L;  // Direction must be set 10-microseconds before stepping
+    State          = MS_RUNNING;
+    wakeScheduler ();
+
+#if defined(STEPPER_TIMER)
+    startTimer (10L);
+#endif
+    UNLOCK_MOTION ();
+  }
+
+  return true;
+}
+
+//=== QueueRelative =======================================
+
+bool StepperMotor::QueueRelative (long numSteps, long stepsPerSecond)
+{
+  long  lastTarget;
+
+  // Relative to where the previous queued (or current) move ends
+  if (QueueHead != QueueTail)
+    lastTarget = Queue[(QueueHead + MOTION_QUEUE_SIZE - 1) % MOTION_QUEUE_SIZE].Target;
+  else if (State == MS_RUNNING)
+    lastTarget = TargetPosition;
+  else
+    lastTarget = AbsolutePosition;
+
+  return QueueAbsolute (lastTarget + numSteps, stepsPerSecond);
+}
+
+//=== GetQueueDepth =======================================
+
+int StepperMotor::GetQueueDepth ()
+{
+  // Number of moves waiting behind the current rotation
+  return (QueueHead - QueueTail + MOTION_QUEUE_SIZE) % MOTION_QUEUE_SIZE;
+}
+
+//=== replaceMotion =======================================
+
+void StepperMotor::replaceMotion ()
+{
+  Homing = HS_IDLE;
+  ClearQueue ();
+
+  // A stream also ends
+  LOCK_MOTION ();
+  Streaming  = false;
+  StreamTail = StreamHead;
+  UNLOCK_MOTION ();
+}
+
+//=== ClearQueue ==========================================
+
+void StepperMotor::ClearQueue ()
+{
+  // The current rotation (if any) still completes, but stops at its target
+  LOCK_MOTION ();
+
+  QueueTail = QueueHead;
+  ExitLevel = 0L;
+  if (State == MS_RUNNING)
+    planProfile ();
+
+  UNLOCK_MOTION ();
+}
+
+//=== EStop ===============================================
+
+void StepperMotor::EStop ()
+{
+  // Emergency Stop
+  // ((( Requires Re-Enable of motor )))
+#if defined(STEPPER_RMT)
+  stopSegments (true);              // Drop queued pulses
+#else
+	StepOut.Low ();     // Pulse Off
+  PulseHigh = false;
+  PulseHold = false;
+  DirectionDeferred = false;
+#endif
+	EnableOut.High ();  // Disengage
+
+  State  = MS_ESTOPPED;
+  Homed  = false;
+  Homing = HS_IDLE;
+  QueueTail = QueueHead;  // Cancel queued moves
+  StreamTail = StreamHead;
+  Streaming  = false;
+  TargetPosition = AbsolutePosition;
+}
+
+//=== IsHomed =============================================
+
+bool StepperMotor::IsHomed ()
+{
+  // Return homed state (not while FindHome is still running)
+  return Homed && (Homing == HS_IDLE);
+}
+
+//=== GetState ============================================
+
+MotorState StepperMotor::GetState ()
+{
+  // Return current motor state
+  return State;
+}
+
+//=== GetAbsolutePosition =================================
+
+long StepperMotor::GetAbsolutePosition ()
+{
+  // Return current position from HOME
+#if defined(STEPPER_TIMER)
+  LOCK_MOTION ();  // Position is updated by the timer interrupt
+  long position = AbsolutePosition;
+  UNLOCK_MOTION ();
+  return position;
+#else
+  return AbsolutePosition;
+#endif
+}
+
+//=== GetVelocity =========================================
+
+long StepperMotor::GetVelocity ()
+{
+  // Return the current step rate (steps per second, negative for counter-clockwise)
+  LOCK_MOTION ();
+  unsigned long interval  = StepInterval;
+  long          increment = StepIncrement;
+  UNLOCK_MOTION ();
+
+  if (State != MS_RUNNING || interval == 0L)
+    return 0L;
+
+  return increment * (long) (1000000UL / interval);
+}
+
+//=== GetRelativePosition =================================
+
+long StepperMotor::GetRelativePosition ()
+{
+  // Return number of steps moved from last position
+#if defined(STEPPER_TIMER)
+  LOCK_MOTION ();  // Position is updated by the timer interrupt
+  long position = DeltaPosition;
+  UNLOCK_MOTION ();
+  return position;
+#else
+  return DeltaPosition;
+#endif
+}
+
+//=== GetLowerLimit =======================================
+
+long StepperMotor::GetLowerLimit ()
+{
+  return LowerLimit;
+}
+
+//=== GetUpperLimit =======================================
+
+long StepperMotor::GetUpperLimit ()
+{
+  return UpperLimit;
+}
+
+//=== GetRemainingTime ====================================
+
+unsigned long StepperMotor::GetRemainingTime ()
+{
+  // Return remaining time (in milliseconds) for motion to complete,
+  // including the queued moves
+  RampTiming       timing;
+  QueuedMove      *move;
+  const RampTable *table;
+  float            seconds;
+  long             stepCount, level, increment;
+
+  if (State != MS_RUNNING)
+    return 0L;
+
+  if (Streaming)
+    return (unsigned long) (streamTime () * 1000.0f + 0.5f);
+
+  LOCK_MOTION ();
+  stepCount = StepCount;
+  level     = RampLevel;
+  table     = Table;
+  UNLOCK_MOTION ();
+
+  // The rest of the current rotation from its current phase
+  rampTiming (MaxVelocity, TotalSteps, &timing);
+  if (timing.Curve && Ramping && FullRampSteps != table->RampSteps)
+  {
+    // SetVelocity() lowered the velocity, the ramp keeps to the curve of its table
+    sCurveSetup (&timing.Shape, table->Velocity, rampAccel (table->MaxVelocity), (Profile == PROFILE_SCURVE) ? MaxJerk : 0L);
+    timing.FullSteps = FullRampSteps;
+  }
+  seconds = phaseTime (&timing, stepCount, level, TotalSteps, RampSteps, RampDownStep);
+
+#if !defined(STEPPER_RMT) && !defined(STEPPER_TIMER)
+  // Time until the next step is due
+  long wait = (long) (NextStepMicros - micros());
+  if (wait > 0L)
+    seconds += wait / 1000000.0f;
+#endif
+
+  // Each queued move starts at the level the move before it exits
+  level     = ExitLevel;
+  increment = StepIncrement;
+
+  for (int i=QueueTail; i!=QueueHead; i=(i+1)%MOTION_QUEUE_SIZE)
+  {
+    move = &Queue[i];
+    if (move->Increment != increment)
+      level = 0L;  // Stops to change direction
+
+    seconds  += moveTime (move->MaxVelocity, move->Steps, level, move->ExitLevel);
+    level     = move->ExitLevel;
+    increment = move->Increment;
+  }
+
+  return (unsigned long) (seconds * 1000.0f + 0.5f);
+}
+
+//=== PredictMoveTime =====================================
+
+unsigned long StepperMotor::PredictMoveTime (long numSteps, long stepsPerSecond)
+{
+  // Time (in milliseconds) a relative move would take from a stand-still
+  // with the current ramp settings
+  if (stepsPerSecond > MAX_STEP_RATE)
+    stepsPerSecond = MAX_STEP_RATE;
+  else if (stepsPerSecond < 1L)
+    stepsPerSecond = 1L;
+
+  return (unsigned long) (moveTime (stepsPerSecond, abs (numSteps), 0L, 0L) * 1000.0f + 0.5f);
+}
+
+//=== GetMaxStepRate ======================================
+
+long StepperMotor::GetMaxStepRate ()
+{
+  return MAX_STEP_RATE;
+}
+
+//=== GetVersion ==========================================
+
+const char * StepperMotor::GetVersion ()
+{
+  return version;
+}
+
+//=== Saved Configuration =================================
+//  One record per ConfigStore slot.  Fixed-width fields keep the layout the same on every
+//  target; CONFIG_MAGIC changes whenever the layout does, so an old record is ignored.
+
+#define CONFIG_MAGIC  0x5331  // "S1"
+
+struct StoredConfig
+{
+  uint16_t  Magic;              // CONFIG_MAGIC
+  uint8_t   Profile;            // MotionProfile
+  uint8_t   HasPosition;        // Position is valid, until the next LoadConfig()
+  int32_t   LowerLimit;
+  int32_t   UpperLimit;
+  int32_t   VelocityIncrement;  // Ramp factor (0 = no ramp)
+  int32_t   Acceleration;       // Steps per second² (0 = use the ramp factor)
+  int32_t   MaxJerk;
+  int32_t   HomingFastSpeed;
+  int32_t   HomingSlowSpeed;
+  int32_t   Position;           // AbsolutePosition of a homed motor at rest
+  uint8_t   Crc;                // crc8 of the fields before it
+};
+
+static_assert (sizeof (StoredConfig) <= CONFIG_MAX_LENGTH, "StoredConfig must fit in a ConfigStore record");
+
+//=== SetConfigSlot =======================================
+
+void StepperMotor::SetConfigSlot (int slot)
+{
+  if (slot >= 0)
+    ConfigSlot = slot;
+}
+
+//=== SaveConfig ==========================================
+
+bool StepperMotor::SaveConfig (bool withPosition)
+{
+  StoredConfig  config;
+
+  // Storage writes block, and a position is only known while homed and at rest
+  if (State == MS_RUNNING || (withPosition && (State != MS_ENABLED || !IsHomed ())))
+    return false;
+
+  memset (&config, 0, sizeof (config));  // Padding is stored and compared too
+
+  config.Profile           = (uint8_t) Profile;
+  config.HasPosition       = withPosition ? 1 : 0;
+  config.LowerLimit        = LowerLimit;
+  config.UpperLimit        = UpperLimit;
+  config.VelocityIncrement = VelocityIncrement;
+  config.Acceleration      = Acceleration;
+  config.MaxJerk           = MaxJerk;
+  config.HomingFastSpeed   = HomingFastSpeed;
+  config.HomingSlowSpeed   = HomingSlowSpeed;
+  config.Position          = withPosition ? AbsolutePosition : 0L;
+
+  if (!writeConfig (&config))
+    return false;
+
+  PositionSaved = withPosition;
+  return true;
+}
+
+//=== LoadConfig ==========================================
+
+bool StepperMotor::LoadConfig ()
+{
+  StoredConfig  config;
+
+  if (State == MS_RUNNING || !readConfig (&config))
+    return false;
+
+  Profile           = (config.Profile == PROFILE_SCURVE) ? PROFILE_SCURVE : PROFILE_TRAPEZOID;
+  LowerLimit        = config.LowerLimit;
+  UpperLimit        = config.UpperLimit;
+  VelocityIncrement = config.VelocityIncrement;
+  Acceleration      = config.Acceleration;
+  MaxJerk           = config.MaxJerk;
+  HomingFastSpeed   = config.HomingFastSpeed;
+  HomingSlowSpeed   = config.HomingSlowSpeed;
+  rampChanged ();
+  PositionSaved     = (config.HasPosition != 0);
+
+  // The saved position replaces homing once, then it is cleared:
+  // the moves made after this start are not saved.
+  if (config.HasPosition && State == MS_ENABLED)
+  {
+    AbsolutePosition = config.Position;
+    DeltaPosition    = 0L;
+    TargetPosition   = AbsolutePosition;
+    Homed            = true;
+    seekTriggers ();
+
+#if defined(STEP_ENCODER)
+    syncEncoder ();
+#endif
+
+    config.HasPosition = 0;
+    config.Position    = 0L;
+    PositionSaved      = !writeConfig (&config);
+  }
+
+  return true;
+}
+
+//=== ForgetPosition ======================================
+
+void StepperMotor::ForgetPosition ()
+{
+  // For a caller that keeps storage I/O out of the task that starts the move
+  // (main.cpp's DUAL_CORE command task), the move then finds nothing to clear
+  forgetPosition ();
+}
+
+//=== forgetPosition ======================================
+
+void StepperMotor::forgetPosition ()
+{
+  // Called in task context as the motor leaves the saved position, so a power cycle
+  // during or after the move can't restore it as Homed
+  StoredConfig  config;
+
+  if (!PositionSaved)
+    return;
+
+  PositionSaved = false;
+  if (readConfig (&config) && config.HasPosition)
+  {
+    config.HasPosition = 0;
+    config.Position    = 0L;
+    writeConfig (&config);  // Not retried: a failed write would block every later move start
+  }
+}
+
+//=== readConfig / writeConfig ============================
+
+bool StepperMotor::readConfig (StoredConfig *config)
+{
+  if (!ConfigStore::Read (ConfigSlot, (uint8_t *) config, sizeof (StoredConfig)))
+    return false;
+
+  return config->Magic == CONFIG_MAGIC && config->Crc == crc8 ((const uint8_t *) config, offsetof (StoredConfig, Crc));
+}
+
+bool StepperMotor::writeConfig (StoredConfig *config)
+{
+  config->Magic = CONFIG_MAGIC;
+  config->Crc   = crc8 ((const uint8_t *) config, offsetof (StoredConfig, Crc));
+
+  return ConfigStore::Write (ConfigSlot, (const uint8_t *) config, sizeof (StoredConfig));
+}
+
+//=== BlinkLED ============================================
+
+bool StepperMotor::BlinkLED (int LEDpin)
+{
+  if (!outputPin (LEDpin))
+    return false;
+
+  // A blink still running on another LED ends now
+  if (BlinkChanges > 0 && BlinkPin != LEDpin)
+    digitalWrite (BlinkPin, LOW);
+
+  pinMode(LEDpin, OUTPUT);
+
+  // First flash starts now, Run() makes the rest of the changes
+  digitalWrite (LEDpin, HIGH);
+  BlinkPin     = LEDpin;
+  BlinkMicros  = micros() + BLINK_ON_MICROS;
+  BlinkChanges = 2 * BLINK_COUNT - 1;  // Set last, Run() may be on the other core
+  wakeScheduler ();
+
+  return true;
+}
+
+//=== blinkStep ===========================================
+
+void StepperMotor::blinkStep ()
+{
+  if ((long) (micros() - BlinkMicros) < 0L)
+    return;
+
+  // Changes alternate off and on, ending off
+  if (--BlinkChanges % 2 == 0)
+  {
+    digitalWrite (BlinkPin, LOW);
+    BlinkMicros += BLINK_OFF_MICROS;
+  }
+  else
+  {
+    digitalWrite (BlinkPin, HIGH);
+    BlinkMicros += BLINK_ON_MICROS;
+  }
+}
+
+//=== outputsPending ======================================
+
+bool StepperMotor::outputsPending ()
+{
+#if defined(NONBLOCKING_PULSE)
+  // A rotation can end with its last step pulse still high (a stream that ran dry)
+  if (PulseHigh || PulseHold)
+    return true;
+#endif
+
+  return BlinkChanges > 0 || TriggerPulsing;
+}
+
+
+//=========================================================
+//  ExecuteCommand
+//=========================================================
+
+const char * StepperMotor::ExecuteCommand (const char *packet)
+{
+#if defined(STEP_STATS)
+  unsigned long start = micros();
+#endif
+
+  // Several commands are separated by ';'
+  const char *response = (strchr (packet, ';') != NULL) ? executeBatch (packet) : executeSingle (packet);
+
+#if defined(STEP_STATS)
+  recordCommand (start);
+#endif
+
+  return response;
+}
+
+//=== executeBatch ========================================
+
+const char * StepperMotor::executeBatch (const char *packet)
+{
+  static const char  full[] = "Batch too long";
+  char               command[EC_COMMAND_LENGTH];
+  const char        *start = packet;
+  const char        *end;
+  const char        *response;
+  int                length = 0;
+  int                commandLength;
+
+  ecBatchString[0] = 0;
+
+  while (*start != 0)
+  {
+    end = strchr (start, ';');
+    if (end == NULL)
+      end = start + strlen (start);
+
+    // Each field but the first follows a separator
+    if (start != packet)
+      ecBatchString[length++] = ';';
+
+    // Room for the longest response, and still for the "full" field after it?
+    if (length + EC_RETURN_LENGTH + (int) sizeof (full) > EC_BATCH_LENGTH)
+    {
+      strcpy (ecBatchString + length, full);
+      return ecBatchString;
+    }
+
+    commandLength = end - start;
+    if (commandLength >= EC_COMMAND_LENGTH)
+      response = "Bad command";
+    else
+    {
+      memcpy (command, start, commandLength);
+      command[commandLength] = 0;
+      response = executeSingle (command);
+    }
+
+    strncpy (ecBatchString + length, response, EC_RETURN_LENGTH - 1);
+    ecBatchString[length + EC_RETURN_LENGTH - 1] = 0;
+    length += strlen (ecBatchString + length);
+
+    // A trailing ';' ends the batch
+    start = (*end == ';') ? end + 1 : end;
+  }
+
+  ecBatchString[length] = 0;
+  return ecBatchString;
+}
+
+//=== executeSingle =======================================
+
+const char * StepperMotor::executeSingle (const char *packet)
+{
+  int   ramp;
+  long  limit, velocity, targetOrNumSteps;
+
+  // Initialize return string
+  ecReturnString[0] = 0;
+
+  // Command string must be at least 2 chars
+  if (packet[0] == 0 || packet[1] == 0)
   {
     strcpy (ecReturnString, "Bad command");
     return ecReturnString;
   }
 
-  // Set 2-Char Command and parse all commands
-  strncpy (command, packet, 2);
-  command[2] = 0;
+  // Dispatch on the 2-Char Command packed into 16 bits
+  switch (COMMAND_CODE (packet[0], packet[1]))
+  {
+    //=======================================================
+    //  Emergency Stop (ESTOP)
+    //  When an E-Stop is called, you must re-Enable the
+    //  driver for motion to resume.
+    //=======================================================
+    case COMMAND_CODE ('E','S'):
+      EStop();
+      break;
+
+    //=======================================================
+    //  Enable / Disable
+    //=======================================================
+    case COMMAND_CODE ('E','N'):
+      Enable ();
+      if (State != MS_ENABLED)
+        strcpy (ecReturnString, "No step timer");
+      break;
 
-  //=======================================================
-  //  Emergency Stop (ESTOP)
-  //  I check this first for quick processing.
-  //  When an E-Stop is called, you must re-Enable the
-  //  driver for motion to resume.
-  //=======================================================
-  if (strcmp (command, "ES") == 0)
-    EStop();
+    case COMMAND_CODE ('D','I'):
+      Disable ();
+      break;
 
-  //=======================================================
-  //  Enable / Disable
-  //=======================================================
-  else if (strcmp (command, "EN") == 0)
-    Enable ();
-  else if (strcmp (command, "DI") == 0)
-    Disable ();
-
-  //=======================================================
-  //  Find HOME, Set HOME Position, LOWER and UPPER Limits
-  //=======================================================
-  else if (strcmp (command, "FH") == 0)
-    FindHome ();
-  else if (strcmp (command, "SH") == 0)
-    SetHomePosition ();
-  else if (strcmp (command, "SL") == 0 || strcmp (command, "SU") == 0)
-  {
-    // Check for value
-    if (strlen (packet) < 3)
-      strcpy (ecReturnString, "Missing limit value");
-    else
+    //=======================================================
+    //  Find HOME, Set HOME Position, LOWER and UPPER Limits
+    //=======================================================
+    case COMMAND_CODE ('F','H'):
+      FindHome ();
+      break;
+
+    case COMMAND_CODE ('S','H'):
+      SetHomePosition ();
+      break;
+
+    case COMMAND_CODE ('S','L'):
+    case COMMAND_CODE ('S','U'):
+      // Check for value
+      if (packet[2] == 0)
+        strcpy (ecReturnString, "Missing limit value");
+      else
+      {
+        limit = strtol (packet+2, NULL, 10);
+
+        if (packet[1] == 'L')
+          SetLowerLimit (limit);
+        else
+          SetUpperLimit (limit);
+      }
+      break;
+
+    case COMMAND_CODE ('S','A'):
+      // Acceleration in steps per second²: SAaaaa...
+      if (packet[2] == 0 || strtol (packet+2, NULL, 10) <= 0L)
+        strcpy (ecReturnString, "Missing acceleration value");
+      else
+        SetAcceleration (strtol (packet+2, NULL, 10));
+      break;
+
+    case COMMAND_CODE ('S','P'):
+      // Profile digit, then optional max jerk: SPp[jjjj...]
+      if (packet[2] < '0' || packet[2] > '1')
+        strcpy (ecReturnString, "Missing profile 0-1");
+      else
+        SetProfile ((MotionProfile) (packet[2] - '0'), strtol (packet+3, NULL, 10));
+      break;
+
+    case COMMAND_CODE ('S','F'):
+      // Fast and slow homing speeds, same format as rotate commands: SFvvvvssss
+      if (!parseRotate (packet, &velocity, &targetOrNumSteps))
+        strcpy (ecReturnString, "Bad command");
+      else
+        SetHomingSpeed (velocity, targetOrNumSteps);
+      break;
+
+    //=======================================================
+    //  Set Velocity Ramp Factor
+    //=======================================================
+    case COMMAND_CODE ('S','R'):
+      // Check for value
+      if (packet[2] == 0 || packet[3] != 0)
+        strcpy (ecReturnString, "Missing ramp value 0-9");
+      else
+      {
+        ramp = atoi (packet+2);
+
+        // Check specified ramp value
+        if (ramp >= 0 && ramp <= 9)
+          SetRamp (ramp);
+      }
+      break;
+
+    //=======================================================
+    //  Rotate Commands
+    //=======================================================
+    case COMMAND_CODE ('R','H'):
+      RotateToHome ();
+      break;
+
+    case COMMAND_CODE ('R','L'):
+      RotateToLowerLimit ();
+      break;
+
+    case COMMAND_CODE ('R','U'):
+      RotateToUpperLimit ();
+      break;
+
+    case COMMAND_CODE ('R','A'):
+    case COMMAND_CODE ('R','R'):
+      // Parse max velocity and target/numSteps
+      if (!parseRotate (packet, &velocity, &targetOrNumSteps))
+        strcpy (ecReturnString, "Bad command");
+      else if (velocity < 1L)
+        strcpy (ecReturnString, "Bad velocity");
+      else if (packet[1] == 'A')
+        RotateAbsolute (targetOrNumSteps, velocity);
+      else
+        RotateRelative (targetOrNumSteps, velocity);
+      break;
+
+    //=======================================================
+    //  Motion Queue
+    //=======================================================
+    case COMMAND_CODE ('Q','A'):
+    case COMMAND_CODE ('Q','R'):
+      if (!parseRotate (packet, &velocity, &targetOrNumSteps))
+        strcpy (ecReturnString, "Bad command");
+      else if (velocity < 1L)
+        strcpy (ecReturnString, "Bad velocity");
+      else if (!((packet[1] == 'A') ? QueueAbsolute (targetOrNumSteps, velocity) : QueueRelative (targetOrNumSteps, velocity)))
+        strcpy (ecReturnString, (GetQueueDepth () < MOTION_QUEUE_SIZE - 1) ? "Not ready" : "Queue full");
+      break;
+
+    case COMMAND_CODE ('S','V'):
+    {
+      // Velocity override of the current rotation: SVvelocity or SVpercent%
+      char *next;
+      long  value = strtol (packet+2, &next, 10);
+
+      if (next == packet+2)
+        strcpy (ecReturnString, "Bad command");
+      else if (!((*next == '%') ? OverrideVelocity ((int) value) : SetVelocity (value)))
+        strcpy (ecReturnString, "Not running");
+      break;
+    }
+
+    case COMMAND_CODE ('Q','D'):
+      ltoa (GetQueueDepth (), ecReturnString, 10);
+      break;
+
+    case COMMAND_CODE ('Q','C'):
+      ClearQueue ();
+      break;
+
+    case COMMAND_CODE ('S','Q'):
     {
-      limit = strtol (packet+2, NULL, 10);
+      // Streamed segment: SQinterval,count,add  (SQ alone returns the free slots)
+      char *next;
+      long  interval = strtol (packet+2, &next, 10);
+      long  count    = (*next == ',') ? strtol (next+1, &next, 10) : 0L;
+      long  add      = (*next == ',') ? strtol (next+1, &next, 10) : 0L;
 
-      if (strcmp (command, "SL") == 0)
-        SetLowerLimit (limit);
+      if (packet[2] == 0)
+        ltoa (GetStreamFree (), ecReturnString, 10);
+      else if (count == 0L)
+        strcpy (ecReturnString, "Bad segment");
+      else if (!QueueSegment (interval, count, add))
+        strcpy (ecReturnString, (State != MS_RUNNING || !Streaming) ? "Not ready to stream" : StreamEnd ? "Stream ending" : "Stream full");
       else
-        SetUpperLimit (limit);
+        ltoa (GetStreamFree (), ecReturnString, 10);
+      break;
     }
-  }
 
-  //=======================================================
-  //  Set Velocity Ramp Factor
-  //=======================================================
-  else if (strcmp (command, "SR") == 0)
-  {
-    // Check for value
-    if (strlen (packet) != 3)
-      strcpy (ecReturnString, "Missing ramp value 0-9");
-    else
+    //=======================================================
+    //  Query Commands and Blink
+    //=======================================================
+    case COMMAND_CODE ('G','A'):
+      ltoa (GetAbsolutePosition (), ecReturnString, 10);
+      break;
+
+    case COMMAND_CODE ('G','R'):
+      ltoa (GetRelativePosition (), ecReturnString, 10);
+      break;
+
+    case COMMAND_CODE ('G','L'):
+      ltoa (GetLowerLimit (), ecReturnString, 10);
+      break;
+
+    case COMMAND_CODE ('G','U'):
+      ltoa (GetUpperLimit (), ecReturnString, 10);
+      break;
+
+    case COMMAND_CODE ('G','T'):
+      ltoa (GetRemainingTime (), ecReturnString, 10);
+      break;
+
+    case COMMAND_CODE ('G','D'):
+      // Predicted duration of a move, same format as RR: GDvvvvssss
+      if (!parseRotate (packet, &velocity, &targetOrNumSteps))
+        strcpy (ecReturnString, "Bad command");
+      else if (velocity < 1L)
+        strcpy (ecReturnString, "Bad velocity");
+      else
+        ltoa (PredictMoveTime (targetOrNumSteps, velocity), ecReturnString, 10);
+      break;
+
+    case COMMAND_CODE ('G','M'):
+      ltoa (GetMaxStepRate (), ecReturnString, 10);
+      break;
+
+    case COMMAND_CODE ('G','V'):
+      return GetVersion();
+
+#if defined(STEP_STATS)
+    case COMMAND_CODE ('G','S'):
     {
-      ramp = atoi (packet+2);
+      // Summary, one histogram bin or the longest command: GS[bin|C]
+      int bin = atoi (packet+2);
 
-      // Check specified ramp value
-      if (ramp >= 0 && ramp <= 9)
-        SetRamp (ramp);
+      if (packet[2] == 0)
+        snprintf (ecReturnString, EC_RETURN_LENGTH, "%lu,%lu,%lu,%lu", Stats.Steps, Stats.MaxLate, Stats.Missed, Stats.MaxRunGap);
+      else if (packet[2] == 'C')
+        ultoa (Stats.MaxCommand, ecReturnString, 10);
+      else if (packet[2] >= '0' && packet[2] <= '9' && bin < STATS_BINS)
+        ultoa (Stats.Histogram[bin], ecReturnString, 10);
+      else
+        strcpy (ecReturnString, "Bad stats bin");
+      break;
     }
-  }
 
-  //=======================================================
-  //  Rotate Commands
-  //=======================================================
-  else if (strcmp (command, "RH") == 0)
-    RotateToHome ();
-  else if (strcmp (command, "RL") == 0)
-    RotateToLowerLimit ();
-  else if (strcmp (command, "RU") == 0)
-    RotateToUpperLimit ();
-  else if (strcmp (command, "RA") == 0 || strcmp (command, "RR") == 0)
-  {
-    // Rotate command must be at least 7 chars
-    if (strlen (packet) < 7)
-      strcpy (ecReturnString, "Bad command");
-    else
+    case COMMAND_CODE ('C','S'):
+      ClearStepStats ();
+      break;
+#endif
+
+#if defined(STEP_ENCODER)
+    case COMMAND_CODE ('S','E'):
     {
-      // Parse max velocity and target/numSteps
-      char velString[5];  // Velocity is 4-chars 0001..9999
-      strncpy (velString, packet+2, 4);
-      velString[4] = 0;
-      velocity = strtol (velString, NULL, 10);
-      targetOrNumSteps = strtol (packet+6, NULL, 10);  // Target position or number of steps is remainder of packet
+      // Following error limit and mode: SEsteps[,mode]  (SE0 = off)
+      char *next;
+      long  steps = strtol (packet+2, &next, 10);
+      long  mode  = (*next == ',') ? strtol (next+1, NULL, 10) : 0L;
 
-      if (strcmp (command, "RA") == 0)
-        RotateAbsolute (targetOrNumSteps, velocity);
+      if (next == packet+2)
+        strcpy (ecReturnString, "Missing following error");
       else
-        RotateRelative (targetOrNumSteps, velocity);
+        SetFollowingError (steps, (mode == 1L) ? ENCODER_CORRECT : ENCODER_STOP);
+      break;
+    }
+
+    case COMMAND_CODE ('G','E'):
+      snprintf (ecReturnString, EC_RETURN_LENGTH, "%ld,%ld", GetEncoderPosition (), GetFollowingError ());
+      break;
+#endif
+
+    case COMMAND_CODE ('S','C'):
+      // Save the configuration: SC, or SC1 to save the position too
+      if (!SaveConfig (packet[2] == '1'))
+        strcpy (ecReturnString, "Not saved");
+      break;
+
+    case COMMAND_CODE ('L','C'):
+      if (!LoadConfig ())
+        strcpy (ecReturnString, "Not loaded");
+      break;
+
+    case COMMAND_CODE ('T','P'):
+    {
+      // Compare point: TPposition,pin,action  (TP alone returns the number set)
+      char *next;
+      long  position = strtol (packet+2, &next, 10);
+      long  pin      = (*next == ',') ? strtol (next+1, &next, 10) : -1L;
+      long  action   = (*next == ',') ? strtol (next+1, &next, 10) : -1L;
+
+      if (packet[2] == 0)
+        ltoa (GetTriggerCount (), ecReturnString, 10);
+      else if (action < TRIGGER_HIGH || action > TRIGGER_PULSE)
+        strcpy (ecReturnString, "Bad trigger");
+      else if (pin < 0L || pin > 255L || !outputPin ((int) pin))
+        strcpy (ecReturnString, "Bad pin");
+      else if (!AddTrigger (position, (int) pin, (TriggerAction) action))
+        strcpy (ecReturnString, (State == MS_RUNNING) ? "Not while running" : "Triggers full");
+      break;
+    }
+
+    case COMMAND_CODE ('T','C'):
+      if (!ClearTriggers ())
+        strcpy (ecReturnString, "Not while running");
+      break;
+
+    case COMMAND_CODE ('T','M'):
+    {
+      // Telemetry subscription: TMperiod[,steps]  (TM0 = off)
+      char *next;
+      long  period = strtol (packet+2, &next, 10);
+      long  steps  = (*next == ',') ? strtol (next+1, NULL, 10) : 0L;
+
+      SetTelemetry (period, steps);
+      break;
     }
-  }
 
-  //=======================================================
-  //  Query Commands and Blink
-  //=======================================================
-  else if (strcmp (command, "GA") == 0)
-    ltoa (GetAbsolutePosition (), ecReturnString, 10);
-  else if (strcmp (command, "GR") == 0)
-    ltoa (GetRelativePosition (), ecReturnString, 10);
-  else if (strcmp (command, "GL") == 0)
-    ltoa(GetLowerLimit (), ecReturnString, 10);
-  else if (strcmp (command, "GU") == 0)
-    ltoa (GetUpperLimit (), ecReturnString, 10);
-  else if (strcmp (command, "GT") == 0)
-    ltoa (GetRemainingTime (), ecReturnString, 10);
-  else if (strcmp (command, "GV") == 0)
-    return GetVersion();
-  else if (strcmp (command, "BL") == 0)
-  {
-    // Parse pin number: BLpin
-    int pin = atoi (packet+2);
-    BlinkLED (pin);
+    case COMMAND_CODE ('B','L'):
+      // Parse pin number: BLpin
+      if (!BlinkLED (atoi (packet+2)))
+        strcpy (ecReturnString, "Bad pin");
+      break;
+
+    //=======================================================
+    //  User Commands
+    //=======================================================
+    default:
+      if (!executeUserCommand (packet))
+        strcpy (ecReturnString, "Unknown command");
+      break;
   }
-  else
-    strcpy (ecReturnString, "Unknown command");
 
   return ecReturnString;
 }
+
+//=== parseRotate =========================================
+
+bool StepperMotor::parseRotate (const char *packet, long *velocity, long *targetOrNumSteps)
+{
+  // Rotate command must be at least 7 chars: ccvvvvs...
+  // or any velocity followed by a comma: ccv...,s...
+  char         velString[5];  // Velocity is 4-chars 0001..9999
+  char        *end;
+  const char  *comma = strchr (packet+2, ',');
+
+  if (comma != NULL)
+  {
+    *velocity = strtol (packet+2, &end, 10);
+    if (end != comma || end == packet+2)
+      return false;
+
+    *targetOrNumSteps = strtol (comma+1, &end, 10);
+    return (end != comma+1);
+  }
+
+  if (strlen (packet) < 7)
+    return false;
+
+  strncpy (velString, packet+2, 4);
+  velString[4] = 0;
+  *velocity         = strtol (velString, NULL, 10);
+  *targetOrNumSteps = strtol (packet+6, NULL, 10);  // Target position or number of steps is remainder of packet
+
+  return true;
+}
+
+//=== RegisterCommand =====================================
+
+// Every code handled by executeSingle(), keep in step with its switch
+static const uint16_t BuiltInCommands[] =
+{
+  COMMAND_CODE ('E','S'), COMMAND_CODE ('E','N'), COMMAND_CODE ('D','I'), COMMAND_CODE ('F','H'),
+  COMMAND_CODE ('S','H'), COMMAND_CODE ('S','L'), COMMAND_CODE ('S','U'), COMMAND_CODE ('S','A'),
+  COMMAND_CODE ('S','P'), COMMAND_CODE ('S','F'), COMMAND_CODE ('S','R'), COMMAND_CODE ('R','H'),
+  COMMAND_CODE ('R','L'), COMMAND_CODE ('R','U'), COMMAND_CODE ('R','A'), COMMAND_CODE ('R','R'),
+  COMMAND_CODE ('Q','A'), COMMAND_CODE ('Q','R'), COMMAND_CODE ('S','V'), COMMAND_CODE ('Q','D'),
+  COMMAND_CODE ('Q','C'), COMMAND_CODE ('S','Q'), COMMAND_CODE ('G','A'), COMMAND_CODE ('G','R'),
+  COMMAND_CODE ('G','L'), COMMAND_CODE ('G','U'), COMMAND_CODE ('G','T'), COMMAND_CODE ('G','D'),
+  COMMAND_CODE ('G','M'), COMMAND_CODE ('G','V'),
+#if defined(STEP_STATS)
+  COMMAND_CODE ('G','S'), COMMAND_CODE ('C','S'),
+#endif
+#if defined(STEP_ENCODER)
+  COMMAND_CODE ('S','E'), COMMAND_CODE ('G','E'),
+#endif
+  COMMAND_CODE ('S','C'), COMMAND_CODE ('L','C'), COMMAND_CODE ('T','P'), COMMAND_CODE ('T','C'),
+  COMMAND_CODE ('T','M'), COMMAND_CODE ('B','L')
+};
+
+bool StepperMotor::RegisterCommand (const char *name, CommandHandler handler)
+{
+  uint16_t code;
+
+  if (NumUserCommands >= MAX_USER_COMMANDS || name[0] == 0 || name[1] == 0 || handler == NULL)
+    return false;
+
+  // Built-in commands are matched first and a second handler would never run, so both are refused
+  code = COMMAND_CODE (name[0], name[1]);
+  for (unsigned int i=0; i<sizeof (BuiltInCommands) / sizeof (BuiltInCommands[0]); i++)
+    if (BuiltInCommands[i] == code)
+      return false;
+
+  for (int i=0; i<NumUserCommands; i++)
+    if (UserCommands[i].Code == code)
+      return false;
+
+  UserCommands[NumUserCommands].Code    = code;
+  UserCommands[NumUserCommands].Handler = handler;
+  NumUserCommands++;
+
+  return true;
+}
+
+//=== executeUserCommand ==================================
+
+bool StepperMotor::executeUserCommand (const char *packet)
+{
+  uint16_t code = COMMAND_CODE (packet[0], packet[1]);
+
+  for (int i=0; i<NumUserCommands; i++)
+  {
+    if (UserCommands[i].Code == code)
+    {
+      UserCommands[i].Handler (this, packet, ecReturnString);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+//=========================================================
+//  ExecuteBinary
+//=========================================================
+
+const uint8_t * StepperMotor::ExecuteBinary (const uint8_t *frame, int frameLength, int *responseLength)
+{
+#if defined(STEP_STATS)
+  unsigned long start = micros();
+#endif
+
+  const uint8_t *response = executeFrame (frame, frameLength, responseLength);
+
+#if defined(STEP_STATS)
+  recordCommand (start);
+#endif
+
+  return response;
+}
+
+//=== executeFrame ========================================
+
+const uint8_t * StepperMotor::executeFrame (const uint8_t *frame, int frameLength, int *responseLength)
+{
+  uint8_t        opcode, length;
+  const uint8_t  *payload;
+  long           value0, value1, value2;
+  long           values[5];
+
+  // Check framing and CRC
+  if (frameLength < BIN_HEADER_LENGTH + 1 || frame[0] != BIN_SYNC)
+    return binaryError (BIN_ERROR_FRAME, responseLength);
+
+  opcode  = frame[1];
+  length  = frame[2];
+  payload = frame + BIN_HEADER_LENGTH;
+
+  if (length > BIN_MAX_PAYLOAD || frameLength != BIN_HEADER_LENGTH + length + 1)
+    return binaryError (BIN_ERROR_FRAME, responseLength);
+
+  if (crc8 (frame + 1, length + 2) != frame[BIN_HEADER_LENGTH + length])
+    return binaryError (BIN_ERROR_CRC, responseLength);
+
+  // Little-endian int32 parameters
+  value0 = (length >= 4)  ? getInt32 (payload)     : 0L;
+  value1 = (length >= 8)  ? getInt32 (payload + 4) : 0L;
+  value2 = (length >= 12) ? getInt32 (payload + 8) : 0L;
+
+  switch (opcode)
+  {
+    //=== E-Stop is first for quick processing ===
+    case BIN_ESTOP            : EStop ();                                                   break;
+
+    //=== Enable / Disable / Home / Limits / Ramp ===
+    case BIN_ENABLE           : Enable ();
+                                if (State != MS_ENABLED) return binaryError (BIN_ERROR_TIMER, responseLength);
+                                break;
+    case BIN_DISABLE          : Disable ();                                                 break;
+    case BIN_FIND_HOME        : FindHome ();                                                break;
+    case BIN_SET_HOME         : SetHomePosition ();                                         break;
+    case BIN_SET_LOWER_LIMIT  : if (length < 4) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                SetLowerLimit (value0);                                     break;
+    case BIN_SET_UPPER_LIMIT  : if (length < 4) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                SetUpperLimit (value0);                                     break;
+    case BIN_SET_RAMP         : if (length < 4) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                SetRamp ((int) value0);                                     break;
+    case BIN_SET_HOMING_SPEED : if (length < 8) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                SetHomingSpeed (value0, value1);                            break;
+    case BIN_SET_PROFILE      : if (length < 8) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                SetProfile ((MotionProfile) value0, value1);                break;
+    case BIN_SET_ACCELERATION : if (length < 4) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                SetAcceleration (value0);                                   break;
+
+    //=== Rotate: velocity, target/steps ===
+    case BIN_ROTATE_ABSOLUTE  : if (length < 8) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                if (value0 < 1L) return binaryError (BIN_ERROR_VELOCITY, responseLength);
+                                RotateAbsolute (value1, value0);                            break;
+    case BIN_ROTATE_RELATIVE  : if (length < 8) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                if (value0 < 1L) return binaryError (BIN_ERROR_VELOCITY, responseLength);
+                                RotateRelative (value1, value0);                            break;
+    case BIN_ROTATE_HOME      : RotateToHome ();                                            break;
+    case BIN_ROTATE_LOWER     : RotateToLowerLimit ();                                      break;
+    case BIN_ROTATE_UPPER     : RotateToUpperLimit ();                                      break;
+
+    //=== Motion Queue ===
+    case BIN_QUEUE_ABSOLUTE   : if (length < 8) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                if (value0 < 1L) return binaryError (BIN_ERROR_VELOCITY, responseLength);
+                                if (!QueueAbsolute (value1, value0))
+                                  return binaryError ((GetQueueDepth () < MOTION_QUEUE_SIZE - 1) ? BIN_ERROR_NOT_READY : BIN_ERROR_QUEUE_FULL, responseLength);
+                                break;
+    case BIN_QUEUE_RELATIVE   : if (length < 8) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                if (value0 < 1L) return binaryError (BIN_ERROR_VELOCITY, responseLength);
+                                if (!QueueRelative (value1, value0))
+                                  return binaryError ((GetQueueDepth () < MOTION_QUEUE_SIZE - 1) ? BIN_ERROR_NOT_READY : BIN_ERROR_QUEUE_FULL, responseLength);
+                                break;
+    case BIN_QUEUE_CLEAR      : ClearQueue ();                                              break;
+    case BIN_STREAM_SEGMENT   : if (length < 12) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                if (!QueueSegment (value0, value1, value2))
+                                  return binaryError (BIN_ERROR_QUEUE_FULL, responseLength);
+                                values[0] = GetStreamFree ();
+                                return binaryResponse (opcode, values, 1, responseLength);
+    case BIN_SET_VELOCITY     : if (length < 4) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                if (!SetVelocity (value0))
+                                  return binaryError (BIN_ERROR_NOT_RUNNING, responseLength);
+                                break;
+    case BIN_OVERRIDE_VELOCITY: if (length < 4) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                if (!OverrideVelocity ((int) value0))
+                                  return binaryError (BIN_ERROR_NOT_RUNNING, responseLength);
+                                break;
+    case BIN_SET_TELEMETRY    : if (length < 8) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                SetTelemetry (value0, value1);                              break;
+    case BIN_SAVE_CONFIG      : if (length < 4) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                if (!SaveConfig (value0 != 0L))
+                                  return binaryError (BIN_ERROR_CONFIG, responseLength);
+                                break;
+    case BIN_LOAD_CONFIG      : if (!LoadConfig ())
+                                  return binaryError (BIN_ERROR_CONFIG, responseLength);
+                                break;
+    case BIN_ADD_TRIGGER      : if (length < 12) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                if (value1 < 0L || value1 > 255L || !outputPin ((int) value1))
+                                  return binaryError (BIN_ERROR_PIN, responseLength);
+                                if (value2 < TRIGGER_HIGH || value2 > TRIGGER_PULSE || !AddTrigger (value0, (int) value1, (TriggerAction) value2))
+                                  return binaryError (BIN_ERROR_TRIGGER, responseLength);
+                                break;
+    case BIN_CLEAR_TRIGGERS   : if (!ClearTriggers ())
+                                  return binaryError (BIN_ERROR_TRIGGER, responseLength);
+                                break;
+    case BIN_STREAM_FREE      : values[0] = GetStreamFree ();        return binaryResponse (opcode, values, 1, responseLength);
+
+    //=== Queries ===
+    case BIN_GET_ABSOLUTE     : values[0] = GetAbsolutePosition ();  return binaryResponse (opcode, values, 1, responseLength);
+    case BIN_GET_RELATIVE     : values[0] = GetRelativePosition ();  return binaryResponse (opcode, values, 1, responseLength);
+    case BIN_GET_LOWER_LIMIT  : values[0] = GetLowerLimit ();        return binaryResponse (opcode, values, 1, responseLength);
+    case BIN_GET_UPPER_LIMIT  : values[0] = GetUpperLimit ();        return binaryResponse (opcode, values, 1, responseLength);
+    case BIN_GET_TIME         : values[0] = GetRemainingTime ();     return binaryResponse (opcode, values, 1, responseLength);
+    case BIN_QUEUE_DEPTH      : values[0] = GetQueueDepth ();        return binaryResponse (opcode, values, 1, responseLength);
+    case BIN_GET_MAX_RATE     : values[0] = GetMaxStepRate ();       return binaryResponse (opcode, values, 1, responseLength);
+    case BIN_PREDICT_TIME     : if (length < 8) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                if (value0 < 1L) return binaryError (BIN_ERROR_VELOCITY, responseLength);
+                                values[0] = PredictMoveTime (value1, value0);
+                                return binaryResponse (opcode, values, 1, responseLength);
+#if defined(STEP_STATS)
+    case BIN_GET_STATS        : values[0] = Stats.Steps;
+                                values[1] = Stats.MaxLate;
+                                values[2] = Stats.Missed;
+                                values[3] = Stats.MaxRunGap;
+                                values[4] = Stats.MaxCommand;
+                                return binaryResponse (opcode, values, 5, responseLength);
+    case BIN_CLEAR_STATS      : ClearStepStats ();                                          break;
+#endif
+#if defined(STEP_ENCODER)
+    case BIN_SET_FOLLOWING_ERROR: if (length < 8) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                SetFollowingError (value0, (EncoderMode) value1);           break;
+    case BIN_GET_ENCODER      : values[0] = GetEncoderPosition ();
+                                values[1] = GetFollowingError ();
+                                return binaryResponse (opcode, values, 2, responseLength);
+#endif
+    case BIN_GET_STATUS       : values[0] = GetAbsolutePosition ();
+                                values[1] = GetRemainingTime ();
+                                values[2] = GetState ();
+                                values[3] = GetQueueDepth ();
+                                return binaryResponse (opcode, values, 4, responseLength);
+
+    case BIN_GET_VERSION:
+      // Version string is the payload
+      length = strlen (version);
+      binReturnFrame[0] = BIN_SYNC;
+      binReturnFrame[1] = opcode;
+      binReturnFrame[2] = length;
+      memcpy (binReturnFrame + BIN_HEADER_LENGTH, version, length);
+      binReturnFrame[BIN_HEADER_LENGTH + length] = crc8 (binReturnFrame + 1, length + 2);
+      *responseLength = BIN_HEADER_LENGTH + length + 1;
+      return binReturnFrame;
+
+    case BIN_BLINK            : if (length < 4) return binaryError (BIN_ERROR_LENGTH, responseLength);
+                                if (value0 < 0L || value0 > 255L || !BlinkLED ((int) value0))
+                                  return binaryError (BIN_ERROR_PIN, responseLength);
+                                break;
+
+    default:
+      return binaryError (BIN_ERROR_OPCODE, responseLength);
+  }
+
+  // Acknowledge commands with an empty payload
+  return binaryResponse (opcode, NULL, 0, responseLength);
+}
+
+//=== binaryResponse ======================================
+
+const uint8_t * StepperMotor::binaryResponse (uint8_t opcode, const long *values, int numValues, int *responseLength)
+{
+  *responseLength = buildFrame (binReturnFrame, opcode, values, numValues);
+
+  return binReturnFrame;
+}
+
+//=== buildFrame ==========================================
+
+int StepperMotor::buildFrame (uint8_t *frame, uint8_t opcode, const long *values, int numValues)
+{
+  // Returns the frame length
+  int length = 4 * numValues;
+
+  frame[0] = BIN_SYNC;
+  frame[1] = opcode;
+  frame[2] = length;
+
+  for (int i=0; i<numValues; i++)
+    putInt32 (frame + BIN_HEADER_LENGTH + 4 * i, values[i]);
+
+  frame[BIN_HEADER_LENGTH + length] = crc8 (frame + 1, length + 2);
+
+  return BIN_HEADER_LENGTH + length + 1;
+}
+
+//=== binaryError =========================================
+
+const uint8_t * StepperMotor::binaryError (long errorCode, int *responseLength)
+{
+  return binaryResponse (BIN_ERROR, &errorCode, 1, responseLength);
+}
+
+//=== crc8 ================================================
+
+uint8_t StepperMotor::crc8 (const uint8_t *data, int length)
+{
+  // CRC-8 (polynomial 0x07, initial value 0)
+  uint8_t crc = 0;
+
+  while (length-- > 0)
+  {
+    crc ^= *data++;
+    for (int bit=0; bit<8; bit++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  }
+
+  return crc;
+}
+
+//=== getInt32 / putInt32 =================================
+
+long StepperMotor::getInt32 (const uint8_t *bytes)
+{
+  // Sign-extended through int32_t, long is 64 bits on the native env
+  return (long) (int32_t) ((uint32_t) bytes[0] | ((uint32_t) bytes[1] << 8) | ((uint32_t) bytes[2] << 16) | ((uint32_t) bytes[3] << 24));
+}
+
+void StepperMotor::putInt32 (uint8_t *bytes, long value)
+{
+  bytes[0] = value;
+  bytes[1] = value >> 8;
+  bytes[2] = value >> 16;
+  bytes[3] = value >> 24;
+}
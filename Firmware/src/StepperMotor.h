@@ -90,6 +90,27 @@
 //  Once a ramp value is set, all rotate commands will use that ramp value.
 //  The default ramp value at start-up is 5.
 //
+//  The ramp factor adds a fixed velocity increment for every step, so the acceleration in time
+//  grows with velocity.  SetAcceleration() or "SA" sets a true constant acceleration in steps/sec²
+//  instead: velocity grows as √(2·a·steps), the stopping distance is v²/2a and a rotation takes the
+//  minimum time the acceleration allows.  SetRamp() goes back to the ramp factor.
+//
+//  For heavy loads that resonate at the sharp corners of the trapezoid, SetProfile(PROFILE_SCURVE) or
+//  "SP1" selects a jerk-limited (7-segment) S-curve instead.  Acceleration rises and falls at the max
+//  jerk (steps/sec³, "SP1jjjj..." or SetProfile's maxJerk) up to the SetAcceleration() value, or
+//  to the acceleration the trapezoid ramp averages if only a ramp factor is set:
+//
+//                                        .─────────────────.          <── full velocity
+//                                      /                     \.
+//                                     │                       │
+//                                    /                         \.
+//                                 ──'───────────────────────────'──
+//
+//  The S-curve is computed once per rotation into the same step interval table the trapezoid uses,
+//  so the cost of each step is unchanged.  A rotation that is too short to reach full velocity
+//  lowers its peak velocity so that the whole S-curve still fits.  Queued moves do not blend when
+//  the S-curve is selected; each one stops at its target.
+//
 //─────────────────────────────────────────────────────────────────────────────────────────────────
 //
 //  All control can be performed either by directly calling methods or by executing a command
@@ -104,12 +125,125 @@
 //    RANGE_ERROR_UPPER   - Reached upper range limit
 //    LIMIT_SWITCH_LOWER  - Lower limit switch triggered
 //    LIMIT_SWITCH_UPPER  - Upper limit switch triggered
+//    HOME_COMPLETE       - FindHome is complete
+//    FOLLOWING_ERROR     - The encoder disagrees with the step position (STEP_ENCODER builds)
+//    STEP_ERROR          - Steps could not be sent, the motor stopped (STEPPER_RMT builds)
+//    MOTION_ABORTED      - A motor of a StepperGroup move was Disabled or E-Stopped
+//
+//  FindHome() (or "FH") does not block.  It seeks the lower limit switch at the fast homing speed,
+//  backs off until the switch releases, re-approaches slowly for a repeatable position and backs off
+//  again.  Run() then returns HOME_COMPLETE.  An E-Stop is still processed at any time while homing.
+//
+//  By default, Run() generates every step pulse in software each time it is called.  On the ESP32,
+//  build with -D STEPPER_RMT (see the esp32-s3-rmt env in platformio.ini) to have Run() hand short
+//  segments of the velocity ramp to the RMT peripheral instead.  Pulses are then timed by hardware
+//  and the CPU is free between segments.  In this mode:
+//    - Positions are counted as segments are queued, so they may lead the motor by up to
+//      RMT_QUEUED_SEGMENTS segments (about RMT_SEGMENT_MICROS each).
+//    - Limit switches are checked between segments; the queued segments are allowed to finish
+//      so the reported position stays exact.
+//    - A new Rotate command waits for the queued segments before changing direction.
+//
+//  Build with -D STEPPER_TIMER (see the esp32-s3-timer env in platformio.ini) to have a hardware
+//  timer interrupt generate each step instead (gptimer on the ESP32, Timer1 on AVR).  Stepping then
+//  continues while loop() is busy, and Run() only reports the RunReturn events queued by the
+//  interrupt.  Run() must still be called to receive RUN_COMPLETE and limit events.
+//  Each motor takes its own timer: on AVR only one StepperMotor gets Timer1, and the ESP32-S3 has
+//  four gptimers.  A motor constructed without one is refused: Enable() leaves it Disabled ("EN"
+//  returns "No step timer", BIN_ENABLE returns BIN_ERROR_TIMER), so it never steps.  Motors added
+//  to a StepperScheduler share its one timer instead (see StepperScheduler.h).
+//
+//  Limit switches are read after every step.  Build with -D LIMIT_INTERRUPTS to attach interrupts
+//  to the limit switch pins instead (GPIO interrupts on the ESP32, pin change interrupts on AVR).
+//  The interrupt latches the switch, and the stepping loop only checks that flag.  The motor is
+//  stopped on the next Run() pass (on the spot with STEPPER_TIMER) instead of after the next step.
+//  A switch that is already pressed when a rotation starts toward it is latched at the start.
+//  Polled or not, only the switch in the direction of travel stops a motor, so a motor resting on
+//  a switch can drive off it.  While homing, the switches are still read on every step.  On AVR,
+//  the PCINT vectors are used by this class.
+//
+//  In software stepping, each step pulse normally holds Run() for PULSE_WIDTH microseconds.
+//  Build with -D NONBLOCKING_PULSE to have Run() raise the Step pin and return, then lower it on
+//  the first pass after PULSE_WIDTH microseconds.  The pin is also held low for PULSE_WIDTH before
+//  the next pulse.  A direction change during a pulse is deferred: the Direction pin is set once the
+//  pulse and its low time have ended, and the next pulse waits another 10-microseconds for it.
+//
+//  Build with -D FAST_GPIO (set in the esp32-s3 envs) to toggle the Step, Direction and Enable pins and
+//  read the limit switches with direct register access instead of digitalWrite()/digitalRead().
+//  See FastGPIO.h.
+//
+//  Outputs that must switch at exact positions (camera or dispenser triggers) can be fired by the
+//  step engine itself instead of a host polling "GA".  AddTrigger() or "TP" adds a compare point
+//  of (position, pin, action): the pin is set HIGH, set LOW or pulsed HIGH for TRIGGER_PULSE_MICROS
+//  on the step that reaches the position, in either direction.  Up to TRIGGER_POINTS points are
+//  kept sorted by position, and the step path only looks at the points next to the current position,
+//  so each step costs the same however many there are.  Pulses are ended by Run().
+//    - Software and timer stepping (and a StepperGroup) fire the output right after the step pulse.
+//    - With STEPPER_RMT a segment ends at each compare point and the output fires when that
+//      segment has been sent, so it still comes within one step interval of the step.
+//  Compare points are only added or cleared while the motor is at rest.
+//
+//  AbsolutePosition is only a count of the steps sent, so a stall under load goes unnoticed until
+//  the next FindHome.  Build with -D STEP_ENCODER (the esp32-s3-encoder env) and call AttachEncoder()
+//  to count a quadrature encoder on the motor shaft with a PCNT unit of the ESP32.  The edges are
+//  counted by the hardware, so they cost no CPU time.  Every ENCODER_CHECK_MICROS while running, and
+//  at the end of each rotation, Run() compares the encoder (scaled to steps) with the step position.
+//  If they differ by more than the limit set with SetFollowingError() or "SE", the motor stops and
+//  takes the encoder's position as its own, so GA reports where it really is.  Then either:
+//    - ENCODER_STOP     Run() returns FOLLOWING_ERROR and the queued moves are cancelled.
+//    - ENCODER_CORRECT  the rotation restarts from a stand-still to finish at its target, and the
+//                       queued moves still follow it.  Run() returns FOLLOWING_ERROR only after
+//                       ENCODER_RETRIES corrections of one rotation, or at once for a stream.
+//  The limit must allow for the encoder's resolution and for load lag.  With STEPPER_RMT it must
+//  also cover the RMT lead: positions are counted as segments are queued, which is up to
+//  RMT_QUEUED_SEGMENTS * RMT_SEGMENT_MICROS of motion ahead of the shaft.  The encoder is set to the
+//  step position by SetHomePosition() and by a position restored with LoadConfig().  Motors stepped
+//  by a StepperGroup are not checked.
 //
 //  Your app should normally wait until the motor is finished with a previous Rotate method/command
 //  before issuing a new Rotate command.  If a Rotate command is called while the motor is already
 //  running, then the current rotation is interrupted and the new Rotate command is executed from
 //  the motor's current position.
 //
+//  To chain moves without stopping, queue them instead with QueueAbsolute()/QueueRelative() or the
+//  "QA"/"QR" commands.  Up to MOTION_QUEUE_SIZE-1 moves wait behind the current rotation.  Each time
+//  a move is queued, the planner looks ahead over the queue and sets the velocity at which each move
+//  passes into the next, so consecutive moves in the same direction blend without stopping and the
+//  last move still ramps down to a stand-still at its target.  A change of direction always stops.
+//  The ramp table of the next queued move is built ahead of time, when it is queued or on the Run()
+//  pass after the previous junction, into a spare table, so starting the move only swaps the two.
+//  (In STEPPER_TIMER builds the interrupt never builds a table: if Run() wasn't called during a
+//  whole move, the motor waits at its target until the next Run() pass builds the next one.)
+//  Run() returns RUN_COMPLETE only when the last queued move is complete.  A range or limit error,
+//  an E-Stop or a direct Rotate command cancels the queued moves.
+//
+//  To change the speed of a rotation while it runs, call SetVelocity() (steps/sec) or
+//  OverrideVelocity() (percent of the commanded velocity), or send "SV".  The motor ramps from its
+//  current velocity to the new one without stopping, and the ramp down is re-planned so the rotation
+//  still stops exactly at its target (or blends into the next queued move).  The change only applies
+//  to the current rotation: queued moves keep their own velocities.
+//
+//  A host that computes its own trajectory can stream it instead, as compact segments of
+//  (interval, count, add) with QueueSegment() or the "SQ" command.  A segment takes |count| steps
+//  (negative for counter-clockwise): the first 'interval' ticks after the step before it, then each
+//  interval 'add' ticks longer (or shorter) than the last.  Ticks are 1/16 microseconds.  Up to
+//  STREAM_BUFFER_SIZE-1 segments wait in a ring buffer and Run() takes them back to back with no
+//  gap.  The first segment starts the stream at once, and the stream ends with RUN_COMPLETE when
+//  the ring runs dry, so keep it topped up: "SQ" returns the number of free slots.  Range
+//  limits and limit switches are checked as for any rotation.  A Rotate command or E-Stop ends it.
+//
+//  The limits, ramp or acceleration, profile and homing speeds are lost at a power cycle unless they
+//  are saved with SaveConfig() or "SC".  LoadConfig() or "LC" (main.cpp calls it at start-up) puts
+//  them back.  SaveConfig(true) or "SC1" also saves the position of a homed motor at rest, and the
+//  next LoadConfig() of an Enabled motor restores it as Homed, so a trusted setup can skip FindHome.
+//  A saved position is used only once.  LoadConfig() consumes it as it restores it; otherwise the
+//  first move or homing clears it, since the motor then leaves that position.  The clear is one
+//  storage write, made in task context as that move starts and never retried, and a motor with no
+//  saved position never touches storage as it moves.  Save it again when the machine is parked.
+//  Records are kept in NVS on the ESP32 and in EEPROM on AVR (see ConfigStore.h), one slot per
+//  motor (SetConfigSlot(), default 0), and an unchanged record is never rewritten.  Storage writes
+//  block for milliseconds, so neither call is accepted while the motor is running.
+//
 //─────────────────────────────────────────────────────────────────────────────────────────────────
 //
 //  This class also has a method for operating the stepper motor by executing String commands.
@@ -118,10 +252,13 @@
 //    EN    = ENABLE                - Enables the motor driver (energizes the motor) and also sets the HOME position
 //    DI    = DISABLE               - Disables the motor driver (releases the motor)
 //    FH    = FIND HOME             - Seeks counter-clockwise until lower limit switch is triggered, backs off a bit and sets HOME position
+//    SF... = SET FIND HOME SPEEDS  - Sets the fast seek and slow re-approach speeds for FIND HOME (SFvvvvssss, same format as RA)
 //    SH    = SET HOME POSITION     - Sets the current position of the motor as its HOME position (Sets Absolute position to zero)
 //    SL... = SET LOWER LIMIT       - Sets the LOWER LIMIT (minimum Absolute Position) of the motor's range
 //    SU... = SET UPPER LIMIT       - Sets the UPPER LIMIT (maximum Absolute Position) of the motor's range
 //    SRr   = SET RAMP              - Sets the trapezoidal velocity RAMP (up/down) for smooth motor start and stop
+//    SA... = SET ACCELERATION      - Sets a true constant acceleration in steps/sec² for the ramps (SAaaaa...), SR goes back to the ramp factor
+//    SPp.. = SET PROFILE           - Selects the trapezoid (SP0) or S-curve (SP1) velocity profile, optionally with max jerk (SP1jjjj...)
 //    RA... = ROTATE ABSOLUTE       - Rotates motor to an Absolute target position from its HOME position
 //    RR... = ROTATE RELATIVE       - Rotates motor clockwise or counter-clockwise any number of steps from its current position
 //    RH    = ROTATE HOME           - Rotates motor to its HOME position
@@ -134,10 +271,46 @@
 //    GU    = GET UPPER LIMIT       - Returns the motor's Absolute UPPER LIMIT position
 //    GT    = GET TIME              - Returns the remaining time in ms for motion to complete
 //    GV    = GET VERSION           - Returns this firmware's current version
-//    BLp   = BLINK LED             - Blink the specified LED to indicate identification
+//    GM    = GET MAX RATE          - Returns the highest step rate (steps/sec) of this build's backend
+//    GD... = GET DURATION          - Returns the time in ms a move would take from a stand-still (same format as RR)
+//    QA... = QUEUE ABSOLUTE        - Queues a move to an Absolute target position (same format as RA)
+//    QR... = QUEUE RELATIVE        - Queues a move of a number of steps from the end of the previous move (same format as RR)
+//    QD    = QUEUE DEPTH           - Returns the number of moves waiting in the queue
+//    QC    = QUEUE CLEAR           - Cancels the queued moves (the current rotation still completes)
+//    SV... = SET VELOCITY          - Changes the velocity of the current rotation without stopping (SVvvvv steps/sec, or SVppp% of its commanded velocity)
+//    SQ... = STREAM SEGMENT        - Streams a segment (SQinterval,count,add), returns the free slots ("SQ" alone only returns them)
+//    SCp   = SAVE CONFIG           - Saves the limits, ramp, profile and homing speeds (SC1 = also the position of a homed motor at rest)
+//    LC    = LOAD CONFIG           - Loads the saved configuration, and restores a saved position once
+//    SE... = SET FOLLOWING ERROR   - Sets the steps the encoder may differ by (SEssss[,m], m 0 = stop, 1 = correct, SE0 = off) (STEP_ENCODER)
+//    GE    = GET ENCODER           - Returns "encoder position,following error" in steps (STEP_ENCODER)
+//    TP... = TRIGGER POINT         - Adds a compare point (TPposition,pin,action, action 0 = high, 1 = low, 2 = pulse), "TP" alone returns the number set
+//    TC    = TRIGGERS CLEAR        - Removes all compare points
+//    TM... = TELEMETRY             - Pushes a telemetry frame every p ms and/or s steps and on state changes (TMp[,s], TM0 = off)
+//    BLp   = BLINK LED             - Blink the specified LED to indicate identification (1 second, advanced by Run())
+//
+//    No command waits on a timer or a pin: anything timed (a blink, a reversal behind queued RMT pulses)
+//    is a state that Run() advances, as is a NONBLOCKING_PULSE direction change that waits for the end
+//    of a step pulse.  Commands still take CPU time of their own, a ramp table build for a rotation or
+//    queued move most of all.  That build is the bound on a command: at most RAMP_TABLE_SIZE + 1
+//    entries (two S-curve solves each) however long the move, about 25us for a 2048-entry S-curve on
+//    an x86-64 host and 75us at worst (test_benchmark_command_worst).  SC and LC touch flash/EEPROM
+//    and are refused while running.  With STEP_STATS, "GSC" returns the longest command measured on
+//    the target.
+//
+//    Several commands can be sent in one packet, separated by ';' ("EN;SL-100;SU5000;SR3;GA").  They are
+//    executed in order and answered with one string of their responses, also separated by ';', with an
+//    empty field for each command that returns nothing (";;;;1234").  A command only runs if its response
+//    still fits in the EC_BATCH_LENGTH buffer; otherwise the batch ends there with a "Batch too long"
+//    field and the rest of the commands are not executed.
+//
+//    Your own 2-char commands can be added with RegisterCommand() without editing this class.
+//    The handler receives the whole packet and may write up to EC_RETURN_LENGTH-1 chars to the
+//    response string.  Built-in commands can't be replaced: RegisterCommand() returns false for a
+//    built-in code, or for a code that is already registered.
 //
 //    where r is the velocity ramp rate (0-9)
-//          p is the pin number of the built-in LED
+//          p is the pin number of the built-in LED (BL) or the velocity profile (SP, 0 = trapezoid, 1 = S-curve)
+//          jjjj... is the S-curve max jerk in steps per second³
 //
 //    ───────────────────────────────────────────────────
 //     Command String Format: (no spaces between fields)
@@ -170,6 +343,8 @@
 //      Velocity (steps per sec) ────┤        │
 //        [4-digits] 1___ - 9999     │        │
 //        Right-padded with spaces   │        │
+//        (or any number and a comma,│        │
+//         up to GetMaxStepRate())   │        │
 //                                   │        │
 //      Ramp Slope ──────────────────┘        │
 //        [1-digit] 0 - 9                     │
@@ -191,11 +366,32 @@
 //     "SH"            - SET HOME               - Set the current position of the motor as its HOME position (which is zero)
 //     "RA500 2000"    - ROTATE ABSOLUTE        - Rotate the motor at 500 steps per second, to Absolute position of +2000 steps clockwise from HOME
 //     "RR3210-12000"  - ROTATE RELATIVE        - Rotate the motor at 3210 steps per second, -12000 steps counter-clockwise from its current position
+//     "RR64000,-3200" - ROTATE RELATIVE        - Rotate the motor at 64000 steps per second, -3200 steps counter-clockwise (velocities over 9999)
 //     "RH"            - ROTATE HOME            - Rotate motor back to its HOME position (0)
 //     "RL"            - ROTATE to LOWER LIMIT  - Rotate motor to its LOWER LIMIT position
 //     "ES"            - EMERGENCY STOP         - Immediately stop the motor and cancel rotation command
 //     "GR"            - GET RELATIVE POSITION  - Get the current relative step position of the motor
 //
+//  ───────────────────────────────────────────────────
+//   Binary Protocol
+//  ───────────────────────────────────────────────────
+//  ExecuteBinary() accepts the same commands as compact binary frames.  A binary frame starts with
+//  the BIN_SYNC byte (0xA5), which is never the first byte of an ASCII command, so a host can mix
+//  both protocols on one link.  (main.cpp detects the protocol from the first byte of each packet.)
+//
+//      ┌──────┬────────┬────────┬──────────────────────┬──────┐
+//      │ 0xA5 │ opcode │ length │ payload (length)     │ CRC8 │
+//      └──────┴────────┴────────┴──────────────────────┴──────┘
+//
+//    - Payload values are little-endian int32's.  Rotate/Queue: velocity, then target or steps.
+//    - CRC8 (polynomial 0x07) covers opcode, length and payload.
+//    - Every frame gets a response frame with the same opcode: an empty payload for commands,
+//      the value(s) for queries, or opcode BIN_ERROR (0xFF) with an int32 BinaryError code.
+//    - BIN_GET_STATUS returns position, remaining time, state and queue depth in one frame.
+//    - With a telemetry subscription ("TM" or BIN_SET_TELEMETRY), Run() also prepares unrequested
+//      BIN_TELEMETRY frames of position, velocity and state.  Your loop takes them with TakeTelemetry()
+//      and should drop any that don't fit in the transmit buffer, so sending never holds up Run().
+//
 //  This class may also be queried for position, range limits, remaining motion time and firmware version with the following commands:
 //
 //     GA = GET ABSOLUTE position - Returns the motor's current step position relative to its HOME position
@@ -203,8 +399,18 @@
 //     GL = GET LOWER LIMIT       - Returns the motor's Absolute LOWER LIMIT position
 //     GU = GET UPPER LIMIT       - Returns the motor's Absolute UPPER LIMIT position
 //     GT = GET TIME              - Returns the remaining time in ms for motion to complete
+//     GD = GET DURATION          - Returns the time in ms a move would take (GDvvvvssss, same format as RR)
 //     GV = GET VERSION           - Returns this firmware's current version
 //
+//  GT is computed from the profile phase (ramp up, cruise, ramp down) the motor is in, and also counts
+//  the queued moves.  It is closed-form for every profile, so it is exact for short triangle moves too.
+//
+//  Built with -D STEP_STATS (the esp32-s3-stats env), the step timing can be queried too:
+//     GS  = GET STATS            - Returns "steps,max late µs,missed deadlines,longest Run() gap µs"
+//     GSn = GET STATS BIN        - Returns the count of histogram bin n (0 = on time, n = 2^(n-1) .. 2^n-1 µs late)
+//     GSC = GET STATS COMMAND    - Returns the longest ExecuteCommand() or ExecuteBinary() call in µs
+//     CS  = CLEAR STATS          - Clears the step timing statistics
+//
 //  The returned result is a string with the following format:
 //     APs... = Absolute Position of motor is s steps from its HOME position
 //     RPs... = Relative Position of motor is s steps from its last targeted position
@@ -219,9 +425,183 @@
 #ifndef SMC_H
 #define SMC_H
 
-#define HOMING_SPEED      3000L
+#define HOMING_SPEED          3000L        // Fast seek to the lower limit switch, and RH/RL/RU (steps per second)
+#define HOMING_SLOW_SPEED     100L         // Back-off and slow re-approach (steps per second)
+#define HOMING_BACKOFF_STEPS  100L         // Steps to move clear of the switch before re-approaching
+#define HOMING_MAX_STEPS      1000000000L  // Seek distance limit
 #define PULSE_WIDTH       5     // 5-microseconds (check your driver's pulse width requirement)
 #define EC_RETURN_LENGTH  30
+#define EC_COMMAND_LENGTH 32    // Longest command in a batch
+
+// Batched commands ("EN;SL-100;GA") are answered with one string of up to EC_BATCH_LENGTH-1 chars
+#ifndef EC_BATCH_LENGTH
+  #if defined(ARDUINO_ARCH_AVR)
+    #define EC_BATCH_LENGTH  96
+  #else
+    #define EC_BATCH_LENGTH  192
+  #endif
+#endif
+
+#define MAX_USER_COMMANDS 8     // Commands that can be added with RegisterCommand()
+
+// A 2-char command packed into 16 bits for dispatch
+#define COMMAND_CODE(c1,c2)  ((uint16_t) (((uint8_t) (c1) << 8) | (uint8_t) (c2)))
+
+#define BIN_SYNC          0xA5  // First byte of a binary command frame
+#define BIN_HEADER_LENGTH 3     // Sync, opcode, payload length
+#define BIN_MAX_PAYLOAD   24    // Longest payload (the version string)
+#define BIN_MAX_FRAME     (BIN_HEADER_LENGTH + BIN_MAX_PAYLOAD + 1)
+
+#ifndef MOTION_QUEUE_SIZE
+  #define MOTION_QUEUE_SIZE  8  // Ring buffer size, holds MOTION_QUEUE_SIZE-1 queued moves
+#endif
+
+#ifndef STREAM_BUFFER_SIZE
+  #if defined(ARDUINO_ARCH_AVR)
+    #define STREAM_BUFFER_SIZE  8   // Ring buffer size, holds STREAM_BUFFER_SIZE-1 streamed segments
+  #else
+    #define STREAM_BUFFER_SIZE  32
+  #endif
+#endif
+
+#define STREAM_TICK_BITS      4   // Streamed intervals are in 1/16 microseconds
+#define STREAM_TICK_MASK      ((1UL << STREAM_TICK_BITS) - 1UL)
+
+// Step intervals for the velocity ramp are precomputed into a table of RAMP_TABLE_SIZE entries
+// when the velocity or ramp changes, so no division is done per step.  Ramps with more steps than
+// the table share each entry between neighbouring steps, and the build costs one division per entry
+// however long the ramp is.  test_benchmark_run prints the host cost of the per-step division
+// the table replaced; it has not been measured on a target.  Intervals are kept with
+// RAMP_FRACTION_BITS of fractional microseconds, and at full velocity the remainder of the division
+// is carried as well, so the commanded step rate holds exactly over long moves.  Both can be
+// overridden with build flags.
+// Step times are compared with a signed difference, so the schedule survives the micros() wrap.
+#ifndef RAMP_TABLE_SIZE
+  #if defined(ARDUINO_ARCH_AVR)
+    #define RAMP_TABLE_SIZE   64
+  #else
+    #define RAMP_TABLE_SIZE   2048
+  #endif
+#endif
+
+#ifndef RAMP_FRACTION_BITS
+  #define RAMP_FRACTION_BITS  4     // 1/16 microseconds (at most 11)
+#endif
+
+#define RAMP_FRACTION_MASK    ((1UL << RAMP_FRACTION_BITS) - 1UL)
+
+#include "FastGPIO.h"
+
+#if defined(STEPPER_RMT) && defined(STEPPER_TIMER)
+  #error "Select only one of STEPPER_RMT or STEPPER_TIMER"
+#endif
+
+#define SCURVE_JERK  1000000L  // Default S-curve max jerk (steps per second³)
+
+#if defined(LIMIT_INTERRUPTS) && defined(ARDUINO_ARCH_AVR)
+  #define MAX_LIMIT_MOTORS  4   // Motors that can share the pin change interrupts
+#endif
+
+#if defined(NONBLOCKING_PULSE) && (defined(STEPPER_RMT) || defined(STEPPER_TIMER))
+  #error "NONBLOCKING_PULSE is only for software stepping"
+#endif
+
+#if defined(STEP_STATS)
+  #ifndef STATS_BINS
+    #define STATS_BINS      16  // Log2 lateness bins, the last one counts everything later
+  #endif
+  #ifndef STATS_DEADLINE
+    #define STATS_DEADLINE  50  // A step later than this (micros) is a missed deadline
+  #endif
+
+struct StepStats
+{
+  unsigned long  Steps;                  // Steps timed
+  unsigned long  MaxLate;                // Latest step against NextStepMicros (micros)
+  unsigned long  Missed;                 // Steps later than STATS_DEADLINE
+  unsigned long  MaxRunGap;              // Longest time between Run() calls while running (micros)
+  unsigned long  MaxCommand;             // Longest ExecuteCommand() or ExecuteBinary() call (micros)
+  unsigned long  Histogram[STATS_BINS];  // Steps by lateness: bin 0 on time, bin n 2^(n-1) to 2^n - 1 late
+};
+#endif
+
+#if defined(STEPPER_TIMER)
+  #if defined(ARDUINO_ARCH_ESP32)
+    #include "driver/gptimer.h"
+  #endif
+
+  #define TIMER_EVENT_QUEUE  4  // RunReturn events the timer interrupt can queue for Run()
+#endif
+
+#if defined(STEPPER_RMT)
+  #if !defined(ARDUINO_ARCH_ESP32)
+    #error "STEPPER_RMT requires an ESP32 target"
+  #endif
+
+  #include <atomic>
+  #include "driver/rmt_tx.h"
+
+  #define RMT_RESOLUTION_HZ     1000000L  // 1-microsecond ticks
+  #define RMT_MAX_DURATION      32767L    // Longest duration of one symbol half (15 bits)
+  #define RMT_SEGMENT_MICROS    10000L    // Stop filling a segment after about 10ms of motion
+  #define RMT_SEGMENT_SYMBOLS   256       // Symbols per segment buffer (about 2.4ms of steps at 100k steps/sec)
+  #define RMT_MAX_STEP_SYMBOLS  17        // Symbols needed by the slowest step (1 step per second)
+  #define RMT_QUEUED_SEGMENTS   2         // Segments queued in the RMT at once (double buffered)
+  #define RMT_WAIT_MS           ((RMT_QUEUED_SEGMENTS * RMT_SEGMENT_MICROS) / 1000L + 1L)  // Longest a full transmit queue takes to drain (STEP_ERROR after it)
+#endif
+
+#ifndef TRIGGER_POINTS
+  #if defined(ARDUINO_ARCH_AVR)
+    #define TRIGGER_POINTS      4     // Position-compare outputs per motor
+  #else
+    #define TRIGGER_POINTS      16
+  #endif
+#endif
+
+#ifndef TRIGGER_PULSE_MICROS
+  #define TRIGGER_PULSE_MICROS  100L  // Width of a TRIGGER_PULSE (at least, it ends on a Run() pass)
+#endif
+
+#define BLINK_COUNT       10      // Flashes of BlinkLED()
+#define BLINK_ON_MICROS   20000L  // LED on time of each flash
+#define BLINK_OFF_MICROS  80000L  // LED off time after each flash
+
+#if defined(STEP_ENCODER)
+  #if defined(ARDUINO) && !defined(ARDUINO_ARCH_ESP32)
+    #error "STEP_ENCODER requires an ESP32 target (PCNT)"
+  #endif
+
+  #include "driver/pulse_cnt.h"
+
+  #define ENCODER_LIMIT           30000   // The 16-bit counter wraps here, the driver accumulates the total
+  #ifndef ENCODER_GLITCH_NS
+    #define ENCODER_GLITCH_NS     1000    // Shorter pulses on the encoder pins are ignored
+  #endif
+  #ifndef ENCODER_CHECK_MICROS
+    #define ENCODER_CHECK_MICROS  1000L   // Following error check period while running
+  #endif
+  #ifndef ENCODER_RETRIES
+    #define ENCODER_RETRIES       3       // Corrections of one rotation before FOLLOWING_ERROR (ENCODER_CORRECT)
+  #endif
+#endif
+
+// Highest step rate (steps per second) of each backend.  These are conservative estimates from the
+// per-step work of each backend, not measurements, so a build may well hold a faster rate.  Faster
+// velocities are held to it, and GetMaxStepRate() / "GM" report it to the host.  Override with
+// -D MAX_STEP_RATE= after measuring your own build (the STEP_STATS env shows when steps start running late).
+#ifndef MAX_STEP_RATE
+  #if defined(STEPPER_RMT)
+    #define MAX_STEP_RATE  (1000000L / (2L * PULSE_WIDTH))  // Pulse and low time of PULSE_WIDTH each (the hardware bound)
+  #elif defined(STEPPER_TIMER) && defined(ARDUINO_ARCH_AVR)
+    #define MAX_STEP_RATE  10000L   // One Timer1 interrupt per step
+  #elif defined(STEPPER_TIMER)
+    #define MAX_STEP_RATE  50000L   // One gptimer interrupt per step
+  #elif defined(ARDUINO_ARCH_AVR)
+    #define MAX_STEP_RATE  8000L    // Run() loop with digitalWrite()
+  #else
+    #define MAX_STEP_RATE  40000L   // Run() loop
+  #endif
+#endif
 
 enum MotorState
 {
@@ -231,6 +611,25 @@ enum MotorState
   MS_ESTOPPED   // Motor is in an E-STOP condition (Emergency Stop), it must be Enabled to resume motion
 };
 
+enum MotionProfile
+{
+  PROFILE_TRAPEZOID,   // Linear velocity ramp (default)
+  PROFILE_SCURVE       // Jerk-limited S-curve ramp
+};
+
+enum TriggerAction
+{
+  TRIGGER_HIGH,        // Sets the pin HIGH
+  TRIGGER_LOW,         // Sets the pin LOW
+  TRIGGER_PULSE        // Pulses the pin HIGH for TRIGGER_PULSE_MICROS
+};
+
+enum EncoderMode
+{
+  ENCODER_STOP,        // A following error stops the motor, Run() returns FOLLOWING_ERROR
+  ENCODER_CORRECT      // A following error restarts the rotation from the encoder's position
+};
+
 enum RunReturn
 {
   OKAY,                // Idle or still running
@@ -238,7 +637,143 @@ enum RunReturn
   RANGE_ERROR_LOWER,   // Reached lower range limit
   RANGE_ERROR_UPPER,   // Reached upper range limit
   LIMIT_SWITCH_LOWER,  // Lower limit switch triggered
-  LIMIT_SWITCH_UPPER   // Upper limit switch triggered
+  LIMIT_SWITCH_UPPER,  // Upper limit switch triggered
+  HOME_COMPLETE,       // FindHome is complete, the motor is at its new HOME position
+  FOLLOWING_ERROR,     // The encoder is more than the following error from the step position (STEP_ENCODER builds)
+  STEP_ERROR,          // The RMT driver refused a segment, the motor stopped at the last step it sent (STEPPER_RMT builds)
+  MOTION_ABORTED       // A grouped motor was Disabled or E-Stopped (lost its HOME) during the move, the group stopped
+};
+
+enum BinaryOpcode
+{
+  BIN_ESTOP = 0x01,
+  BIN_ENABLE,
+  BIN_DISABLE,
+  BIN_FIND_HOME,
+  BIN_SET_HOME,
+  BIN_SET_LOWER_LIMIT,   // limit
+  BIN_SET_UPPER_LIMIT,   // limit
+  BIN_SET_RAMP,          // ramp
+  BIN_SET_HOMING_SPEED,  // fast speed, slow speed
+  BIN_ROTATE_ABSOLUTE,   // velocity, position
+  BIN_ROTATE_RELATIVE,   // velocity, steps
+  BIN_ROTATE_HOME,
+  BIN_ROTATE_LOWER,
+  BIN_ROTATE_UPPER,
+  BIN_QUEUE_ABSOLUTE,    // velocity, position
+  BIN_QUEUE_RELATIVE,    // velocity, steps
+  BIN_QUEUE_CLEAR,
+  BIN_QUEUE_DEPTH,       // returns depth
+  BIN_GET_ABSOLUTE,      // returns position
+  BIN_GET_RELATIVE,      // returns position
+  BIN_GET_LOWER_LIMIT,   // returns limit
+  BIN_GET_UPPER_LIMIT,   // returns limit
+  BIN_GET_TIME,          // returns ms
+  BIN_GET_VERSION,       // returns version string
+  BIN_GET_STATUS,        // returns position, remaining ms, MotorState, queue depth
+  BIN_BLINK,             // pin
+  BIN_SET_PROFILE,       // profile, max jerk (0 = unchanged)
+  BIN_SET_ACCELERATION,  // steps per second²
+  BIN_PREDICT_TIME,      // velocity, steps, returns ms
+  BIN_GET_STATS,         // returns steps, max late, missed, max Run() gap, max command (STEP_STATS builds)
+  BIN_CLEAR_STATS,
+  BIN_STREAM_SEGMENT,    // interval, count, add, returns free slots
+  BIN_STREAM_FREE,       // returns free slots
+  BIN_SET_TELEMETRY,     // period ms, steps (0, 0 = off)
+  BIN_TELEMETRY,         // Pushed only: position, velocity, MotorState
+  BIN_SET_VELOCITY,      // steps per second, for the current rotation
+  BIN_OVERRIDE_VELOCITY, // percent of the commanded velocity, for the current rotation
+  BIN_GET_MAX_RATE,      // returns steps per second
+  BIN_SAVE_CONFIG,       // with position (0 = configuration only)
+  BIN_LOAD_CONFIG,
+  BIN_SET_FOLLOWING_ERROR,  // steps (0 = off), EncoderMode (STEP_ENCODER builds)
+  BIN_GET_ENCODER,       // returns encoder position, following error (STEP_ENCODER builds)
+  BIN_ADD_TRIGGER,       // position, pin, TriggerAction
+  BIN_CLEAR_TRIGGERS,
+  BIN_ERROR = 0xFF       // Response only, returns a BinaryError
+};
+
+enum BinaryError
+{
+  BIN_ERROR_FRAME = 1,   // Bad sync byte or length
+  BIN_ERROR_CRC,         // CRC mismatch
+  BIN_ERROR_OPCODE,      // Unknown opcode
+  BIN_ERROR_LENGTH,      // Missing parameters
+  BIN_ERROR_QUEUE_FULL,  // Motion queue is full
+  BIN_ERROR_NOT_RUNNING, // No rotation to change
+  BIN_ERROR_CONFIG,      // Configuration not saved or loaded (see SaveConfig() / LoadConfig())
+  BIN_ERROR_TRIGGER,     // Compare point not added or cleared (list full, or the motor is running)
+  BIN_ERROR_PIN,         // Not an output pin, or one of the motor's own pins (BIN_ADD_TRIGGER, BIN_BLINK)
+  BIN_ERROR_TIMER,       // No step timer for this motor, it can't be enabled (STEPPER_TIMER builds, BIN_ENABLE)
+  BIN_ERROR_VELOCITY,    // Velocity below 1 step/sec (rotate and queue opcodes)
+  BIN_ERROR_NOT_READY    // Not homed and Enabled (or running), or following a stream (queue opcodes)
+};
+
+enum HomingState
+{
+  HS_IDLE,           // Not homing
+  HS_SEEK,           // Fast seek to the lower limit switch
+  HS_BACKOFF,        // Slowly back off until the switch releases
+  HS_BACKOFF_CLEAR,  // Move clear of the switch
+  HS_APPROACH,       // Slow re-approach to the switch
+  HS_RELEASE,        // Slowly back off until the switch releases
+  HS_FINAL           // A few more steps, then set HOME
+};
+
+
+class StepperMotor;
+class StepperScheduler;
+
+typedef void (*CommandHandler) (StepperMotor *motor, const char *packet, char *response);
+
+struct UserCommand
+{
+  uint16_t        Code;     // COMMAND_CODE of the 2-char command
+  CommandHandler  Handler;
+};
+
+struct RampTiming;
+struct StoredConfig;
+
+struct StreamSegment
+{
+  long  Interval;     // Ticks from the step before to the first step of the segment
+  long  Count;        // Number of steps, negative for counter-clockwise
+  long  Add;          // Ticks added to the interval after each step
+};
+
+struct TriggerPoint
+{
+  long           Position;  // Absolute position that fires the output
+  FastPin        Out;       // Output pin (see FastGPIO.h)
+  uint8_t        Action;    // TriggerAction
+  volatile bool  Pulsing;   // A TRIGGER_PULSE is high until PulseEnd
+  unsigned long  PulseEnd;
+};
+
+struct QueuedMove
+{
+  long      Target;         // Absolute target position
+  long      MaxVelocity;    // Steps per second
+  long      Steps;          // Number of steps from the end of the previous move
+  long      Increment;      // 1 for clockwise, -1 for counter-clockwise
+  long      ExitLevel;      // Planned ramp level (steps into the ramp) at the end of the move
+  long      RampVelocity;   // Ramp planned ahead of the junction (see prepareMove)
+  long      FullRampSteps;
+  uint16_t  Planned;        // RampSettings the ramp was planned with (0 = not yet)
+};
+
+struct RampTable
+{
+  unsigned long  Intervals[RAMP_TABLE_SIZE + 1];  // Step intervals (fixed-point micros) for each velocity level
+  long           Length;       // Number of velocity levels in the table
+  long           RampSteps;    // Velocity levels in the full ramp the table was built for
+  long           Increment;    // VelocityIncrement the table was built for
+  MotionProfile  Profile;      // Profile the table was built for
+  long           MaxVelocity;  // S-curve MaxVelocity, RampVelocity and MaxJerk the table was built for
+  long           Velocity;
+  long           Jerk;
+  long           Accel;        // Acceleration the table was built for
 };
 
 
@@ -248,16 +783,27 @@ enum RunReturn
 
 class StepperMotor
 {
+  friend class StepperGroup;      // Steps grouped motors with a shared velocity profile
+  friend class StepperScheduler;  // Steps independent motors from one clock
+
   private:
     const char  version[25] = "Stepper Motor 2025-07-01";
     char        ecReturnString[EC_RETURN_LENGTH];
+    char        ecBatchString[EC_BATCH_LENGTH];
+    uint8_t     binReturnFrame[BIN_MAX_FRAME];
+    UserCommand UserCommands[MAX_USER_COMMANDS];
+    int         NumUserCommands;
 
-    MotorState  State = MS_DISABLED;  // Default is disabled (unlocked)
+    volatile MotorState  State = MS_DISABLED;  // Default is disabled (unlocked)
 
     // GPIO Pins For Digital Stepper Driver and Limit Switches
-    int  EnablePin, DirectionPin, StepPin, LLSwitchPin, ULSwitchPin;
+    int      EnablePin, DirectionPin, StepPin, LLSwitchPin, ULSwitchPin;
+    FastPin  EnableOut, DirectionOut, StepOut, LLSwitchIn, ULSwitchIn;  // See FastGPIO.h
 
     bool           Homed = false;      // The motor must be "Homed" before use
+    HomingState    Homing;             // FindHome phase
+    long           HomingFastSpeed;    // Seek speed for FindHome
+    long           HomingSlowSpeed;    // Back-off and re-approach speed for FindHome
     const long     RampScale = 5L;
     long           MaxVelocity;        // Highest velocity while running
     long           TargetOrSteps;
@@ -271,46 +817,312 @@ class StepperMotor
     long           UpperLimit;         // Maximum step position
     long           RampSteps;          // Total number of steps during ramping
     long           RampDownStep;       // Step at which to start ramping down
-    long           Velocity;           // Current velocity of motor
+    long           RampLevel;          // Steps into the ramp at the current velocity (0 = stand-still)
     long           VelocityIncrement;  // Velocity adjustment for ramping (determined by ramp factor)
+    MotionProfile  Profile;            // Shape of the velocity ramp
+    long           MaxJerk;            // S-curve max jerk (steps per second³)
+    long           Acceleration;       // Ramp acceleration (steps per second²), 0 = use the ramp factor
+    long           RampVelocity;       // Velocity at the top of the ramp (below MaxVelocity for short S-curves)
+    long           FullRampSteps;      // Steps to ramp from a stand-still up to RampVelocity
     long           NextPosition;       // Position after next step
     unsigned long  NextStepMicros;     // Target micros for next step
+    bool           PulseHigh;          // Step pin is high, waiting for the end of the pulse (NONBLOCKING_PULSE)
+    bool           PulseHold;          // Step pin is low, waiting out the low time before the next pulse
+    unsigned long  PulseMicros;        // End of the pulse, or of the low time after it
+    bool           DirectionDeferred;  // The Direction pin changes once the pulse has ended (NONBLOCKING_PULSE)
+    bool           DirectionChanged;   // The Direction pin just changed, the next step waits 10-microseconds for it
+    unsigned long  StepDelay;          // How late that step was, taken off the interval after it (the schedule is kept)
 
-    void startRotation ();
-    void doStep ();
+    RampTable      Tables[2];          // The ramp table in use, and a spare built ahead of a junction
+    RampTable     *Table;              // Table the step engine reads
+    RampTable     *Spare;              // Built in task context, then swapped in (never while the engine reads it)
+    volatile bool  SpareBusy;          // The spare is being built, the step engine must not take it
+    volatile bool  PrepareNeeded;      // The next queued move has no ramp planned yet (Run() plans it)
+    uint16_t       RampSettings;       // Bumped by SetRamp() / SetAcceleration() / SetProfile(), so older plans are redone
+    long           RampIndex;          // Current table entry
+    long           RampAccum;          // Spreads the ramp's velocity levels over the table entries
+    unsigned long  CruiseInterval;     // Step interval (fixed-point micros) at full velocity
+    unsigned long  CruiseRemainder;    // Remainder of the CruiseInterval division
+    unsigned long  CruiseAccum;        // Carries CruiseRemainder into CruiseInterval
+    unsigned long  IntervalFraction;   // Fractional micros carried to the next step
+    bool           Ramping;            // Velocity follows the ramp (false for constant velocity)
+    long           ExitLevel;          // Ramp level at the end of the current rotation (0 = stand-still)
+    long           CommandedVelocity;  // MaxVelocity the current rotation was started with (before SetVelocity)
+    StepperScheduler *Scheduler;       // Scheduler that steps this motor (NULL = stepped by Run())
+    int            SchedulerAxis;      // This motor's axis in the Scheduler
+
+    void           wakeScheduler       ();  // Tells the Scheduler the motor started moving
+    unsigned long  StepInterval;       // Micros from the last step to the next one, 0 when stopping
+
+    uint8_t        TelemetryFrame[BIN_HEADER_LENGTH + 12 + 1];  // Latest BIN_TELEMETRY frame
+    bool           TelemetryReady;     // TelemetryFrame is waiting for TakeTelemetry()
+    long           TelemetryPeriod;    // Micros between frames (0 = off)
+    long           TelemetrySteps;     // Steps between frames (0 = off)
+    unsigned long  TelemetryMicros;    // Time, position and state of the last frame
+    long           TelemetryPosition;
+    MotorState     TelemetryState;
+
+    void           checkTelemetry      ();  // Builds a telemetry frame when one is due
+
+    int            ConfigSlot;         // ConfigStore slot of this motor's saved configuration
+    bool           PositionSaved;      // The saved configuration may hold a position (cleared when the motor moves)
+
+    bool           readConfig          (StoredConfig *config);  // Reads and checks the saved configuration
+    bool           writeConfig         (StoredConfig *config);  // Seals and saves a configuration
+    void           forgetPosition      ();                      // Clears a saved position before the motor leaves it
+
+    int            BlinkPin;           // LED of BlinkLED()
+    int            BlinkChanges;       // LED changes still to make (0 = not blinking)
+    unsigned long  BlinkMicros;        // When the next change is due
+
+    void           blinkStep           ();  // Makes the next LED change when it is due
+    bool           outputsPending      ();  // A blink or TRIGGER_PULSE still needs Run() while at rest
+
+    QueuedMove     Queue[MOTION_QUEUE_SIZE];  // Moves waiting behind the current rotation
+    volatile int   QueueHead;                 // Next free slot
+    volatile int   QueueTail;                 // Next move to run
+
+    TriggerPoint   Triggers[TRIGGER_POINTS];  // Position-compare outputs, sorted by Position
+    int            NumTriggers;
+    int            TriggerBelow;              // Points below AbsolutePosition (the next ones either way are next to it)
+    volatile bool  TriggerPulsing;            // A TRIGGER_PULSE may still be high
+
+    void           checkTriggers       ();  // Fires the compare points at a new position (once per step)
+    void           fireTriggers        (int first, int count);
+    void           seekTriggers        ();  // Finds TriggerBelow again after the position jumps
+    bool           outputPin           (int pin);  // The pin can be driven by a compare point or BlinkLED()
+    void           endTriggerPulses    ();  // Ends the TRIGGER_PULSE outputs that are due
+
+    StreamSegment  Stream[STREAM_BUFFER_SIZE];  // Host-streamed segments
+    volatile int   StreamHead;                  // Next free slot
+    volatile int   StreamTail;                  // Next segment to run
+    bool           Streaming;                   // Steps come from the stream instead of a rotation
+    bool           StreamEnd;                   // The ring ran dry, stop at the next step
+    long           StreamLeft;                  // Steps left in the current segment
+    long           StreamInterval;              // Ticks until the next step
+    long           StreamAdd;                   // Ticks added after each step of the current segment
+    long           StreamIncrement;             // Direction of the current segment
+    unsigned long  StreamFraction;              // Fractional micros carried to the next step
+
+    bool           nextSegment         ();  // Takes the next streamed segment, if any
+    void           setStreamDirection  ();  // Sets the Direction pin for the current segment
+    void           setDirection        ();  // Sets the Direction pin for StepIncrement
+    unsigned long  advanceStream       ();  // advanceStep() for streamed segments
+    float          streamTime          ();  // Seconds of streamed steps still to run
+
+    void           startRotation       ();
+    void           setupRotation       ();  // Sets ramp and direction for a new rotation without starting it
+    void           doStep              ();
+    RunReturn      readLimitSwitches   ();  // Reads the limit switch pins
+    bool           pulseBusy           ();  // Ends a finished step pulse, true until the next pulse may start
+    RunReturn      checkNextStep       ();  // Checks target and range limits before the next step
+    unsigned long  advanceStep         ();  // Updates position and velocity after a step, returns micros until the next one
+    unsigned long  keepSchedule        (unsigned long interval);  // Takes StepDelay off the interval after a delayed step
+    RunReturn      checkLimitSwitches  ();  // Checks the limit switches, if specified
+    void           setupRamp           ();  // Sets the ramp length for the profile and builds its table
+    bool           curveRamp           ();  // True if the ramp is computed in time (S-curve or SetAcceleration())
+    float          rampAccel           (long maxVelocity);  // Ramp acceleration (steps per second²)
+    long           curveSteps          (long velocity, long maxVelocity);  // Steps of a curve ramp up to velocity
+    void           planRamp            (long maxVelocity, long steps, long *rampVelocity, long *fullSteps);
+    void           rampTiming          (long maxVelocity, long steps, RampTiming *timing);
+    float          moveTime            (long maxVelocity, long steps, long entryLevel, long exitLevel);  // Predicted seconds of a move
+    void           buildRampTable      (RampTable *table, long maxVelocity, long rampVelocity, long fullSteps);  // Precomputes a ramp's step intervals
+    bool           tableFits           (const RampTable *table, long maxVelocity, long rampVelocity, long fullSteps);  // The table was built for this ramp
+    void           swapTables          ();  // The spare becomes the table in use
+    void           resetRamp           ();  // Starts the ramp over from its first step
+    void           rampChanged         ();  // A ramp setting changed, queued moves are planned again
+    void           setupCruise         ();  // Sets the step interval for MaxVelocity
+    long           tableLevel          (unsigned long interval);  // Ramp level of a step interval in the table
+    bool           parseRotate         (const char *packet, long *velocity, long *targetOrNumSteps);
+    bool           executeUserCommand  (const char *packet);
+    const char *   executeSingle       (const char *packet);  // ExecuteCommand() of one command
+    const char *   executeBatch        (const char *packet);  // ExecuteCommand() of ';' separated commands
+    const uint8_t *executeFrame        (const uint8_t *frame, int frameLength, int *responseLength);  // ExecuteBinary() of a frame
+    const uint8_t *binaryResponse      (uint8_t opcode, const long *values, int numValues, int *responseLength);
+    const uint8_t *binaryError         (long errorCode, int *responseLength);
+    static int     buildFrame          (uint8_t *frame, uint8_t opcode, const long *values, int numValues);
+    static uint8_t crc8                (const uint8_t *data, int length);
+    static long    getInt32            (const uint8_t *bytes);
+    static void    putInt32            (uint8_t *bytes, long value);
+    RunReturn      runEngine           ();              // Steps the motor (software, RMT or timer backend)
+    RunReturn      stopRotation        (RunReturn rr);  // Stops the motor with a Run() result
+    void           replaceMotion       ();              // Cancels queued moves and homing for a direct rotation
+    RunReturn      checkHomingSwitches ();
+    void           startHomingPhase    (HomingState phase, long numSteps, long stepsPerSecond);
+    RunReturn      homingEvent         (RunReturn rr);  // Advances the FindHome state machine
+    void           setRampLevel        (long level);    // Continues the ramp from a velocity level
+    void           planProfile         ();              // Plans the rest of the rotation to end at ExitLevel
+    long           junctionLevel       (long increment1, long velocity1, long increment2, long velocity2);
+    void           planQueue           ();              // Look-ahead planner for queued moves
+    bool           nextQueuedMove      ();              // Starts the next queued move, if any
+    void           prepareMove         ();              // Plans the next queued move's ramp and builds its table (task context)
+    bool           moveReady           (const QueuedMove *move);  // The move's ramp is planned and its table built
+    bool           takeMoveRamp        (QueuedMove *move);        // Switches to the move's prepared ramp, false if not ready
+    bool           reversalPending     ();              // True if the next queued move changes direction
+
+#if defined(STEP_STATS)
+    StepStats      Stats;
+    unsigned long  LastRunMicros;      // Time of the last Run() call while running
+    bool           RunTimed;           // LastRunMicros is valid
+
+    void           recordRun           ();                    // Times the gap since the last Run() call
+    void           recordStep          (unsigned long late);  // Adds a step's lateness to the stats
+    void           recordCommand       (unsigned long start); // Times a command from its start
+#endif
+
+#if defined(LIMIT_INTERRUPTS)
+    volatile RunReturn  LimitEvent;                 // Switch latched by the limit interrupt (OKAY = none)
+
+    void                initLimitInterrupts ();
+    void                releaseLimitInterrupts ();
+    void                limitInterrupt      ();
+
+  #if defined(ARDUINO_ARCH_AVR)
+    static StepperMotor  *LimitMotors[MAX_LIMIT_MOTORS];
+    static int            NumLimitMotors;
+  #else
+    static void           limitAlarm (void *context);
+  #endif
+#endif
+
+#if defined(STEP_ENCODER)
+    pcnt_unit_handle_t  EncoderUnit;        // PCNT unit counting the encoder (NULL = none attached)
+    long                EncoderCounts;      // Encoder counts per revolution
+    long                EncoderSteps;       // Motor steps per revolution
+    long                EncoderOffset;      // Steps added to the scaled count to give the encoder position
+    long                MaxFollowingError;  // Steps the encoder may differ from the step position (0 = no check)
+    EncoderMode         FollowingMode;      // What a following error does
+    int                 Corrections;        // Corrections made to the current rotation
+    unsigned long       EncoderMicros;      // Last check while running
+
+    long                encoderSteps   ();  // Encoder count scaled to steps, before EncoderOffset
+    void                syncEncoder    ();  // Sets the encoder position to the step position
+    RunReturn           checkEncoder   (RunReturn rr);  // Compares the encoder with the step position
+#endif
+
+#if defined(STEPPER_TIMER)
+    volatile RunReturn  Events[TIMER_EVENT_QUEUE];  // RunReturn events queued by the timer interrupt
+    volatile uint8_t    EventHead, EventTail;
+    volatile bool       TimerHeld;                  // A queued move waits for Run() to build its ramp table
+    bool                TimerReady;                 // This motor has its step timer (a motor without one can't be enabled)
+
+  #if defined(ARDUINO_ARCH_AVR)
+    static StepperMotor  *TimerMotor;               // The motor driven by Timer1
+    static StepperScheduler *TimerScheduler;        // Or the scheduler driving all of its motors with it
+    unsigned long        TimerTicksLeft;            // Timer1 ticks left in the current interval
+    void                 loadTimer  ();
+  #else
+    gptimer_handle_t     StepTimer;
+    uint64_t             NextStepCount;             // Timer count of the next step
+    static bool          timerAlarm (gptimer_handle_t timer, const gptimer_alarm_event_data_t *eventData, void *context);
+  #endif
+
+    void                 initTimer  ();
+    void                 releaseTimer ();
+    void                 startTimer (unsigned long delayMicros);
+    void                 stopTimer  ();
+    void                 timerStep  ();
+    void                 stopMotion (RunReturn rr);
+    RunReturn            takeEvent  ();
+#endif
+
+#if defined(STEPPER_RMT)
+    rmt_channel_handle_t  RmtChannel;
+    rmt_encoder_handle_t  RmtEncoder;
+    rmt_symbol_word_t     RmtSymbols[RMT_QUEUED_SEGMENTS][RMT_SEGMENT_SYMBOLS];
+    std::atomic<int>      RmtPending;     // Number of segments queued in the RMT (also counted down by its interrupt)
+    bool                  DirectionPending;  // A reversal waits for the queued segments before setting the Direction pin
+    int                   RmtBuffer;      // Next segment buffer to fill
+    RunReturn             SegmentReturn;  // Why segment building stopped (OKAY while still running)
+    bool                  SegmentBuilding;               // Compare points reached now wait for their segment
+    int                   SegmentTriggerFirst, SegmentTriggerCount;  // Compare points of the segment being built
+    int                   RmtTriggerFirst[RMT_QUEUED_SEGMENTS];      // Compare points fired when each queued segment is sent
+    int                   RmtTriggerCount[RMT_QUEUED_SEGMENTS];
+    int                   RmtQueued;      // Transmissions queued, and sent (their slot is the count modulo RMT_QUEUED_SEGMENTS)
+    volatile int          RmtSent;
+
+    void                  initRMT        ();
+    RunReturn             runSegments    ();
+    bool                  stopSegments   (bool abort);  // False if the queued steps didn't finish (STEP_ERROR)
+    static bool           rmtSegmentDone (rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *eventData, void *context);
+#endif
 
   public:
+#if defined(LIMIT_INTERRUPTS) && defined(ARDUINO_ARCH_AVR)
+    static void    LimitISR            ();  // Called by the pin change interrupts
+#endif
+#if defined(STEPPER_TIMER) && defined(ARDUINO_ARCH_AVR)
+    static void    TimerISR            ();  // Called from the Timer1 compare interrupt (not for application use)
+#endif
+
     StepperMotor (int enablePin=2, int directionPin=3, int stepPin=4, int llSwitchPin=-1, int ulSwitchPin=-1);
+   ~StepperMotor ();
 
     RunReturn      Run                 ();  // Keeps the motor running (must be called from your loop() function with no delay)
 
     void           Enable              ();                                      // Enables the motor driver (energizes the motor)
     void           Disable             ();                                      // Disables the motor driver (releases the motor)
 
-    void           FindHome            ();                                      // "Auto Home": Seek to lower limit switch and set home position just off it
+    void           FindHome            ();                                      // "Auto Home": Seek to lower limit switch and set home position just off it (Run() returns HOME_COMPLETE)
+    void           SetHomingSpeed      (long fastSpeed, long slowSpeed);        // Sets the FindHome seek and slow re-approach speeds (steps per second)
     void           SetHomePosition     ();                                      // Sets the current position of the motor as its HOME position (Sets Absolute position to zero)
     void           SetLowerLimit       (long lowerLimit);                       // Sets the LOWER LIMIT (minimum Absolute Position) of the motor's range
     void           SetUpperLimit       (long upperLimit);                       // Sets the UPPER LIMIT (maximum Absolute Position) of the motor's range
     void           SetRamp             (int ramp);                              // Sets the trapezoidal velocity RAMP (up/down) for smooth motor start and stop
+    void           SetAcceleration     (long stepsPerSec2);                     // Sets a true constant acceleration for the ramps (instead of SetRamp())
+    void           SetProfile          (MotionProfile profile, long maxJerk=0); // Selects the trapezoid or S-curve velocity profile (maxJerk in steps/sec³, 0 = unchanged)
 
-    void           RotateAbsolute      (long absPosition, int stepsPerSecond);  // Rotates motor to an Absolute target position from its HOME position
-    void           RotateRelative      (long numSteps, int stepsPerSecond);     // Rotates motor clockwise(+) or counter-clockwise(-) any number of steps from its current position
+    void           RotateAbsolute      (long absPosition, long stepsPerSecond); // Rotates motor to an Absolute target position from its HOME position (ignored below 1 step/sec)
+    void           RotateRelative      (long numSteps, long stepsPerSecond);    // Rotates motor clockwise(+) or counter-clockwise(-) any number of steps from its current position (ignored below 1 step/sec)
     void           RotateToHome        ();                                      // Rotates motor to its HOME position
     void           RotateToLowerLimit  ();                                      // Rotates motor to its LOWER LIMIT position
     void           RotateToUpperLimit  ();                                      // Rotates motor to its UPPER LIMIT position
     void           EStop               ();                                      // Stops the motor immediately (emergency stop)
+    bool           SetVelocity         (long stepsPerSecond);                   // Ramps the current rotation to a new velocity without stopping, returns false if not running
+    bool           OverrideVelocity    (int percent);                           // SetVelocity() to a percentage of the rotation's commanded velocity
+
+    bool           QueueAbsolute       (long absPosition, long stepsPerSecond); // Queues a move to an Absolute target position, returns false if full, below 1 step/sec, not homed or not Enabled
+    bool           QueueRelative       (long numSteps, long stepsPerSecond);    // Queues a move of numSteps from the end of the previous move, returns false as QueueAbsolute()
+    int            GetQueueDepth       ();                                      // Returns the number of queued moves waiting behind the current rotation
+    void           ClearQueue          ();                                      // Cancels the queued moves (the current rotation still completes)
+    bool           QueueSegment        (long interval, long count, long add);   // Streams a segment of steps (see notes above), returns false if the ring is full or ran dry
+    int            GetStreamFree       ();                                      // Returns the number of free slots in the stream ring buffer
 
     bool           IsHomed             ();                                      // Returns true or false
     MotorState     GetState            ();                                      // Returns current state of motor
     long           GetAbsolutePosition ();                                      // Returns the motor's current step position relative to its HOME position
+    long           GetVelocity         ();                                      // Returns the current velocity in steps per second (negative for counter-clockwise)
     long           GetRelativePosition ();                                      // Returns the motor's current step position relative to its last targeted position
     long           GetLowerLimit       ();                                      // Returns the motor's Absolute LOWER LIMIT position
     long           GetUpperLimit       ();                                      // Returns the motor's Absolute UPPER LIMIT position
-    unsigned long  GetRemainingTime    ();                                      // Return the remaining time in ms when rotation will complete
+    unsigned long  GetRemainingTime    ();                                      // Return the remaining time in ms when rotation (and the queued moves) will complete
+    unsigned long  PredictMoveTime     (long numSteps, long stepsPerSecond);    // Return the time in ms a relative move would take from a stand-still
+    long           GetMaxStepRate      ();                                      // Returns the highest step rate of this build's backend (MAX_STEP_RATE)
     const char *   GetVersion          ();                                      // Returns this firmware's current version
-    void           BlinkLED            (int LEDpin);                            // Blink the specified LED to indicate identification
+#if defined(STEP_STATS)
+    const StepStats *GetStepStats      ();                                      // Returns the step timing statistics
+    void           ClearStepStats      ();                                      // Clears the step timing statistics
+#endif
+    void           SetTelemetry        (long periodMs, long everySteps);        // Pushes position/velocity/state frames every periodMs and/or everySteps steps (0, 0 = off)
+    const uint8_t *TakeTelemetry       (int *frameLength);                      // Returns the latest telemetry frame to send, or NULL if none is due
+#if defined(STEP_ENCODER)
+    bool           AttachEncoder       (int pinA, int pinB, long countsPerRev, long stepsPerRev);  // Counts a quadrature encoder with a PCNT unit, returns false if none is free
+    void           SetFollowingError   (long maxSteps, EncoderMode mode=ENCODER_STOP);  // Sets how far the encoder may differ from the step position (0 = off)
+    long           GetEncoderPosition  ();                                      // Returns the encoder's position in steps from HOME
+    long           GetFollowingError   ();                                      // Returns the encoder position minus the step position
+#endif
+    bool           AddTrigger          (long position, int pin, TriggerAction action);  // Adds a position-compare output, returns false if full, running or a bad pin
+    bool           ClearTriggers       ();                                      // Removes all compare points, returns false if running
+    int            GetTriggerCount     ();                                      // Returns the number of compare points
+    void           SetConfigSlot       (int slot);                              // Selects the storage slot of this motor's configuration (one per motor, default 0)
+    bool           SaveConfig          (bool withPosition=false);               // Saves the configuration (and the position, if homed and at rest), returns false if not saved
+    bool           LoadConfig          ();                                      // Loads the saved configuration (and a saved position, once), returns false if none
+    void           ForgetPosition      ();                                      // Clears a saved position now (a storage write), not as the next move starts
+    bool           BlinkLED            (int LEDpin);                            // Blink the specified LED to indicate identification (returns at once, Run() flashes it), false if a bad pin
 
-    const char *   ExecuteCommand      (const char *packet);                    // Execute a stepper motor function by string command (see notes above)
+    const char *   ExecuteCommand      (const char *packet);                    // Execute a stepper motor function by string command, or several separated by ';' (see notes above)
+    bool           RegisterCommand     (const char *name, CommandHandler handler);  // Adds your own 2-char command to ExecuteCommand(), returns false if built-in, taken or full
+    const uint8_t *ExecuteBinary       (const uint8_t *frame, int frameLength, int *responseLength);  // Execute a binary command frame, returns the response frame
 };
 
 #endif
@@ -0,0 +1,506 @@
+//==========================================================
+//
+//   FILE   : StepperScheduler.cpp
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Independent motion for any number of StepperMotor objects from one clock.
+//            (See StepperScheduler.h for details)
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//==========================================================
+
+#include <Arduino.h>
+#include "StepperScheduler.h"
+
+// The timer heap is also changed by interrupts (the step timer's, and a limit switch's), so
+// on AVR the interrupt state is restored rather than turned back on
+#if defined(STEPPER_TIMER) && defined(ARDUINO_ARCH_AVR)
+  #define LOCK_TIMER()    uint8_t sreg = SREG; noInterrupts ()
+  #define UNLOCK_TIMER()  SREG = sreg
+#elif defined(STEPPER_TIMER)
+  extern portMUX_TYPE MotionLock;  // StepperMotor.cpp's, also held by the motors' interrupts
+  #define LOCK_TIMER()    portENTER_CRITICAL_SAFE (&MotionLock)
+  #define UNLOCK_TIMER()  portEXIT_CRITICAL_SAFE (&MotionLock)
+#endif
+
+//==========================================================
+//  Constructor
+//==========================================================
+StepperScheduler::StepperScheduler ()
+{
+  NumMotors = 0;
+  EventAxis = 0;
+  HeapSize  = 0;
+
+#if defined(STEPPER_RMT) || defined(STEPPER_TIMER)
+  NextAxis  = 0;
+#endif
+
+#if defined(STEPPER_TIMER)
+  InInterrupt = false;
+  #if !defined(ARDUINO_ARCH_AVR)
+  Timer       = NULL;  // Created by the first AddMotor()
+  #endif
+#endif
+}
+
+//==========================================================
+//  Destructor
+//==========================================================
+StepperScheduler::~StepperScheduler ()
+{
+  // Declared after its motors, the scheduler goes first and hands them back
+  for (int axis=0; axis<NumMotors; axis++)
+  {
+#if defined(STEPPER_TIMER)
+    Motors[axis]->releaseTimer ();
+#endif
+    Motors[axis]->Scheduler = NULL;
+  }
+
+#if defined(STEPPER_TIMER)
+  #if defined(ARDUINO_ARCH_AVR)
+  TIMSK1 &= ~_BV(OCIE1A);
+  if (StepperMotor::TimerScheduler == this)
+    StepperMotor::TimerScheduler = NULL;
+  #else
+  if (Timer != NULL)
+  {
+    gptimer_stop      (Timer);
+    gptimer_disable   (Timer);
+    gptimer_del_timer (Timer);
+  }
+  #endif
+
+  // Each motor takes a timer of its own again, if one is free
+  for (int axis=0; axis<NumMotors; axis++)
+    Motors[axis]->initTimer ();
+#endif
+}
+
+//=== AddMotor ============================================
+
+bool StepperScheduler::AddMotor (StepperMotor *motor)
+{
+  if (NumMotors >= MAX_SCHEDULER_MOTORS || motor->Scheduler != NULL)
+    return false;
+
+#if defined(STEPPER_TIMER)
+  // The motor gives up its own step timer (if it got one) for the scheduler's
+  motor->releaseTimer ();
+  if (!claimTimer ())
+  {
+    motor->initTimer ();
+    return false;
+  }
+#endif
+
+  HeapPosition[NumMotors] = -1;
+  Motors[NumMotors]       = motor;
+  motor->Scheduler        = this;
+  motor->SchedulerAxis    = NumMotors++;
+
+#if defined(STEPPER_TIMER)
+  motor->TimerReady = true;
+
+  // Already moving?  It goes on from the scheduler's timer
+  if (motor->State == MS_RUNNING)
+    motor->startTimer (10L);
+#else
+  // Already moving (or sending telemetry)?
+  if (needsRun (motor))
+    wake (motor);
+#endif
+
+  return true;
+}
+
+//=== GetNumMotors ========================================
+
+int StepperScheduler::GetNumMotors ()
+{
+  return NumMotors;
+}
+
+//=========================================================
+//  Run:
+//  Must be called inside your loop function with no delay.
+//=========================================================
+RunReturn StepperScheduler::Run ()
+{
+  RunReturn  rr;
+  int        axis;
+
+#if defined(STEPPER_RMT) || defined(STEPPER_TIMER)
+  // The hardware times the steps, so service each motor in turn
+  for (int i=0; i<NumMotors; i++)
+  {
+    axis     = NextAxis;
+    NextAxis = (NextAxis + 1) % NumMotors;
+
+    rr = Motors[axis]->Run ();
+    if (rr != OKAY)
+    {
+      EventAxis = axis;
+      return rr;
+    }
+  }
+
+  return OKAY;
+#else
+  StepperMotor  *motor;
+  unsigned long  now = micros();
+
+  // Each running motor is due at most once per pass
+  for (int count=HeapSize; count>0; count--)
+  {
+    // Is the earliest deadline due?  (A signed difference stays correct when micros() wraps)
+    axis = Heap[0];
+    if ((long) (now - Deadline[axis]) < 0L)
+      break;
+
+    motor = Motors[axis];
+    rr    = motor->Run ();
+
+    // Still moving (or ending a blink or trigger pulse, or sending telemetry), so sort it back in
+    // by its new deadline
+    if (needsRun (motor))
+      wake (motor);
+    else
+      remove (axis);
+
+    if (rr != OKAY)
+    {
+      EventAxis = axis;
+      return rr;
+    }
+  }
+
+  return OKAY;
+#endif
+}
+
+//=== GetEventAxis ========================================
+
+int StepperScheduler::GetEventAxis ()
+{
+  return EventAxis;
+}
+
+//=== IsRunning ===========================================
+
+bool StepperScheduler::IsRunning ()
+{
+  for (int axis=0; axis<NumMotors; axis++)
+    if (Motors[axis]->State == MS_RUNNING)
+      return true;
+
+  return false;
+}
+
+//=== EStop ===============================================
+
+void StepperScheduler::EStop ()
+{
+  for (int axis=0; axis<NumMotors; axis++)
+    Motors[axis]->EStop ();
+
+  // (In timer builds a stopped motor leaves the timer heap when its next step interrupt finds it stopped)
+#if !defined(STEPPER_TIMER)
+  // Stopped motors would only leave the heap on their next deadline
+  for (int axis=0; axis<NumMotors; axis++)
+    HeapPosition[axis] = -1;
+
+  HeapSize = 0;
+
+  // Those with telemetry on still report the E-Stop (and their blink still ends)
+  for (int axis=0; axis<NumMotors; axis++)
+    if (needsRun (Motors[axis]))
+      wake (Motors[axis]);
+#endif
+}
+
+//=== wake ================================================
+
+void StepperScheduler::wake (StepperMotor *motor)
+{
+  // A motor started (or restarted) moving, so its deadline may now be earlier.
+  // Also sorts a motor in the heap back in by its new deadline.
+  int axis = motor->SchedulerAxis;
+
+  Deadline[axis] = deadline (motor);
+  place (axis);
+}
+
+//=== place ===============================================
+
+void StepperScheduler::place (int axis)
+{
+  int slot = HeapPosition[axis];
+
+  if (slot < 0)
+  {
+    slot               = HeapSize++;
+    Heap[slot]         = axis;
+    HeapPosition[axis] = slot;
+  }
+
+  siftUp (slot);
+  siftDown (HeapPosition[axis]);
+}
+
+//=== needsRun ============================================
+
+bool StepperScheduler::needsRun (StepperMotor *motor)
+{
+  // A motor at rest still needs Run() to end its outputs, and to send telemetry: periodic frames,
+  // and the frame of a state change (a Disable or E-Stop at rest)
+  return motor->State == MS_RUNNING || motor->outputsPending () ||
+         motor->TelemetryPeriod > 0L || motor->TelemetrySteps > 0L;
+}
+
+//=== deadline ============================================
+
+unsigned long StepperScheduler::deadline (StepperMotor *motor)
+{
+  // A motor at rest only has outputs to end or telemetry to check, so it is due on every pass.
+  // (From the next microsecond: due now, it would take the top of the heap again in this pass.)
+  if (motor->State != MS_RUNNING)
+    return micros() + 1UL;
+
+#if defined(NONBLOCKING_PULSE)
+  // A step pulse (or the low time after it) ends before the next step
+  if (motor->PulseHigh || motor->PulseHold)
+    return motor->PulseMicros;
+#endif
+
+  return motor->NextStepMicros;
+}
+
+#if defined(STEPPER_TIMER)
+
+//=== claimTimer ==========================================
+
+bool StepperScheduler::claimTimer ()
+{
+#if defined(ARDUINO_ARCH_AVR)
+  // Timer1 is free once the motor that had it was added
+  if (StepperMotor::TimerScheduler == this)
+    return true;
+
+  if (StepperMotor::TimerMotor != NULL || StepperMotor::TimerScheduler != NULL)
+    return false;
+
+  StepperMotor::TimerScheduler = this;
+#else
+  if (Timer != NULL)
+    return true;
+
+  // Free-running 1MHz timer, the alarm is moved to each earliest deadline
+  gptimer_config_t timerConfig = {};
+  timerConfig.clk_src       = GPTIMER_CLK_SRC_DEFAULT;
+  timerConfig.direction     = GPTIMER_COUNT_UP;
+  timerConfig.resolution_hz = 1000000L;
+  if (gptimer_new_timer (&timerConfig, &Timer) != ESP_OK)
+  {
+    Timer = NULL;
+    return false;
+  }
+
+  gptimer_event_callbacks_t callbacks = {};
+  callbacks.on_alarm = timerAlarm;
+  if (gptimer_register_event_callbacks (Timer, &callbacks, this) != ESP_OK ||
+      gptimer_enable (Timer) != ESP_OK)
+  {
+    gptimer_del_timer (Timer);
+    Timer = NULL;
+    return false;
+  }
+
+  gptimer_start (Timer);
+#endif
+
+  return true;
+}
+
+//=== armTimer ============================================
+
+void StepperScheduler::armTimer (int axis, unsigned long at)
+{
+  LOCK_TIMER ();
+
+  Deadline[axis] = at;
+  place (axis);
+
+  // The interrupt arms the compare once it has stepped every due motor
+  if (!InInterrupt)
+    loadTimer ();
+
+  UNLOCK_TIMER ();
+}
+
+//=== disarmTimer =========================================
+
+void StepperScheduler::disarmTimer (int axis)
+{
+  LOCK_TIMER ();
+
+  remove (axis);
+  if (!InInterrupt)
+    loadTimer ();
+
+  UNLOCK_TIMER ();
+}
+
+//=== loadTimer ===========================================
+
+void StepperScheduler::loadTimer ()
+{
+  // With the lock held, or from the interrupt
+  long  wait = (HeapSize > 0) ? (long) (Deadline[Heap[0]] - micros()) : 0L;
+
+  if (wait < 1L)
+    wait = 1L;  // Due (or late), fire as soon as possible
+
+#if defined(ARDUINO_ARCH_AVR)
+  if (HeapSize == 0)
+  {
+    TIMSK1 &= ~_BV(OCIE1A);
+    return;
+  }
+
+  // A wait longer than the 16-bit compare register ends early, with nothing due, and is armed again
+  unsigned long ticks = wait * (F_CPU / 8000000L);
+  if (ticks > 65536L)
+    ticks = 65536L;
+
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | _BV(CS11);  // CTC mode, prescaler 8
+  TCNT1  = 0;
+  OCR1A  = ticks - 1L;
+  TIFR1  = _BV(OCF1A);              // Clear any stale compare match
+  TIMSK1 |= _BV(OCIE1A);
+#else
+  if (HeapSize == 0)
+  {
+    // A one-shot alarm that is not moved forward will not fire again
+    gptimer_set_alarm_action (Timer, NULL);
+    return;
+  }
+
+  uint64_t  count;
+
+  gptimer_get_raw_count (Timer, &count);
+
+  gptimer_alarm_config_t alarmConfig = {};
+  alarmConfig.alarm_count = count + wait;
+  gptimer_set_alarm_action (Timer, &alarmConfig);
+#endif
+}
+
+//=== timerInterrupt ======================================
+
+void StepperScheduler::timerInterrupt ()
+{
+  // Each due motor takes its step and arms its next one (timerStep() calls armTimer())
+  unsigned long  now = micros();
+  int            axis;
+
+  InInterrupt = true;
+
+  for (int count=HeapSize; count>0 && HeapSize>0; count--)
+  {
+    axis = Heap[0];
+    if ((long) (now - Deadline[axis]) < 0L)
+      break;
+
+    remove (axis);
+    Motors[axis]->timerStep ();
+  }
+
+  InInterrupt = false;
+  loadTimer ();
+}
+
+#if !defined(ARDUINO_ARCH_AVR)
+
+//=== timerAlarm ==========================================
+
+bool IRAM_ATTR StepperScheduler::timerAlarm (gptimer_handle_t timer, const gptimer_alarm_event_data_t *eventData, void *context)
+{
+  portENTER_CRITICAL_ISR (&MotionLock);
+  ((StepperScheduler *) context)->timerInterrupt ();
+  portEXIT_CRITICAL_ISR (&MotionLock);
+  return false;
+}
+
+#endif
+
+#endif
+
+//=== Heap ================================================
+
+bool StepperScheduler::earlier (int slot1, int slot2)
+{
+  return (long) (Deadline[Heap[slot1]] - Deadline[Heap[slot2]]) < 0L;
+}
+
+void StepperScheduler::swap (int slot1, int slot2)
+{
+  int axis = Heap[slot1];
+
+  Heap[slot1] = Heap[slot2];
+  Heap[slot2] = axis;
+
+  HeapPosition[Heap[slot1]] = slot1;
+  HeapPosition[Heap[slot2]] = slot2;
+}
+
+void StepperScheduler::siftUp (int slot)
+{
+  while (slot > 0 && earlier (slot, (slot - 1) / 2))
+  {
+    swap (slot, (slot - 1) / 2);
+    slot = (slot - 1) / 2;
+  }
+}
+
+void StepperScheduler::siftDown (int slot)
+{
+  int child;
+
+  while ((child = 2 * slot + 1) < HeapSize)
+  {
+    if (child + 1 < HeapSize && earlier (child + 1, child))
+      child++;
+
+    if (!earlier (child, slot))
+      break;
+
+    swap (slot, child);
+    slot = child;
+  }
+}
+
+void StepperScheduler::remove (int axis)
+{
+  int slot = HeapPosition[axis];
+
+  if (slot < 0)
+    return;
+
+  // The last axis takes its slot
+  HeapPosition[axis] = -1;
+  if (slot < --HeapSize)
+  {
+    int last = Heap[HeapSize];
+
+    Heap[slot]         = last;
+    HeapPosition[last] = slot;
+    siftUp (slot);
+    siftDown (HeapPosition[last]);
+  }
+}
@@ -0,0 +1,137 @@
+//=============================================================================
+//
+//     FILE : StepperScheduler.h
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Independent motion for any number of StepperMotor objects from one clock.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  A StepperScheduler runs up to MAX_SCHEDULER_MOTORS motors independently: each motor keeps
+//  its own moves, queue, profile and limits and is commanded with its own methods or commands.
+//  Unlike a StepperGroup, the axes are not synchronized.
+//
+//  Calling Run() on every motor costs a micros() read and a compare per motor on every pass,
+//  even when none of them is due.  The scheduler instead keeps the running motors in a min-heap
+//  ordered by their next step time, so each pass reads the clock once and compares it with the
+//  earliest deadline only.  A due motor is stepped (by its own Run()) and moved down the heap,
+//  so the cost follows the number of steps, not the number of motors.  A motor that starts a
+//  rotation, queued move or stream, or turns its telemetry on, is put back into the heap by the
+//  motor itself.  A motor at rest stays in it, due on every pass, while its BlinkLED() or a
+//  TRIGGER_PULSE still has to end, and for as long as its telemetry is on (SetTelemetry() or
+//  "TM"), so periodic frames and the frame of a Disable or E-Stop at rest are still sent.
+//
+//  In software stepping the scheduler polls: the deadlines are checked against micros() each time
+//  loop() calls Run(), so steps are only as punctual as those calls.
+//
+//  In STEPPER_TIMER builds the scheduler takes one hardware timer for all of its motors (Timer1 on
+//  AVR, one gptimer on the ESP32) and the motors give up their own.  The heap then holds each
+//  running motor's next step time, and the timer's compare is armed for the earliest one only.
+//  Its interrupt steps every motor that is due (timerStep(), as a motor with its own timer does)
+//  and arms the compare for the next deadline.  A motor's step times are kept as a sum of its
+//  intervals from one clock, so the motors don't drift against each other, and a Timer1 build can
+//  run several motors.  Run() just services the motors in turn to collect their events.  In
+//  STEPPER_RMT builds each motor is timed by its own RMT channel and is serviced the same way.
+//
+//  Usage:
+//
+//    StepperMotor      X (2, 3, 4), Y (5, 6, 7), Z (8, 9, 10);
+//    StepperScheduler  Motors;
+//
+//    setup()
+//    {
+//      X.Enable();  Y.Enable();  Z.Enable();
+//      Motors.AddMotor (&X);  Motors.AddMotor (&Y);  Motors.AddMotor (&Z);
+//
+//      X.RotateRelative (2000, 3000);
+//      Y.RotateRelative (-500, 800);
+//    }
+//
+//    loop()
+//    {
+//      RunReturn rr = Motors.Run();  // The Run() result of a motor, at most one per call
+//      if (rr != OKAY)
+//        ...                         // GetEventAxis() is the motor it came from
+//    }
+//
+//  Don't call Run() on the scheduled motors yourself.  With LIMIT_INTERRUPTS, a latched switch
+//  stops its motor at the motor's next step time instead of on the next pass (on the spot in
+//  STEPPER_TIMER builds).  In STEPPER_TIMER builds AddMotor() returns false if the timer is held by
+//  a motor that isn't in the scheduler (on AVR, the first motor constructed takes Timer1 until it
+//  is added).
+//
+//=============================================================================
+
+#ifndef SMS_H
+#define SMS_H
+
+#include "StepperMotor.h"
+
+#ifndef MAX_SCHEDULER_MOTORS
+  #define MAX_SCHEDULER_MOTORS  8
+#endif
+
+//=========================================================
+//  class StepperScheduler
+//=========================================================
+
+class StepperScheduler
+{
+  friend class StepperMotor;  // Motors wake the scheduler when they start moving
+
+  private:
+    StepperMotor   *Motors[MAX_SCHEDULER_MOTORS];
+    int            NumMotors;
+    int            EventAxis;                           // Axis of the last non-OKAY Run() result
+
+    int            Heap[MAX_SCHEDULER_MOTORS];          // Axes of the running motors, earliest deadline first
+    int            HeapSize;
+    int            HeapPosition[MAX_SCHEDULER_MOTORS];  // Heap slot of each axis (-1 = not in the heap)
+    unsigned long  Deadline[MAX_SCHEDULER_MOTORS];      // Micros at which each axis next needs Run()
+
+#if defined(STEPPER_RMT) || defined(STEPPER_TIMER)
+    int            NextAxis;                            // Next axis to service
+#endif
+
+#if defined(STEPPER_TIMER)
+    volatile bool  InInterrupt;                         // timerInterrupt() is stepping the due motors
+  #if !defined(ARDUINO_ARCH_AVR)
+    gptimer_handle_t  Timer;                            // The step timer of all the motors
+    static bool    timerAlarm     (gptimer_handle_t timer, const gptimer_alarm_event_data_t *eventData, void *context);
+  #endif
+
+    bool           claimTimer     ();                   // Takes the hardware timer, returns false if a motor outside the scheduler has it
+    void           armTimer       (int axis, unsigned long at);  // Sets when an axis next steps (micros)
+    void           disarmTimer    (int axis);           // An axis has no next step
+    void           loadTimer      ();                   // Arms the compare for the earliest deadline
+    void           timerInterrupt ();                   // Steps the axes that are due
+#endif
+
+    void           wake       (StepperMotor *motor);    // Puts a motor that started moving into the heap
+    void           place      (int axis);               // Puts an axis into the heap (or sorts it back in) by its Deadline
+    bool           needsRun   (StepperMotor *motor);    // A motor is moving, or at rest with outputs or telemetry to service
+    unsigned long  deadline   (StepperMotor *motor);    // When a motor next needs Run()
+    bool           earlier    (int slot1, int slot2);   // Heap order of two slots
+    void           swap       (int slot1, int slot2);
+    void           siftUp     (int slot);
+    void           siftDown   (int slot);
+    void           remove     (int axis);               // Takes an axis out of the heap
+
+  public:
+    StepperScheduler ();
+   ~StepperScheduler ();
+
+    bool           AddMotor       (StepperMotor *motor);  // Adds a motor as the next axis, returns false if the scheduler is full
+    int            GetNumMotors   ();                     // Returns the number of axes
+
+    RunReturn      Run            ();                     // Keeps the motors moving (must be called from your loop() function with no delay)
+    int            GetEventAxis   ();                     // Returns the axis of the last non-OKAY Run() result
+    bool           IsRunning      ();                     // Returns true while any motor is moving
+    void           EStop          ();                     // Stops all motors immediately (emergency stop)
+};
+
+#endif
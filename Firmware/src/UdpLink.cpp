@@ -0,0 +1,205 @@
+//==========================================================
+//
+//   FILE   : UdpLink.cpp
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Command and telemetry transport over Wi-Fi UDP (ESP32, -D UDP_LINK).
+//            (See UdpLink.h for details)
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//==========================================================
+
+#if defined(UDP_LINK)
+
+#include <Arduino.h>
+#include <string.h>
+#include "UdpLink.h"
+
+//==========================================================
+//  Constructor
+//==========================================================
+UdpLink::UdpLink ()
+{
+  LastPeer      = -1;
+  EventSequence = 0;
+
+  for (int i=0; i<UDP_PEERS; i++)
+  {
+    Peers[i].Used           = false;
+    Peers[i].Pending        = false;
+    Peers[i].Sequence       = -1L;
+    Peers[i].ResponseLength = 0;
+  }
+}
+
+//=== Begin ===============================================
+
+bool UdpLink::Begin (uint16_t port, IPAddress group)
+{
+  // One socket for unicast and the multicast group, on the same port
+  return Socket.beginMulticast (group, port) != 0;
+}
+
+//=== Receive =============================================
+
+bool UdpLink::Receive (LinkPacket *packet, int *peer)
+{
+  int       size, length, p;
+  long      sequence;
+  uint8_t  *payload;
+
+  while ((size = Socket.parsePacket ()) > 0)
+  {
+    length = Socket.read (Datagram, UDP_HEADER + UDP_MAX_PAYLOAD);
+
+    // Ignore other traffic, empty commands and datagrams too long for a response buffer
+    if (size > length || length <= UDP_HEADER || Datagram[0] != UDP_SYNC || Datagram[1] != UDP_COMMAND)
+      continue;
+
+    p = findPeer (Socket.remoteIP (), Socket.remotePort ());
+    if (p < 0)
+      continue;  // Every peer has a command running, the host will retry
+
+    sequence = (long) Datagram[2] | ((long) Datagram[3] << 8);
+
+    if (Peers[p].Sequence == sequence)
+    {
+      // A retry: answer it again without running the command twice
+      if (!Peers[p].Pending)
+        send (Peers[p].Address, Peers[p].Port, Peers[p].Response, Peers[p].ResponseLength);
+      continue;
+    }
+
+    Peers[p].Sequence    = sequence;
+    Peers[p].Pending     = true;
+    Peers[p].HeardMillis = millis ();
+    LastPeer             = p;
+
+    payload = Datagram + UDP_HEADER;
+    length -= UDP_HEADER;
+
+    packet->Binary  = (payload[0] == BIN_SYNC);
+    packet->TooLong = false;
+    packet->Data    = payload;
+
+    if (!packet->Binary)
+    {
+      // Text command, terminated in place (a trailing LF or CR is dropped)
+      while (length > 0 && (payload[length - 1] == '\n' || payload[length - 1] == '\r'))
+        length--;
+      payload[length] = 0;
+    }
+
+    packet->Length = length;
+    *peer          = p;
+    return true;
+  }
+
+  return false;
+}
+
+//=== Reply ===============================================
+
+void UdpLink::Reply (int peer, const uint8_t *data, int length)
+{
+  UdpPeer *entry = &Peers[peer];
+
+  if (length > UDP_MAX_PAYLOAD)
+    length = UDP_MAX_PAYLOAD;
+
+  // Kept for retries of the same command
+  entry->Response[0] = UDP_SYNC;
+  entry->Response[1] = UDP_RESPONSE;
+  entry->Response[2] = (uint8_t) entry->Sequence;
+  entry->Response[3] = (uint8_t) (entry->Sequence >> 8);
+  memcpy (entry->Response + UDP_HEADER, data, length);
+
+  entry->ResponseLength = UDP_HEADER + length;
+  entry->Pending        = false;
+
+  send (entry->Address, entry->Port, entry->Response, entry->ResponseLength);
+}
+
+//=== Forget ==============================================
+
+void UdpLink::Forget (int peer)
+{
+  Peers[peer].Pending  = false;
+  Peers[peer].Sequence = -1L;
+}
+
+//=== Send ================================================
+
+void UdpLink::Send (UdpKind kind, const uint8_t *data, int length)
+{
+  uint8_t  datagram[UDP_HEADER + UDP_MAX_PAYLOAD];
+
+  if (LastPeer < 0)
+    return;
+
+  if (length > UDP_MAX_PAYLOAD)
+    length = UDP_MAX_PAYLOAD;
+
+  datagram[0] = UDP_SYNC;
+  datagram[1] = (uint8_t) kind;
+  datagram[2] = (uint8_t) EventSequence;
+  datagram[3] = (uint8_t) (EventSequence >> 8);
+  memcpy (datagram + UDP_HEADER, data, length);
+  EventSequence++;
+
+  send (Peers[LastPeer].Address, Peers[LastPeer].Port, datagram, UDP_HEADER + length);
+}
+
+//=== findPeer ============================================
+
+int UdpLink::findPeer (IPAddress address, uint16_t port)
+{
+  int  oldest = -1;
+
+  for (int i=0; i<UDP_PEERS; i++)
+    if (Peers[i].Used && Peers[i].Address == address && Peers[i].Port == port)
+      return i;
+
+  // A new host takes a free entry, or the one heard from longest ago that isn't running a command
+  for (int i=0; i<UDP_PEERS; i++)
+  {
+    if (!Peers[i].Used)
+    {
+      oldest = i;
+      break;
+    }
+
+    if (!Peers[i].Pending && (oldest < 0 || (long) (Peers[i].HeardMillis - Peers[oldest].HeardMillis) < 0L))
+      oldest = i;
+  }
+
+  if (oldest >= 0)
+  {
+    Peers[oldest].Used           = true;
+    Peers[oldest].Pending        = false;
+    Peers[oldest].Address        = address;
+    Peers[oldest].Port           = port;
+    Peers[oldest].Sequence       = -1L;
+    Peers[oldest].ResponseLength = 0;
+    Peers[oldest].HeardMillis    = millis ();
+
+    if (LastPeer == oldest)
+      LastPeer = -1;
+  }
+
+  return oldest;
+}
+
+//=== send ================================================
+
+void UdpLink::send (IPAddress address, uint16_t port, const uint8_t *datagram, int length)
+{
+  Socket.beginPacket (address, port);
+  Socket.write (datagram, length);
+  Socket.endPacket ();
+}
+
+#endif
@@ -0,0 +1,110 @@
+//=============================================================================
+//
+//     FILE : UdpLink.h
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Command and telemetry transport over Wi-Fi UDP (ESP32, -D UDP_LINK).
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  Each datagram carries one text command (or ';' batch) or one binary frame, after a 4-byte header:
+//
+//      ┌──────┬──────┬──────────┬──────────────────────────────────┐
+//      │ 0x5A │ kind │ sequence │ text command or binary frame     │
+//      └──────┴──────┴──────────┴──────────────────────────────────┘
+//        sync   UdpKind  16-bit LE
+//
+//    - Every UDP_COMMAND gets exactly one UDP_RESPONSE with the same sequence number, sent back to
+//      the address and port it came from: the text response (possibly empty) or the binary response frame.
+//    - Retries are idempotent.  The last sequence number and response of each peer are kept, so
+//      a command whose response was lost is answered again from that copy instead of being run twice.
+//      A retry that arrives while the command is still running is ignored.  Use a new sequence
+//      number for each new command and wait for its response (or give up) before the next.
+//    - The socket also joins a multicast group on the same port.  One datagram sent to the group
+//      reaches every board at once, so several controllers can start a move together.  Each board
+//      answers it to the sender.
+//    - RunReturn events (UDP_EVENT, text "result,position") and telemetry frames (UDP_TELEMETRY)
+//      go to the peer that sent the last command, numbered by their own counter.
+//
+//  Up to UDP_PEERS hosts are tracked; a new one replaces the one heard from longest ago (never one
+//  whose command is still running).
+//
+//  The link is not thread safe: main.cpp uses it only from the command task, on the core that does
+//  not step the motor, next to the Wi-Fi stack.
+//
+//=============================================================================
+
+#ifndef UDP_LINK_H
+#define UDP_LINK_H
+
+#if defined(UDP_LINK)
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include "StepperMotor.h"
+#include "CommandLink.h"
+
+#define UDP_SYNC         0x5A   // First byte of every datagram
+#define UDP_HEADER       4      // Sync, kind, 16-bit sequence number
+
+#ifndef UDP_PEERS
+  #define UDP_PEERS      4      // Hosts with a cached response
+#endif
+
+#ifndef UDP_MAX_PAYLOAD
+  #define UDP_MAX_PAYLOAD  (EC_BATCH_LENGTH - 1)  // Longest command or response (chars, or a binary frame)
+#endif
+
+enum UdpKind
+{
+  UDP_COMMAND,     // Host to board: text command or binary frame
+  UDP_RESPONSE,    // Board to host: the response, same sequence number as the command
+  UDP_EVENT,       // Board to host: RunReturn event, "result,position"
+  UDP_TELEMETRY    // Board to host: BIN_TELEMETRY frame
+};
+
+struct UdpPeer
+{
+  IPAddress      Address;
+  uint16_t       Port;
+  long           Sequence;            // Sequence number of the last command (-1 = none yet)
+  bool           Used;                // The entry holds a peer
+  bool           Pending;             // The last command is still running (no response yet)
+  unsigned long  HeardMillis;         // When the last command arrived
+  uint8_t        Response[UDP_HEADER + UDP_MAX_PAYLOAD];  // Response datagram of the last command
+  int            ResponseLength;
+};
+
+//=========================================================
+//  class UdpLink
+//=========================================================
+
+class UdpLink
+{
+  private:
+    WiFiUDP    Socket;
+    UdpPeer    Peers[UDP_PEERS];
+    int        LastPeer;              // Peer of the last command (-1 = none), gets the events
+    uint16_t   EventSequence;
+    uint8_t    Datagram[UDP_HEADER + UDP_MAX_PAYLOAD + 1];  // Received datagram, +1 for the NUL of a text command
+
+    int        findPeer  (IPAddress address, uint16_t port);  // Peer entry of a host, adding it if new (-1 = no free entry)
+    void       send      (IPAddress address, uint16_t port, const uint8_t *datagram, int length);
+
+  public:
+    UdpLink ();
+
+    bool       Begin     (uint16_t port, IPAddress group);  // Opens the socket (Wi-Fi must be connected), returns false on failure
+    bool       Receive   (LinkPacket *packet, int *peer);   // Returns true when a new command is ready (retries are answered here)
+    void       Reply     (int peer, const uint8_t *data, int length);  // Sends (and keeps) the response to a peer's command
+    void       Forget    (int peer);                        // Drops a peer's command that wasn't run, so a retry runs it
+    void       Send      (UdpKind kind, const uint8_t *data, int length);  // Sends an event or telemetry to the last peer
+};
+
+#endif
+#endif
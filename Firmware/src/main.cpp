@@ -17,29 +17,146 @@
 
 #include <Arduino.h>
 #include "StepperMotor.h"
+#include "CommandLink.h"
+
+#if defined(DUAL_CORE)
+  #if !defined(ARDUINO_ARCH_ESP32)
+    #error "DUAL_CORE requires an ESP32 target"
+  #endif
+  #include <atomic>
+  #include "SpscQueue.h"
+#endif
+
+#if defined(UDP_LINK)
+  #if !defined(DUAL_CORE)
+    #error "UDP_LINK requires DUAL_CORE (the network runs on the command core)"
+  #endif
+  #include <WiFi.h>
+  #include "UdpLink.h"
+#endif
 
 //--- Defines ---------------------------------------------
 
-#define SERIAL_BAUDRATE       115200L
-#define MAX_COMMAND_LENGTH    20       // Update this length to hold your longest command
+#ifndef SERIAL_BAUDRATE
+  #define SERIAL_BAUDRATE     115200L  // UART only, native USB CDC always runs at full speed
+#endif
+#ifndef SERIAL_RX_BUFFER
+  #define SERIAL_RX_BUFFER    2048     // ESP32 driver receive buffer, filled from the UART/USB interrupt while loop() is busy
+#endif
+                                       // (-D LINK_MAX_PACKET=.. sets the longest command, see CommandLink.h)
+
+#if defined(UDP_LINK)
+  #if !defined(WIFI_SSID) || !defined(WIFI_PASSWORD)
+    #error "UDP_LINK needs WIFI_SSID and WIFI_PASSWORD (see the esp32-s3-udp env in platformio.ini)"
+  #endif
+  #ifndef UDP_PORT
+    #define UDP_PORT          4210           // Commands, responses, events and telemetry
+  #endif
+  #ifndef UDP_GROUP
+    #define UDP_GROUP         "239.72.83.1"  // Multicast group every board joins on UDP_PORT
+  #endif
+#endif
 
 #define DRIVER_ENABLE_PIN     2        // MCU pins going to stepper driver board
 #define DRIVER_DIRECTION_PIN  3
 #define DRIVER_STEP_PIN       4
 
+#if defined(STEP_ENCODER)
+  #define ENCODER_PIN_A           5      // Quadrature encoder on the motor shaft
+  #define ENCODER_PIN_B           6
+  #ifndef ENCODER_COUNTS_PER_REV
+    #define ENCODER_COUNTS_PER_REV  4000   // 1000-line encoder, 4 counts per line
+  #endif
+  #ifndef MOTOR_STEPS_PER_REV
+    #define MOTOR_STEPS_PER_REV     3200   // 200-step motor at 1/16 micro-stepping
+  #endif
+  #ifndef ENCODER_MAX_ERROR
+    #define ENCODER_MAX_ERROR       32     // Following error limit in steps (2 full steps), "SE" changes it
+  #endif
+#endif
+
+#if defined(DUAL_CORE)
+  #define MOTION_CORE         1        // Run() and the motion commands
+  #define COMMAND_CORE        0        // Serial I/O, queries and storage commands
+  #define MOTION_PRIORITY     (configMAX_PRIORITIES - 1)
+  #define COMMAND_PRIORITY    1
+  #define TASK_STACK          4096
+  #define PACKET_QUEUE        16       // Packets each way between the cores
+  #define EVENT_RESERVE       4        // Event slots telemetry leaves free for RunReturns
+  #define PACKET_DATA         EC_BATCH_LENGTH  // Holds a command, a text response or a binary frame
+
+  #define SOURCE_SERIAL       -1       // Packet came from (or goes to) Serial, else a UdpLink peer
+
+  enum PacketKind
+  {
+    PACKET_TEXT,    // ASCII command or response
+    PACKET_BINARY,  // Binary frame
+    PACKET_RUN,     // RunReturn event from Run()
+    PACKET_TELEMETRY  // Telemetry frame, dropped if the Serial buffer is full
+  };
+
+  enum PacketRoute
+  {
+    ROUTE_QUERY,    // Reads one word of the motor, run on the command core
+    ROUTE_MOTION,   // Changes the motion, run on the motion core
+    ROUTE_STORAGE   // Flash I/O, run on the command core while the motion core waits (at rest)
+  };
+
+  struct Packet
+  {
+    uint8_t  Kind;               // PacketKind
+    uint8_t  Route;              // PacketRoute of a command
+    uint8_t  Length;             // Bytes in Data
+    int8_t   Result;             // RunReturn of a PACKET_RUN
+    int8_t   Source;             // SOURCE_SERIAL or the UdpLink peer of a command, kept in its response
+    long     Position;           // Absolute position of a PACKET_RUN
+    uint8_t  Data[PACKET_DATA];
+  };
+
+  static_assert (PACKET_DATA >= LINK_MAX_PACKET && PACKET_DATA >= EC_BATCH_LENGTH && PACKET_DATA >= BIN_MAX_FRAME,
+                 "PACKET_DATA must hold a command, a response and a binary frame");
+  static_assert (PACKET_DATA <= 256, "Packet lengths are 8 bits");
+#endif
+
 //--- Globals ---------------------------------------------
 
-char        commandString[MAX_COMMAND_LENGTH] = "";  // Command from Serial client (Chrome browser web app)
-int         commandLength = 0;
-char        nextChar;
-const char  *response;
+CommandLink    *Link;                        // Frames commands from the Serial client (Chrome browser web app)
+LinkPacket     command;                     // Text command or binary frame (first byte is BIN_SYNC)
+const char     *response;
+
+const uint8_t  *binaryResponse;
+int            binaryResponseLength;
+const uint8_t  *telemetryFrame;
+int            telemetryLength;
 
 // A StepperMotor object
 StepperMotor  *MyStepper;
 
+#if defined(DUAL_CORE)
+SpscQueue<Packet, PACKET_QUEUE>  Commands;  // Command core to motion core (motion and storage commands)
+SpscQueue<Packet, PACKET_QUEUE>  Responses; // Motion core to command core, one for each command (never dropped)
+SpscQueue<Packet, PACKET_QUEUE>  Events;    // Motion core to command core (RunReturns and telemetry)
+SpscQueue<Packet, 2>             Storage;   // Motion core to command core, a storage command handed back at rest
+std::atomic<bool>                StorageDone;  // The command core ran it, the motion core may go on
+#endif
+
+#if defined(UDP_LINK)
+UdpLink        Udp;                         // Wi-Fi transport, used only by the command task
+bool           UdpReady = false;            // Socket is open (after Wi-Fi connects)
+#endif
+
 //--- Declarations -----------------------------------------
 
-bool commandReady ();
+void reportRunReturn (RunReturn rr, long position);
+
+#if defined(DUAL_CORE)
+void motionTask  (void *parameter);
+void commandTask (void *parameter);
+bool receive     (Packet *packet);
+int  route       (const Packet *packet, bool *moves);
+void execute     (Packet *packet);
+void sendPacket  (Packet *packet);
+#endif
 
 
 //==========================================================
@@ -48,16 +165,41 @@ bool commandReady ();
 void setup ()
 {
   //Initialize serial and wait for port to open:
-  Serial.begin (115200);
+#if defined(ARDUINO_ARCH_ESP32)
+  Serial.setRxBufferSize (SERIAL_RX_BUFFER);  // Must come before begin()
+#endif
+  Serial.begin (SERIAL_BAUDRATE);
   while (!Serial);  // wait for serial port to connect
 
+  Link = new CommandLink (&Serial);
+
   // Init and enable the motor driver (energize)
   MyStepper = new StepperMotor (DRIVER_ENABLE_PIN, DRIVER_DIRECTION_PIN, DRIVER_STEP_PIN);
   MyStepper->Enable ();
+  MyStepper->LoadConfig ();  // Saved limits and ramp, and a saved position if one is waiting (see "SC")
+
+#if defined(STEP_ENCODER)
+  // Lost steps stop the motor with a FOLLOWING_ERROR event
+  if (MyStepper->AttachEncoder (ENCODER_PIN_A, ENCODER_PIN_B, ENCODER_COUNTS_PER_REV, MOTOR_STEPS_PER_REV))
+    MyStepper->SetFollowingError (ENCODER_MAX_ERROR, ENCODER_STOP);
+#endif
 
   // Ready for commands
   Serial.print (MyStepper->GetVersion());
   Serial.println (" : ready");
+
+#if defined(UDP_LINK)
+  // Connects in the background, the command task opens the socket once it's up
+  WiFi.mode (WIFI_STA);
+  WiFi.setSleep (false);  // Modem sleep would add up to a beacon interval of latency
+  WiFi.begin (WIFI_SSID, WIFI_PASSWORD);
+#endif
+
+#if defined(DUAL_CORE)
+  // The motion engine gets a core of its own, Serial I/O runs on the other one
+  xTaskCreatePinnedToCore (motionTask , "motion"  , TASK_STACK, NULL, MOTION_PRIORITY , NULL, MOTION_CORE);
+  xTaskCreatePinnedToCore (commandTask, "commands", TASK_STACK, NULL, COMMAND_PRIORITY, NULL, COMMAND_CORE);
+#endif
 }
 
 
@@ -66,78 +208,413 @@ void setup ()
 //==========================================================
 void loop ()
 {
+#if defined(DUAL_CORE)
+  // Everything runs in the two tasks
+  vTaskDelete (NULL);
+#endif
+
   // Keep the motor running by calling Run()
-  switch (MyStepper->Run ())
+  RunReturn rr = MyStepper->Run ();
+  if (rr != OKAY)
+    reportRunReturn (rr, MyStepper->GetAbsolutePosition ());
+
+  // Telemetry frames are dropped rather than waiting for room in the transmit buffer
+  telemetryFrame = MyStepper->TakeTelemetry (&telemetryLength);
+  if (telemetryFrame != NULL && Serial.availableForWrite () >= telemetryLength)
+    Serial.write (telemetryFrame, telemetryLength);
+
+  // Check for any commands from UI app
+  if (Link->Receive (&command))
+  {
+    if (command.TooLong)
+    {
+      Serial.println ("ERROR: Command is too long.");
+      return;
+    }
+
+    if (command.Binary)
+    {
+      // Binary frames always get a binary response frame
+      binaryResponse = MyStepper->ExecuteBinary (command.Data, command.Length, &binaryResponseLength);
+      Serial.write (binaryResponse, binaryResponseLength);
+      return;
+    }
+
+    response = MyStepper->ExecuteCommand ((const char *) command.Data);
+
+    // Handle response
+    if (strlen (response) > 0)
+      Serial.println (response);
+  }
+}
+
+//--- reportRunReturn -------------------------------------
+
+void reportRunReturn (RunReturn rr, long position)
+{
+  switch (rr)
   {
     case RUN_COMPLETE:
       Serial.print ("Run complete, position = ");
-      Serial.println (MyStepper->GetAbsolutePosition ());
+      Serial.println (position);
       break;
 
     case RANGE_ERROR_LOWER:
       Serial.print ("Lower Range Error, position = ");
-      Serial.println (MyStepper->GetAbsolutePosition ());
+      Serial.println (position);
       break;
 
     case RANGE_ERROR_UPPER:
       Serial.print ("Upper Range Error, position = ");
-      Serial.println (MyStepper->GetAbsolutePosition ());
+      Serial.println (position);
       break;
 
     case LIMIT_SWITCH_LOWER:
       Serial.print ("Lower Limit Switch Triggered, position = ");
-      Serial.println (MyStepper->GetAbsolutePosition ());
+      Serial.println (position);
       break;
 
     case LIMIT_SWITCH_UPPER:
       Serial.print ("Upper Limit Switch Triggered, position = ");
-      Serial.println (MyStepper->GetAbsolutePosition ());
+      Serial.println (position);
+      break;
+
+    case HOME_COMPLETE:
+      Serial.println ("Home complete");
+      break;
+
+    case FOLLOWING_ERROR:
+      Serial.print ("Following Error (steps lost), position = ");
+      Serial.println (position);
+      break;
+
+    case STEP_ERROR:
+      Serial.print ("Step Error (steps not sent), position = ");
+      Serial.println (position);
+      break;
+
+    case MOTION_ABORTED:
+      Serial.print ("Motion Aborted (motor disabled), position = ");
+      Serial.println (position);
+      break;
+
+    default:
       break;
   }
+}
 
-  // Check for any commands from UI app
-  if (commandReady ())
+#if defined(DUAL_CORE)
+//--- motionTask ------------------------------------------
+//  Runs the motor and the commands that change its motion.  Queries and storage commands
+//  are run on the command core, so no flash I/O and no query formatting happen here.
+//  Commands arrive and results leave through the lock-free queues.
+
+void motionTask (void *parameter)
+{
+  Packet          packet;
+  const uint8_t  *frame;
+  int             frameLength;
+
+  for (;;)
   {
-    response = MyStepper->ExecuteCommand (commandString);
+    RunReturn rr = MyStepper->Run ();
+    if (rr != OKAY)
+    {
+      packet.Kind     = PACKET_RUN;
+      packet.Length   = 0;
+      packet.Result   = (int8_t) rr;
+      packet.Position = MyStepper->GetAbsolutePosition ();
+      Events.Push (packet);  // Dropped only if the command core is that far behind
+    }
 
-    // Handle response
-    if (strlen (response) > 0)
-      Serial.println (response);
+    // Telemetry is dropped first, so a full queue still has room for RunReturns
+    frame = MyStepper->TakeTelemetry (&frameLength);
+    if (frame != NULL && Events.Free () > EVENT_RESERVE)
+    {
+      packet.Kind   = PACKET_TELEMETRY;
+      packet.Length = (uint8_t) frameLength;
+      memcpy (packet.Data, frame, frameLength);
+      Events.Push (packet);
+    }
+
+    // A command is only taken when its response has room, so no response is ever dropped
+    // (a host waiting on one, or a UdpLink peer Pending on it, would wait forever)
+    if (Responses.Free () > 0 && Commands.Pop (&packet))
+    {
+      if (packet.Route == ROUTE_STORAGE && MyStepper->GetState () != MS_RUNNING)
+      {
+        // At rest: hand it back to the command core and leave the motor alone until it has run
+        // (while running, SaveConfig() and LoadConfig() refuse at once without touching storage)
+        StorageDone.store (false, std::memory_order_relaxed);
+        Storage.Push (packet);
+        while (!StorageDone.load (std::memory_order_acquire))
+          vTaskDelay (1);
+        continue;
+      }
+
+      execute (&packet);
+      Responses.Push (packet);
+    }
 
-    // Reset for a new command
-    commandLength = 0;
+    // Let the idle task have the core while the motor is stopped
+    if (MyStepper->GetState () != MS_RUNNING && Commands.IsEmpty ())
+      vTaskDelay (1);
   }
 }
 
-//--- commandReady ----------------------------------------
+//--- commandTask -----------------------------------------
+//  Serial (and UDP) parsing and printing, away from the motion core.  Each command is
+//  routed: one-word queries run here once the motion core has answered every command sent
+//  before them (responses stay in order), motion commands and the other queries are passed
+//  to the motion core, and storage commands come back here to run while the motion core
+//  waits with the motor at rest.
 
-bool commandReady ()
+void commandTask (void *parameter)
 {
-  while (Serial.available ())
+  Packet  packet;
+  Packet  held;                    // A command waiting for its turn
+  bool    holding  = false;
+  int     inFlight = 0;            // Commands passed to the motion core and not yet answered
+  bool    moves;
+
+#if defined(UDP_LINK)
+  IPAddress  group;
+
+  group.fromString (UDP_GROUP);
+#endif
+
+  for (;;)
   {
-    nextChar = (char) Serial.read ();
+#if defined(UDP_LINK)
+    if (!UdpReady && WiFi.status () == WL_CONNECTED)
+      UdpReady = Udp.Begin (UDP_PORT, group);
+#endif
+
+    // Print the responses, then the RunReturn events and telemetry from the motion core
+    while (Responses.Pop (&packet) || Events.Pop (&packet))
+    {
+      if (packet.Kind == PACKET_TEXT || packet.Kind == PACKET_BINARY)
+        inFlight--;
+      sendPacket (&packet);
+    }
 
-    if (nextChar != '\r')  // ignore CR's
+    // A storage command handed back: the responses before it were pushed first
+    if (Storage.Pop (&packet))
     {
-      if (nextChar == '\n')
+      while (Responses.Pop (&held))
       {
-        // Command is ready, terminate it
-        commandString[commandLength] = 0;
-        return true;
+        inFlight--;
+        sendPacket (&held);
       }
 
-      // Add char to end of buffer
-      if (commandLength < MAX_COMMAND_LENGTH - 1)
-        commandString[commandLength++] = nextChar;
-      else  // too long
+      execute (&packet);
+      StorageDone.store (true, std::memory_order_release);
+      inFlight--;
+      sendPacket (&packet);
+    }
+
+    // Every complete packet waiting, so a burst is routed in one pass
+    while (holding || receive (&held))
+    {
+      holding = true;
+
+      held.Route = (uint8_t) route (&held, &moves);
+
+      if (held.Route == ROUTE_QUERY)
       {
-        Serial.println ("ERROR: Command is too long.");
+        if (inFlight > 0)
+          break;  // Held until the motion core has answered the commands before it
 
-        // Ignore and start new command
-        commandLength = 0;
+        execute (&held);
+        sendPacket (&held);
       }
+      else
+      {
+        // A move leaves a saved position: clear it here, not in the motion core
+        if (moves)
+          MyStepper->ForgetPosition ();
+
+        if (Commands.Push (held))
+          inFlight++;
+#if defined(UDP_LINK)
+        else if (held.Source != SOURCE_SERIAL)
+          Udp.Forget (held.Source);  // Not run, so the host's retry will run it
+#endif
+        else
+          Serial.println ("ERROR: Command queue is full.");
+      }
+
+      holding = false;
     }
+
+    vTaskDelay (1);
   }
+}
+
+//--- receive ---------------------------------------------
+//  The next command from Serial (or a UdpLink peer), false if none is waiting.
+
+bool receive (Packet *packet)
+{
+  int  source = SOURCE_SERIAL;
+
+  for (;;)
+  {
+    if (Link->Receive (&command))
+    {
+      if (command.TooLong)
+      {
+        Serial.println ("ERROR: Command is too long.");
+        continue;
+      }
+    }
+#if defined(UDP_LINK)
+    // Retries are answered inside Receive(), only new commands come out
+    else if (!UdpReady || !Udp.Receive (&command, &source))
+      return false;
+#else
+    else
+      return false;
+#endif
+
+    packet->Kind   = command.Binary ? PACKET_BINARY : PACKET_TEXT;
+    packet->Source = (int8_t) source;
+    packet->Length = (uint8_t) command.Length;
+    memcpy (packet->Data, command.Data, command.Binary ? command.Length : command.Length + 1);
+
+    return true;
+  }
+}
+
+//--- route -----------------------------------------------
+//  Where a command runs, and whether it can start a move.  Only the queries that read one
+//  word (a position, a limit or a constant) run on the command core: the rest read several
+//  fields that the motion core changes together (the ramp, the queue, the statistics), so
+//  they are passed to it like motion commands.  A batch is a query only if all of its
+//  commands are, and a storage command if any of them is.  A frame too short to have an
+//  opcode only gets an error response, so it is run as a query (a bad CRC is refused by
+//  ExecuteBinary() on either core, before it touches the motor).
+
+int route (const Packet *packet, bool *moves)
+{
+  const char *c;
+  int         result = ROUTE_QUERY;
+
+  *moves = false;
+
+  if (packet->Kind == PACKET_BINARY)
+  {
+    if (packet->Length < BIN_HEADER_LENGTH)
+      return ROUTE_QUERY;
+
+    switch (packet->Data[1])
+    {
+      case BIN_GET_ABSOLUTE   : case BIN_GET_RELATIVE   : case BIN_GET_LOWER_LIMIT: case BIN_GET_UPPER_LIMIT:
+      case BIN_GET_VERSION    : case BIN_GET_MAX_RATE   :
+        return ROUTE_QUERY;
+
+      case BIN_SAVE_CONFIG    : case BIN_LOAD_CONFIG    :
+        return ROUTE_STORAGE;
 
-  return false;
+      case BIN_FIND_HOME      : case BIN_ROTATE_ABSOLUTE: case BIN_ROTATE_RELATIVE: case BIN_ROTATE_HOME    :
+      case BIN_ROTATE_LOWER   : case BIN_ROTATE_UPPER   : case BIN_QUEUE_ABSOLUTE : case BIN_QUEUE_RELATIVE :
+      case BIN_STREAM_SEGMENT :
+        *moves = true;
+        return ROUTE_MOTION;
+
+      default:
+        return ROUTE_MOTION;
+    }
+  }
+
+  // Text: the 2-char code of each command in the batch
+  for (c=(const char *) packet->Data; c != NULL; c=strchr (c, ';'))
+  {
+    if (*c == ';')
+      c++;
+    if (c[0] == 0 || c[1] == 0)
+      continue;  // Answered "Bad command" without touching the motor
+
+    switch (COMMAND_CODE (c[0], c[1]))
+    {
+      case COMMAND_CODE ('G','A'): case COMMAND_CODE ('G','R'): case COMMAND_CODE ('G','L'):
+      case COMMAND_CODE ('G','U'): case COMMAND_CODE ('G','M'): case COMMAND_CODE ('G','V'):
+        break;
+
+      case COMMAND_CODE ('S','C'): case COMMAND_CODE ('L','C'):
+        return ROUTE_STORAGE;
+
+      case COMMAND_CODE ('R','A'): case COMMAND_CODE ('R','R'): case COMMAND_CODE ('R','H'):
+      case COMMAND_CODE ('R','L'): case COMMAND_CODE ('R','U'): case COMMAND_CODE ('Q','A'):
+      case COMMAND_CODE ('Q','R'): case COMMAND_CODE ('F','H'): case COMMAND_CODE ('S','Q'):
+        *moves = true;
+        result = ROUTE_MOTION;
+        break;
+
+      default:
+        result = ROUTE_MOTION;
+        break;
+    }
+  }
+
+  return result;
+}
+
+//--- execute ---------------------------------------------
+//  Runs a command, its response replaces it in the packet.
+
+void execute (Packet *packet)
+{
+  if (packet->Kind == PACKET_BINARY)
+  {
+    int             frameLength;
+    const uint8_t  *frame = MyStepper->ExecuteBinary (packet->Data, packet->Length, &frameLength);
+
+    packet->Length = (uint8_t) frameLength;
+    memcpy (packet->Data, frame, frameLength);
+  }
+  else
+  {
+    const char *text = MyStepper->ExecuteCommand ((const char *) packet->Data);
+
+    packet->Length = (uint8_t) strlen (text);
+    memcpy (packet->Data, text, packet->Length + 1);
+  }
+}
+
+//--- sendPacket ------------------------------------------
+//  A response goes back where its command came from, events and telemetry to every client.
+
+void sendPacket (Packet *packet)
+{
+#if defined(UDP_LINK)
+  char  event[24];
+
+  if ((packet->Kind == PACKET_TEXT || packet->Kind == PACKET_BINARY) && packet->Source != SOURCE_SERIAL)
+  {
+    Udp.Reply (packet->Source, packet->Data, packet->Length);
+    return;
+  }
+
+  if (UdpReady && packet->Kind == PACKET_RUN)
+  {
+    snprintf (event, sizeof (event), "%d,%ld", packet->Result, packet->Position);
+    Udp.Send (UDP_EVENT, (const uint8_t *) event, strlen (event));
+  }
+  else if (UdpReady && packet->Kind == PACKET_TELEMETRY)
+    Udp.Send (UDP_TELEMETRY, packet->Data, packet->Length);
+#endif
+
+  if (packet->Kind == PACKET_RUN)
+    reportRunReturn ((RunReturn) packet->Result, packet->Position);
+  else if (packet->Kind == PACKET_BINARY)
+    Serial.write (packet->Data, packet->Length);
+  else if (packet->Kind == PACKET_TELEMETRY)
+  {
+    if (Serial.availableForWrite () >= packet->Length)
+      Serial.write (packet->Data, packet->Length);
+  }
+  else if (packet->Length > 0)
+    Serial.println ((const char *) packet->Data);
 }
+#endif
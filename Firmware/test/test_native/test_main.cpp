@@ -0,0 +1,1788 @@
+//=============================================================================
+//
+//     FILE : test_main.cpp
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Host verification and Run() benchmarks for the native env.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  Run with:  pio test -e native
+//
+//  Moves are run against the mock Arduino layer (lib/ArduinoMock): each Run() call advances
+//  the virtual clock by RUN_PERIOD microseconds, as a tight loop() would, and the Step pin
+//  writes are read back to check step counts and the interval profile.
+//
+//  The benchmarks time Run() and ExecuteCommand() on the host CPU.  Host times aren't target
+//  times, but a regression in the per-call cost shows up here just the same.
+//
+//=============================================================================
+
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "StepperMotor.h"
+#include "StepperScheduler.h"
+#include "StepperGroup.h"
+#include "SpscQueue.h"
+#include "CommandLink.h"
+#include <EEPROM.h>
+#include "driver/pulse_cnt.h"
+
+#define ENABLE_PIN     2
+#define DIRECTION_PIN  3
+#define STEP_PIN       4
+#define LL_SWITCH_PIN  5
+#define UL_SWITCH_PIN  6
+
+#define RUN_PERIOD     1L         // Virtual micros per Run() call
+#define RUN_LIMIT      100000000L // Run() calls before a move is considered stuck
+#define MAX_STEPS      45000L
+
+static unsigned long  StepTimes[MAX_STEPS];
+
+//=== Helpers =============================================
+
+static RunReturn runMove (StepperMotor *motor)
+{
+  // Calls Run() until the move is complete, returns its RunReturn
+  RunReturn rr = OKAY;
+
+  for (long i=0; i<RUN_LIMIT && rr == OKAY; i++)
+  {
+    rr = motor->Run ();
+    MockAdvance (RUN_PERIOD);
+  }
+
+  return rr;
+}
+
+static long stepTimes ()
+{
+  return MockRisingEdges (STEP_PIN, StepTimes, MAX_STEPS);
+}
+
+static double nowNanos ()
+{
+  return std::chrono::duration<double, std::nano> (std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+void setUp ()
+{
+  MockReset ();
+}
+
+void tearDown ()
+{
+}
+
+//=== Step Counts =========================================
+
+void test_relative_move_steps ()
+{
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  motor.Enable ();
+  motor.SetRamp (5);
+  motor.RotateRelative (20000L, 3000);
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (20000L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (20000L, stepTimes ());
+
+  motor.RotateAbsolute (-500L, 2000);
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (-500L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (40500L, stepTimes ());
+}
+
+void test_queued_moves_steps ()
+{
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  // Refused, not left in the queue, while Disabled (not homed) or E-Stopped
+  TEST_ASSERT_FALSE (motor.QueueAbsolute (2000L, 3000));
+  TEST_ASSERT_FALSE (motor.QueueRelative (100L, 3000));
+  TEST_ASSERT_EQUAL (0, motor.GetQueueDepth ());
+  motor.Enable ();
+  motor.EStop ();
+  TEST_ASSERT_FALSE (motor.QueueAbsolute (2000L, 3000));
+  TEST_ASSERT_EQUAL (0, motor.GetQueueDepth ());
+  TEST_ASSERT_EQUAL (0L, stepTimes ());
+
+  motor.Enable ();
+  motor.SetRamp (5);
+  motor.QueueAbsolute (2000L, 3000);
+  motor.QueueAbsolute (5000L, 2000);
+  motor.QueueAbsolute (9000L, 3000);
+  motor.QueueRelative (-200L, 1000);
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (8800L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (9200L, stepTimes ());
+  TEST_ASSERT_EQUAL (0, motor.GetQueueDepth ());
+}
+
+void test_limit_switch_stops ()
+{
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN, LL_SWITCH_PIN, UL_SWITCH_PIN);
+  RunReturn     rr = OKAY;
+
+  motor.Enable ();
+  motor.SetRamp (0);
+  motor.RotateRelative (5000L, 1000);
+
+  // Press the upper switch after 100 steps
+  for (long i=0; i<RUN_LIMIT && rr == OKAY; i++)
+  {
+    if (MockLevels[UL_SWITCH_PIN] == HIGH && motor.GetAbsolutePosition () == 100L)
+      MockSetLevel (UL_SWITCH_PIN, LOW);
+
+    rr = motor.Run ();
+    MockAdvance (RUN_PERIOD);
+  }
+
+  TEST_ASSERT_EQUAL (LIMIT_SWITCH_UPPER, rr);
+#if defined(LIMIT_INTERRUPTS)
+  TEST_ASSERT_EQUAL (100L, stepTimes ());  // The latch stops it before the next step
+#else
+  TEST_ASSERT_LESS_OR_EQUAL (101L, stepTimes ());
+#endif
+}
+
+void test_limit_switch_drive_off ()
+{
+  // A motor resting on a pressed switch can drive off it, but not further into it
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN, LL_SWITCH_PIN, UL_SWITCH_PIN);
+
+  motor.Enable ();
+  motor.SetRamp (0);
+  MockSetLevel (LL_SWITCH_PIN, LOW);
+
+  motor.RotateRelative (-100L, 1000);
+  TEST_ASSERT_EQUAL (LIMIT_SWITCH_LOWER, runMove (&motor));
+#if defined(LIMIT_INTERRUPTS)
+  TEST_ASSERT_EQUAL (0L, stepTimes ());    // Latched as the rotation starts
+#else
+  TEST_ASSERT_LESS_OR_EQUAL (1L, stepTimes ());
+#endif
+
+  MockReset ();
+  MockSetLevel (LL_SWITCH_PIN, LOW);
+  long start = motor.GetAbsolutePosition ();
+
+  motor.RotateRelative (200L, 1000);
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (start + 200L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (200L, stepTimes ());
+}
+
+//=== Homing ==============================================
+
+#define HOME_SWITCH   -1000L      // The simulated lower switch is pressed at and below this position
+#define HOME_FAST     2000L       // Homing speeds (steps per second)
+#define HOME_SLOW     200L
+#define HOME_STEPS    2000
+
+static long           HomePositions[HOME_STEPS];  // Position after each homing step
+static unsigned long  HomeTimes[HOME_STEPS];      // and its time
+static long           HomeSteps;
+
+static RunReturn runHoming (StepperMotor *motor, long stopAt, void (*stop) (StepperMotor *motor))
+{
+  // Like runMove(), with the lower switch following the position.  Records each step, and
+  // calls stop() (if any) once stopAt steps are made, then calls Run() for 100ms more at most.
+  // The switch changes after the Run() call that made the step, and Run() reads it right after
+  // each step, so it is seen one step later: pressed at HOME_SWITCH - 1 going down, released at
+  // HOME_SWITCH + 2 going up.
+  RunReturn rr    = OKAY;
+  long      last  = motor->GetAbsolutePosition ();
+  long      limit = RUN_LIMIT;
+
+  HomeSteps = 0L;
+  for (long i=0; i<limit && rr == OKAY; i++)
+  {
+    if (stop != NULL && HomeSteps == stopAt)
+    {
+      stop (motor);
+      stop  = NULL;
+      limit = i + 100000L / RUN_PERIOD;
+    }
+
+    rr = motor->Run ();
+    MockAdvance (RUN_PERIOD);
+
+    long position = motor->GetAbsolutePosition ();
+    if (position != last && rr != HOME_COMPLETE && HomeSteps < HOME_STEPS)
+    {
+      HomePositions[HomeSteps] = position;
+      HomeTimes[HomeSteps++]   = MockMicros;
+      last                     = position;
+
+      if ((position <= HOME_SWITCH) != (MockLevels[LL_SWITCH_PIN] == LOW))
+        MockSetLevel (LL_SWITCH_PIN, (position <= HOME_SWITCH) ? LOW : HIGH);
+    }
+  }
+
+  return rr;
+}
+
+static long homingPhase (long from, long direction, long interval, long endPosition)
+{
+  // Checks one phase from step 'from' on, returns the step after it.  Every step moves one
+  // position that way, 'interval' apart after the first (a phase starts with an immediate step),
+  // until endPosition.  A reversal's 10µs Direction pin hold may shorten the next interval.
+  long i;
+
+  for (i=from; i<HomeSteps; i++)
+  {
+    long previous = (i == 0L) ? 0L : HomePositions[i - 1];
+
+    TEST_ASSERT_EQUAL (direction, HomePositions[i] - previous);
+    if (i > from)
+      TEST_ASSERT_INT32_WITHIN (10L + RUN_PERIOD, interval, HomeTimes[i] - HomeTimes[i - 1]);  // 10µs direction hold
+
+    if (HomePositions[i] == endPosition)
+      return i + 1L;
+  }
+
+  TEST_ASSERT_EQUAL (endPosition, HomePositions[HomeSteps - 1]);  // Never reached
+  return i;
+}
+
+static void eStopMotor   (StepperMotor *motor) { motor->EStop (); }
+static void disableMotor (StepperMotor *motor) { motor->Disable (); }
+static void pressUpper   (StepperMotor *motor) { (void) motor; MockSetLevel (UL_SWITCH_PIN, LOW); }
+
+static void startHoming (StepperMotor *motor)
+{
+  motor->SetRamp (0);
+  motor->SetHomingSpeed (HOME_FAST, HOME_SLOW);
+  motor->FindHome ();
+  TEST_ASSERT_EQUAL (MS_RUNNING, motor->GetState ());
+  TEST_ASSERT_FALSE (motor->IsHomed ());
+}
+
+void test_find_home ()
+{
+  // Fast seek down onto the switch, slow back-off until it releases and clear of it,
+  // slow re-approach, slow release and a few steps more, then HOME is set there
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN, LL_SWITCH_PIN, UL_SWITCH_PIN);
+  long          step;
+
+  startHoming (&motor);
+  TEST_ASSERT_EQUAL (HOME_COMPLETE, runHoming (&motor, 0L, NULL));
+
+  step = homingPhase (0L,   -1L, 1000000L / HOME_FAST, HOME_SWITCH - 1L);                          // Seek
+  step = homingPhase (step,  1L, 1000000L / HOME_SLOW, HOME_SWITCH + 2L);                          // Back-off
+  step = homingPhase (step,  1L, 1000000L / HOME_SLOW, HOME_SWITCH + 2L + HOMING_BACKOFF_STEPS);   // Clear
+  step = homingPhase (step, -1L, 1000000L / HOME_SLOW, HOME_SWITCH - 1L);                          // Approach
+  step = homingPhase (step,  1L, 1000000L / HOME_SLOW, HOME_SWITCH + 2L);                          // Release
+  step = homingPhase (step,  1L, 1000000L / HOME_SLOW, HOME_SWITCH + 2L + 10L);                    // Final steps
+  TEST_ASSERT_EQUAL (HomeSteps, step);
+
+  TEST_ASSERT_EQUAL (MS_ENABLED, motor.GetState ());
+  TEST_ASSERT_TRUE (motor.IsHomed ());
+  TEST_ASSERT_EQUAL (0L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (HomeSteps, stepTimes ());
+}
+
+void test_find_home_cancelled ()
+{
+  // E-Stop during the seek, Disable during the re-approach: no step after it, and not homed
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN, LL_SWITCH_PIN, UL_SWITCH_PIN);
+  long          approach = 1L - HOME_SWITCH + 3L + HOMING_BACKOFF_STEPS;  // Steps before the re-approach
+
+  startHoming (&motor);
+  TEST_ASSERT_EQUAL (OKAY, runHoming (&motor, 300L, eStopMotor));
+  TEST_ASSERT_EQUAL (MS_ESTOPPED, motor.GetState ());
+  TEST_ASSERT_EQUAL (300L, stepTimes ());
+  TEST_ASSERT_FALSE (motor.IsHomed ());
+
+  // Homing doesn't resume with the motor
+  motor.Enable ();
+  TEST_ASSERT_EQUAL (OKAY, runHoming (&motor, 0L, disableMotor));
+  TEST_ASSERT_EQUAL (300L, stepTimes ());
+
+  MockReset ();
+  startHoming (&motor);
+  TEST_ASSERT_EQUAL (OKAY, runHoming (&motor, approach + 50L, disableMotor));
+  TEST_ASSERT_EQUAL (MS_DISABLED, motor.GetState ());
+  TEST_ASSERT_EQUAL (HOME_SWITCH + 2L + HOMING_BACKOFF_STEPS - 50L, HomePositions[HomeSteps - 1]);
+  TEST_ASSERT_EQUAL (approach + 50L, stepTimes ());
+  TEST_ASSERT_FALSE (motor.IsHomed ());
+
+  // The upper switch while seeking down means the switches are the wrong way round
+  MockReset ();
+  startHoming (&motor);
+  TEST_ASSERT_EQUAL (LIMIT_SWITCH_UPPER, runHoming (&motor, 200L, pressUpper));
+  TEST_ASSERT_EQUAL (MS_ENABLED, motor.GetState ());
+  TEST_ASSERT_LESS_OR_EQUAL (201L, stepTimes ());
+  TEST_ASSERT_FALSE (motor.IsHomed ());
+  TEST_ASSERT_EQUAL (OKAY, runHoming (&motor, 0L, disableMotor));
+  TEST_ASSERT_EQUAL (0L, HomeSteps);
+}
+
+//=== Interval Profiles ===================================
+
+void test_constant_velocity_rate ()
+{
+  // The commanded rate must hold exactly over a long move
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  motor.Enable ();
+  motor.SetRamp (0);
+  motor.RotateRelative (30010L, 3001);
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+
+  long  n        = stepTimes ();
+  long  expected = (long) (1000000.0 * (n - 1) / 3001.0 + 0.5);
+
+  TEST_ASSERT_EQUAL (30010L, n);
+  TEST_ASSERT_INT32_WITHIN (2, expected, (long) (StepTimes[n - 1] - StepTimes[0]));
+
+  for (long i=1; i<n; i++)
+    TEST_ASSERT_INT32_WITHIN (1, 333, (long) (StepTimes[i] - StepTimes[i - 1]));
+}
+
+static void checkRampShape (long n, long cruiseInterval)
+{
+  // Intervals shrink while ramping up, hold at the cruise interval, then grow
+  long  i = 1;
+
+  while (i < n - 1 && (long) (StepTimes[i + 1] - StepTimes[i]) > cruiseInterval + 1L)
+  {
+    TEST_ASSERT_LESS_OR_EQUAL ((long) (StepTimes[i] - StepTimes[i - 1]) + 1L, (long) (StepTimes[i + 1] - StepTimes[i]));
+    i++;
+  }
+
+  long  rampUp = i;
+
+  while (i < n - 1 && (long) (StepTimes[i + 1] - StepTimes[i]) <= cruiseInterval + 1L)
+    i++;
+
+  // The ramp down takes about as many steps as the ramp up
+  TEST_ASSERT_GREATER_THAN (0L, rampUp);
+  TEST_ASSERT_INT32_WITHIN (rampUp / 20L + 2L, rampUp, n - i);
+
+  for (; i < n - 1; i++)
+    TEST_ASSERT_GREATER_OR_EQUAL ((long) (StepTimes[i] - StepTimes[i - 1]) - 1L, (long) (StepTimes[i + 1] - StepTimes[i]));
+}
+
+void test_trapezoid_profile ()
+{
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  motor.Enable ();
+  motor.SetRamp (5);
+  motor.RotateRelative (20000L, 3000);
+
+  unsigned long predicted = motor.PredictMoveTime (20000L, 3000);
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+
+  long n = stepTimes ();
+  checkRampShape (n, 334L);
+  TEST_ASSERT_INT32_WITHIN (2, predicted, (StepTimes[n - 1] - StepTimes[0]) / 1000L);
+}
+
+void test_acceleration_profile ()
+{
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  motor.Enable ();
+  motor.SetAcceleration (20000L);
+  motor.RotateRelative (20000L, 3000);
+
+  unsigned long predicted = motor.PredictMoveTime (20000L, 3000);
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+
+  long n = stepTimes ();
+  checkRampShape (n, 334L);
+  TEST_ASSERT_INT32_WITHIN (2, predicted, (StepTimes[n - 1] - StepTimes[0]) / 1000L);
+}
+
+void test_scurve_profile ()
+{
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  motor.Enable ();
+  motor.SetProfile (PROFILE_SCURVE);
+  motor.RotateRelative (20000L, 3000);
+
+  unsigned long predicted = motor.PredictMoveTime (20000L, 3000);
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+
+  long n = stepTimes ();
+  checkRampShape (n, 334L);
+  TEST_ASSERT_INT32_WITHIN (2, predicted, (StepTimes[n - 1] - StepTimes[0]) / 1000L);
+}
+
+void test_high_step_rate ()
+{
+  // Velocities past the old 4-digit field, held to the backend's limit
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  long          maxRate = motor.GetMaxStepRate ();
+  char          command[24];
+
+  TEST_ASSERT_EQUAL (MAX_STEP_RATE, maxRate);
+  TEST_ASSERT_EQUAL (maxRate, atol (motor.ExecuteCommand ("GM")));
+
+  motor.Enable ();
+  motor.SetRamp (5);
+  sprintf (command, "RR%ld,-20000", maxRate / 2L);
+  unsigned long predicted = motor.PredictMoveTime (20000L, maxRate / 2L);
+
+  TEST_ASSERT_EQUAL (0, motor.ExecuteCommand (command)[0]);
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (-20000L, motor.GetAbsolutePosition ());
+
+  long n = stepTimes ();
+  TEST_ASSERT_EQUAL (20000L, n);
+  TEST_ASSERT_INT32_WITHIN (1, 2000000L / maxRate, (long) (StepTimes[n / 2L] - StepTimes[n / 2L - 1L]));
+  TEST_ASSERT_INT32_WITHIN (2, predicted, (StepTimes[n - 1] - StepTimes[0]) / 1000L);
+
+  // Twice the limit runs at the limit
+  MockReset ();
+  motor.RotateRelative (20000L, 2L * maxRate);
+  predicted = motor.PredictMoveTime (20000L, 2L * maxRate);
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  n = stepTimes ();
+  TEST_ASSERT_EQUAL (20000L, n);
+  TEST_ASSERT_INT32_WITHIN (1, 1000000L / maxRate, (long) (StepTimes[n / 2L] - StepTimes[n / 2L - 1L]));
+  TEST_ASSERT_INT32_WITHIN (2, predicted, (StepTimes[n - 1] - StepTimes[0]) / 1000L);
+}
+
+//=== Velocity Override ===================================
+
+static RunReturn runOverride (StepperMotor *motor, long position, long percent, unsigned long *predicted)
+{
+  // Runs a move, changing its velocity (in percent) when it reaches position.
+  // predicted is set to when the move should then end (ms), if the change was accepted.
+  RunReturn  rr   = OKAY;
+  bool       done = false;
+
+  for (long i=0; i<RUN_LIMIT && rr == OKAY; i++)
+  {
+    rr = motor->Run ();
+    MockAdvance (RUN_PERIOD);
+
+    if (!done && motor->GetAbsolutePosition () >= position)
+    {
+      if (motor->OverrideVelocity ((int) percent))
+        *predicted = MockMicros / 1000UL + motor->GetRemainingTime ();
+      done = true;
+    }
+  }
+
+  return rr;
+}
+
+static void checkOverride (long n, long from, long to, long interval)
+{
+  // No jump in the step intervals after the override, the new cruise
+  // interval holds and the move still ramps down to a stop at its target
+  for (long i=from; i<n - 200L; i++)
+    TEST_ASSERT_INT32_WITHIN (30, (long) (StepTimes[i] - StepTimes[i - 1]), (long) (StepTimes[i + 1] - StepTimes[i]));
+
+  for (long i=to; i<n - 1000L; i++)
+    TEST_ASSERT_INT32_WITHIN (1, interval, (long) (StepTimes[i] - StepTimes[i - 1]));
+
+  TEST_ASSERT_GREATER_THAN (5L * interval, (long) (StepTimes[n - 1] - StepTimes[n - 2]));
+}
+
+void test_velocity_override ()
+{
+  StepperMotor   motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  unsigned long  predicted = 0UL;
+  long           n;
+
+  motor.Enable ();
+  motor.SetRamp (5);
+  TEST_ASSERT_FALSE (motor.SetVelocity (2000L));  // Not running
+
+  // Speed up from 1000 to 3000 steps/sec
+  motor.RotateRelative (20000L, 1000);
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runOverride (&motor, 5000L, 300L, &predicted));
+
+  n = stepTimes ();
+  TEST_ASSERT_EQUAL (20000L, n);
+  TEST_ASSERT_EQUAL (20000L, motor.GetAbsolutePosition ());
+  checkOverride (n, 4990L, 5200L, 333L);
+  TEST_ASSERT_INT32_WITHIN (2, predicted, MockWrites[MockNumWrites - 1].Micros / 1000UL);
+
+  // Slow down from 3000 to 1500 steps/sec with constant acceleration
+  MockReset ();
+  motor.SetAcceleration (20000L);
+  motor.RotateRelative (20000L, 3000);
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runOverride (&motor, 25000L, 50L, &predicted));
+
+  n = stepTimes ();
+  TEST_ASSERT_EQUAL (20000L, n);
+  TEST_ASSERT_EQUAL (40000L, motor.GetAbsolutePosition ());
+  checkOverride (n, 4990L, 5500L, 667L);
+  TEST_ASSERT_INT32_WITHIN (2, predicted, MockWrites[MockNumWrites - 1].Micros / 1000UL);
+}
+
+//=== Streamed Segments ===================================
+
+void test_stream_segments ()
+{
+  // Intervals follow (interval, count, add) back to back across segments
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  motor.Enable ();
+  TEST_ASSERT_TRUE (motor.QueueSegment (16000L, 10L, -800L));  // 1000µs, then 50µs shorter each step
+  TEST_ASSERT_TRUE (motor.QueueSegment (8000L, 5L, 0L));       // 500µs
+  TEST_ASSERT_TRUE (motor.QueueSegment (8000L, -4L, 0L));      // Back 4 steps
+  TEST_ASSERT_EQUAL (STREAM_BUFFER_SIZE - 3, motor.GetStreamFree ());
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (11L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (19L, stepTimes ());
+
+  for (long i=1; i<10; i++)
+    TEST_ASSERT_INT32_WITHIN (1, 1000L - 50L * i, (long) (StepTimes[i] - StepTimes[i - 1]));
+  for (long i=10; i<15; i++)
+    TEST_ASSERT_INT32_WITHIN (1, 500L, (long) (StepTimes[i] - StepTimes[i - 1]));
+  // The first step after a reversal waits 10µs for the Direction pin, the schedule is unchanged
+  TEST_ASSERT_INT32_WITHIN (1, 510L, (long) (StepTimes[15] - StepTimes[14]));
+  for (long i=16; i<19; i++)
+    TEST_ASSERT_INT32_WITHIN (1, 500L * (i - 14L), (long) (StepTimes[i] - StepTimes[14]));
+}
+
+void test_stream_flow_control ()
+{
+  // A host keeping the ring topped up streams without a gap
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  RunReturn     rr   = OKAY;
+  long          sent = 0L;
+
+  motor.Enable ();
+  for (long i=0; i<RUN_LIMIT && rr == OKAY; i++)
+  {
+    if (sent < 100L && motor.GetStreamFree () > 0)
+    {
+      TEST_ASSERT_TRUE (motor.QueueSegment (3200L, 20L, 0L));  // 200µs
+      sent++;
+    }
+
+    rr = motor.Run ();
+    MockAdvance (RUN_PERIOD);
+  }
+
+  long n = stepTimes ();
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, rr);
+  TEST_ASSERT_EQUAL (2000L, n);
+  TEST_ASSERT_INT32_WITHIN (2, 1999L * 200L, (long) (StepTimes[n - 1] - StepTimes[0]));
+
+  // A segment sent after the ring ran dry, before the stream stops, is refused rather than lost
+  TEST_ASSERT_TRUE (motor.QueueSegment (1600L, 3L, 0L));
+  for (long i=0; i<RUN_LIMIT && motor.GetAbsolutePosition () != 2003L; i++)
+  {
+    TEST_ASSERT_EQUAL (OKAY, motor.Run ());
+    MockAdvance (RUN_PERIOD);
+  }
+  TEST_ASSERT_EQUAL (MS_RUNNING, motor.GetState ());
+  TEST_ASSERT_FALSE (motor.QueueSegment (1600L, 3L, 0L));
+  TEST_ASSERT_EQUAL (0, strcmp ("Stream ending", motor.ExecuteCommand ("SQ1600,3,0")));
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, motor.Run ());
+  TEST_ASSERT_TRUE (motor.QueueSegment (1600L, 3L, 0L));  // A new stream
+}
+
+//=== Telemetry ===========================================
+
+static long frameValue (const uint8_t *frame, int index)
+{
+  // Little-endian int32 payload value of a binary frame
+  const uint8_t *bytes = frame + BIN_HEADER_LENGTH + 4 * index;
+
+  return (int32_t) (bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24));
+}
+
+void test_telemetry_frames ()
+{
+  // Every 100 steps of a 1000 step move, plus the start and the end
+  StepperMotor    motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  RunReturn       rr     = OKAY;
+  const uint8_t  *frame;
+  int             length;
+  long            positions[20];
+  long            states[20];
+  int             frames = 0;
+
+  motor.Enable ();
+  motor.SetTelemetry (0L, 100L);
+  motor.RotateRelative (1000L, 1000);
+
+  for (long i=0; i<RUN_LIMIT && rr == OKAY; i++)
+  {
+    rr = motor.Run ();
+    MockAdvance (RUN_PERIOD);
+
+    frame = motor.TakeTelemetry (&length);
+    if (frame != NULL && frames < 20)
+    {
+      TEST_ASSERT_EQUAL (BIN_HEADER_LENGTH + 12 + 1, length);
+      TEST_ASSERT_EQUAL (BIN_SYNC, frame[0]);
+      TEST_ASSERT_EQUAL (BIN_TELEMETRY, frame[1]);
+      TEST_ASSERT_EQUAL (12, frame[2]);
+
+      positions[frames] = frameValue (frame, 0);
+      states[frames]    = frameValue (frame, 2);
+      frames++;
+    }
+  }
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, rr);
+  TEST_ASSERT_EQUAL (12, frames);
+  TEST_ASSERT_EQUAL (MS_RUNNING, states[0]);
+  for (int i=1; i<11; i++)
+    TEST_ASSERT_EQUAL (100L * i, positions[i]);
+  TEST_ASSERT_EQUAL (1000L, positions[11]);
+  TEST_ASSERT_EQUAL (MS_ENABLED, states[11]);
+
+  // Unsubscribed, no more frames
+  motor.SetTelemetry (0L, 0L);
+  motor.RotateRelative (200L, 1000);
+  runMove (&motor);
+  TEST_ASSERT_TRUE (motor.TakeTelemetry (&length) == NULL);
+}
+
+//=== Scheduler ===========================================
+
+void test_scheduler_independent_moves ()
+{
+  // Three axes at their own rates, each finishing on its own
+  StepperMotor      x (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  StepperMotor      y (ENABLE_PIN, 7, 8);
+  StepperMotor      z (ENABLE_PIN, 9, 10);
+  StepperScheduler  scheduler;
+  RunReturn         rr;
+  long              completed[3] = { 0L, 0L, 0L };
+  int               events = 0;
+
+  TEST_ASSERT_TRUE (scheduler.AddMotor (&x));
+  TEST_ASSERT_TRUE (scheduler.AddMotor (&y));
+  TEST_ASSERT_TRUE (scheduler.AddMotor (&z));
+  TEST_ASSERT_FALSE (scheduler.AddMotor (&z));  // Already scheduled
+
+  x.Enable ();  y.Enable ();  z.Enable ();
+  x.SetRamp (0);
+  y.SetRamp (0);
+  z.SetRamp (5);
+  x.RotateRelative (2000L, 2000);
+  y.RotateRelative (-500L, 800);
+  z.RotateRelative (3000L, 3000);
+
+  for (long i=0; i<RUN_LIMIT && events < 3; i++)
+  {
+    rr = scheduler.Run ();
+    MockAdvance (RUN_PERIOD);
+
+    if (rr != OKAY)
+    {
+      TEST_ASSERT_EQUAL (RUN_COMPLETE, rr);
+      completed[scheduler.GetEventAxis ()] = MockMicros;
+      events++;
+    }
+  }
+
+  TEST_ASSERT_EQUAL (3, events);
+  TEST_ASSERT_FALSE (scheduler.IsRunning ());
+  TEST_ASSERT_EQUAL (2000L, x.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (-500L, y.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (3000L, z.GetAbsolutePosition ());
+
+  // The constant velocity axes keep their exact rates (a step may be held up by
+  // another axis's pulse, but it doesn't shift the steps after it)
+  TEST_ASSERT_EQUAL (2000L, stepTimes ());
+  TEST_ASSERT_INT32_WITHIN (PULSE_WIDTH + 2, 1999L * 500L, (long) (StepTimes[1999] - StepTimes[0]));
+  TEST_ASSERT_EQUAL (500L, MockRisingEdges (8, StepTimes, MAX_STEPS));
+  TEST_ASSERT_INT32_WITHIN (PULSE_WIDTH + 2, 499L * 1250L, (long) (StepTimes[499] - StepTimes[0]));
+  TEST_ASSERT_EQUAL (3000L, MockRisingEdges (10, StepTimes, MAX_STEPS));
+
+  // Each finished on its own schedule: y (625ms), then x (1s), then z
+  TEST_ASSERT_TRUE (completed[1] < completed[0] && completed[0] < completed[2]);
+}
+
+void test_scheduler_restart ()
+{
+  // A new rotation on a slow axis must not wait for its old deadline
+  StepperMotor      x (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  StepperMotor      y (ENABLE_PIN, 7, 8);
+  StepperScheduler  scheduler;
+
+  scheduler.AddMotor (&x);
+  scheduler.AddMotor (&y);
+  x.Enable ();  y.Enable ();
+  x.SetRamp (0);
+  y.SetRamp (0);
+  x.RotateRelative (100L, 2);     // A step every 500ms
+  y.RotateRelative (100000L, 1);  // A step every second
+
+  for (long i=0; i<1000L; i++)
+  {
+    scheduler.Run ();
+    MockAdvance (RUN_PERIOD);
+  }
+
+  x.RotateRelative (10L, 1000);
+  unsigned long start = MockMicros;
+
+  for (long i=0; i<20000L; i++)
+  {
+    scheduler.Run ();
+    MockAdvance (RUN_PERIOD);
+  }
+
+  long n = stepTimes ();
+  TEST_ASSERT_EQUAL (11L, n);  // The first slow step, then the new move
+  TEST_ASSERT_INT32_WITHIN (2, start + 10UL, StepTimes[1]);
+  TEST_ASSERT_EQUAL (11L, x.GetAbsolutePosition ());
+}
+
+void test_scheduler_telemetry_at_rest ()
+{
+  // A scheduled motor at rest keeps sending its telemetry: periodic frames, and the
+  // frames of a Disable and an E-Stop
+  StepperMotor      x (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  StepperMotor      y (ENABLE_PIN, 7, 8);
+  StepperScheduler  scheduler;
+  const uint8_t    *frame;
+  int               length;
+  int               frames = 0;
+
+  scheduler.AddMotor (&x);
+  scheduler.AddMotor (&y);
+  x.Enable ();  y.Enable ();
+  x.SetTelemetry (100L, 0L);
+
+  for (long i=0; i<550000L; i++)  // 550ms
+  {
+    scheduler.Run ();
+    MockAdvance (RUN_PERIOD);
+    if (x.TakeTelemetry (&length) != NULL)
+      frames++;
+  }
+  TEST_ASSERT_EQUAL (5, frames);
+
+  // Steps only: no periodic frames, but a state change is still reported
+  y.SetTelemetry (0L, 100L);
+  y.Disable ();
+  MockAdvance (RUN_PERIOD);
+  scheduler.Run ();
+  frame = y.TakeTelemetry (&length);
+  TEST_ASSERT_TRUE (frame != NULL);
+  TEST_ASSERT_EQUAL (MS_DISABLED, frameValue (frame, 2));
+
+  scheduler.EStop ();
+  MockAdvance (RUN_PERIOD);
+  scheduler.Run ();
+  frame = x.TakeTelemetry (&length);
+  TEST_ASSERT_TRUE (frame != NULL);
+  TEST_ASSERT_EQUAL (MS_ESTOPPED, frameValue (frame, 2));
+}
+
+//=== Coordinated Motion ==================================
+
+void test_group_motor_stopped ()
+{
+  // A grouped motor E-Stopped mid-move stops the group with MOTION_ABORTED, not OKAY
+  StepperMotor  x (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  StepperMotor  y (8, 9, 10);
+  StepperGroup  group;
+  long          steps[2] = { 2000L, 1000L };
+  RunReturn     rr = OKAY;
+
+  x.Enable ();
+  y.Enable ();
+  TEST_ASSERT_TRUE (group.AddMotor (&x));
+  TEST_ASSERT_TRUE (group.AddMotor (&y));
+  group.MoveRelative (steps, 2000);
+
+  for (long i=0; i<RUN_LIMIT && rr == OKAY; i++)
+  {
+    if (y.GetAbsolutePosition () == 300L)
+      y.EStop ();
+
+    rr = group.Run ();
+    MockAdvance (RUN_PERIOD);
+  }
+
+  TEST_ASSERT_EQUAL (MOTION_ABORTED, rr);
+  TEST_ASSERT_EQUAL (MOTION_ABORTED, group.GetAxisReturn (1));
+  TEST_ASSERT_EQUAL (OKAY, group.GetAxisReturn (0));
+  TEST_ASSERT_LESS_OR_EQUAL (602L, x.GetAbsolutePosition ());
+}
+
+void test_group_arrival ()
+{
+  // All axes arrive on the same Run() call, the minor axis steps evenly spaced between the major axis steps
+  StepperMotor   x (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  StepperMotor   y (8, 9, 10);
+  StepperMotor   z (11, 12, 13);
+  StepperGroup   group;
+  long           target[3] = { 2000L, -500L, 1200L };
+  static unsigned long  minorTimes[2000];
+  RunReturn      rr = OKAY;
+  long           n, m, major;
+
+  x.Enable ();
+  y.Enable ();
+  z.Enable ();
+  group.AddMotor (&x);
+  group.AddMotor (&y);
+  group.AddMotor (&z);
+  TEST_ASSERT_TRUE (group.MoveAbsolute (target, 2000));
+
+  for (long i=0; i<RUN_LIMIT && rr == OKAY; i++)
+  {
+    rr = group.Run ();
+    MockAdvance (RUN_PERIOD);
+
+    // No axis gets there before the others
+    bool arrived = (x.GetAbsolutePosition () == target[0]);
+    TEST_ASSERT_TRUE (arrived == (y.GetAbsolutePosition () == target[1]));
+    TEST_ASSERT_TRUE (arrived == (z.GetAbsolutePosition () == target[2]));
+  }
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, rr);
+  n = stepTimes ();
+  TEST_ASSERT_EQUAL (2000L, n);
+
+  // Each minor step lands on a major step, floor or ceil (2000 / minor) major steps after the last one
+  for (int pin=10; pin<=13; pin+=3)
+  {
+    long minor = (pin == 10) ? 500L : 1200L;
+
+    m = MockRisingEdges (pin, minorTimes, 2000L);
+    TEST_ASSERT_EQUAL (minor, m);
+
+    major = -1L;
+    for (long i=0, j=0; i<m; i++)
+    {
+      while (j < n && StepTimes[j] != minorTimes[i])
+        j++;
+
+      TEST_ASSERT_TRUE (j < n);
+      if (major >= 0L)
+      {
+        TEST_ASSERT_GREATER_OR_EQUAL (2000L / minor, j - major);
+        TEST_ASSERT_LESS_OR_EQUAL ((2000L + minor - 1L) / minor, j - major);
+      }
+      major = j;
+    }
+
+    TEST_ASSERT_EQUAL (n - 1L, major);
+  }
+}
+
+void test_group_refused ()
+{
+  // A move is refused, and no motor touched, unless every axis is ready
+  StepperMotor   x (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  StepperMotor   y (8, 9, 10);
+  StepperGroup   group;
+  long           steps[2] = { 1000L, 500L };
+
+  x.Enable ();
+  group.AddMotor (&x);
+  group.AddMotor (&y);
+  TEST_ASSERT_FALSE (group.MoveRelative (steps, 2000));   // y is Disabled
+  TEST_ASSERT_EQUAL (MS_DISABLED, y.GetState ());
+
+  y.Enable ();
+  TEST_ASSERT_FALSE (group.MoveRelative (steps, 0));
+  TEST_ASSERT_FALSE (group.MoveRelative (steps, -2000));
+
+  y.RotateRelative (300L, 1000);
+  TEST_ASSERT_FALSE (group.MoveRelative (steps, 2000));   // y is running
+  TEST_ASSERT_FALSE (group.IsRunning ());
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&y));
+  TEST_ASSERT_EQUAL (300L, y.GetAbsolutePosition ());     // Its own move was left alone
+  TEST_ASSERT_EQUAL (0L, x.GetAbsolutePosition ());
+
+  TEST_ASSERT_TRUE (group.MoveRelative (steps, 2000));
+  TEST_ASSERT_FALSE (group.MoveRelative (steps, 2000));   // Already moving
+}
+
+//=== Batched Commands ====================================
+
+void test_batched_commands ()
+{
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  char          batch[EC_BATCH_LENGTH * 2] = "";
+  const char   *response;
+  int           fields = 1;
+
+  // One field per command, empty for commands that return nothing
+  response = motor.ExecuteCommand ("EN;SL-100;SU5000;SR3;GL;GU;XX;");
+  TEST_ASSERT_EQUAL (0, strcmp (response, ";;;;-100;5000;Unknown command"));
+  TEST_ASSERT_EQUAL (0, strcmp (motor.ExecuteCommand ("GU"), "5000"));
+
+  // Commands stop when the response might not fit
+  for (int i=0; i<EC_BATCH_LENGTH / 3; i++)
+    strcat (batch, "SL-2000000000;GL;");
+
+  response = motor.ExecuteCommand (batch);
+  TEST_ASSERT_TRUE (strlen (response) < EC_BATCH_LENGTH);
+  TEST_ASSERT_EQUAL (0, strcmp (response + strlen (response) - 14, "Batch too long"));
+
+  for (const char *c=response; *c; c++)
+    if (*c == ';')
+      fields++;
+
+  TEST_ASSERT_GREATER_THAN (4, fields);
+  TEST_ASSERT_LESS_OR_EQUAL (EC_BATCH_LENGTH / 3, fields);    // Far fewer than the 2 * EC_BATCH_LENGTH / 3 sent
+  TEST_ASSERT_EQUAL (-2000000000L, motor.GetLowerLimit ());
+}
+
+//=== User Commands =======================================
+
+static void helloCommand (StepperMotor *motor, const char *packet, char *response)
+{
+  (void) motor;
+  (void) packet;
+
+  strcpy (response, "Hello");
+}
+
+static void otherCommand (StepperMotor *motor, const char *packet, char *response)
+{
+  (void) motor;
+  (void) packet;
+
+  strcpy (response, "Other");
+}
+
+void test_user_commands ()
+{
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  TEST_ASSERT_TRUE (motor.RegisterCommand ("HI", helloCommand));
+  TEST_ASSERT_EQUAL (0, strcmp (motor.ExecuteCommand ("HI"), "Hello"));
+
+  // A built-in or taken code would never reach its handler
+  TEST_ASSERT_FALSE (motor.RegisterCommand ("RA", otherCommand));
+  TEST_ASSERT_FALSE (motor.RegisterCommand ("BL", otherCommand));
+  TEST_ASSERT_FALSE (motor.RegisterCommand ("HI", otherCommand));
+  TEST_ASSERT_EQUAL (0, strcmp (motor.ExecuteCommand ("HI"), "Hello"));
+
+  // Full after MAX_USER_COMMANDS
+  for (int i=1; i<MAX_USER_COMMANDS; i++)
+  {
+    char name[3] = { 'U', (char) ('0' + i), 0 };
+    TEST_ASSERT_TRUE (motor.RegisterCommand (name, otherCommand));
+  }
+  TEST_ASSERT_FALSE (motor.RegisterCommand ("UX", otherCommand));
+}
+
+//=== Command Link ========================================
+
+void test_command_link ()
+{
+  MockStream    port;
+  CommandLink   link (&port);
+  LinkPacket    packet;
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  const uint8_t status[4] = { BIN_SYNC, BIN_GET_ABSOLUTE, 0, 0 };
+  uint8_t       frame[4];
+  uint8_t       crc = 0;
+  char          line[LINK_MAX_PACKET + 10];
+  int           response;
+
+  // CRC8 (0x07) of the opcode and length
+  memcpy (frame, status, 4);
+  for (int i=1; i<3; i++)
+  {
+    crc ^= frame[i];
+    for (int bit=0; bit<8; bit++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  }
+  frame[3] = crc;
+
+  // Text, blank and binary packets from one read, framed in place
+  port.Feed ("EN\r\n\nGA", 7);
+  TEST_ASSERT_TRUE (link.Receive (&packet));
+  TEST_ASSERT_FALSE (packet.Binary);
+  TEST_ASSERT_EQUAL (0, strcmp ((const char *) packet.Data, "EN"));
+  TEST_ASSERT_EQUAL (1L, port.Reads);
+
+  TEST_ASSERT_FALSE (link.Receive (&packet));  // "GA" has no LF yet (the blank line is skipped)
+  port.Feed ("\n", 1);
+  port.Feed (frame, 2);
+  TEST_ASSERT_TRUE (link.Receive (&packet));
+  TEST_ASSERT_EQUAL (2, packet.Length);
+
+  // Half a frame followed "GA\n", the rest arrives later
+  TEST_ASSERT_FALSE (link.Receive (&packet));
+  port.Feed (frame + 2, 2);
+  TEST_ASSERT_TRUE (link.Receive (&packet));
+  TEST_ASSERT_TRUE (packet.Binary);
+  TEST_ASSERT_EQUAL (4, packet.Length);
+  TEST_ASSERT_EQUAL (BIN_GET_ABSOLUTE, motor.ExecuteBinary (packet.Data, packet.Length, &response)[1]);
+
+  // A too-long line is reported once and its tail is never a command
+  memset (line, 'X', sizeof (line));
+  line[sizeof (line) - 1] = '\n';
+  port.Feed ("GR", 2);
+  port.Feed (line, sizeof (line));
+  port.Feed ("GU\n", 3);
+  TEST_ASSERT_TRUE (link.Receive (&packet));
+  TEST_ASSERT_TRUE (packet.TooLong);
+  TEST_ASSERT_TRUE (link.Receive (&packet));
+  TEST_ASSERT_EQUAL (0, strcmp ((const char *) packet.Data, "GU"));
+  TEST_ASSERT_FALSE (link.Receive (&packet));
+  TEST_ASSERT_EQUAL (1L, link.GetOverflows ());
+
+  // Many packets through the buffer, in chunks that don't line up with it
+  long received = 0L;
+  for (int i=0; i<200; i++)
+  {
+    port.Feed ("QD;GA\n", 6);
+    if (i % 7 == 6)
+      while (link.Receive (&packet))
+      {
+        TEST_ASSERT_EQUAL (0, strcmp ((const char *) packet.Data, "QD;GA"));
+        received++;
+      }
+  }
+  while (link.Receive (&packet))
+    received++;
+  TEST_ASSERT_EQUAL (200L, received);
+}
+
+//=== Binary Protocol =====================================
+
+static int binaryFrame (uint8_t *frame, uint8_t opcode, const long *values, int numValues)
+{
+  // A command frame with little-endian int32 parameters and its CRC8 (0x07), returns its length
+  int      length = 4 * numValues;
+  uint8_t  crc    = 0;
+
+  frame[0] = BIN_SYNC;
+  frame[1] = opcode;
+  frame[2] = length;
+  for (int i=0; i<length; i++)
+    frame[BIN_HEADER_LENGTH + i] = (uint8_t) ((uint32_t) values[i / 4] >> (8 * (i % 4)));
+
+  for (int i=1; i<BIN_HEADER_LENGTH + length; i++)
+  {
+    crc ^= frame[i];
+    for (int bit=0; bit<8; bit++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  }
+  frame[BIN_HEADER_LENGTH + length] = crc;
+
+  return BIN_HEADER_LENGTH + length + 1;
+}
+
+void test_binary_frames ()
+{
+  StepperMotor   motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  uint8_t        frame[BIN_MAX_FRAME];
+  const uint8_t *reply;
+  long           values[2];
+  int            length, response;
+
+  motor.Enable ();
+
+  // Negative parameters are sign-extended
+  values[0] = -1000L;
+  length = binaryFrame (frame, BIN_SET_LOWER_LIMIT, values, 1);
+  reply  = motor.ExecuteBinary (frame, length, &response);
+  TEST_ASSERT_EQUAL (BIN_SET_LOWER_LIMIT, reply[1]);
+  TEST_ASSERT_EQUAL (-1000L, motor.GetLowerLimit ());
+
+  length = binaryFrame (frame, BIN_GET_LOWER_LIMIT, values, 0);
+  reply  = motor.ExecuteBinary (frame, length, &response);
+  TEST_ASSERT_EQUAL (BIN_HEADER_LENGTH + 4 + 1, response);
+  TEST_ASSERT_EQUAL (-1000L, frameValue (reply, 0));
+
+  values[0] = 4000L;
+  values[1] = -300L;
+  length = binaryFrame (frame, BIN_ROTATE_RELATIVE, values, 2);
+  TEST_ASSERT_EQUAL (BIN_ROTATE_RELATIVE, motor.ExecuteBinary (frame, length, &response)[1]);
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (-300L, motor.GetAbsolutePosition ());
+
+  // BIN_GET_STATUS: position, remaining ms, state and queue depth of a running queue
+  TEST_ASSERT_TRUE (motor.QueueAbsolute (700L, 1000));
+  TEST_ASSERT_TRUE (motor.QueueAbsolute (0L, 1000));
+  length = binaryFrame (frame, BIN_GET_STATUS, values, 0);
+  reply  = motor.ExecuteBinary (frame, length, &response);
+  TEST_ASSERT_EQUAL (BIN_GET_STATUS, reply[1]);
+  TEST_ASSERT_EQUAL (BIN_HEADER_LENGTH + 16 + 1, response);
+  TEST_ASSERT_EQUAL (-300L, frameValue (reply, 0));
+  TEST_ASSERT_EQUAL ((long) motor.GetRemainingTime (), frameValue (reply, 1));
+  TEST_ASSERT_TRUE (frameValue (reply, 1) > 0L);
+  TEST_ASSERT_EQUAL (MS_RUNNING, frameValue (reply, 2));
+  TEST_ASSERT_EQUAL (1L, frameValue (reply, 3));
+  motor.EStop ();
+
+  // A bad CRC is refused, and the command is not executed
+  values[0] = -5L;
+  length = binaryFrame (frame, BIN_SET_LOWER_LIMIT, values, 1);
+  frame[length - 1] ^= 0x01;
+  reply = motor.ExecuteBinary (frame, length, &response);
+  TEST_ASSERT_EQUAL (BIN_ERROR, reply[1]);
+  TEST_ASSERT_EQUAL (BIN_ERROR_CRC, frameValue (reply, 0));
+  TEST_ASSERT_EQUAL (-1000L, motor.GetLowerLimit ());
+
+  // A frame shorter than its length byte, and missing parameters
+  length = binaryFrame (frame, BIN_SET_LOWER_LIMIT, values, 1);
+  reply  = motor.ExecuteBinary (frame, length - 1, &response);
+  TEST_ASSERT_EQUAL (BIN_ERROR, reply[1]);
+  TEST_ASSERT_EQUAL (BIN_ERROR_FRAME, frameValue (reply, 0));
+
+  length = binaryFrame (frame, BIN_SET_LOWER_LIMIT, values, 0);
+  reply  = motor.ExecuteBinary (frame, length, &response);
+  TEST_ASSERT_EQUAL (BIN_ERROR, reply[1]);
+  TEST_ASSERT_EQUAL (BIN_ERROR_LENGTH, frameValue (reply, 0));
+
+  // Unknown opcode
+  length = binaryFrame (frame, 0x7E, values, 0);
+  reply  = motor.ExecuteBinary (frame, length, &response);
+  TEST_ASSERT_EQUAL (BIN_ERROR, reply[1]);
+  TEST_ASSERT_EQUAL (BIN_ERROR_OPCODE, frameValue (reply, 0));
+}
+
+void test_zero_velocity_refused ()
+{
+  // A velocity below 1 step/sec is refused by every path, and the motor never steps
+  StepperMotor   motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  uint8_t        frame[BIN_MAX_FRAME];
+  const uint8_t *reply;
+  long           values[2];
+  int            length, response;
+
+  motor.Enable ();
+
+  TEST_ASSERT_EQUAL_STRING ("Bad velocity", motor.ExecuteCommand ("RR0,100"));
+  TEST_ASSERT_EQUAL_STRING ("Bad velocity", motor.ExecuteCommand ("RR0000100"));
+  TEST_ASSERT_EQUAL_STRING ("Bad velocity", motor.ExecuteCommand ("RA-5,100"));
+  TEST_ASSERT_EQUAL_STRING ("Bad velocity", motor.ExecuteCommand ("QR0,100"));
+
+  values[0] = 0L;
+  values[1] = 100L;
+  length = binaryFrame (frame, BIN_ROTATE_RELATIVE, values, 2);
+  reply  = motor.ExecuteBinary (frame, length, &response);
+  TEST_ASSERT_EQUAL (BIN_ERROR, reply[1]);
+  TEST_ASSERT_EQUAL (BIN_ERROR_VELOCITY, frameValue (reply, 0));
+
+  values[0] = -1L;
+  length = binaryFrame (frame, BIN_QUEUE_ABSOLUTE, values, 2);
+  reply  = motor.ExecuteBinary (frame, length, &response);
+  TEST_ASSERT_EQUAL (BIN_ERROR, reply[1]);
+  TEST_ASSERT_EQUAL (BIN_ERROR_VELOCITY, frameValue (reply, 0));
+
+  // The API ignores them too
+  motor.RotateRelative (100L, 0L);
+  motor.RotateAbsolute (100L, -3000L);
+  TEST_ASSERT_FALSE (motor.QueueRelative (100L, 0L));
+
+  TEST_ASSERT_EQUAL (MS_ENABLED, motor.GetState ());
+  TEST_ASSERT_EQUAL (0, motor.GetQueueDepth ());
+  for (int i=0; i<10000; i++)
+  {
+    motor.Run ();
+    MockAdvance (RUN_PERIOD);
+  }
+
+  TEST_ASSERT_EQUAL (0L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (0L, stepTimes ());
+}
+
+//=== Saved Configuration =================================
+
+void test_saved_config ()
+{
+  // Configuration and position survive a "power cycle" (a new StepperMotor on the same EEPROM)
+  MockEraseEEPROM ();
+  {
+    StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+    motor.Enable ();
+    TEST_ASSERT_FALSE (motor.LoadConfig ());  // Nothing saved yet
+
+    motor.SetLowerLimit (-1000L);
+    motor.SetUpperLimit (5000L);
+    motor.SetAcceleration (20000L);
+    motor.SetProfile (PROFILE_SCURVE, 500000L);
+    motor.RotateRelative (1234L, 3000);
+    TEST_ASSERT_FALSE (motor.SaveConfig ());  // Not while running
+
+    TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+    TEST_ASSERT_TRUE (motor.SaveConfig (true));
+
+    // Saving the same record again writes nothing
+    long writes = MockEEPROMWrites;
+    TEST_ASSERT_TRUE (motor.SaveConfig (true));
+    TEST_ASSERT_EQUAL (writes, MockEEPROMWrites);
+  }
+
+  MockReset ();
+  {
+    StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+    unsigned long expected;
+
+    motor.Enable ();
+    TEST_ASSERT_EQUAL (0, motor.ExecuteCommand ("LC")[0]);
+    TEST_ASSERT_EQUAL (-1000L, motor.GetLowerLimit ());
+    TEST_ASSERT_EQUAL (5000L, motor.GetUpperLimit ());
+    TEST_ASSERT_EQUAL (1234L, motor.GetAbsolutePosition ());
+    TEST_ASSERT_TRUE (motor.IsHomed ());
+
+    // Same profile as the saved one: S-curve with the saved acceleration and jerk
+    StepperMotor  reference (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+    reference.SetAcceleration (20000L);
+    reference.SetProfile (PROFILE_SCURVE, 500000L);
+    expected = reference.PredictMoveTime (3000L, 3000);
+    TEST_ASSERT_EQUAL (expected, motor.PredictMoveTime (3000L, 3000));
+  }
+
+  MockReset ();
+  {
+    // The saved position was used once, the configuration stays
+    StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+    motor.Enable ();
+    TEST_ASSERT_TRUE (motor.LoadConfig ());
+    TEST_ASSERT_EQUAL (0L, motor.GetAbsolutePosition ());
+    TEST_ASSERT_EQUAL (5000L, motor.GetUpperLimit ());
+
+    // A position is only saved from a homed motor
+    motor.Disable ();
+    TEST_ASSERT_FALSE (motor.SaveConfig (true));
+    TEST_ASSERT_TRUE (motor.ExecuteCommand ("SC1")[0] != 0);
+  }
+}
+
+void test_saved_position_moved ()
+{
+  // A move after SC1 clears the saved position: the "power cycle" after it must not restore it
+  MockEraseEEPROM ();
+  {
+    StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+    motor.Enable ();
+    motor.RotateRelative (1000L, 3000);
+    TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+    TEST_ASSERT_TRUE (motor.SaveConfig (true));
+
+    motor.RotateRelative (2000L, 3000);
+    TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+    TEST_ASSERT_EQUAL (3000L, motor.GetAbsolutePosition ());
+  }
+
+  MockReset ();
+  {
+    StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+    motor.Enable ();  // Homed at 0, the saved 1000 is not restored over it
+    TEST_ASSERT_TRUE (motor.LoadConfig ());
+    TEST_ASSERT_EQUAL (0L, motor.GetAbsolutePosition ());
+
+    // Queued moves and streams clear it too
+    motor.RotateRelative (700L, 3000);
+    TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+    TEST_ASSERT_TRUE (motor.SaveConfig (true));
+    TEST_ASSERT_TRUE (motor.QueueAbsolute (500L, 3000));
+    TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+    TEST_ASSERT_TRUE (motor.SaveConfig (true));
+    TEST_ASSERT_TRUE (motor.QueueSegment (1600L, 10L, 0L));
+    TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  }
+
+  MockReset ();
+  {
+    StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+    motor.Enable ();
+    TEST_ASSERT_TRUE (motor.LoadConfig ());
+    TEST_ASSERT_EQUAL (0L, motor.GetAbsolutePosition ());
+  }
+}
+
+//=== Trigger Points ======================================
+
+#define TRIGGER_PIN_A  20
+#define TRIGGER_PIN_B  21
+
+static int pinWrites (int pin, MockWrite *writes, int maxWrites)
+{
+  // The writes of one pin, in order
+  int count = 0;
+
+  for (long i=0; i<MockNumWrites && i<MOCK_WRITES && count<maxWrites; i++)
+    if (MockWrites[i].Pin == pin)
+      writes[count++] = MockWrites[i];
+
+  return count;
+}
+
+void test_trigger_points ()
+{
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  MockWrite     writes[8];
+
+  motor.Enable ();
+  motor.SetRamp (0);
+  TEST_ASSERT_TRUE (motor.AddTrigger (1500L, TRIGGER_PIN_A, TRIGGER_LOW));
+  TEST_ASSERT_TRUE (motor.AddTrigger (2500L, TRIGGER_PIN_B, TRIGGER_PULSE));
+  TEST_ASSERT_EQUAL (0, motor.ExecuteCommand ("TP1000,20,0")[0]);
+  TEST_ASSERT_EQUAL (0, strcmp ("3", motor.ExecuteCommand ("TP")));
+
+  // Never the motor's own pins, nor a pin the board doesn't have
+  TEST_ASSERT_FALSE (motor.AddTrigger (0L, STEP_PIN, TRIGGER_HIGH));
+  TEST_ASSERT_FALSE (motor.AddTrigger (0L, DIRECTION_PIN, TRIGGER_HIGH));
+  TEST_ASSERT_FALSE (motor.AddTrigger (0L, NUM_DIGITAL_PINS, TRIGGER_HIGH));
+  TEST_ASSERT_EQUAL (0, strcmp ("Bad pin", motor.ExecuteCommand ("TP0,-1,0")));
+  TEST_ASSERT_EQUAL (0, strcmp ("Bad pin", motor.ExecuteCommand ("BL4")));
+  TEST_ASSERT_EQUAL (0, strcmp ("3", motor.ExecuteCommand ("TP")));
+
+  motor.RotateRelative (3000L, 2000);
+  TEST_ASSERT_FALSE (motor.AddTrigger (0L, TRIGGER_PIN_A, TRIGGER_HIGH));  // Not while running
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+
+  motor.RotateAbsolute (0L, 2000);
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (6000L, stepTimes ());
+
+  // Each output switches on the step that reaches its position, in both directions
+  TEST_ASSERT_EQUAL (4, pinWrites (TRIGGER_PIN_A, writes, 8));
+  TEST_ASSERT_EQUAL (HIGH, writes[0].Value);
+  TEST_ASSERT_INT32_WITHIN (PULSE_WIDTH, StepTimes[999] + PULSE_WIDTH, writes[0].Micros);
+  TEST_ASSERT_EQUAL (LOW, writes[1].Value);
+  TEST_ASSERT_INT32_WITHIN (PULSE_WIDTH, StepTimes[1499] + PULSE_WIDTH, writes[1].Micros);
+  TEST_ASSERT_EQUAL (LOW, writes[2].Value);
+  TEST_ASSERT_INT32_WITHIN (PULSE_WIDTH, StepTimes[3000 + 1499] + PULSE_WIDTH, writes[2].Micros);
+  TEST_ASSERT_EQUAL (HIGH, writes[3].Value);
+  TEST_ASSERT_INT32_WITHIN (PULSE_WIDTH, StepTimes[3000 + 1999] + PULSE_WIDTH, writes[3].Micros);
+
+  // A pulse lasts TRIGGER_PULSE_MICROS, ended by a later Run()
+  TEST_ASSERT_EQUAL (4, pinWrites (TRIGGER_PIN_B, writes, 8));
+  TEST_ASSERT_INT32_WITHIN (PULSE_WIDTH, StepTimes[2499] + PULSE_WIDTH, writes[0].Micros);
+  TEST_ASSERT_EQUAL (LOW, writes[1].Value);
+  TEST_ASSERT_INT32_WITHIN (2, writes[0].Micros + TRIGGER_PULSE_MICROS, writes[1].Micros);
+
+  TEST_ASSERT_TRUE (motor.ClearTriggers ());
+  TEST_ASSERT_EQUAL (0, motor.GetTriggerCount ());
+}
+
+//=== Command Latency =====================================
+
+#define LED_PIN  13
+
+static void runFor (StepperMotor *motor, unsigned long micros)
+{
+  // Calls Run() for a span of virtual time, whatever it returns
+  for (unsigned long end = MockMicros + micros; (long) (MockMicros - end) < 0L; )
+  {
+    motor->Run ();
+    MockAdvance (RUN_PERIOD);
+  }
+}
+
+void test_commands_never_wait ()
+{
+  // No command makes an explicit wait, even while moving: timed work is left to Run().
+  // (The mock clock only advances in delay() / delayMicroseconds(), not for CPU time, see GSC for that)
+  static const char *commands[] = { "BL13", "GA", "GT", "SV50%", "RR-100002000", "QR5002000", "SQ",
+                                    "GD300002000", "RA20001000;GA;BL13", "ES" };
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  MockWrite     writes[48];
+
+  motor.Enable ();
+  motor.RotateRelative (30000L, 2000);
+  runFor (&motor, 50000L);
+
+  for (unsigned c=0; c<sizeof (commands) / sizeof (commands[0]); c++)
+  {
+    unsigned long start = MockMicros;
+
+    motor.ExecuteCommand (commands[c]);
+    TEST_ASSERT_EQUAL (start, MockMicros);
+  }
+
+  // The last blink, flashed by Run(): 20ms on, 80ms off, BLINK_COUNT times
+  long           first = pinWrites (LED_PIN, writes, 48) - 1;
+  unsigned long  start = writes[first].Micros;
+
+  runFor (&motor, BLINK_COUNT * (BLINK_ON_MICROS + BLINK_OFF_MICROS));
+  TEST_ASSERT_EQUAL (first + 2 * BLINK_COUNT, pinWrites (LED_PIN, writes, 48));
+
+  for (int i=0; i<2 * BLINK_COUNT; i++)
+  {
+    unsigned long due = start + (i / 2) * (BLINK_ON_MICROS + BLINK_OFF_MICROS) + (i % 2) * BLINK_ON_MICROS;
+
+    TEST_ASSERT_EQUAL ((i % 2 == 0) ? HIGH : LOW, writes[first + i].Value);
+    TEST_ASSERT_INT32_WITHIN (RUN_PERIOD, due, writes[first + i].Micros);
+  }
+
+  // A motor at rest in a StepperScheduler still finishes its blink
+  StepperScheduler  scheduler;
+
+  scheduler.AddMotor (&motor);
+  first = pinWrites (LED_PIN, writes, 48);
+  motor.BlinkLED (LED_PIN);
+  for (unsigned long end = MockMicros + BLINK_COUNT * (BLINK_ON_MICROS + BLINK_OFF_MICROS); (long) (MockMicros - end) < 0L; )
+  {
+    scheduler.Run ();
+    MockAdvance (RUN_PERIOD);
+  }
+  TEST_ASSERT_EQUAL (first + 2 * BLINK_COUNT, pinWrites (LED_PIN, writes, 48));
+}
+
+//=== Non-blocking Pulse ==================================
+//  Built with -D NONBLOCKING_PULSE (the native-nonblocking env)
+
+#if defined(NONBLOCKING_PULSE)
+void test_deferred_direction ()
+{
+  // A reversal during a step pulse sets the Direction pin once the pulse and its low time
+  // have ended, and the next pulse waits 10µs for it.  The command itself doesn't wait.
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  MockWrite     steps[4], directions[8];
+  int           n;
+
+  motor.Enable ();
+  motor.RotateRelative (100L, 1000);
+  for (long i=0; i<RUN_LIMIT && stepTimes () == 0L; i++)
+  {
+    motor.Run ();
+    MockAdvance (RUN_PERIOD);
+  }
+
+  unsigned long start = MockMicros;
+  motor.RotateRelative (-50L, 1000);
+  TEST_ASSERT_EQUAL (start, MockMicros);
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (-49L, motor.GetAbsolutePosition ());
+
+  // Step pin: low at construction, the first pulse, then the first pulse after the reversal
+  TEST_ASSERT_EQUAL (4, pinWrites (STEP_PIN, steps, 4));
+  n = pinWrites (DIRECTION_PIN, directions, 8);
+  TEST_ASSERT_EQUAL (HIGH, directions[n - 1].Value);
+  TEST_ASSERT_GREATER_OR_EQUAL (steps[2].Micros + PULSE_WIDTH, directions[n - 1].Micros);
+  TEST_ASSERT_GREATER_OR_EQUAL (directions[n - 1].Micros + 10UL, steps[3].Micros);
+}
+#endif
+
+//=== Encoder =============================================
+//  Built with -D STEP_ENCODER (the native env), like the encoder code itself
+
+#if defined(STEP_ENCODER)
+#define ENCODER_COUNTS  4000L     // Encoder counts per revolution
+#define MOTOR_STEPS     3200L     // Motor steps per revolution
+
+static long  ShaftSteps;          // Steps the shaft has really turned
+
+static RunReturn runSlipping (StepperMotor *motor, long slipFrom, long slip)
+{
+  // Like runMove(), with the encoder following the Step pulses (clockwise only) except
+  // for 'slip' pulses lost once the shaft reaches slipFrom
+  RunReturn rr      = OKAY;
+  long      scanned = 0L;
+  long      slipped = 0L;
+
+  ShaftSteps = 0L;
+  for (long i=0; i<RUN_LIMIT && rr == OKAY; i++)
+  {
+    for (; scanned < MockNumWrites && scanned < MOCK_WRITES; scanned++)
+      if (MockWrites[scanned].Pin == STEP_PIN && MockWrites[scanned].Value == HIGH)
+      {
+        if (ShaftSteps >= slipFrom && slipped < slip)
+          slipped++;
+        else
+          ShaftSteps++;
+      }
+
+    MockEncoderCount = (int) (ShaftSteps * ENCODER_COUNTS / MOTOR_STEPS);
+
+    rr = motor->Run ();
+    MockAdvance (RUN_PERIOD);
+  }
+
+  return rr;
+}
+
+void test_following_error ()
+{
+  {
+    // A stall stops the motor where the encoder says it is
+    StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+    motor.Enable ();
+    motor.SetRamp (0);
+    TEST_ASSERT_TRUE (motor.AttachEncoder (7, 8, ENCODER_COUNTS, MOTOR_STEPS));
+    motor.SetFollowingError (20L, ENCODER_STOP);
+    motor.RotateRelative (5000L, 2000);
+
+    TEST_ASSERT_EQUAL (FOLLOWING_ERROR, runSlipping (&motor, 1000L, RUN_LIMIT));
+    TEST_ASSERT_EQUAL (MS_ENABLED, motor.GetState ());
+    TEST_ASSERT_EQUAL (1000L, motor.GetAbsolutePosition ());
+    TEST_ASSERT_TRUE (motor.IsHomed ());
+    TEST_ASSERT_LESS_OR_EQUAL (1000L + 20L + 4L, stepTimes ());  // Stopped within a check period
+    TEST_ASSERT_EQUAL (0, strcmp ("1000,0", motor.ExecuteCommand ("GE")));
+  }
+
+  MockReset ();
+  {
+    // Slipped steps are made up, and the queued moves still follow
+    StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+    motor.Enable ();
+    motor.SetRamp (0);
+    TEST_ASSERT_TRUE (motor.AttachEncoder (7, 8, ENCODER_COUNTS, MOTOR_STEPS));
+    TEST_ASSERT_EQUAL (0, motor.ExecuteCommand ("SE20,1")[0]);
+    motor.QueueAbsolute (3000L, 2000);
+    motor.QueueAbsolute (6000L, 2000);
+
+    TEST_ASSERT_EQUAL (RUN_COMPLETE, runSlipping (&motor, 1000L, 50L));
+    TEST_ASSERT_EQUAL (6000L, motor.GetAbsolutePosition ());
+    TEST_ASSERT_INT32_WITHIN (20, 6000L, ShaftSteps);                 // What is left is within the limit
+    TEST_ASSERT_INT32_WITHIN (1, ShaftSteps - 6000L, motor.GetFollowingError ());  // 1 count rounding
+    TEST_ASSERT_GREATER_THAN (6000L + 20L, stepTimes ());              // Lost steps were sent again
+  }
+}
+#endif
+
+//=== SPSC Queue ==========================================
+
+void test_spsc_queue ()
+{
+  // Order, full and empty across several wraps of the ring
+  SpscQueue<long, 4>  queue;
+  long                value;
+  long                next = 0L;
+
+  TEST_ASSERT_TRUE (queue.IsEmpty ());
+  TEST_ASSERT_FALSE (queue.Pop (&value));
+
+  for (long round=0; round<5; round++)
+  {
+    for (long i=0; i<3; i++)
+      TEST_ASSERT_TRUE (queue.Push (round * 3L + i));
+
+    TEST_ASSERT_FALSE (queue.Push (-1L));  // Holds N-1 items
+
+    while (queue.Pop (&value))
+      TEST_ASSERT_EQUAL (next++, value);
+
+    TEST_ASSERT_TRUE (queue.IsEmpty ());
+  }
+
+  TEST_ASSERT_EQUAL (15L, next);
+}
+
+//=== Benchmarks ==========================================
+
+void test_benchmark_run ()
+{
+  // Host cost of Run() while idle, between steps and per step
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  char          message[100];
+  long          calls = 0L;
+  double        start;
+
+  motor.Enable ();
+  start = nowNanos ();
+  for (long i=0; i<1000000L; i++)
+    motor.Run ();
+  double idle = (nowNanos () - start) / 1000000.0;
+
+  motor.SetRamp (5);
+  motor.RotateRelative (40000L, 9999);
+
+  start = nowNanos ();
+  while (motor.Run () == OKAY)
+  {
+    MockAdvance (RUN_PERIOD);
+    calls++;
+  }
+  double running = (nowNanos () - start) / calls;
+
+  snprintf (message, sizeof (message), "Run(): idle %.1f ns/call, moving %.1f ns/call, %.1f calls/step", idle, running, (double) calls / 40000.0);
+  TEST_MESSAGE (message);
+
+  // The per-step work the ramp table replaced: next velocity level, then one division
+  volatile long  increment = 25L;  // Volatile, so neither is folded or hoisted out of the loop
+  volatile long  interval;
+  long           velocity  = 0L;
+
+  start = nowNanos ();
+  for (long i=0; i<1000000L; i++)
+  {
+    velocity += increment;
+    if (velocity > 1000000L)
+      velocity = increment;
+    interval = 1000000L / velocity;
+  }
+  double division = (nowNanos () - start) / 1000000.0;
+  (void) interval;
+
+  snprintf (message, sizeof (message), "Per-step division replaced by the ramp table: %.1f ns/step", division);
+  TEST_MESSAGE (message);
+}
+
+void test_benchmark_scheduler ()
+{
+  // Host cost per pass of eight motors, one of them moving: each motor's Run() vs the scheduler
+  StepperMotor      motors[8] = { StepperMotor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN) };
+  StepperScheduler  scheduler;
+  char              message[100];
+  long              passes = 0L;
+  double            start;
+
+  for (int i=0; i<8; i++)
+    motors[i].Enable ();
+
+  motors[0].SetRamp (0);
+  motors[0].RotateRelative (10000L, 5000);
+  start = nowNanos ();
+  while (motors[0].GetState () == MS_RUNNING)
+  {
+    for (int i=0; i<8; i++)
+      motors[i].Run ();
+    MockAdvance (RUN_PERIOD);
+    passes++;
+  }
+  double each = (nowNanos () - start) / passes;
+
+  for (int i=0; i<8; i++)
+    scheduler.AddMotor (&motors[i]);
+
+  motors[0].RotateRelative (10000L, 5000);
+  passes = 0L;
+  start  = nowNanos ();
+  while (motors[0].GetState () == MS_RUNNING)
+  {
+    scheduler.Run ();
+    MockAdvance (RUN_PERIOD);
+    passes++;
+  }
+  double scheduled = (nowNanos () - start) / passes;
+
+  snprintf (message, sizeof (message), "8 motors: Run() each %.1f ns/pass, StepperScheduler %.1f ns/pass", each, scheduled);
+  TEST_MESSAGE (message);
+}
+
+void test_benchmark_commands ()
+{
+  // Host cost of parsing and executing text commands
+  static const char *commands[] = { "GA", "GT", "SR5", "RR300002000", "GD300002000", "QD" };
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  char          message[100];
+
+  motor.Enable ();
+
+  for (unsigned c=0; c<sizeof (commands) / sizeof (commands[0]); c++)
+  {
+    double start = nowNanos ();
+    for (long i=0; i<100000L; i++)
+      motor.ExecuteCommand (commands[c]);
+    double cost = (nowNanos () - start) / 100000.0;
+
+    snprintf (message, sizeof (message), "ExecuteCommand(\"%s\"): %.1f ns/call", commands[c], cost);
+    TEST_MESSAGE (message);
+  }
+}
+
+void test_benchmark_command_worst ()
+{
+  // Host cost of the slowest command: a rotation from rest that builds a full S-curve table
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  char          command[20];
+  char          message[100];
+  double        total = 0.0;
+  double        worst = 0.0;
+
+  motor.ExecuteCommand ("SA1000;SP1");  // 8000 steps/sec takes over 32000 steps to reach, far more than RAMP_TABLE_SIZE
+
+  for (long i=0; i<200L; i++)
+  {
+    // A new velocity each time, so neither table fits and the build is never skipped
+    motor.Enable ();
+    snprintf (command, sizeof (command), "RA%04ld1000000", 8000L + i);
+
+    double start = nowNanos ();
+    motor.ExecuteCommand (command);
+    double cost  = nowNanos () - start;
+
+    TEST_ASSERT_EQUAL (MS_RUNNING, motor.GetState ());
+    total += cost;
+    if (cost > worst)
+      worst = cost;
+    motor.EStop ();
+  }
+
+  snprintf (message, sizeof (message), "ExecuteCommand(\"RA\") with a %d-entry S-curve build: %.1f us mean, %.1f us worst",
+            RAMP_TABLE_SIZE, total / 200000.0, worst / 1000.0);
+  TEST_MESSAGE (message);
+}
+
+//=== main ================================================
+
+int main (int argc, char **argv)
+{
+  (void) argc;
+  (void) argv;
+
+  UNITY_BEGIN ();
+
+  RUN_TEST (test_relative_move_steps);
+  RUN_TEST (test_queued_moves_steps);
+  RUN_TEST (test_limit_switch_stops);
+  RUN_TEST (test_limit_switch_drive_off);
+  RUN_TEST (test_find_home);
+  RUN_TEST (test_find_home_cancelled);
+  RUN_TEST (test_constant_velocity_rate);
+  RUN_TEST (test_trapezoid_profile);
+  RUN_TEST (test_acceleration_profile);
+  RUN_TEST (test_scurve_profile);
+  RUN_TEST (test_velocity_override);
+  RUN_TEST (test_high_step_rate);
+  RUN_TEST (test_stream_segments);
+  RUN_TEST (test_stream_flow_control);
+  RUN_TEST (test_telemetry_frames);
+  RUN_TEST (test_scheduler_independent_moves);
+  RUN_TEST (test_scheduler_restart);
+  RUN_TEST (test_scheduler_telemetry_at_rest);
+  RUN_TEST (test_group_motor_stopped);
+  RUN_TEST (test_group_arrival);
+  RUN_TEST (test_group_refused);
+  RUN_TEST (test_batched_commands);
+  RUN_TEST (test_user_commands);
+  RUN_TEST (test_command_link);
+  RUN_TEST (test_binary_frames);
+  RUN_TEST (test_zero_velocity_refused);
+  RUN_TEST (test_saved_config);
+  RUN_TEST (test_saved_position_moved);
+  RUN_TEST (test_trigger_points);
+  RUN_TEST (test_commands_never_wait);
+#if defined(NONBLOCKING_PULSE)
+  RUN_TEST (test_deferred_direction);
+#endif
+#if defined(STEP_ENCODER)
+  RUN_TEST (test_following_error);
+#endif
+  RUN_TEST (test_spsc_queue);
+  RUN_TEST (test_benchmark_run);
+  RUN_TEST (test_benchmark_scheduler);
+  RUN_TEST (test_benchmark_commands);
+  RUN_TEST (test_benchmark_command_worst);
+
+  return UNITY_END ();
+}
@@ -0,0 +1,270 @@
+//=============================================================================
+//
+//     FILE : test_main.cpp
+//
+//  PROJECT : Stepper Motor (Digital Only)
+//
+//    NOTES : Host verification of the AVR STEPPER_TIMER backend for the native-timer env.
+//
+//   AUTHOR : Bill Daniels (bill@dstechlabs.com)
+//            See LICENSE.md
+//
+//=============================================================================
+//
+//  Run with:  pio test -e native-timer
+//
+//  The env builds StepperMotor for AVR with -D STEPPER_TIMER against the mock Arduino layer,
+//  which emulates Timer1: the virtual clock counts its ticks and calls the compare interrupt,
+//  so the steps come from timerStep() and Run() only reports the events it queued.
+//
+//=============================================================================
+
+#include <Arduino.h>
+#include <unity.h>
+#include "StepperMotor.h"
+#include "StepperScheduler.h"
+
+#define ENABLE_PIN     2
+#define DIRECTION_PIN  3
+#define STEP_PIN       4
+
+#define RUN_LIMIT      20000000L  // Virtual micros before a move is considered stuck
+#define MAX_STEPS      20000L
+
+static unsigned long  StepTimes[MAX_STEPS];
+
+//=== Helpers =============================================
+
+static RunReturn runMove (StepperMotor *motor)
+{
+  // Calls Run() until the move is complete, returns its RunReturn
+  RunReturn rr = OKAY;
+
+  for (long i=0; i<RUN_LIMIT && rr == OKAY; i++)
+  {
+    rr = motor->Run ();
+    MockAdvance (1L);
+  }
+
+  return rr;
+}
+
+static long stepTimes ()
+{
+  return MockRisingEdges (STEP_PIN, StepTimes, MAX_STEPS);
+}
+
+void setUp ()
+{
+  MockReset ();
+}
+
+void tearDown ()
+{
+}
+
+//=== Queued Moves ========================================
+
+void test_timer_relative_move ()
+{
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  motor.Enable ();
+  motor.SetRamp (5);
+  motor.RotateRelative (3000L, 2000);
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (3000L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (3000L, stepTimes ());
+  TEST_ASSERT_GREATER_OR_EQUAL (3000L, MockTimerInterrupts);
+}
+
+void test_timer_reversing_queue ()
+{
+  // Each reversal (and the stop before the slower last move) starts from a stand-still inside
+  // the timer interrupt, which must keep the compare interrupt running
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  motor.Enable ();
+  motor.SetRamp (5);
+  TEST_ASSERT_TRUE (motor.QueueAbsolute (2000L, 2000));
+  TEST_ASSERT_TRUE (motor.QueueAbsolute (500L, 2000));
+  TEST_ASSERT_TRUE (motor.QueueAbsolute (1500L, 3000));
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (1500L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (4500L, stepTimes ());
+  TEST_ASSERT_EQUAL (0, motor.GetQueueDepth ());
+
+  // The Direction pin is set at least 10 microseconds before the first step after it changes
+  long  writes = (MockNumWrites < MOCK_WRITES) ? MockNumWrites : MOCK_WRITES;
+  int   level  = LOW;
+  long  changes = 0L;
+
+  for (long i=0, step=0; i<writes; i++)
+  {
+    if (MockWrites[i].Pin == STEP_PIN && MockWrites[i].Value == HIGH)
+      step++;
+
+    if (MockWrites[i].Pin != DIRECTION_PIN || MockWrites[i].Value == level)
+      continue;
+
+    level = MockWrites[i].Value;
+    changes++;
+    TEST_ASSERT_GREATER_OR_EQUAL (MockWrites[i].Micros + 10UL, StepTimes[step]);
+  }
+
+  TEST_ASSERT_EQUAL (2L, changes);
+}
+
+void test_timer_held_move ()
+{
+  // The interrupt never builds a ramp table: without Run() passes the third move's table
+  // isn't built ahead of its junction, so the move waits at the second target for Run()
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  motor.Enable ();
+  motor.SetRamp (5);
+  TEST_ASSERT_TRUE (motor.QueueAbsolute (1000L, 2000));
+  TEST_ASSERT_TRUE (motor.QueueAbsolute (1500L, 3000));  // Blends, its table was built when queued
+  TEST_ASSERT_TRUE (motor.QueueAbsolute (1200L, 1000));
+
+  MockAdvance (2000000L);
+  TEST_ASSERT_EQUAL (1500L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (1, motor.GetQueueDepth ());
+
+  TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+  TEST_ASSERT_EQUAL (1200L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (1800L, stepTimes ());
+}
+
+void test_timer_second_motor ()
+{
+  // Timer1 drives one motor: a second one is refused instead of taking it over
+  {
+    StepperMotor  motor  (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+    StepperMotor  second (5, 6, 7);
+
+    second.Enable ();
+    TEST_ASSERT_EQUAL (MS_DISABLED, second.GetState ());
+    TEST_ASSERT_EQUAL (0, strcmp ("No step timer", second.ExecuteCommand ("EN")));
+    second.RotateRelative (100L, 2000);
+    TEST_ASSERT_EQUAL (MS_DISABLED, second.GetState ());
+
+    motor.Enable ();
+    motor.RotateRelative (500L, 2000);
+    TEST_ASSERT_EQUAL (RUN_COMPLETE, runMove (&motor));
+    TEST_ASSERT_EQUAL (500L, stepTimes ());
+  }
+
+  // Released with its motor, Timer1 is free for the next one
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+
+  motor.Enable ();
+  TEST_ASSERT_EQUAL (MS_ENABLED, motor.GetState ());
+}
+
+//=== Scheduler ===========================================
+
+void test_timer_scheduler ()
+{
+  // Two motors share Timer1 through a scheduler: its compare is armed for the earlier of
+  // their deadlines, and each motor's steps keep their own times from the one clock
+  {
+    StepperMotor      holder (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+    StepperMotor      other  (5, 6, 7);
+    StepperScheduler  motors;
+
+    TEST_ASSERT_FALSE (motors.AddMotor (&other));  // Timer1 is the holder's
+  }
+
+  StepperMotor      x (ENABLE_PIN, DIRECTION_PIN, STEP_PIN);
+  StepperMotor      y (5, 6, 7);
+  StepperScheduler  motors;
+  int               completed = 0;
+
+  TEST_ASSERT_TRUE (motors.AddMotor (&x));
+  TEST_ASSERT_TRUE (motors.AddMotor (&y));
+
+  x.Enable ();
+  y.Enable ();
+  TEST_ASSERT_EQUAL (MS_ENABLED, y.GetState ());
+  x.SetRamp (0);
+  y.SetRamp (0);
+  x.RotateRelative (2000L, 2000);  // 500us intervals
+  y.RotateRelative (-800L, 800);   // 1250us intervals
+
+  for (long i=0; i<RUN_LIMIT && completed < 2; i++)
+  {
+    if (motors.Run () == RUN_COMPLETE)
+      completed++;
+    MockAdvance (1L);
+  }
+
+  TEST_ASSERT_EQUAL (2, completed);
+  TEST_ASSERT_EQUAL (2000L, x.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (-800L, y.GetAbsolutePosition ());
+  TEST_ASSERT_LESS_OR_EQUAL (2000L + 800L + 2L, MockTimerInterrupts);  // Steps and direction changes only
+
+  // No drift: the last step is the sum of the intervals after the first
+  TEST_ASSERT_EQUAL (2000L, stepTimes ());
+  TEST_ASSERT_INT32_WITHIN (2L, 1999L * 500L, (long) (StepTimes[1999] - StepTimes[0]));
+  TEST_ASSERT_EQUAL (800L, MockRisingEdges (7, StepTimes, MAX_STEPS));
+  TEST_ASSERT_INT32_WITHIN (2L, 798L * 1250L, (long) (StepTimes[799] - StepTimes[1]));  // The first interval after a reversal is kept short
+}
+
+//=== Limit Switch Interrupts =============================
+//  Built with -D LIMIT_INTERRUPTS (the native-timer-limits env)
+
+#if defined(LIMIT_INTERRUPTS)
+#define LL_SWITCH_PIN  8
+#define UL_SWITCH_PIN  9
+
+void test_timer_limit_interrupt ()
+{
+  // The pin change interrupt stops the step timer on the spot, and a motor
+  // resting on the other switch drives off it
+  StepperMotor  motor (ENABLE_PIN, DIRECTION_PIN, STEP_PIN, LL_SWITCH_PIN, UL_SWITCH_PIN);
+  RunReturn     rr = OKAY;
+
+  motor.Enable ();
+  motor.SetRamp (0);
+  MockSetLevel (LL_SWITCH_PIN, LOW);
+  motor.RotateRelative (3000L, 2000);
+
+  for (long i=0; i<RUN_LIMIT && rr == OKAY; i++)
+  {
+    if (MockLevels[UL_SWITCH_PIN] == HIGH && motor.GetAbsolutePosition () == 100L)
+      MockSetLevel (UL_SWITCH_PIN, LOW);
+
+    rr = motor.Run ();
+    MockAdvance (1L);
+  }
+
+  TEST_ASSERT_EQUAL (LIMIT_SWITCH_UPPER, rr);
+  TEST_ASSERT_EQUAL (100L, motor.GetAbsolutePosition ());
+  TEST_ASSERT_EQUAL (100L, stepTimes ());
+  TEST_ASSERT_EQUAL (MS_ENABLED, motor.GetState ());
+}
+#endif
+
+//=== main ================================================
+
+int main (int argc, char **argv)
+{
+  (void) argc;
+  (void) argv;
+
+  UNITY_BEGIN ();
+
+  RUN_TEST (test_timer_relative_move);
+  RUN_TEST (test_timer_reversing_queue);
+  RUN_TEST (test_timer_held_move);
+  RUN_TEST (test_timer_second_motor);
+  RUN_TEST (test_timer_scheduler);
+#if defined(LIMIT_INTERRUPTS)
+  RUN_TEST (test_timer_limit_interrupt);
+#endif
+
+  return UNITY_END ();
+}